@@ -0,0 +1,129 @@
+//    IPscan - an HTTP-initiated IPv6 port scanner.
+//
+//    Copyright (C) 2011-2021 Tim Chappell.
+//
+//    This file is part of IPscan.
+//
+//    IPscan is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with IPscan.  If not, see <http://www.gnu.org/licenses/>.
+
+// udpprobebench.c 	version
+// 0.01			initial version - per-probe build, fill and validate microbenchmarks
+//
+// Measures the cost of each UDP probe in the registry, so that a new or changed probe can be
+// tuned on its own, away from a live scan. Built with "make bench", and run as:
+//
+//	bench/udpprobebench [iterations] [port[:special]]
+//
+// Validation is timed against the probe's own request, as if echoed back by the client. That
+// exercises the whole of most validators before they reject it, and any probe whose validator
+// accepts its own echo is flagged, since an echo service would then be reported as open.
+
+#include "ipscan.h"
+#include "ipscan_portlist.h"
+//
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <stdint.h>
+#include <inttypes.h>
+
+// Number of times each operation is repeated by default
+#define BENCH_ITERATIONS 100000
+
+//
+// Prototype declarations
+//
+int udp_template_build(struct udp_template_struc *t, uint16_t port, uint8_t special, const char *hostname);
+int udp_payload_fill(const struct udp_template_struc *t, char *txmessage, uint32_t probeid);
+int udp_response_match(const struct udp_template_struc *t, uint32_t probeid, const char *reply, int len);
+uint64_t bench_now_nsecs(void);
+
+uint64_t bench_now_nsecs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return( ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec );
+}
+
+int main(int argc, char **argv)
+{
+	struct udp_template_struc t;
+	char txmessage[UDP_BUFFER_SIZE+1];
+	unsigned int iterations = BENCH_ITERATIONS;
+	unsigned int i, n, selectport = 0, selectspecial = 0, selected = 0;
+	uint64_t start, buildns, fillns, validatens;
+	uint32_t probeid = 1;
+	int len = 0, match = UDP_MATCH_NO, rc = 0;
+
+	if (argc > 1)
+	{
+		iterations = (unsigned int)strtoul(argv[1], NULL, 10);
+		if (0 == iterations) iterations = BENCH_ITERATIONS;
+	}
+	if (argc > 2)
+	{
+		if (1 > sscanf(argv[2], "%u:%u", &selectport, &selectspecial))
+		{
+			fprintf(stderr, "usage: %s [iterations] [port[:special]]\n", argv[0]);
+			return(EXIT_FAILURE);
+		}
+		selected = 1;
+	}
+
+	printf("%u iterations, times in nanoseconds per operation\n", iterations);
+	printf("%-12s %-24s %5s %8s %8s %8s  %s\n", "Probe", "Description", "Len", "Build", "Fill", "Validate", "Echo");
+
+	for (n = 0; n < numudpprobes; n++)
+	{
+		const struct udp_probedesc_struc *probe = &udpprobes[n];
+		char name[16];
+
+		if (1 == selected && (probe->port != selectport || probe->special != selectspecial)) continue;
+
+		start = bench_now_nsecs();
+		for (i = 0; i < iterations; i++)
+		{
+			if (0 != udp_template_build(&t, probe->port, probe->special, "::1"))
+			{
+				fprintf(stderr, "Failed to build probe for port %d:%d\n", probe->port, probe->special);
+				rc = EXIT_FAILURE;
+				break;
+			}
+		}
+		if (i < iterations) continue;
+		buildns = (bench_now_nsecs() - start) / iterations;
+
+		start = bench_now_nsecs();
+		for (i = 0; i < iterations; i++)
+		{
+			len = udp_payload_fill(&t, &txmessage[0], probeid + i);
+		}
+		fillns = (bench_now_nsecs() - start) / iterations;
+		probeid += iterations;
+
+		start = bench_now_nsecs();
+		for (i = 0; i < iterations; i++)
+		{
+			match = udp_response_match(&t, probeid - 1, &txmessage[0], len);
+		}
+		validatens = (bench_now_nsecs() - start) / iterations;
+
+		snprintf(name, sizeof(name), "%d:%d", probe->port, probe->special);
+		printf("%-12s %-24s %5d %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "  %s\n", name, probe->desc, len, buildns, fillns, validatens,\
+			(UDP_MATCH_YES == match) ? "ACCEPTED" : ((UDP_MATCH_UNKNOWN == match) ? "unknown" : "rejected"));
+	}
+	return(rc);
+}
@@ -78,6 +78,20 @@
 // 0.57 - update copyright year and move to client session/starttime generation
 // 0.58 - minor tweaks to delays before database record deletion at end of javascript test
 // 0.59 - added LGTM pragmas to ignore cross-site scripting false positives
+// 0.60 - move TCP port scan to the non-blocking connect engine
+// 0.61 - use run-time selected TCP scan engine
+// 0.62 - derive TCP and UDP timeouts from the measured round trip time
+// 0.63 - set up the shared probe pacer before scanning
+// 0.64 - resolve the client address once into a shared scan context
+// 0.65 - add operator-enabled full-range TCP scan
+// 0.66 - add port sets, e.g. portset=8000-8100,8443, parsed straight into a compact set
+// 0.67 - look up the local interface details once, before the UDP children are forked
+// 0.68 - build the UDP probe payload templates once, before the UDP children are forked
+// 0.69 - fill the UDP port list from the probe registry, and scan in order of measured cost
+// 0.70 - report the amplification factor of answered UDP ports in the text-mode results table
+// 0.71 - report the round trip time, jitter and loss of the ICMPv6 echo train, and seed the timeouts from each of its samples
+// 0.72 - run the ICMPv6, UDP and TCP phases concurrently, under one limit on the scan's children and seeded by the echo train
+// 0.73 - open the raw sockets, then drop root privileges for good, before anything else is done
 
 #include "ipscan.h"
 #include "ipscan_portlist.h"
@@ -121,12 +135,18 @@
 int write_db(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, uint32_t port, int32_t result, char *indirecthost);
 int dump_db(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session);
 int read_db_result(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, uint32_t port);
+int write_db_scan(struct scan_context_struc *ctx, uint32_t port, int32_t result, char *indirecthost);
+int read_db_scan(struct scan_context_struc *ctx, uint32_t port);
+int read_db_scan_note(struct scan_context_struc *ctx, uint32_t port, char *indirecthost, size_t size);
 int delete_from_db(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session);
 int tidy_up_db(uint64_t time_now);
 int update_db(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, uint32_t port, int32_t result, char *indirecthost);
+int read_db_bitmap(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, uint32_t proto, struct portbitmap_struc *bitmap);
+int dump_db_bitmap(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, uint32_t proto);
 
-int check_udp_ports_parll(char * hostname, unsigned int portindex, unsigned int todo, uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, struct portlist_struc *udpportlist);
-int check_tcp_ports_parll(char * hostname, unsigned int portindex, unsigned int todo, uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, struct portlist_struc *portlist);
+int check_udp_ports_parll(struct scan_context_struc *ctx, unsigned int portindex, unsigned int todo, struct portlist_struc *udpportlist);
+int check_tcp_ports(struct scan_context_struc *ctx, unsigned int portindex, unsigned int todo, struct portlist_struc *portlist);
+int check_tcp_ports_set(struct scan_context_struc *ctx, const struct portset_struc *set, unsigned int *portsstats);
 
 void create_json_header(void);
 void create_html_header(uint16_t numports, uint16_t numudpports, char * reconquery);
@@ -149,15 +169,52 @@ uint64_t get_session(void);
 void proto_to_string(int proto, char * retstring);
 void fetch_to_string(int fetchnum, char * retstring);
 char * state_to_string(int statenum, char * retstringptr, int retstringfree);
+void rtt_sample(struct rtt_struc *rtt, uint64_t sampleusecs);
+uint64_t rtt_timeout(struct rtt_struc *rtt, uint64_t floorusecs, uint64_t ceilingusecs);
+int scan_context_init(struct scan_context_struc *ctx, char * hostname, uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session);
+void scan_child_add(struct scan_context_struc *ctx, pid_t pid, int proto);
+void scan_child_slot(struct scan_context_struc *ctx, int proto, int protomax);
+void scan_children_wait(struct scan_context_struc *ctx, int proto);
+int rtt_share_wait(struct scan_context_struc *ctx, uint64_t maxwaitusecs);
+int scan_drop_privileges(void);
+
+// from ipscan_pacer
+int pacer_init(void);
+unsigned int pacer_rate(void);
+unsigned int pacer_env_rate(const char * envname, unsigned int defaultrate);
+void pacer_set_rate(unsigned int rate);
+
+// from ipscan_iface
+#if (1 == IPSCAN_INCLUDE_UDP)
+int iface_init(void);
+// from ipscan_payload
+int udp_templates_init(const char *hostname, unsigned int numudpports, struct portlist_struc *udpportlist);
+void udp_probes_order(struct portlist_struc *list, unsigned int num, const char *hostname);
+#endif
+
+// from ipscan_bitmap
+int portset_parse(struct portset_struc *set, const char *string, size_t len, unsigned int maxports);
+void portset_add_range(struct portset_struc *set, uint16_t firstport, uint16_t lastport);
+void portset_remove(struct portset_struc *set, uint16_t port);
 
 // create_results_key_table is only referenced if creating the text-only version of the scanner
 #if (1 == TEXTMODE)
 void create_results_key_table(char * hostname, time_t timestamp);
+void create_portset_results_table(struct portbitmap_struc *bitmap);
 #endif
 
 // Only include reference to ping-test function if compiled in
 #if (1 == IPSCAN_INCLUDE_PING)
-int check_icmpv6_echoresponse(char * hostname, uint64_t starttime, uint64_t session, char * router);
+int check_icmpv6_echoresponse_parll(struct scan_context_struc *ctx);
+#endif
+#if (1 == IPSCAN_INCLUDE_RAWPING)
+int icmpv6_raw_prepare(void);
+#endif
+
+// from ipscan_tcp and ipscan_syn
+#if (1 == IPSCAN_INCLUDE_SYN)
+int tcp_engine_select(void);
+int syn_open_sockets(void);
 #endif
 
 
@@ -207,6 +264,11 @@ int main(void)
 	// List of ports to be tested and their results
 	struct portlist_struc portlist[MAXPORTS];
 
+	// UDP ports in the order they are scanned
+	#if (1 == IPSCAN_INCLUDE_UDP)
+	struct portlist_struc udpscanlist[NUMUDPPROBES];
+	#endif
+
 	int result;
 
 	#if (TEXTMODE != 1)
@@ -230,6 +292,13 @@ int main(void)
 	int beginscan = 0;
 	int fetch = 0;
 
+	// Set if the client requested, and the operator allows, a full-range TCP scan
+	int fullscan = 0;
+
+	// Any additional TCP ports requested as a port set, or every port for a full-range scan
+	struct portset_struc portset;
+	memset(&portset, 0, sizeof(portset));
+
 	// the session starttime, used as an unique index for the database
 	time_t   starttime;
 	// the query derived starttime
@@ -239,11 +308,18 @@ int main(void)
 	uint16_t port;
 	uint16_t portindex;
 
-	// Parallel scanning related
-	int numchildren;
-	int remaining;
-	int childstatus;
+	// Parallel scanning related - the UDP ports are scanned by forked children
+	#if (1 == IPSCAN_INCLUDE_UDP)
 	unsigned int porti;
+	#endif
+
+	// Client address, database keys, round trip time estimate and children shared by every probe of this scan
+	struct scan_context_struc scanctx;
+	#if (1 == IPSCAN_INCLUDE_PING) && (1 == TEXTMODE)
+	// Echo train statistics, as read back from the ping result's note
+	double pingrtt[3], pingjitter;
+	unsigned int pinglost, pingsent;
+	#endif
 
 	// Ports to be tested
 	uint16_t numports = 0;
@@ -306,12 +382,34 @@ int main(void)
 	openlog(EXENAME, LOG_PID, LOG_LOCAL0);
 	#endif
 
+	// Open the raw sockets, which require root privileges, then give those up for good - before
+	// anything else is done, and in particular before any children are forked
+	#if (1 == IPSCAN_INCLUDE_RAWPING)
+	(void)icmpv6_raw_prepare();
+	#endif
+	#if (1 == IPSCAN_INCLUDE_SYN)
+	if (IPSCAN_TCP_ENGINE_SYN == tcp_engine_select()) (void)syn_open_sockets();
+	#endif
+	if (0 != scan_drop_privileges())
+	{
+		IPSCAN_LOG( LOGPREFIX "ipscan: ERROR : unable to drop root privileges, exiting\n");
+		exit(EXIT_FAILURE);
+	}
+
 	// Initialise the port list
 	for (i = 0; i < DEFNUMPORTS; i++)
 	{
 		portlist[i] = defportlist[i];
 	}
 
+	// Initialise the UDP port list from the probe registry
+	for (i = 0; i < NUMUDPPROBES; i++)
+	{
+		udpportlist[i].port_num = udpprobes[i].port;
+		udpportlist[i].special = udpprobes[i].special;
+		memcpy(&udpportlist[i].port_desc[0], &udpprobes[i].desc[0], PORTDESCSIZE);
+	}
+
 	// Clear out the port result type statistics
 	for (i = 0 ; i < NUMRESULTTYPES ; i++)
 	{
@@ -443,7 +541,34 @@ int main(void)
 					query[numqueries].varname[varnameindex]=0; // Add termination
 
 					finished = (32 > querystring[queryindex] || 126 < querystring[queryindex] || MAXQUERYSTRLEN <= queryindex) ? 1 : 0;
-					if (0 == finished && '=' == querystring[queryindex])
+					if (0 == finished && '=' == querystring[queryindex] && 0 == strncmp("portset", query[numqueries].varname, 8))
+					{
+						// A port set is parsed straight into the compact set, rather than becoming a query entry
+						queryindex++;
+						unsigned int setlen = 0;
+						while ( MAXQUERYSTRLEN > (queryindex + setlen) && 32 <= querystring[queryindex + setlen] \
+								&& 127 > querystring[queryindex + setlen] && '&' != querystring[queryindex + setlen])
+						{
+							setlen++;
+						}
+						#if (0 < IPSCAN_PORTSET_MAXPORTS)
+						rc = portset_parse(&portset, &querystring[queryindex], setlen, IPSCAN_PORTSET_MAXPORTS);
+						if (0 > rc)
+						{
+							IPSCAN_LOG( LOGPREFIX "ipscan: invalid port set, or more than %d ports, ignored\n", IPSCAN_PORTSET_MAXPORTS);
+						}
+						#ifdef QUERYDEBUG
+						else
+						{
+							IPSCAN_LOG( LOGPREFIX "ipscan: Added a port set of %d ports\n", rc);
+						}
+						#endif
+						#else
+						IPSCAN_LOG( LOGPREFIX "ipscan: port set requested, but not enabled (IPSCAN_PORTSET_MAXPORTS)\n");
+						#endif
+						queryindex += setlen;
+					}
+					else if (0 == finished && '=' == querystring[queryindex])
 					{
 						// Jump over '='
 						while ('=' == querystring[queryindex] && MAXQUERYSTRLEN > queryindex)
@@ -891,6 +1016,27 @@ int main(void)
 			#endif
 		}
 
+		// Look for the fullscan query string, only honoured if the operator has enabled full-range scans
+		i = 0;
+		fullscan = 0;
+		while (i < numqueries && strncmp("fullscan",query[i].varname,8)!= 0) i++;
+		if (i < numqueries && query[i].valid == 1 && 1 == query[i].varval)
+		{
+			#if (1 == IPSCAN_FULLSCAN_ENABLE)
+			fullscan = 1;
+			memset(&portset, 0, sizeof(portset));
+			portset_add_range(&portset, IPSCAN_FULLSCAN_FIRSTPORT, IPSCAN_FULLSCAN_LASTPORT);
+			#else
+			IPSCAN_LOG( LOGPREFIX "ipscan: full-range scan requested, but not enabled (IPSCAN_FULLSCAN_ENABLE)\n");
+			#endif
+		}
+
+		// Ports already in the list are scanned individually, so remove them from any port set
+		for (portindex = 0; portindex < numports && 0 < portset.count; portindex++)
+		{
+			if (0 == portlist[portindex].special) portset_remove(&portset, portlist[portindex].port_num);
+		}
+
 		// Dump the variables resulting from the query-string parsing
 		#ifdef QUERYDEBUG
 		IPSCAN_LOG( LOGPREFIX "ipscan: DEBUG info: numqueries = %d\n", numqueries);
@@ -902,7 +1048,7 @@ int main(void)
 		IPSCAN_LOG( LOGPREFIX "ipscan: DEBUG info: session = %"PRIu64" starttime = %"PRIu64" and numports = %d\n", \
 				session, (uint64_t)starttime, numports);
 		#endif
-		IPSCAN_LOG( LOGPREFIX "ipscan: DEBUG info: numcustomports = %d NUMUSERDEFPORTS = %d\n", numcustomports, NUMUSERDEFPORTS );
+		IPSCAN_LOG( LOGPREFIX "ipscan: DEBUG info: numcustomports = %d NUMUSERDEFPORTS = %d fullscan = %d portset = %u ports\n", numcustomports, NUMUSERDEFPORTS, fullscan, portset.count );
 		IPSCAN_LOG( LOGPREFIX "ipscan: DEBUG info: reconstituted query string = %s\n", reconquery );
 		#endif
 
@@ -948,6 +1094,60 @@ int main(void)
 			printf("</head>\n");
 			printf("<body>\n");
 			printf("<h3 style=\"color:red\">IPv6 Port Scan Results for host %s</h3>\n", remoteaddrstring);
+
+			// Log termsaccepted
+			IPSCAN_LOG( LOGPREFIX "ipscan: Client: %x:%x:%x:: beginning with termsaccepted = %d\n",\
+					(unsigned int)((remotehost_msb>>48) & 0xFFFF), (unsigned int)((remotehost_msb>>32) & 0xFFFF),\
+					(unsigned int)((remotehost_msb>>16) & 0xFFFF), termsaccepted );
+			IPSCAN_LOG( LOGPREFIX "ipscan: at time %"PRIu64", session %"PRIu64"\n", (uint64_t)starttime, (uint64_t)session);
+
+			// Set up the probe pacer, shared by every process involved in this scan
+			(void)pacer_init();
+			#if (1 <= IPSCAN_LOGVERBOSITY)
+			IPSCAN_LOG( LOGPREFIX "ipscan: probes paced at up to %u per second\n", pacer_rate());
+			#endif
+
+			// Look up the local interface details used by some UDP probes, and build the UDP payloads,
+			// so that the UDP children share them
+			#if (1 == IPSCAN_INCLUDE_UDP)
+			(void)iface_init();
+			rc = udp_templates_init(remoteaddrstring, NUMUDPPORTS, &udpportlist[0]);
+			if (0 != rc)
+			{
+				IPSCAN_LOG( LOGPREFIX "ipscan: WARNING: %d UDP payloads failed to build\n", rc);
+			}
+			memcpy(&udpscanlist[0], &udpportlist[0], sizeof(udpscanlist));
+			udp_probes_order(&udpscanlist[0], NUMUDPPORTS, remoteaddrstring);
+			#endif
+
+			rc = scan_context_init(&scanctx, remoteaddrstring, remotehost_msb, remotehost_lsb, (uint64_t)starttime, (uint64_t)session);
+			if (rc != 0)
+			{
+				IPSCAN_LOG( LOGPREFIX "ipscan: ERROR : scan_context_init() returned : %d\n", rc);
+				printf("<p>Unable to scan the client address %s, please report this to the site administrator.</p>\n", remoteaddrstring);
+				create_html_body_end();
+				return(EXIT_SUCCESS);
+			}
+
+			// The ICMPv6, UDP and TCP phases are independent, so they run concurrently - the echo train
+			// and the UDP ports are scanned by children whilst this process scans the TCP ports. The probe
+			// timeouts are seeded from the train's first ECHO-REPLY, which is waited for only briefly.
+			// Only included if ping is compiled in ...
+			#if (IPSCAN_INCLUDE_PING == 1)
+			scan_child_slot(&scanctx, IPSCAN_PROTO_ICMPV6, 1);
+			scan_child_add(&scanctx, (pid_t)check_icmpv6_echoresponse_parll(&scanctx), IPSCAN_PROTO_ICMPV6);
+			(void)rtt_share_wait(&scanctx, ICMPV6_RTT_WAIT_USECS);
+			#endif
+
+			#if (1 == IPSCAN_INCLUDE_UDP)
+			scanctx.udptimeoutusecs = rtt_timeout(&scanctx.rtt, UDPTIMEOUT_FLOOR_USECS, UDPTIMEOUT_CEILING_USECS);
+			#endif
+			#if (1 < IPSCAN_LOGVERBOSITY)
+			IPSCAN_LOG( LOGPREFIX "ipscan: RTT-derived timeouts are TCP %"PRIu64" usecs, UDP %"PRIu64" usecs\n",\
+					rtt_timeout(&scanctx.rtt, TCPTIMEOUT_FLOOR_USECS, TCPTIMEOUT_CEILING_USECS),\
+					rtt_timeout(&scanctx.rtt, UDPTIMEOUT_FLOOR_USECS, UDPTIMEOUT_CEILING_USECS));
+			#endif
+
 			stptr = ctime_r(&starttime,stimeresult);
 			if (NULL == stptr)
 			{
@@ -956,19 +1156,89 @@ int main(void)
 			else
 			{
 				printf("<p>Scan beginning at: %s, expected to take up to %d seconds ...</p>\n", \
-						stimeresult, (int)ESTIMATEDTIMETORUN );
+						stimeresult, (int)ESTIMATEDTIMETORUN_FOR(rtt_timeout(&scanctx.rtt, TCPTIMEOUT_FLOOR_USECS, TCPTIMEOUT_CEILING_USECS),\
+						rtt_timeout(&scanctx.rtt, UDPTIMEOUT_FLOOR_USECS, UDPTIMEOUT_CEILING_USECS)) );
+			}
+			if (0 < pacer_rate())
+			{
+				printf("<p>Probes are paced at up to %u per second.</p>\n", pacer_rate());
+			}
+			if (1 == fullscan)
+			{
+				printf("<p>A full-range scan of TCP ports %d to %d has been requested, its TCP phase alone may take up to %d seconds.</p>\n",\
+						IPSCAN_FULLSCAN_FIRSTPORT, IPSCAN_FULLSCAN_LASTPORT, (int)PORTSETRUNTIME_FOR(portset.count, rtt_timeout(&scanctx.rtt,\
+						TCPTIMEOUT_FLOOR_USECS, TCPTIMEOUT_CEILING_USECS), pacer_env_rate(IPSCAN_FULLSCAN_RATE_ENV, IPSCAN_FULLSCAN_PACER_RATE)) );
+			}
+			else if (0 < portset.count)
+			{
+				printf("<p>A set of %u additional TCP ports has been requested, scanning these may add up to %d seconds.</p>\n",\
+						portset.count, (int)PORTSETRUNTIME_FOR(portset.count, rtt_timeout(&scanctx.rtt, TCPTIMEOUT_FLOOR_USECS,\
+						TCPTIMEOUT_CEILING_USECS), pacer_env_rate(IPSCAN_FULLSCAN_RATE_ENV, IPSCAN_FULLSCAN_PACER_RATE)) );
 			}
 
-			// Log termsaccepted
-			IPSCAN_LOG( LOGPREFIX "ipscan: Client: %x:%x:%x:: beginning with termsaccepted = %d\n",\
+			#if (1 == IPSCAN_INCLUDE_UDP)
+			// Log UDP start of scan
+			#if (1 < IPSCAN_LOGVERBOSITY)
+			IPSCAN_LOG( LOGPREFIX "ipscan: Beginning scan of %d UDP ports on client : %s\n", numudpports, remoteaddrstring);
+			#else
+			IPSCAN_LOG( LOGPREFIX "ipscan: Beginning scan of UDP ports on client  : %x:%x:%x::\n",\
 					(unsigned int)((remotehost_msb>>48) & 0xFFFF), (unsigned int)((remotehost_msb>>32) & 0xFFFF),\
-					(unsigned int)((remotehost_msb>>16) & 0xFFFF), termsaccepted );
-			IPSCAN_LOG( LOGPREFIX "ipscan: at time %"PRIu64", session %"PRIu64"\n", (uint64_t)starttime, (uint64_t)session);
+					(unsigned int)((remotehost_msb>>16) & 0xFFFF) );
+			#endif
+
+			// Scan the UDP ports in parallel, within the scan's limit on children
+			porti = 0;
+			while (porti < numudpports)
+			{
+				unsigned int todo = ((numudpports - porti) > MAXUDPPORTSPERCHILD) ? MAXUDPPORTSPERCHILD : (numudpports - porti);
+				scan_child_slot(&scanctx, IPSCAN_PROTO_UDP, MAXUDPCHILDREN);
+				#ifdef UDPPARLLDEBUG
+				IPSCAN_LOG( LOGPREFIX "ipscan: check_udp_ports_parll(%s,%d,%d,host_msb,host_lsb,starttime,session,portlist)\n",remoteaddrstring,porti,todo);
+				#endif
+				scan_child_add(&scanctx, (pid_t)check_udp_ports_parll(&scanctx, porti, todo, &udpscanlist[0]), IPSCAN_PROTO_UDP);
+				porti += todo;
+			}
+			#endif
+
+			//
+			// TCP scan is always included
+			//
+			#if (1 < IPSCAN_LOGVERBOSITY)
+			IPSCAN_LOG( LOGPREFIX "ipscan: Beginning scan of %d TCP ports on client : %s\n", (numports + (int)portset.count), remoteaddrstring);
+			#else
+			IPSCAN_LOG( LOGPREFIX "ipscan: Beginning scan of TCP ports on client  : %x:%x:%x::\n",\
+					(unsigned int)((remotehost_msb>>48) & 0xFFFF), (unsigned int)((remotehost_msb>>32) & 0xFFFF),\
+					(unsigned int)((remotehost_msb>>16) & 0xFFFF) );
+			#endif
+
+			// Scan the TCP ports concurrently using the non-blocking connect engine
+			#ifdef PARLLDEBUG
+			IPSCAN_LOG( LOGPREFIX "ipscan: check_tcp_ports(%s,0,%d,host_msb,host_lsb,starttime,session,portlist)\n",remoteaddrstring,numports);
+			#endif
+			rc = check_tcp_ports(&scanctx, 0, numports, &portlist[0]);
+			if (rc != 0)
+			{
+				IPSCAN_LOG( LOGPREFIX "ipscan: check_tcp_ports() exited with ORed value of %d\n",rc);
+			}
+
+			// Scan any port set concurrently, at the port set rate, recording the results as bitmaps
+			if (0 < portset.count)
+			{
+				IPSCAN_LOG( LOGPREFIX "ipscan: Beginning %s scan of %u further TCP ports\n", ((1 == fullscan) ? "full-range" : "port set"), portset.count);
+				pacer_set_rate(pacer_env_rate(IPSCAN_FULLSCAN_RATE_ENV, IPSCAN_FULLSCAN_PACER_RATE));
+				rc = check_tcp_ports_set(&scanctx, &portset, &portsstats[0]);
+				if (rc != 0)
+				{
+					IPSCAN_LOG( LOGPREFIX "ipscan: check_tcp_ports_set() exited with ORed value of %d\n",rc);
+				}
+			}
+
+			// The ICMPv6 and UDP results are only complete once their children have exited
+			scan_children_wait(&scanctx, SCAN_CHILDREN_ALL);
 
-			// Only included if ping is compiled in ...
 			#if (IPSCAN_INCLUDE_PING == 1)
-			// Ping the remote host and store the result ...
-			pingresult = check_icmpv6_echoresponse(remoteaddrstring, (uint64_t)starttime, (uint64_t)session, indirecthost);
+			// The echo train's child stored its result, with the responding router or the train's statistics as the note
+			pingresult = read_db_scan_note(&scanctx, (0 + (IPSCAN_PROTO_ICMPV6 << IPSCAN_PROTO_SHIFT)), &indirecthost[0], sizeof(indirecthost));
 			result = (pingresult >= IPSCAN_INDIRECT_RESPONSE) ? (pingresult - IPSCAN_INDIRECT_RESPONSE) : pingresult ;
 
 			#if (1 < IPSCAN_LOGVERBOSITY)
@@ -981,12 +1251,6 @@ int main(void)
 
 			portsstats[result]++ ;
 
-			rc = write_db(remotehost_msb, remotehost_lsb, (uint64_t)starttime, (uint64_t)session, (0 + (IPSCAN_PROTO_ICMPV6 << IPSCAN_PROTO_SHIFT)), pingresult, indirecthost);
-			if (rc != 0)
-			{
-				IPSCAN_LOG( LOGPREFIX "ipscan: ERROR : write_db for ping result returned : %d\n", rc);
-			}
-
 			printf("<p>ICMPv6 ECHO-Request:</p>\n");
 			printf("<table border=\"1\">\n");
 			printf("<tr style=\"text-align:left\">\n");
@@ -994,6 +1258,12 @@ int main(void)
 			{
 				printf("<td title=\"IPv6 ping\">ICMPv6 ECHO REQUEST returned : </td><td style=\"background-color:%s\">INDIRECT-%s (from %s)</td>\n",resultsstruct[result].colour,resultsstruct[result].label, indirecthost);
 			}
+			else if (ECHOREPLY == pingresult && 6 == sscanf(indirecthost, ICMPV6_RTT_NOTE "%lf/%lf/%lf," ICMPV6_JITTER_NOTE "%lf," ICMPV6_LOSS_NOTE "%u/%u",\
+					&pingrtt[0], &pingrtt[1], &pingrtt[2], &pingjitter, &pinglost, &pingsent))
+			{
+				printf("<td title=\"IPv6 ping\">ICMPv6 ECHO REQUEST returned : </td><td style=\"background-color:%s\">%s (round trip time min/avg/max %.2f/%.2f/%.2f ms, jitter %.2f ms, %u of %u lost)</td>\n",\
+					resultsstruct[result].colour, resultsstruct[result].label, pingrtt[0], pingrtt[1], pingrtt[2], pingjitter, pinglost, pingsent);
+			}
 			else
 			{
 				printf("<td title=\"IPv6 ping\">ICMPv6 ECHO REQUEST returned : </td><td style=\"background-color:%s\">%s</td>\n",resultsstruct[result].colour,resultsstruct[result].label);
@@ -1003,67 +1273,30 @@ int main(void)
 			#endif
 
 			#if (1 == IPSCAN_INCLUDE_UDP)
-			// Log UDP start of scan
-			#if (1 < IPSCAN_LOGVERBOSITY)
-			IPSCAN_LOG( LOGPREFIX "ipscan: Beginning scan of %d UDP ports on client : %s\n", numudpports, remoteaddrstring);
-			#else
-			IPSCAN_LOG( LOGPREFIX "ipscan: Beginning scan of UDP ports on client  : %x:%x:%x::\n",\
-					(unsigned int)((remotehost_msb>>48) & 0xFFFF), (unsigned int)((remotehost_msb>>32) & 0xFFFF),\
-					(unsigned int)((remotehost_msb>>16) & 0xFFFF) );
-			#endif
-
-			// Scan the UDP ports in parallel
-			remaining = numudpports;
-			porti = 0;
-			numchildren = 0;
-			rc = 0;
-			while (remaining > 0 || numchildren > 0)
-			{
-				while (remaining > 0)
-				{
-					if (numchildren < MAXUDPCHILDREN && remaining > 0)
-					{
-						unsigned int todo = (remaining > MAXUDPPORTSPERCHILD) ? MAXUDPPORTSPERCHILD : (unsigned int)remaining;
-						#ifdef UDPPARLLDEBUG
-						IPSCAN_LOG( LOGPREFIX "ipscan: check_udp_ports_parll(%s,%d,%d,host_msb,host_lsb,starttime,session,portlist)\n",remoteaddrstring,porti,todo);
-						#endif
-						rc |= check_udp_ports_parll(remoteaddrstring, porti, todo, remotehost_msb, remotehost_lsb, (uint64_t)starttime, session, &udpportlist[0]);
-						porti += todo;
-						numchildren ++;
-						remaining = (int)(numudpports - porti);
-					}
-					if (numchildren == MAXUDPCHILDREN && remaining > 0)
-					{
-						int pid = wait(&childstatus);
-						numchildren--;
-						if (childstatus != 0) IPSCAN_LOG( LOGPREFIX "ipscan: WARNING: UDP ongoing phase : PID=%d retired with status=%d, numchildren is now %d\n", pid, childstatus, numchildren );
-					}
-				}
-				while (numchildren > 0)
-				{
-					int pid = wait(&childstatus);
-					numchildren--;
-					if (childstatus != 0) IPSCAN_LOG( LOGPREFIX "ipscan: WARNING: UDP shutdown phase : PID=%d retired with status=%d, numchildren is now %d\n", pid, childstatus, numchildren );
-				}
-			}
-
-			if (rc != 0)
-			{
-				IPSCAN_LOG( LOGPREFIX "ipscan: check_udp_ports_parll() exited with ORed value of %d\n",rc);
-			}
-
 			printf("<p>Individual UDP port scan results:</p>\n");
 			// Start of UDP port scan results table
 			printf("<table border=\"1\">\n");
 			for (portindex= 0; portindex < NUMUDPPORTS ; portindex++)
 			{
+				char udpnote[INET6_ADDRSTRLEN+1] = "";
+				char udpamp[INET6_ADDRSTRLEN+1] = "";
+				char *ampptr;
+
 				port = udpportlist[portindex].port_num;
 				special = udpportlist[portindex].special;
 				last = (portindex == (NUMUDPPORTS-1)) ? 1 : 0 ;
-				result = read_db_result(remotehost_msb, remotehost_lsb, (uint64_t)starttime, (uint64_t)session, (uint32_t)(port + ((special & IPSCAN_SPECIAL_MASK) << IPSCAN_SPECIAL_SHIFT) + (IPSCAN_PROTO_UDP << IPSCAN_PROTO_SHIFT) ));
+				result = read_db_scan_note(&scanctx, (uint32_t)(port + ((special & IPSCAN_SPECIAL_MASK) << IPSCAN_SPECIAL_SHIFT) + (IPSCAN_PROTO_UDP << IPSCAN_PROTO_SHIFT) ), &udpnote[0], sizeof(udpnote));
+
+				// The note carries the amplification factor of an answered port, e.g. "retx=0,amp=37.5,dgrams=4"
+				ampptr = strstr(udpnote, UDP_AMPLIFICATION_NOTE);
+				if (NULL != ampptr)
+				{
+					ampptr += strlen(UDP_AMPLIFICATION_NOTE);
+					snprintf(udpamp, sizeof(udpamp), " (amplification x%.*s)", (int)strcspn(ampptr, ","), ampptr);
+				}
 				if ( PORTUNKNOWN == result )
 				{
-					IPSCAN_LOG( LOGPREFIX "ipscan: read_db_result() returned UNKNOWN: UDP port scan results table\n" );
+					IPSCAN_LOG( LOGPREFIX "ipscan: read_db_scan() returned UNKNOWN: UDP port scan results table\n" );
 					IPSCAN_LOG( LOGPREFIX "ipscan: for client : %x:%x:%x::\n",\
 							(unsigned int)((remotehost_msb>>48) & 0xFFFF), (unsigned int)((remotehost_msb>>32) & 0xFFFF),\
 							(unsigned int)((remotehost_msb>>16) & 0xFFFF) );
@@ -1093,11 +1326,11 @@ int main(void)
 					portsstats[result]++ ;
 					if (0 != special)
 					{
-						printf("<td title=\"%s\" style=\"background-color:%s\">Port %d[%d] = %s</td>", udpportlist[portindex].port_desc, resultsstruct[i].colour, port, special, resultsstruct[i].label);
+						printf("<td title=\"%s\" style=\"background-color:%s\">Port %d[%d] = %s%s</td>", udpportlist[portindex].port_desc, resultsstruct[i].colour, port, special, resultsstruct[i].label, udpamp);
 					}
 					else
 					{
-						printf("<td title=\"%s\" style=\"background-color:%s\">Port %d = %s</td>", udpportlist[portindex].port_desc, resultsstruct[i].colour, port, resultsstruct[i].label);
+						printf("<td title=\"%s\" style=\"background-color:%s\">Port %d = %s%s</td>", udpportlist[portindex].port_desc, resultsstruct[i].colour, port, resultsstruct[i].label, udpamp);
 					}
 				}
 				else
@@ -1123,58 +1356,7 @@ int main(void)
 			printf("</table>\n");
 			#endif
 
-			//
-			// TCP scan is always included
-			//
-			#if (1 < IPSCAN_LOGVERBOSITY)
-			IPSCAN_LOG( LOGPREFIX "ipscan: Beginning scan of %d TCP ports on client : %s\n", numports, remoteaddrstring);
-			#else
-			IPSCAN_LOG( LOGPREFIX "ipscan: Beginning scan of TCP ports on client  : %x:%x:%x::\n",\
-					(unsigned int)((remotehost_msb>>48) & 0xFFFF), (unsigned int)((remotehost_msb>>32) & 0xFFFF),\
-					(unsigned int)((remotehost_msb>>16) & 0xFFFF) );
-			#endif
 			printf("<p>Individual TCP port scan results:</p>\n");
-
-			// Scan the TCP ports in parallel
-			remaining = (int)numports;
-			porti = 0;
-			numchildren = 0;
-			rc = 0;
-			while (remaining > 0 || numchildren > 0)
-			{
-				while (remaining > 0)
-				{
-					if (numchildren < MAXCHILDREN && remaining > 0)
-					{
-						unsigned int todo = (remaining > MAXPORTSPERCHILD) ? MAXPORTSPERCHILD : (unsigned int)remaining;
-						#ifdef PARLLDEBUG
-						IPSCAN_LOG( LOGPREFIX "ipscan: check_tcp_ports_parll(%s,%d,%d,host_msb,host_lsb,starttime,session,portlist)\n",remoteaddrstring,porti,todo);
-						#endif
-						rc |= check_tcp_ports_parll(remoteaddrstring, porti, todo, remotehost_msb, remotehost_lsb, (uint64_t)starttime, (uint64_t)session, &portlist[0]);
-						porti += todo;
-						numchildren ++;
-						remaining = (int)(numports - porti);
-					}
-					if (numchildren == MAXCHILDREN && remaining > 0)
-					{
-						int pid = wait(&childstatus);
-						numchildren--;
-						if (childstatus != 0) IPSCAN_LOG( LOGPREFIX "ipscan: WARNING: ongoing phase : PID=%d retired with status=%d, numchildren is now %d\n", pid, childstatus, numchildren );
-					}
-				}
-				while (numchildren > 0)
-				{
-					int pid = wait(&childstatus);
-					numchildren--;
-					if (childstatus != 0) IPSCAN_LOG( LOGPREFIX "ipscan: WARNING: shutdown phase : PID=%d retired with status=%d, numchildren is now %d\n", pid, childstatus, numchildren );
-				}
-			}
-
-			if (rc != 0)
-			{
-				IPSCAN_LOG( LOGPREFIX "ipscan: check_tcp_ports_parll() exited with ORed value of %d\n",rc);
-			}
-
 			// Start of TCP port scan results table
 			printf("<table border=\"1\">\n");
 			for (portindex= 0; portindex < numports ; portindex++)
@@ -1182,10 +1364,10 @@ int main(void)
 				port = portlist[portindex].port_num;
 				special = portlist[portindex].special;
 				last = (portindex == (numports-1)) ? 1 : 0 ;
-				result = read_db_result(remotehost_msb, remotehost_lsb, (uint64_t)starttime, (uint64_t)session, (uint32_t)(port + ((special & IPSCAN_SPECIAL_MASK) << IPSCAN_SPECIAL_SHIFT)+ (IPSCAN_PROTO_TCP << IPSCAN_PROTO_SHIFT)) );
+				result = read_db_scan(&scanctx, (uint32_t)(port + ((special & IPSCAN_SPECIAL_MASK) << IPSCAN_SPECIAL_SHIFT)+ (IPSCAN_PROTO_TCP << IPSCAN_PROTO_SHIFT)) );
 				if ( PORTUNKNOWN == result )
 				{
-					IPSCAN_LOG( LOGPREFIX "ipscan: read_db_result() returned UNKNOWN: TCP port scan results table\n" );
+					IPSCAN_LOG( LOGPREFIX "ipscan: read_db_scan() returned UNKNOWN: TCP port scan results table\n" );
 					IPSCAN_LOG( LOGPREFIX "ipscan: for client : %x:%x:%x::\n",\
 							(unsigned int)((remotehost_msb>>48) & 0xFFFF), (unsigned int)((remotehost_msb>>32) & 0xFFFF),\
 							(unsigned int)((remotehost_msb>>16) & 0xFFFF) );
@@ -1257,6 +1439,33 @@ int main(void)
 			}
 			printf("</table>\n");
 
+			if (0 < portset.count)
+			{
+				printf("<p>%s TCP port scan results (%u ports):</p>\n", ((1 == fullscan) ? "Full-range" : "Port set"), portset.count);
+
+				// Report the stored bitmaps in compact form
+				struct portbitmap_struc *bitmap = calloc(1, sizeof(struct portbitmap_struc));
+				if (NULL == bitmap)
+				{
+					IPSCAN_LOG( LOGPREFIX "ipscan: ERROR: calloc() failed for port set scan bitmap\n");
+					printf("<p>Unable to report the port set scan results, please report this to the site administrator.</p>\n");
+				}
+				else
+				{
+					rc = read_db_bitmap(remotehost_msb, remotehost_lsb, (uint64_t)starttime, (uint64_t)session, IPSCAN_PROTO_TCP, bitmap);
+					if (0 == rc)
+					{
+						create_portset_results_table(bitmap);
+					}
+					else
+					{
+						IPSCAN_LOG( LOGPREFIX "ipscan: ERROR: read_db_bitmap() returned %d\n", rc);
+						printf("<p>Unable to report the port set scan results, please report this to the site administrator.</p>\n");
+					}
+					free(bitmap);
+				}
+			}
+
 			char fintimeresult[32]; // ctime requires 26 bytes
 			char * ftptr = NULL;
 			time_t nowtime = time(0);
@@ -1274,7 +1483,7 @@ int main(void)
 				}
 				else
 				{
-					printf("<p>Scan of %d ports complete at: %s.</p>\n", numports, fintimeresult);
+					printf("<p>Scan of %d ports complete at: %s.</p>\n", (numports + (int)portset.count), fintimeresult);
 				}
 			}
 
@@ -1463,12 +1672,25 @@ int main(void)
 
 			// Simplified header in which to wrap array of results
 			create_json_header();
-			// Dump the current port results for this client, querystarttime and querysession
-			rc = dump_db(remotehost_msb, remotehost_lsb, (uint64_t)querystarttime, (uint64_t)querysession);
-			if (rc != 0)
+			if (0 < portset.count)
 			{
-				IPSCAN_LOG( LOGPREFIX "ipscan: ERROR: dump_db return code was %d (expected 0)\n", rc);
-				return(EXIT_SUCCESS);
+				// Dump the port set TCP results in compact form - only present once that phase is complete
+				rc = dump_db_bitmap(remotehost_msb, remotehost_lsb, (uint64_t)querystarttime, (uint64_t)querysession, IPSCAN_PROTO_TCP);
+				if (rc != 0)
+				{
+					IPSCAN_LOG( LOGPREFIX "ipscan: ERROR: dump_db_bitmap return code was %d (expected 0)\n", rc);
+					return(EXIT_SUCCESS);
+				}
+			}
+			else
+			{
+				// Dump the current port results for this client, querystarttime and querysession
+				rc = dump_db(remotehost_msb, remotehost_lsb, (uint64_t)querystarttime, (uint64_t)querysession);
+				if (rc != 0)
+				{
+					IPSCAN_LOG( LOGPREFIX "ipscan: ERROR: dump_db return code was %d (expected 0)\n", rc);
+					return(EXIT_SUCCESS);
+				}
 			}
 		}
 
@@ -1526,27 +1748,50 @@ int main(void)
 					(unsigned int)((remotehost_msb>>16) & 0xFFFF), termsaccepted );
 			IPSCAN_LOG( LOGPREFIX "ipscan: at querystarttime %"PRId64", querysession %"PRId64"\n", querystarttime, querysession);
 
-			// Only include this section if ping is compiled in ...
-			#if (IPSCAN_INCLUDE_PING == 1)
-			pingresult = check_icmpv6_echoresponse(remoteaddrstring, (uint64_t)querystarttime, (uint64_t)querysession, indirecthost);
-			result = (pingresult >= IPSCAN_INDIRECT_RESPONSE) ? (pingresult - IPSCAN_INDIRECT_RESPONSE) : pingresult ;
-			#if (1 < IPSCAN_LOGVERBOSITY)
-			IPSCAN_LOG( LOGPREFIX "ipscan: ICMPv6 ping of client %s returned %d (%s), from host %s\n",remoteaddrstring,\
-					 pingresult, resultsstruct[result].label, indirecthost);
-			#else
-			IPSCAN_LOG( LOGPREFIX "ipscan: ICMPv6 ping of client: %x:%x:%x::\n",\
-					(unsigned int)((remotehost_msb>>48) & 0xFFFF), (unsigned int)((remotehost_msb>>32) & 0xFFFF),\
-					(unsigned int)((remotehost_msb>>16) & 0xFFFF) );
+			// Set up the probe pacer, shared by every process involved in this scan
+			(void)pacer_init();
+			#if (1 <= IPSCAN_LOGVERBOSITY)
+			IPSCAN_LOG( LOGPREFIX "ipscan: probes paced at up to %u per second\n", pacer_rate());
 			#endif
-			portsstats[result]++ ;
-			rc = write_db(remotehost_msb, remotehost_lsb, (uint64_t)querystarttime, (uint64_t)querysession,\
-					(0 + (IPSCAN_PROTO_ICMPV6 << IPSCAN_PROTO_SHIFT)), pingresult, indirecthost);
+
+			// Look up the local interface details used by some UDP probes, and build the UDP payloads,
+			// so that the UDP children share them
+			#if (1 == IPSCAN_INCLUDE_UDP)
+			(void)iface_init();
+			rc = udp_templates_init(remoteaddrstring, NUMUDPPORTS, &udpportlist[0]);
+			if (0 != rc)
+			{
+				IPSCAN_LOG( LOGPREFIX "ipscan: WARNING: %d UDP payloads failed to build\n", rc);
+			}
+			memcpy(&udpscanlist[0], &udpportlist[0], sizeof(udpscanlist));
+			udp_probes_order(&udpscanlist[0], NUMUDPPORTS, remoteaddrstring);
+			#endif
+
+			rc = scan_context_init(&scanctx, remoteaddrstring, remotehost_msb, remotehost_lsb, (uint64_t)querystarttime, (uint64_t)querysession);
 			if (rc != 0)
 			{
-				IPSCAN_LOG( LOGPREFIX "ipscan: ERROR: write_db for ping result returned non-zero: %d\n", rc);
+				IPSCAN_LOG( LOGPREFIX "ipscan: ERROR: scan_context_init() returned non-zero: %d\n", rc);
 				create_html_body_end();
 				return(EXIT_SUCCESS);
 			}
+
+			// The ICMPv6, UDP and TCP phases are independent, so they run concurrently - the echo train
+			// and the UDP ports are scanned by children whilst this process scans the TCP ports. The probe
+			// timeouts are seeded from the train's first ECHO-REPLY, which is waited for only briefly.
+			// Only include this section if ping is compiled in ...
+			#if (IPSCAN_INCLUDE_PING == 1)
+			scan_child_slot(&scanctx, IPSCAN_PROTO_ICMPV6, 1);
+			scan_child_add(&scanctx, (pid_t)check_icmpv6_echoresponse_parll(&scanctx), IPSCAN_PROTO_ICMPV6);
+			(void)rtt_share_wait(&scanctx, ICMPV6_RTT_WAIT_USECS);
+			#endif
+
+			#if (1 == IPSCAN_INCLUDE_UDP)
+			scanctx.udptimeoutusecs = rtt_timeout(&scanctx.rtt, UDPTIMEOUT_FLOOR_USECS, UDPTIMEOUT_CEILING_USECS);
+			#endif
+			#if (1 < IPSCAN_LOGVERBOSITY)
+			IPSCAN_LOG( LOGPREFIX "ipscan: RTT-derived timeouts are TCP %"PRIu64" usecs, UDP %"PRIu64" usecs\n",\
+					rtt_timeout(&scanctx.rtt, TCPTIMEOUT_FLOOR_USECS, TCPTIMEOUT_CEILING_USECS),\
+					rtt_timeout(&scanctx.rtt, UDPTIMEOUT_FLOOR_USECS, UDPTIMEOUT_CEILING_USECS));
 			#endif
 
 			// Only included if UDP is compiled in ...
@@ -1560,86 +1805,70 @@ int main(void)
 					(unsigned int)((remotehost_msb>>16) & 0xFFFF) );
 			#endif
 
-			// Scan the UDP ports in parallel
-			remaining = (int)numudpports;
+			// Scan the UDP ports in parallel, within the scan's limit on children
 			porti = 0;
-			numchildren = 0;
-			while (remaining > 0 || numchildren > 0)
+			while (porti < numudpports)
 			{
-				while (remaining > 0)
-				{
-					if (numchildren < MAXUDPCHILDREN && remaining > 0)
-					{
-						unsigned int todo = (remaining > MAXUDPPORTSPERCHILD) ? MAXUDPPORTSPERCHILD : (unsigned int)remaining;
-						#ifdef UDPPARLLDEBUG
-						IPSCAN_LOG( LOGPREFIX "ipscan: check_udp_ports_parll(%s,%d,%d,host_msb,host_lsb,querystarttime,querysession,portlist)\n",\
-							remoteaddrstring,porti,todo);
-						#endif
-						rc = check_udp_ports_parll(remoteaddrstring, porti, todo, remotehost_msb, remotehost_lsb, (uint64_t)querystarttime,\
-							(uint64_t)querysession, &udpportlist[0]);
-						porti += todo;
-						numchildren ++;
-						remaining = (int)(numudpports - porti);
-					}
-					if (numchildren == MAXUDPCHILDREN && remaining > 0)
-					{
-						int pid = wait(&childstatus);
-						numchildren--;
-						if (childstatus != 0) IPSCAN_LOG( LOGPREFIX "ipscan: WARNING: UDP ongoing phase : PID=%d retired with status=%d, numchildren is now %d\n", pid, childstatus, numchildren );
-					}
-				}
-				while (numchildren > 0)
-				{
-					int pid = wait(&childstatus);
-					numchildren--;
-					if (childstatus != 0) IPSCAN_LOG( LOGPREFIX "ipscan: WARNING: UDP shutdown phase : PID=%d retired with status=%d, numchildren is now %d\n", pid, childstatus, numchildren );
-				}
+				unsigned int todo = ((numudpports - porti) > MAXUDPPORTSPERCHILD) ? MAXUDPPORTSPERCHILD : (numudpports - porti);
+				scan_child_slot(&scanctx, IPSCAN_PROTO_UDP, MAXUDPCHILDREN);
+				#ifdef UDPPARLLDEBUG
+				IPSCAN_LOG( LOGPREFIX "ipscan: check_udp_ports_parll(%s,%d,%d,host_msb,host_lsb,querystarttime,querysession,portlist)\n",\
+					remoteaddrstring,porti,todo);
+				#endif
+				scan_child_add(&scanctx, (pid_t)check_udp_ports_parll(&scanctx, porti, todo, &udpscanlist[0]), IPSCAN_PROTO_UDP);
+				porti += todo;
 			}
 			#endif
 
 			#if (1 < IPSCAN_LOGVERBOSITY)
-			IPSCAN_LOG( LOGPREFIX "ipscan: Beginning scan of %d TCP ports on client : %s\n", numports, remoteaddrstring);
+			IPSCAN_LOG( LOGPREFIX "ipscan: Beginning scan of %d TCP ports on client : %s\n", (numports + (int)portset.count), remoteaddrstring);
 			#else
 			IPSCAN_LOG( LOGPREFIX "ipscan: Beginning scan of TCP ports on client  : %x:%x:%x::\n",\
 					(unsigned int)((remotehost_msb>>48) & 0xFFFF), (unsigned int)((remotehost_msb>>32) & 0xFFFF),\
 					(unsigned int)((remotehost_msb>>16) & 0xFFFF) );
 			#endif
 
-			// Scan the TCP ports in parallel
-			remaining = (int)numports;
-			porti = 0;
-			numchildren = 0;
-			while (remaining > 0 || numchildren > 0)
+			// Scan the TCP ports concurrently using the non-blocking connect engine
+			#ifdef PARLLDEBUG
+			IPSCAN_LOG( LOGPREFIX "ipscan: check_tcp_ports(%s,0,%d,host_msb,host_lsb,querystarttime,querysession,portlist)\n",remoteaddrstring,numports);
+			#endif
+			rc = check_tcp_ports(&scanctx, 0, numports, &portlist[0]);
+			if (rc != 0)
 			{
-				while (remaining > 0)
-				{
-					if (numchildren < MAXCHILDREN && remaining > 0)
-					{
-						unsigned int todo = (remaining > MAXPORTSPERCHILD) ? MAXPORTSPERCHILD : (unsigned int)remaining;
-						#ifdef PARLLDEBUG
-						IPSCAN_LOG( LOGPREFIX "ipscan: check_tcp_ports_parll(%s,%d,%d,host_msb,host_lsb,querystarttime,querysession,portlist)\n",remoteaddrstring,porti,todo);
-						#endif
-						rc = check_tcp_ports_parll(remoteaddrstring, porti, todo, remotehost_msb, remotehost_lsb,\
-								 (uint64_t)querystarttime, (uint64_t)querysession, &portlist[0]);
-						porti += todo;
-						numchildren ++;
-						remaining = (int)(numports - porti);
-					}
-					if (numchildren == MAXCHILDREN && remaining > 0)
-					{
-						int pid = wait(&childstatus);
-						numchildren--;
-						if (childstatus != 0) IPSCAN_LOG( LOGPREFIX "ipscan: WARNING: ongoing phase : PID=%d retired with status=%d, numchildren is now %d\n", pid, childstatus, numchildren );
-					}
-				}
-				while (numchildren > 0)
+				IPSCAN_LOG( LOGPREFIX "ipscan: check_tcp_ports() exited with ORed value of %d\n",rc);
+			}
+
+			// Scan any port set concurrently, at the port set rate, recording the results as bitmaps
+			if (0 < portset.count)
+			{
+				IPSCAN_LOG( LOGPREFIX "ipscan: Beginning %s scan of %u further TCP ports\n", ((1 == fullscan) ? "full-range" : "port set"), portset.count);
+				pacer_set_rate(pacer_env_rate(IPSCAN_FULLSCAN_RATE_ENV, IPSCAN_FULLSCAN_PACER_RATE));
+				rc = check_tcp_ports_set(&scanctx, &portset, &portsstats[0]);
+				if (rc != 0)
 				{
-					int pid = wait(&childstatus);
-					numchildren--;
-					if (childstatus != 0) IPSCAN_LOG( LOGPREFIX "ipscan: WARNING: shutdown phase : PID=%d retired with status=%d, numchildren is now %d\n", pid, childstatus, numchildren );
+					IPSCAN_LOG( LOGPREFIX "ipscan: check_tcp_ports_set() exited with ORed value of %d\n",rc);
 				}
 			}
 
+			// The ICMPv6 and UDP results are only complete once their children have exited
+			scan_children_wait(&scanctx, SCAN_CHILDREN_ALL);
+
+			// Only include this section if ping is compiled in ...
+			#if (IPSCAN_INCLUDE_PING == 1)
+			// The echo train's child stored its result, with the responding router or the train's statistics as the note
+			pingresult = read_db_scan_note(&scanctx, (0 + (IPSCAN_PROTO_ICMPV6 << IPSCAN_PROTO_SHIFT)), &indirecthost[0], sizeof(indirecthost));
+			result = (pingresult >= IPSCAN_INDIRECT_RESPONSE) ? (pingresult - IPSCAN_INDIRECT_RESPONSE) : pingresult ;
+			#if (1 < IPSCAN_LOGVERBOSITY)
+			IPSCAN_LOG( LOGPREFIX "ipscan: ICMPv6 ping of client %s returned %d (%s), from host %s\n",remoteaddrstring,\
+					 pingresult, resultsstruct[result].label, indirecthost);
+			#else
+			IPSCAN_LOG( LOGPREFIX "ipscan: ICMPv6 ping of client: %x:%x:%x::\n",\
+					(unsigned int)((remotehost_msb>>48) & 0xFFFF), (unsigned int)((remotehost_msb>>32) & 0xFFFF),\
+					(unsigned int)((remotehost_msb>>16) & 0xFFFF) );
+			#endif
+			portsstats[result]++ ;
+			#endif
+
 			// Only included if UDP is compiled in ...
 			#if (IPSCAN_INCLUDE_UDP == 1)
 			// Generate the stats
@@ -1647,11 +1876,10 @@ int main(void)
 			{
 				port = udpportlist[portindex].port_num;
 				special = udpportlist[portindex].special;
-				result = read_db_result(remotehost_msb, remotehost_lsb, (uint64_t)querystarttime, (uint64_t)querysession,\
-					(uint32_t)(port + ((special & IPSCAN_SPECIAL_MASK) << IPSCAN_SPECIAL_SHIFT) + (IPSCAN_PROTO_UDP << IPSCAN_PROTO_SHIFT) ) );
+				result = read_db_scan(&scanctx, (uint32_t)(port + ((special & IPSCAN_SPECIAL_MASK) << IPSCAN_SPECIAL_SHIFT) + (IPSCAN_PROTO_UDP << IPSCAN_PROTO_SHIFT) ) );
 				if ( PORTUNKNOWN == result )
 				{
-					IPSCAN_LOG( LOGPREFIX "ipscan: read_db_result() returned UNKNOWN: UDP creating stats\n" );
+					IPSCAN_LOG( LOGPREFIX "ipscan: read_db_scan() returned UNKNOWN: UDP creating stats\n" );
 					IPSCAN_LOG( LOGPREFIX "ipscan: for client : %x:%x:%x::\n",\
 						(unsigned int)((remotehost_msb>>48) & 0xFFFF), (unsigned int)((remotehost_msb>>32) & 0xFFFF),\
 						(unsigned int)((remotehost_msb>>16) & 0xFFFF) );
@@ -1684,10 +1912,10 @@ int main(void)
 			{
 				port = portlist[portindex].port_num;
 				special = portlist[portindex].special;
-				result = read_db_result(remotehost_msb, remotehost_lsb, (uint64_t)querystarttime, (uint64_t)querysession, (uint32_t)(port + ((special & IPSCAN_SPECIAL_MASK) << IPSCAN_SPECIAL_SHIFT) + (IPSCAN_PROTO_TCP << IPSCAN_PROTO_SHIFT) ));
+				result = read_db_scan(&scanctx, (uint32_t)(port + ((special & IPSCAN_SPECIAL_MASK) << IPSCAN_SPECIAL_SHIFT) + (IPSCAN_PROTO_TCP << IPSCAN_PROTO_SHIFT) ));
 				if ( PORTUNKNOWN == result )
 				{
-					IPSCAN_LOG( LOGPREFIX "ipscan: read_db_result() returned UNKNOWN: TCP creating stats\n" );
+					IPSCAN_LOG( LOGPREFIX "ipscan: read_db_scan() returned UNKNOWN: TCP creating stats\n" );
 					IPSCAN_LOG( LOGPREFIX "ipscan: for client : %x:%x:%x::\n",\
 							(unsigned int)((remotehost_msb>>48) & 0xFFFF), (unsigned int)((remotehost_msb>>32) & 0xFFFF),\
 							(unsigned int)((remotehost_msb>>16) & 0xFFFF) );
@@ -1791,11 +2019,10 @@ int main(void)
 			//
 			while (deletenowtime < timeouttime && client_finished == 0)
 			{
-				result = read_db_result(remotehost_msb, remotehost_lsb, (uint64_t)querystarttime, (uint64_t)querysession,\
-						 (0 + (IPSCAN_PROTO_TESTSTATE << IPSCAN_PROTO_SHIFT) ) );
+				result = read_db_scan(&scanctx, (0 + (IPSCAN_PROTO_TESTSTATE << IPSCAN_PROTO_SHIFT) ) );
 				if ( PORTUNKNOWN == result )
 				{
-					IPSCAN_LOG( LOGPREFIX "ipscan: read_db_result() returned UNKNOWN: waiting for test end\n" );
+					IPSCAN_LOG( LOGPREFIX "ipscan: read_db_scan() returned UNKNOWN: waiting for test end\n" );
 					IPSCAN_LOG( LOGPREFIX "ipscan: for client : %x:%x:%x::\n",\
 							(unsigned int)((remotehost_msb>>48) & 0xFFFF), (unsigned int)((remotehost_msb>>32) & 0xFFFF),\
 							(unsigned int)((remotehost_msb>>16) & 0xFFFF) );
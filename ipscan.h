@@ -19,6 +19,8 @@
 
 #include <stdlib.h>
 #include <inttypes.h>
+#include <sys/types.h>
+#include <netinet/in.h>
 
 #ifndef IPSCAN_H
 	#define IPSCAN_H 1
@@ -55,7 +57,7 @@
 	#endif
 
 	// ipscan Version Number
-	#define IPSCAN_VERNUM "1.86"
+	#define IPSCAN_VERNUM "2.15"
 
 	// Determine reported version string 
 	// and include a hint if parallel scanning (FAST) is enabled
@@ -200,6 +202,35 @@
 	// 1.84 Delete unused code, further Javascript improvements and remove LGTM pragmas
 	// 1.85 define database delete wait-period separately
 	// 1.86 Add some LGTM pragmas to hide cross-site scripting false positives
+	// 1.87 Replace forked TCP port scan children with a non-blocking epoll connect engine
+	// 1.88 Add io_uring TCP engine and run-time TCP engine selection
+	// 1.89 Add optional half-open (SYN) TCP engine
+	// 1.90 Derive TCP and UDP timeouts from the measured round trip time
+	// 1.91 Replace per-port sleeps with a shared token-bucket probe pacer
+	// 1.92 Resolve the client address once into a shared scan context
+	// 1.93 Add TCP probe socket budget manager
+	// 1.94 Re-probe ambiguous TCP results in a second, shorter round
+	// 1.95 Add operator-enabled full-range TCP scan with bitmap results
+	// 1.96 Add client port sets with range syntax, scanned from a compact bitmap
+	// 1.97 Cache the local interface address and MAC for each scan
+	// 1.98 Build UDP probe payloads once into templates
+	// 1.99 Multiplex UDP probes over unconnected sockets with IPV6_RECVERR
+	// 2.00 Batch UDP probe transmission and reception with sendmmsg/recvmmsg
+	// 2.01 Retransmit unanswered UDP probes with backoff inside a fixed budget
+	// 2.02 Send all of a UDP port's tests together, told apart by protocol identifiers
+	// 2.03 Validate UDP replies against the probe they claim to answer
+	// 2.04 Drive UDP probes from a registry of descriptors
+	// 2.05 Measure UDP replies in full and report the amplification factor
+	// 2.06 Schedule probe deadlines, retransmissions and pacing on a timer wheel
+	// 2.07 Add persistent ICMPv6 echo helper shared by all scans
+	// 2.08 Filter ICMPv6 responses in the kernel with a classic BPF program
+	// 2.09 Send a paced ICMPv6 echo train and report RTT, jitter and loss
+	// 2.10 Run the ICMPv6, UDP and TCP phases of a scan concurrently
+	// 2.11 Prefer an unprivileged ICMPv6 datagram socket for the ping test
+	// 2.12 Keep host-wide state in a private directory, IPSCAN_STATE_DIR
+	// 2.13 Keep the per-client TCP probe budget in IPSCAN_STATE_DIR too
+	// 2.14 Open the raw sockets at startup and drop root privileges before anything is forked
+	// 2.15 Close the unused raw ICMPv6 socket when pinging through a datagram socket or the helper
 
 	// Email address
 	#define EMAILADDRESS "webmaster@chappell-family.com"
@@ -227,6 +258,8 @@
 	// Note this is only used to determine the IPv6 address inserted in MPLS LSP Ping packets
 	// and the Link-local address sent in DHCPv6 requests.
 	#define IPSCAN_INTERFACE_NAME "eth0"
+	// Size of the buffer used to drain netlink address and link change notifications
+	#define IPSCAN_NETLINK_BUFSIZE 8192
 
 	// MySQL database-related globals
 	#define MYSQL_HOST "localhost"
@@ -234,6 +267,8 @@
 	#define MYSQL_PASSWD "ipscan-passwd"
 	#define MYSQL_DBNAME "ipscan"
 	#define MYSQL_TBLNAME "results"
+	// Table holding the per-state port bitmaps of full-range TCP scans
+	#define MYSQL_BITMAP_TBLNAME "bitmaps"
 
 	// MySQL - move to use memory engine type by default
 	// Change IPSCAN_MYSQL_MEMORY_ENGINE_ENABLE to 0 to use the "default" engine type
@@ -300,12 +335,15 @@
 	// Primarily for troublesome Javascript clients.
 	// #define CLIENTDEBUG 1
 
-	// Decide whether to include ping support (requires setuid which some servers don't allow)
-	// Do not modify this statement - adjust SETUID_AVAILABLE in the Makefile instead
+	// Ping support is always included - an unprivileged ICMPv6 datagram socket is used wherever
+	// net.ipv4.ping_group_range includes the web server's group, so only the raw socket fallback
+	// requires setuid, which some servers don't allow
+	// Do not modify these statements - adjust SETUID_AVAILABLE in the Makefile instead
+	#define IPSCAN_INCLUDE_PING 1
 	#ifndef SETUID_AVAILABLE
-	#define IPSCAN_INCLUDE_PING 0
+	#define IPSCAN_INCLUDE_RAWPING 0
 	#else
-	#define IPSCAN_INCLUDE_PING SETUID_AVAILABLE
+	#define IPSCAN_INCLUDE_RAWPING SETUID_AVAILABLE
 	#endif
 
 	// Decide whether to include UDP support (access can be restricted on some servers)
@@ -316,6 +354,18 @@
 	#define IPSCAN_INCLUDE_UDP UDP_AVAILABLE
 	#endif
 
+	// Decide whether to include the io_uring TCP engine (requires Linux 5.6 or later)
+	// Do not modify this statement - adjust URING_AVAILABLE in the Makefile instead
+	#ifndef URING_AVAILABLE
+	#define IPSCAN_INCLUDE_URING 0
+	#else
+	#define IPSCAN_INCLUDE_URING URING_AVAILABLE
+	#endif
+
+	// Decide whether to include the half-open (SYN) TCP engine - raw sockets require setuid,
+	// so this follows SETUID_AVAILABLE in the Makefile
+	#define IPSCAN_INCLUDE_SYN IPSCAN_INCLUDE_RAWPING
+
 	// Logging verbosity:
 	//
 	// (0) Quiet   - program/unexpected response errors only
@@ -394,8 +444,9 @@
 
 	// Maximum number of supported query parameters
 	// Must ensure MAXQUERIES exceeds NUMUSERDEFPORTS by sufficient amount!
+	// The query string must be long enough to hold a port set (see IPSCAN_PORTSET_MAXPORTS)
 	#define MAXQUERIES 16
-	#define MAXQUERYSTRLEN 255
+	#define MAXQUERYSTRLEN 2047
 	#define MAXQUERYNAMELEN 32
 	#define MAXQUERYVALLEN 64
 
@@ -467,10 +518,51 @@
 		#define MAXPORTSPERCHILD 9
 	#endif
 
+	// UDP multiplexed engine - each child sends all of its UDP probes from a few unconnected
+	// sockets and then awaits them together, under one shared deadline. Replies are matched to
+	// their probe by source port, and ICMPv6 errors are collected from the sockets' error queues.
+	// Probes of the same port (e.g. NTP and NTP MONLIST) are spread across up to UDP_MUX_MAXSOCKETS
+	// sockets. Set IPSCAN_UDP_MUX to 0 to revert to a connected socket and blocking read per probe.
+	#define IPSCAN_UDP_MUX 1
+	#define UDP_MUX_MAXSOCKETS 4
+	#define UDP_MUX_MAXPROBES 32
+
+	// The multiplexed engine queues its probes and sends each socket's with a single sendmmsg(),
+	// as far as the pacer allows, and drains replies and errors with recvmmsg()
+	#define UDP_BATCH_MAXMSGS UDP_MUX_MAXPROBES
+	#define UDP_BATCH_CONTROLLEN 128
+
+	// The multiplexed engine resends unanswered probes up to UDP_MAXRETRANSMITS times, first after
+	// the RTT-derived UDP timeout (clamped to UDPRETRANSMIT_FLOOR_USECS..UDPRETRANSMIT_CEILING_USECS)
+	// and then doubling the interval each time. Each probe must be answered within
+	// UDPRETRANSMIT_BUDGET_USECS of its first transmission, however often it is resent - the ceiling
+	// ensures that every retransmission fits within it. The number of retransmissions is stored with
+	// each result, in the indirect host field, prefixed by UDP_RETRANSMIT_NOTE.
+	#define UDP_MAXRETRANSMITS 2
+	#define UDPRETRANSMIT_BUDGET_USECS UDPTIMEOUT_CEILING_USECS
+	#define UDPRETRANSMIT_FLOOR_USECS 100000
+	#define UDPRETRANSMIT_CEILING_USECS (UDPRETRANSMIT_BUDGET_USECS / ((2 << UDP_MAXRETRANSMITS) - 1))
+	#define UDP_RETRANSMIT_NOTE "retx="
+
+	// Replies are measured in full, however much of them fits in UDP_BUFFER_SIZE, and any further
+	// datagrams which answer an already answered probe are counted too, until none has arrived for
+	// UDP_AMP_LINGER_USECS (or the round's deadline passes). The bytes received per byte sent then
+	// give the amplification factor, which is stored with the result to one decimal place, after
+	// UDP_AMPLIFICATION_NOTE, together with the number of datagrams after UDP_DATAGRAMS_NOTE.
+	#define UDP_AMP_LINGER_USECS 100000
+	#define UDP_AMPLIFICATION_NOTE "amp="
+	#define UDP_DATAGRAMS_NOTE "dgrams="
+
+	// Returned by the multiplexed engine if it could not be started, before any port has been scanned
+	#define IPSCAN_UDP_MUX_UNAVAILABLE (-32768)
+
 	// Determine the maximum number of children and therefore the maximum number of
 	// UDP port scans that can be running in parallel
 	// Determine the maximum number of UDP port scans that can be allocated to each child
-	#if (FAST == 1)
+	#if (1 == IPSCAN_UDP_MUX)
+		#define MAXUDPCHILDREN 1
+		#define MAXUDPPORTSPERCHILD UDP_MUX_MAXPROBES
+	#elif (FAST == 1)
 		#define MAXUDPCHILDREN 3
 		#define MAXUDPPORTSPERCHILD 3
 	#else
@@ -478,6 +570,89 @@
 		#define MAXUDPPORTSPERCHILD 9
 	#endif
 
+	// The ICMPv6, UDP and TCP phases of a scan run concurrently - the ICMPv6 echo train and the
+	// UDP port batches in forked children whilst the parent scans the TCP ports. MAXSCANCHILDREN
+	// limits how many children (including those of the forked blocking TCP engine) each scan may
+	// have running at once, within which each phase is still limited to its own maximum above.
+	#if (FAST == 1)
+		#define MAXSCANCHILDREN 8
+	#else
+		#define MAXSCANCHILDREN 3
+	#endif
+	// Passed to scan_children_wait() to wait for the children of every phase
+	#define SCAN_CHILDREN_ALL (-1)
+
+	// Determine the maximum number of TCP connect attempts that the non-blocking
+	// engine will have outstanding at any one time - matches the forked scan capacity
+	#define MAXTCPINFLIGHT (MAXCHILDREN * MAXPORTSPERCHILD)
+
+	// TCP scan engines - selected at run-time, each falls back to the next should it be unavailable
+	// The default may be overridden by setting the IPSCAN_TCP_ENGINE environment variable
+	// to one of "uring", "epoll", "blocking" or "syn", e.g. using Apache's SetEnv directive.
+	// The half-open "syn" engine is never the default, it must be explicitly selected
+	#define IPSCAN_TCP_ENGINE_BLOCKING 0
+	#define IPSCAN_TCP_ENGINE_EPOLL 1
+	#define IPSCAN_TCP_ENGINE_URING 2
+	#define IPSCAN_TCP_ENGINE_SYN 3
+	#define IPSCAN_TCP_ENGINE_ENV "IPSCAN_TCP_ENGINE"
+	#if (1 == IPSCAN_INCLUDE_URING)
+		#define IPSCAN_TCP_ENGINE_DEFAULT IPSCAN_TCP_ENGINE_URING
+	#else
+		#define IPSCAN_TCP_ENGINE_DEFAULT IPSCAN_TCP_ENGINE_EPOLL
+	#endif
+
+	// Returned by an engine which could not be started, before any port has been scanned
+	#define IPSCAN_TCP_ENGINE_UNAVAILABLE (-32768)
+
+	// TCP probe socket budget - connect() probes which reached an open port are normally closed
+	// with the FIN exchange, leaving the socket in TIME_WAIT. Set to 1 to close them with an
+	// abortive reset (SO_LINGER of 0) instead, so that no TIME_WAIT state is left behind.
+	#define IPSCAN_TCP_ABORTIVE_CLOSE 1
+
+	// Source port range for the connect() probes - leave both as 0 to use the kernel's ephemeral
+	// port range, otherwise this should not overlap the ports used by the web server's own clients
+	#define IPSCAN_TCP_SRCPORT_MIN 0
+	#define IPSCAN_TCP_SRCPORT_MAX 0
+
+	// Maximum number of probe sockets in flight towards any one client, shared by all of the scans
+	// running on this host through a table kept in IPSCAN_TCP_BUDGET_FILE (within IPSCAN_STATE_DIR,
+	// see below). Probes which find the budget, or the local ports, exhausted are retried
+	// every IPSCAN_TCP_BUDGET_RETRY_USECS for up to IPSCAN_TCP_BUDGET_MAXWAIT_USECS.
+	#define IPSCAN_TCP_HOST_BUDGET (2 * MAXTCPINFLIGHT)
+	#define IPSCAN_TCP_BUDGET_ENTRIES 1024
+	#define IPSCAN_TCP_BUDGET_FILE "tcpbudget"
+	#define IPSCAN_TCP_BUDGET_RETRY_USECS 20000
+	#define IPSCAN_TCP_BUDGET_MAXWAIT_USECS 2000000
+
+	// Full-range TCP scan - set IPSCAN_FULLSCAN_ENABLE to 1 to allow a client to request, by adding
+	// fullscan=1 to its query string, that every TCP port from IPSCAN_FULLSCAN_FIRSTPORT to
+	// IPSCAN_FULLSCAN_LASTPORT is scanned. Results are kept as one bitmap per port state (stored in
+	// MYSQL_BITMAP_TBLNAME) rather than one database row per port. The concurrent engine is handed
+	// IPSCAN_FULLSCAN_BLOCK ports at a time and is paced at IPSCAN_FULLSCAN_PACER_RATE probes per
+	// second, which may be overridden by setting the IPSCAN_FULLSCAN_RATE environment variable.
+	#define IPSCAN_FULLSCAN_ENABLE 0
+	#define IPSCAN_FULLSCAN_FIRSTPORT 1
+	#define IPSCAN_FULLSCAN_LASTPORT 65535
+	#define IPSCAN_FULLSCAN_PORTS (IPSCAN_FULLSCAN_LASTPORT - IPSCAN_FULLSCAN_FIRSTPORT + 1)
+	#define IPSCAN_FULLSCAN_BLOCK 1024
+	#define IPSCAN_FULLSCAN_PACER_RATE 1024
+	#define IPSCAN_FULLSCAN_RATE_ENV "IPSCAN_FULLSCAN_RATE"
+
+	// Port sets - a client may add portset=8000-8100,8443 to its query string to have a list of
+	// TCP ports and port ranges scanned in addition to the default and custom ports. The set is
+	// parsed straight into a compact bitmap, scanned and reported as for a full-range scan, and
+	// may name up to IPSCAN_PORTSET_MAXPORTS ports in total. Set to 0 to disable port sets.
+	#define IPSCAN_PORTSET_MAXPORTS 4096
+	// Longest port set accepted by the forms, it must fit within MAXQUERYSTRLEN once URL-encoded
+	#define IPSCAN_PORTSET_MAXLEN 512
+
+	// Either results in per-state bitmaps being kept in MYSQL_BITMAP_TBLNAME
+	#if (1 == IPSCAN_FULLSCAN_ENABLE || 0 < IPSCAN_PORTSET_MAXPORTS)
+	#define IPSCAN_BITMAP_RESULTS 1
+	#else
+	#define IPSCAN_BITMAP_RESULTS 0
+	#endif
+
 
 	//
 	// Database related
@@ -487,12 +662,36 @@
 	// results into/out of the database. Currently queries are slightly in excess of 250 characters.
 	#define MAXDBQUERYSIZE 512
 
+	// A port bitmap is written as a hexadecimal literal, so its queries are rather larger
+	#define IPSCAN_BITMAP_BYTES (65536 / 8)
+	#define MAXBITMAPQUERYSIZE (MAXDBQUERYSIZE + (2 * IPSCAN_BITMAP_BYTES))
+
 	// Timeout for port response (in seconds)
 	#define TIMEOUTSECS 1
 	#define TIMEOUTMICROSECS 20000
 
-	// Minimum time between ports (s)
-	#define IPSCAN_MINTIME_PER_PORT 1
+	// Probe pacing - every TCP, UDP and ICMPv6 probe sent towards a client takes a token from a
+	// bucket shared by all of the processes performing that scan. The bucket refills at
+	// IPSCAN_PACER_RATE probes per second and holds up to IPSCAN_PACER_BURST tokens. A rate of 0
+	// disables pacing. The rate may be overridden by setting the IPSCAN_PACER_RATE environment variable.
+	#define IPSCAN_PACER_RATE 64
+	#define IPSCAN_PACER_BURST 16
+	#define IPSCAN_PACER_RATE_ENV "IPSCAN_PACER_RATE"
+
+	// State shared by every scan on this host is kept in files within IPSCAN_STATE_DIR, which must be
+	// a directory owned by the web server user (or root) and writable by nobody else, e.g. created
+	// with "install -d -m 0700 -o www-data /run/ipscan". Files which are not regular, are linked more
+	// than once, or are not owned by the scanner and private to it, are refused.
+	#define IPSCAN_STATE_DIR "/run/ipscan"
+
+	// Optionally also limit the total probe rate of all scans running on this host, using a bucket
+	// kept in IPSCAN_PACER_HOSTFILE (within IPSCAN_STATE_DIR). The rate may be overridden by setting
+	// the IPSCAN_PACER_HOSTRATE environment variable.
+	#define IPSCAN_PACER_HOSTWIDE 0
+	#define IPSCAN_PACER_HOSTRATE 512
+	#define IPSCAN_PACER_HOSTBURST 64
+	#define IPSCAN_PACER_HOSTRATE_ENV "IPSCAN_PACER_HOSTRATE"
+	#define IPSCAN_PACER_HOSTFILE "pacer"
 
 	// JSON fetch period (seconds) - tradeoff between update rate and webserver load
 	#define JSONFETCHEVERY 5
@@ -510,6 +709,45 @@
 	#define ICMPV6_MAGIC_VALUE1 1289
 	#define ICMPV6_MAGIC_VALUE2 12569
 
+	// Time allowed for the ECHO-REPLY (or an ICMPv6 error in response) to arrive
+	#define ICMPV6_TIMEOUT_USECS (((uint64_t)(1 + TIMEOUTSECS) * 1000000) + TIMEOUTMICROSECS)
+
+	// Echo train - ICMPV6_TRAIN_COUNT ECHO-REQUESTs (at most 9) are sent ICMPV6_TRAIN_SPACING_USECS apart,
+	// with consecutive sequence numbers from ICMPV6_MAGIC_SEQ, all within ICMPV6_TIMEOUT_USECS of the
+	// first. Round trip times are taken from the kernel's receive timestamps (SO_TIMESTAMPNS). Once an
+	// ECHO-REPLY has been received, any still unanswered ICMPV6_TRAIN_LINGER_USECS after the last
+	// ECHO-REQUEST was sent are counted as lost. The minimum, average and maximum round trip times, the
+	// jitter (the mean difference between successive round trip times) and the loss are stored with an
+	// ECHO-REPLY result, in the indirect host field, e.g. "rtt=1.2/1.5/2.1,jit=0.3,loss=0/5" (in ms).
+	// A count of 1 sends a single ECHO-REQUEST, as previously.
+	#define ICMPV6_TRAIN_COUNT 5
+	#define ICMPV6_TRAIN_SPACING_USECS 100000
+	#define ICMPV6_TRAIN_LINGER_USECS 500000
+	#define ICMPV6_RTT_NOTE "rtt="
+	#define ICMPV6_JITTER_NOTE "jit="
+	#define ICMPV6_LOSS_NOTE "loss="
+	// The echo train runs alongside the UDP and TCP scans, which seed their timeouts from its first
+	// ECHO-REPLY. The scan waits up to ICMPV6_RTT_WAIT_USECS for one before starting them, and they
+	// otherwise adopt any which arrives later, until their own replies have given them an estimate.
+	#define ICMPV6_RTT_WAIT_USECS 300000
+	#define IPSCAN_RTT_POLL_USECS 5000
+
+	// Persistent ICMPv6 echo helper (pingd/ipscan-pingd, built with "make pingd"). Whilst it is running,
+	// scans hand their ECHO-REQUEST to it over the Unix socket IPSCAN_PINGD_SOCKET rather than use
+	// the raw socket each opens at startup, before dropping root privileges. The helper opens its one raw socket as
+	// root and then runs as IPSCAN_PINGD_USER, which must be the user the web server runs the CGIs as.
+	// Scans fall back to their own raw socket whenever the helper cannot be reached.
+	#define IPSCAN_PINGD 1
+	#define IPSCAN_PINGD_SOCKET "/run/ipscan-pingd.sock"
+	#define IPSCAN_PINGD_USER "www-data"
+	// Scans which may be connected at once, and ECHO-REQUESTs which may be outstanding at once. The
+	// latter must be a power of 2, no more than 65536, since the ECHO-REQUEST sequence number encodes it.
+	#define IPSCAN_PINGD_MAXCLIENTS 128
+	#define IPSCAN_PINGD_MAXPENDING 256
+	// Additional time a scan waits for the helper to report, beyond ICMPV6_TIMEOUT_USECS
+	#define IPSCAN_PINGD_GRACE_USECS 250000
+	#define IPSCAN_PINGD_MAGIC 0x69707364
+
 	// UDP buffer size
 	#define UDP_BUFFER_SIZE 512
 
@@ -517,21 +755,102 @@
 	#define UDPTIMEOUTSECS 2
 	#define UDPTIMEOUTMICROSECS 20000
 
+	// Adaptive timeouts - the TCP connect and UDP read timeouts for each scan are derived from the
+	// round trip time measured by the ICMPv6 echo and early TCP completions, as a smoothed RTT plus
+	// four times its variation (after RFC6298), and are then clamped to the floors and ceilings below.
+	// The ceilings are the fixed timeouts above, which also apply whenever no RTT has been measured.
+	#define TCPTIMEOUT_CEILING_USECS ((uint64_t)TIMEOUTSECS * 1000000 + TIMEOUTMICROSECS)
+	#define TCPTIMEOUT_FLOOR_USECS 200000
+	#define UDPTIMEOUT_CEILING_USECS ((uint64_t)UDPTIMEOUTSECS * 1000000 + UDPTIMEOUTMICROSECS)
+	#define UDPTIMEOUT_FLOOR_USECS 500000
+
+	// Ports which time out (PORTINPROGRESS) or respond unexpectedly (PORTUNEXPECTED) are often just
+	// the victims of packet loss, so with IPSCAN_TCP_REPROBE set to 1 they are probed once more in a
+	// second concurrent round. The first round's ceiling is then TCPTIMEOUT_FIRST_CEILING_USECS and the
+	// second round's TCPREPROBE_CEILING_USECS, together still within TCPTIMEOUT_CEILING_USECS.
+	#define IPSCAN_TCP_REPROBE 1
+	#define TCPTIMEOUT_FIRST_CEILING_USECS 600000
+	#define TCPREPROBE_CEILING_USECS 400000
+	// The re-probe list must hold every port of the largest list handed to the engine at once, which is
+	// either the default list or a block of IPSCAN_FULLSCAN_BLOCK ports. A longer list is scanned in a
+	// single round at the full TCPTIMEOUT_CEILING_USECS instead.
+	#define IPSCAN_TCP_REPROBE_MAXPORTS ((IPSCAN_FULLSCAN_BLOCK > MAXPORTS) ? IPSCAN_FULLSCAN_BLOCK : MAXPORTS)
+
+	// SSDP responders may wait up to the M-SEARCH MX value (seconds) before replying,
+	// so this is added to the adaptive UDP timeout for that probe
+	#define SSDP_MX_SECS 1
+
+	// Round trip time estimator state
+	struct rtt_struc
+	{
+		uint64_t srtt;
+		uint64_t rttvar;
+		unsigned int samples;
+	};
+
+	// Round trip time estimate published by the echo train's child for the rest of the scan, mapped
+	// shared before any children are forked. The estimate packs the smoothed round trip time (upper 32
+	// bits) and its variation (lower 32 bits), in microseconds, so that it is read and written whole.
+	struct rtt_share_struc
+	{
+		uint64_t estimate;
+		unsigned int samples;
+		unsigned int finished;
+	};
+
+	// Scan context - the client address is parsed once in main() and the result, together with
+	// the database keys and timeouts, is handed to the ICMPv6, UDP, TCP and database layers
+	struct scan_context_struc
+	{
+		char hostname[INET6_ADDRSTRLEN];
+		struct sockaddr_in6 remoteaddr;
+		uint64_t host_msb;
+		uint64_t host_lsb;
+		uint64_t timestamp;
+		uint64_t session;
+		struct rtt_struc rtt;
+		struct rtt_share_struc *rttshare;
+		uint64_t udptimeoutusecs;
+		uint64_t tcpceilingusecs;
+		struct tcp_reprobe_struc *reprobe;
+		struct portbitmap_struc *bitmap;
+		int numchildren;
+		pid_t childpid[MAXSCANCHILDREN];
+		int childproto[MAXSCANCHILDREN];
+	};
+
 	// An estimate of the time to perform the test - assumes num ports is always
 	// smaller than (MAXPORTSPERCHILD * MAX_CHILDREN) for each protocol
 	#define UDPSTATICTIME 2
 	#define TCPSTATICTIME 2
 	#define ICMP6STATICTIME 2
 
-	#if (IPSCAN_INCLUDE_UDP == 1)
-	#define UDPRUNTIME ((MAXUDPCHILDREN == 1) ? (numudpports * UDPTIMEOUTSECS + UDPSTATICTIME) :  ( (numudpports > MAXUDPPORTSPERCHILD) ? (MAXUDPPORTSPERCHILD * UDPTIMEOUTSECS + UDPSTATICTIME) : ( numudpports * UDPTIMEOUTSECS + UDPSTATICTIME) ) )
+	// Convert a timeout in microseconds into whole seconds, rounding up
+	#define USECS_TO_SECS(usecs) ((int)(((usecs) + 999999) / 1000000))
+
+	#if (IPSCAN_INCLUDE_UDP == 1) && (1 == IPSCAN_UDP_MUX)
+	// Each child's probes, and their retransmissions, are paced out within one fixed budget
+	#define UDPRUNTIME_FOR(udpusecs) ( USECS_TO_SECS( ((numudpports + UDP_MUX_MAXPROBES - 1) / UDP_MUX_MAXPROBES)\
+			* (uint64_t)UDPRETRANSMIT_BUDGET_USECS + PACERRUNTIME_USECS(numudpports * (1 + UDP_MAXRETRANSMITS)) ) + UDPSTATICTIME )
+	#elif (IPSCAN_INCLUDE_UDP == 1)
+	#define UDPRUNTIME_FOR(udpusecs) ((MAXUDPCHILDREN == 1) ? (USECS_TO_SECS(numudpports * (udpusecs)) + UDPSTATICTIME) :  ( (numudpports > MAXUDPPORTSPERCHILD) ? (USECS_TO_SECS(MAXUDPPORTSPERCHILD * (udpusecs)) + UDPSTATICTIME) : ( USECS_TO_SECS(numudpports * (udpusecs)) + UDPSTATICTIME) ) )
 	#else
-	#define UDPRUNTIME 0
+	#define UDPRUNTIME_FOR(udpusecs) 0
 	#endif
 
-	#define TCPRUNTIME ( (MAXCHILDREN == 1) ? (numports * TIMEOUTSECS + TCPSTATICTIME) : ( (numports > MAXPORTSPERCHILD) ? (MAXPORTSPERCHILD * TIMEOUTSECS + TCPSTATICTIME) : ( numports * TIMEOUTSECS + TCPSTATICTIME) ) )
+	// TCP ports are scanned in rounds of up to MAXTCPINFLIGHT concurrent connect attempts
+	// and are paced at IPSCAN_PACER_RATE - summing both gives an upper bound
+	#define PACERRUNTIME_USECS(probes) ((0 < IPSCAN_PACER_RATE) ? (((uint64_t)(probes) * 1000000) / IPSCAN_PACER_RATE) : 0)
+	#define TCPRUNTIME_FOR(tcpusecs) ( USECS_TO_SECS( ((numports + MAXTCPINFLIGHT - 1) / MAXTCPINFLIGHT) * (tcpusecs) + PACERRUNTIME_USECS(numports) ) + TCPSTATICTIME )
 	#define ICMP6RUNTIME (ICMP6STATICTIME + TIMEOUTSECS)
-	#define ESTIMATEDTIMETORUN ( UDPRUNTIME + TCPRUNTIME + ICMP6RUNTIME )
+	#define PORTSETRUNTIME_FOR(ports, tcpusecs, rate) ( USECS_TO_SECS( (((ports) + MAXTCPINFLIGHT - 1) / MAXTCPINFLIGHT) * (uint64_t)(tcpusecs)\
+			+ ((0 < (rate)) ? (((uint64_t)(ports) * 1000000) / (rate)) : 0) ) + TCPSTATICTIME )
+	// The phases overlap, so the longest of them bounds the whole scan
+	#define RUNTIME_MAX(a, b) (((a) > (b)) ? (a) : (b))
+	#define ESTIMATEDTIMETORUN_FOR(tcpusecs, udpusecs) RUNTIME_MAX( RUNTIME_MAX(UDPRUNTIME_FOR(udpusecs), TCPRUNTIME_FOR(tcpusecs)), ICMP6RUNTIME )
+
+	// Worst case estimate, used before any RTT has been measured
+	#define ESTIMATEDTIMETORUN ESTIMATEDTIMETORUN_FOR(TCPTIMEOUT_CEILING_USECS, UDPTIMEOUT_CEILING_USECS)
 
 	// NTP constants - setup as client (mode 3), unsynchronised, poll interval 8, precision 1 second
 	#define NTP_LI 0
@@ -696,5 +1015,176 @@
 		char port_desc[PORTDESCSIZE];
 	};
 
+	// Full-range scan results - one bit per port for each result, together with the number of
+	// ports found in each state. Kept in shared memory whilst scanning, so that forked children
+	// can record their results, and in MYSQL_BITMAP_TBLNAME (one row per state found) thereafter.
+	struct portbitmap_struc
+	{
+		uint32_t count[NUMRESULTTYPES];
+		uint8_t bits[NUMRESULTTYPES][IPSCAN_BITMAP_BYTES];
+	};
+
+	// The set of ports requested by a port set or full-range scan, one bit per port
+	struct portset_struc
+	{
+		uint32_t count;
+		uint8_t bits[IPSCAN_BITMAP_BYTES];
+	};
+
+	// Hierarchical timer wheel, which holds every in-flight probe's deadline, retransmission and
+	// pacing holdoff, so that the engines sleep exactly until the earliest of them. Each level has
+	// TIMER_WHEEL_SLOTS slots of TIMER_TICK_USECS (level 0) or the span of the level below, so the
+	// wheel reaches TIMER_TICK_USECS * TIMER_WHEEL_SLOTS^TIMER_WHEEL_LEVELS ahead (over 4 hours).
+	#define TIMER_TICK_USECS 1000
+	#define TIMER_WHEEL_BITS 6
+	#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+	#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+	#define TIMER_WHEEL_LEVELS 4
+	#define TIMER_NEVER UINT64_MAX
+
+	// What an expired timer is for - owner identifies the probe (or slot) within its engine
+	#define TIMER_TCP_DEADLINE 1
+	#define TIMER_TCP_RETRY 2
+	#define TIMER_TCP_PACE 3
+	#define TIMER_UDP_RETRANSMIT 4
+	#define TIMER_UDP_DEADLINE 5
+	#define TIMER_UDP_LINGER 6
+	#define TIMER_ICMPV6_DEADLINE 7
+	#define TIMER_ICMPV6_TRAIN 8
+
+	// A timer is embedded in its owner's state, and must be zeroed before first use
+	struct timer_struc
+	{
+		struct timer_struc *next;
+		struct timer_struc **pprev;
+		uint64_t expires;
+		unsigned int owner;
+		int kind;
+		uint8_t level;
+		uint8_t slot;
+	};
+
+	struct timerwheel_struc
+	{
+		uint64_t tick;
+		uint64_t occupied[TIMER_WHEEL_LEVELS];
+		unsigned int count;
+		long pid;
+		struct timer_struc *slot[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	};
+
+	// Messages exchanged with the ICMPv6 echo helper, one per SOCK_SEQPACKET datagram. A scan sends
+	// a request and the helper answers it, once the outcome is known, with a reply bearing the same tag.
+	struct pingd_request_struc
+	{
+		uint32_t magic;
+		uint32_t tag;
+		struct in6_addr target;
+		uint64_t timestamp;
+		uint64_t session;
+		uint64_t timeoutusecs;
+		uint32_t count;
+		uint32_t spacingusecs;
+	};
+
+	// The helper reports each ECHO-REQUEST of a train separately, probe being its position in the train
+	struct pingd_reply_struc
+	{
+		uint32_t magic;
+		uint32_t tag;
+		int32_t result;
+		uint32_t probe;
+		uint64_t rttusecs;
+		char router[INET6_ADDRSTRLEN];
+	};
+
+	// Outcome of an echo train - rttusecs is 0 for each ECHO-REQUEST left unanswered
+	struct icmpv6_train_struc
+	{
+		unsigned int sent;
+		unsigned int received;
+		uint64_t rttusecs[ICMPV6_TRAIN_COUNT];
+		uint64_t minrtt;
+		uint64_t avgrtt;
+		uint64_t maxrtt;
+		uint64_t jitter;
+	};
+
+	// IPSCAN_INTERFACE_NAME's IPv6 address and MAC address, as used in some UDP probes. Looked up
+	// once per scan and shared with the scan children, it is only refreshed when netlink reports
+	// an address or link change. generation is odd whilst an update is in progress.
+	struct iface_struc
+	{
+		uint32_t generation;
+		uint8_t addrvalid;
+		uint8_t macvalid;
+		unsigned char mac[6];
+		struct in6_addr addr;
+	};
+
+	// UDP probe payload templates - built once per (port, special) pair, with the offsets of the
+	// fields which are filled in as each probe is sent
+	#define UDP_MAXTEMPLATES 64
+	#define UDP_MAXPATCHES 4
+	#define UDP_PATCH_ID 1
+	#define UDP_PATCH_NTPTIME 2
+	#define UDP_PATCH_MAC 3
+	#define UDP_PATCH_LOCALADDR 4
+
+	struct udp_patch_struc
+	{
+		uint8_t type;
+		uint8_t len;
+		uint16_t offset;
+	};
+
+	// Set in a template's flags if its replies can be told apart from those of the other tests
+	// of the same port, so that all of them may be sent from one socket
+	#define UDP_TEMPLATE_DISTINCT 1
+
+	// Whether a reply belongs to a probe, as returned by udp_response_match()
+	#define UDP_MATCH_NO 0
+	#define UDP_MATCH_YES 1
+	#define UDP_MATCH_UNKNOWN 2
+
+	struct udp_template_struc
+	{
+		uint16_t port;
+		uint8_t special;
+		uint8_t numpatches;
+		uint8_t flags;
+		int len;
+		const struct udp_probedesc_struc *probe;
+		uint32_t buildnsecs;
+		struct udp_patch_struc patch[UDP_MAXPATCHES];
+		char payload[UDP_BUFFER_SIZE+1];
+	};
+
+	// UDP probe registry - one descriptor per UDP test, from which both the UDP port list and the
+	// scanner are driven. build() fills in a template's payload and patches, returning its length
+	// or -1 on error, and validate() decides whether a reply answers the probe, returning a
+	// UDP_MATCH_ value. timeouthint is any time the service may take to answer beyond the round
+	// trip, in microseconds. The registry itself is defined in ipscan_portlist.h.
+	struct udp_probedesc_struc
+	{
+		uint16_t port;
+		uint8_t special;
+		char desc[PORTDESCSIZE];
+		int (*build)(struct udp_template_struc *t, const char *hostname);
+		int (*validate)(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len);
+		uint64_t timeouthint;
+	};
+
+	// Traffic exchanged with one UDP probe's service, from which its amplification factor is derived
+	struct udp_amp_struc
+	{
+		uint32_t txbytes;
+		uint32_t rxbytes;
+		uint32_t rxdatagrams;
+	};
+
+	extern struct udp_probedesc_struc udpprobes[];
+	extern const unsigned int numudpprobes;
+
 	// End of defines
 #endif
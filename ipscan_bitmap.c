@@ -0,0 +1,259 @@
+//    IPscan - an HTTP-initiated IPv6 port scanner.
+//
+//    Copyright (C) 2011-2021 Tim Chappell.
+//
+//    This file is part of IPscan.
+//
+//    IPscan is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with IPscan.  If not, see <http://www.gnu.org/licenses/>.
+
+// ipscan_bitmap.c 	version
+// 0.01			initial version - per-state port bitmaps for full-range scans
+// 0.02			add compact port sets, parsed from range syntax such as 8000-8100,8443
+// 0.03			move bitmap_print_ranges()'s comment back above it
+
+#include "ipscan.h"
+//
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <ctype.h>
+
+// Logging with syslog requires additional include
+#if (LOGMODE == 1)
+#include <syslog.h>
+#endif
+
+// Others that FreeBSD highlighted
+#include <stdint.h>
+#include <inttypes.h>
+
+//
+// Prototype declarations
+//
+int bitmap_index(int result);
+int bitmap_next_range(const uint8_t *bits, unsigned int *port, unsigned int *first, unsigned int *last);
+
+//
+// Allocate an empty bitmap - mapped shared so that the forked blocking engine's children
+// record their results in the parent's copy
+//
+
+struct portbitmap_struc * bitmap_create(void)
+{
+	struct portbitmap_struc *bitmap = mmap(NULL, sizeof(struct portbitmap_struc), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == (void *)bitmap)
+	{
+		IPSCAN_LOG( LOGPREFIX "bitmap_create: mmap failed : %d (%s)\n", errno, strerror(errno));
+		return(NULL);
+	}
+	// Anonymous mappings are zero-filled, i.e. no port is in any state
+	return(bitmap);
+}
+
+void bitmap_destroy(struct portbitmap_struc *bitmap)
+{
+	if (NULL == bitmap) return;
+	if (0 != munmap(bitmap, sizeof(struct portbitmap_struc)))
+	{
+		IPSCAN_LOG( LOGPREFIX "bitmap_destroy: munmap failed : %d (%s)\n", errno, strerror(errno));
+	}
+}
+
+// Map a result onto its bitmap, anything out of range being recorded as unknown
+int bitmap_index(int result)
+{
+	return( (0 <= result && NUMRESULTTYPES > result) ? result : PORTUNKNOWN );
+}
+
+//
+// Record, or remove, a port in the given state. Atomic, since several processes may be
+// updating the same bitmap, and the state's count only changes if the port's bit does.
+//
+
+void bitmap_set(struct portbitmap_struc *bitmap, uint16_t port, int result)
+{
+	int state = bitmap_index(result);
+	uint8_t mask = (uint8_t)(1 << (port & 7));
+	uint8_t old = __atomic_fetch_or(&bitmap->bits[state][port >> 3], mask, __ATOMIC_ACQ_REL);
+
+	if (0 == (old & mask)) __atomic_fetch_add(&bitmap->count[state], 1, __ATOMIC_ACQ_REL);
+}
+
+void bitmap_clear(struct portbitmap_struc *bitmap, uint16_t port, int result)
+{
+	int state = bitmap_index(result);
+	uint8_t mask = (uint8_t)(1 << (port & 7));
+	uint8_t old = __atomic_fetch_and(&bitmap->bits[state][port >> 3], (uint8_t)~mask, __ATOMIC_ACQ_REL);
+
+	if (0 != (old & mask)) __atomic_fetch_sub(&bitmap->count[state], 1, __ATOMIC_ACQ_REL);
+}
+
+//
+// Find the next range of consecutive ports set in a bitmap, starting from *port. Returns 1
+// with the range in *first and *last (and *port advanced beyond it), or 0 once none remain.
+//
+
+int bitmap_next_range(const uint8_t *bits, unsigned int *port, unsigned int *first, unsigned int *last)
+{
+	unsigned int p = *port;
+
+	while (p < 65536)
+	{
+		// Skip whole bytes with no ports set
+		if (0 == (p & 7) && 0 == bits[p >> 3])
+		{
+			p += 8;
+			continue;
+		}
+		if (0 == (bits[p >> 3] & (1 << (p & 7))))
+		{
+			p++;
+			continue;
+		}
+
+		*first = p;
+		while (p < 65536 && 0 != (bits[p >> 3] & (1 << (p & 7)))) p++;
+		*last = p - 1;
+		*port = p;
+		return(1);
+	}
+	*port = p;
+	return(0);
+}
+
+//
+// Print the ports set in a single state's bitmap as a list of ranges, e.g. "1-21, 23, 25-79",
+// returning the number of ranges printed
+//
+
+unsigned int bitmap_print_ranges(const uint8_t *bits)
+{
+	unsigned int port = 0, first, last, numranges = 0;
+
+	while (0 != bitmap_next_range(bits, &port, &first, &last))
+	{
+		if (first == last)
+		{
+			printf("%s%u", (0 == numranges) ? "" : ", ", first);
+		}
+		else
+		{
+			printf("%s%u-%u", (0 == numranges) ? "" : ", ", first, last);
+		}
+		numranges++;
+	}
+	return(numranges);
+}
+
+//
+// Port sets - a compact record of the ports to be scanned, one bit per port
+//
+
+void portset_add_range(struct portset_struc *set, uint16_t firstport, uint16_t lastport)
+{
+	unsigned int port;
+
+	for (port = firstport; port <= lastport; port++)
+	{
+		uint8_t mask = (uint8_t)(1 << (port & 7));
+		if (0 == (set->bits[port >> 3] & mask))
+		{
+			set->bits[port >> 3] |= mask;
+			set->count++;
+		}
+	}
+}
+
+void portset_remove(struct portset_struc *set, uint16_t port)
+{
+	uint8_t mask = (uint8_t)(1 << (port & 7));
+	if (0 != (set->bits[port >> 3] & mask))
+	{
+		set->bits[port >> 3] &= (uint8_t)~mask;
+		set->count--;
+	}
+}
+
+//
+// Parse a list of ports and port ranges, e.g. "8000-8100,8443", into the set. Entries may be
+// separated by commas, spaces or their URL-encoded forms (%2c, %20 and +). The whole list is
+// rejected, leaving the set empty, if any entry is invalid or it names more than maxports ports.
+// Returns the number of ports in the set, or -1 on error.
+//
+
+int portset_parse(struct portset_struc *set, const char *string, size_t len, unsigned int maxports)
+{
+	size_t i = 0;
+	unsigned int firstport, lastport;
+	int valid = 1;
+
+	memset(set, 0, sizeof(struct portset_struc));
+
+	while (i < len && 1 == valid)
+	{
+		// Skip any separators
+		if (',' == string[i] || ' ' == string[i] || '+' == string[i])
+		{
+			i++;
+			continue;
+		}
+		if ('%' == string[i] && (i + 2) < len && '2' == string[i+1] && ('c' == string[i+2] || 'C' == string[i+2] || '0' == string[i+2]))
+		{
+			i += 3;
+			continue;
+		}
+
+		// An entry is either a single port, or a range of the form first-last
+		valid = 0;
+		if (0 == isdigit((unsigned char)string[i])) break;
+		firstport = 0;
+		while (i < len && 0 != isdigit((unsigned char)string[i]) && MAXVALIDPORT >= firstport)
+		{
+			firstport = (firstport * 10) + (unsigned int)(string[i] - '0');
+			i++;
+		}
+		lastport = firstport;
+		if (i < len && '-' == string[i])
+		{
+			i++;
+			if (i >= len || 0 == isdigit((unsigned char)string[i])) break;
+			lastport = 0;
+			while (i < len && 0 != isdigit((unsigned char)string[i]) && MAXVALIDPORT >= lastport)
+			{
+				lastport = (lastport * 10) + (unsigned int)(string[i] - '0');
+				i++;
+			}
+		}
+		if (MINVALIDPORT >= firstport || MAXVALIDPORT < lastport || lastport < firstport) break;
+		// Bound the work done for each entry before adding it
+		if ((lastport - firstport) >= maxports) break;
+		// Entries must be followed by a separator or the end of the list
+		if (i < len && ',' != string[i] && ' ' != string[i] && '+' != string[i] && '%' != string[i]) break;
+
+		portset_add_range(set, (uint16_t)firstport, (uint16_t)lastport);
+		if (maxports >= set->count) valid = 1;
+	}
+
+	if (1 != valid)
+	{
+		IPSCAN_LOG( LOGPREFIX "portset_parse: rejected invalid port set, near offset %u\n", (unsigned int)i);
+		memset(set, 0, sizeof(struct portset_struc));
+		return(-1);
+	}
+	return((int)set->count);
+}
@@ -59,6 +59,10 @@
 // 0.38 - move primary key statements, update copyright year
 // 0.39 - add LGTM pragmas to prevent False Positive (FP) reporting of SQL injection vuln
 // 0.40 - remove LGTM pragmas since FP diagnosis accepted and alerts should go away soon
+// 0.41 - add write_db_scan() and read_db_scan() taking the keys from a scan context
+// 0.42 - add update_db_scan() for re-probed TCP results
+// 0.43 - add write_db_bitmap(), read_db_bitmap() and dump_db_bitmap() for full-range scans
+// 0.44 - add read_db_result_note() and read_db_scan_note(), which also fetch the indirect host field
 
 #include "ipscan.h"
 //
@@ -78,6 +82,7 @@
 
 // MySQL Database includes
 #include <mysql.h>
+#include <mysqld_error.h>
 
 // Logging with syslog requires additional include
 #if (LOGMODE == 1)
@@ -98,6 +103,14 @@
 void proto_to_string(int proto, char * retstring);
 char * state_to_string(int statenum, char * retstringptr, int retstringfree);
 void result_to_string(int result, char * retstring);
+//
+// Functions from ipscan_bitmap.c
+//
+unsigned int bitmap_print_ranges(const uint8_t *bits);
+//
+// Defined later in this file
+//
+int update_db(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, uint32_t port, int32_t result, char *indirecthost);
 // ----------------------------------------------------------------------------------------
 
 // ----------------------------------------------------------------------------------------
@@ -462,6 +475,25 @@ int delete_from_db(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uin
 					IPSCAN_LOG( LOGPREFIX "delete_from_db: ERROR: Failed to create select query\n");
 					retval = 4;
 				}
+
+				#if (1 == IPSCAN_BITMAP_RESULTS)
+				// Also delete any full-range scan bitmaps - the table only exists once such a scan has been run
+				qrylen = snprintf(query, MAXDBQUERYSIZE, "DELETE FROM `%s` WHERE ( hostmsb = '%"PRIu64"' AND hostlsb = '%"PRIu64"' AND createdate = '%"PRIu64"' AND session = '%"PRIu64"')", MYSQL_BITMAP_TBLNAME, host_msb, host_lsb, timestamp, session);
+				if (qrylen > 0 && qrylen < MAXDBQUERYSIZE)
+				{
+					rc = mysql_real_query(connection, query, qrylen);
+					if (0 != rc && ER_NO_SUCH_TABLE != mysql_errno(connection))
+					{
+						IPSCAN_LOG( LOGPREFIX "delete_from_db: ERROR: Delete of bitmaps failed, returned %d (%s).\n", rc, mysql_error(connection) );
+						retval = 12;
+					}
+				}
+				else
+				{
+					IPSCAN_LOG( LOGPREFIX "delete_from_db: ERROR: Failed to create bitmap delete query\n");
+					retval = 4;
+				}
+				#endif
 			}
 			mysql_commit(connection);
 			mysql_close(connection);
@@ -477,10 +509,10 @@ int delete_from_db(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uin
 
 
 //
-// Fetch a single result
+// Fetch a single result, and if indirecthost is not NULL, its indirect host field (e.g. a UDP result's note)
 //
 
-int read_db_result(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, uint32_t port)
+int read_db_result_note(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, uint32_t port, char *indirecthost, size_t size)
 {
 
 	int rc;
@@ -497,7 +529,7 @@ int read_db_result(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uin
 	connection = mysql_init(NULL);
 	if (NULL == connection)
 	{
-		IPSCAN_LOG( LOGPREFIX "read_db_result: ERROR: Failed to initialise MySQL\n");
+		IPSCAN_LOG( LOGPREFIX "read_db_result_note: ERROR: Failed to initialise MySQL\n");
 		retres = PORTINTERROR;
 	}
 	else
@@ -512,8 +544,8 @@ int read_db_result(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uin
 			mysqlrc = mysql_real_connect(connection, MYSQL_HOST, MYSQL_USER, MYSQL_PASSWD, MYSQL_DBNAME, 0, NULL, 0);
 			if (NULL == mysqlrc)
 			{
-				IPSCAN_LOG( LOGPREFIX "read_db_result: ERROR: Failed to connect to MySQL database (%s) : %s\n", MYSQL_DBNAME, mysql_error(connection) );
-				IPSCAN_LOG( LOGPREFIX "read_db_result: HOST %s, USER %s, PASSWD %s\n", MYSQL_HOST, MYSQL_USER, MYSQL_PASSWD);
+				IPSCAN_LOG( LOGPREFIX "read_db_result_note: ERROR: Failed to connect to MySQL database (%s) : %s\n", MYSQL_DBNAME, mysql_error(connection) );
+				IPSCAN_LOG( LOGPREFIX "read_db_result_note: HOST %s, USER %s, PASSWD %s\n", MYSQL_HOST, MYSQL_USER, MYSQL_PASSWD);
 				retres = PORTINTERROR;
 			}
 			else
@@ -540,44 +572,48 @@ int read_db_result(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uin
 									{
 										// Set the return result
 										retres = dbres;
+										if (NULL != indirecthost && 0 < size)
+										{
+											snprintf(indirecthost, size, "%s", (NULL != row[7]) ? row[7] : "");
+										}
 									}
 									else
 									{
-										IPSCAN_LOG( LOGPREFIX "read_db_result: ERROR: Unexpected row scan results - rcres = %d\n", rcres);
+										IPSCAN_LOG( LOGPREFIX "read_db_result_note: ERROR: Unexpected row scan results - rcres = %d\n", rcres);
 									}
 								}
 								else
 								{
-									IPSCAN_LOG( LOGPREFIX "read_db_result: ERROR: Unexpected row scan results - num_fields = %d\n", num_fields);
+									IPSCAN_LOG( LOGPREFIX "read_db_result_note: ERROR: Unexpected row scan results - num_fields = %d\n", num_fields);
 								}
 							}
 							mysql_free_result(result);
 						}
 						else
 						{
-							IPSCAN_LOG( LOGPREFIX "read_db_result: ERROR: surprisingly mysql_store_result() returned NULL\n");
+							IPSCAN_LOG( LOGPREFIX "read_db_result_note: ERROR: surprisingly mysql_store_result() returned NULL\n");
 							// Didn't get any results, so check if we should have got some
 							if (mysql_field_count(connection) == 0)
 							{
-								IPSCAN_LOG( LOGPREFIX "read_db_result: ERROR: surprisingly mysql_field_count() expected to return 0 fields\n");
+								IPSCAN_LOG( LOGPREFIX "read_db_result_note: ERROR: surprisingly mysql_field_count() expected to return 0 fields\n");
 							}
 							else
 							{
-								IPSCAN_LOG( LOGPREFIX "read_db_result: ERROR: mysql_store_result() error : %s\n", mysql_error(connection));
+								IPSCAN_LOG( LOGPREFIX "read_db_result_note: ERROR: mysql_store_result() error : %s\n", mysql_error(connection));
 								retres = PORTINTERROR;
 							}
 						}
 					}
 					else
 					{
-						IPSCAN_LOG( LOGPREFIX "read_db_result: ERROR: Failed to execute select query \"%s\" %d (%s)\n",\
+						IPSCAN_LOG( LOGPREFIX "read_db_result_note: ERROR: Failed to execute select query \"%s\" %d (%s)\n",\
                                                                                         query, mysql_errno(connection), mysql_error(connection) );
 						retres = PORTINTERROR;
 					}
 				}
 				else
 				{
-					IPSCAN_LOG( LOGPREFIX "read_db_result: ERROR: Failed to create select query\n");
+					IPSCAN_LOG( LOGPREFIX "read_db_result_note: ERROR: Failed to create select query\n");
 					retres = PORTINTERROR;
 				}
 			}
@@ -586,19 +622,326 @@ int read_db_result(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uin
 		}
 		else
 		{
-			IPSCAN_LOG( LOGPREFIX "read_db_result: ERROR: mysql_options() failed - check your my.cnf file\n");
+			IPSCAN_LOG( LOGPREFIX "read_db_result_note: ERROR: mysql_options() failed - check your my.cnf file\n");
 			retres = PORTINTERROR;
 		}
 	}
 
 	if (PORTUNKNOWN == retres)
 	{
-		IPSCAN_LOG( LOGPREFIX "read_db_result: ERROR: about to exit with PORTUNKNOWN return code\n");
+		IPSCAN_LOG( LOGPREFIX "read_db_result_note: ERROR: about to exit with PORTUNKNOWN return code\n");
 	}
 
 	return (retres);
 }
 
+int read_db_result(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, uint32_t port)
+{
+	return( read_db_result_note(host_msb, host_lsb, timestamp, session, port, NULL, 0) );
+}
+
+// ----------------------------------------------------------------------------------------
+//
+// Scan context forms of write_db(), update_db(), read_db_result() and read_db_result_note(), for use by the probing layers
+//
+// ----------------------------------------------------------------------------------------
+
+int write_db_scan(struct scan_context_struc *ctx, uint32_t port, int32_t result, char *indirecthost)
+{
+	return( write_db(ctx->host_msb, ctx->host_lsb, ctx->timestamp, ctx->session, port, result, indirecthost) );
+}
+
+int update_db_scan(struct scan_context_struc *ctx, uint32_t port, int32_t result, char *indirecthost)
+{
+	return( update_db(ctx->host_msb, ctx->host_lsb, ctx->timestamp, ctx->session, port, result, indirecthost) );
+}
+
+int read_db_scan(struct scan_context_struc *ctx, uint32_t port)
+{
+	return( read_db_result(ctx->host_msb, ctx->host_lsb, ctx->timestamp, ctx->session, port) );
+}
+
+int read_db_scan_note(struct scan_context_struc *ctx, uint32_t port, char *indirecthost, size_t size)
+{
+	return( read_db_result_note(ctx->host_msb, ctx->host_lsb, ctx->timestamp, ctx->session, port, indirecthost, size) );
+}
+
+// ----------------------------------------------------------------------------------------
+//
+// Functions to write and read the per-state port bitmaps of a full-range scan
+//
+// ----------------------------------------------------------------------------------------
+
+int write_db_bitmap(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, uint32_t proto, int32_t result, uint32_t count, const uint8_t *bits)
+{
+
+	// ID                 BIGINT UNSIGNED
+	//
+	// HOSTADDRESS MSB    BIGINT UNSIGNED
+	//	       LSB    BIGINT UNSIGNED
+	//
+	// DATE-TIME          BIGINT UNSIGNED
+	//
+	// SESSIONID          BIGINT UNSIGNED
+	//
+	// PROTO              BIGINT UNSIGNED
+	//
+	// RESULT             BIGINT UNSIGNED
+	//
+	// PORTCOUNT          BIGINT UNSIGNED
+	//				  The number of bits set in the bitmap
+	//
+	// BITMAP             VARBINARY(IPSCAN_BITMAP_BYTES)
+	//				  One bit per port, port 0 being the least significant bit of the first byte
+
+	int rc;
+	int qrylen;
+	int retval = -1; // do not change this
+	unsigned int i;
+	char query[MAXBITMAPQUERYSIZE];
+	MYSQL *connection;
+	MYSQL *mysqlrc;
+
+	connection = mysql_init(NULL);
+	if (NULL == connection)
+	{
+		IPSCAN_LOG( LOGPREFIX "write_db_bitmap: ERROR: Failed to initialise MySQL\n");
+		retval = 1;
+	}
+	else
+	{
+		// By using mysql_options() the MySQL library reads the [client] and [ipscan] sections
+		// in the my.cnf file which ensures that your program works, even if someone has set
+		// up MySQL in some nonstandard way.
+		rc = mysql_options(connection, MYSQL_READ_DEFAULT_GROUP, "ipscan");
+		if (0 == rc)
+		{
+
+			mysqlrc = mysql_real_connect(connection, MYSQL_HOST, MYSQL_USER, MYSQL_PASSWD, MYSQL_DBNAME, 0, NULL, 0);
+			if (NULL == mysqlrc)
+			{
+				IPSCAN_LOG( LOGPREFIX "write_db_bitmap: ERROR: Failed to connect to MySQL database (%s) : %s\n", MYSQL_DBNAME, mysql_error(connection));
+				IPSCAN_LOG( LOGPREFIX "write_db_bitmap: HOST %s, USER %s, PASSWD %s\n", MYSQL_HOST, MYSQL_USER, MYSQL_PASSWD);
+				retval = 3;
+			}
+			else
+			{
+				#if (IPSCAN_MYSQL_MEMORY_ENGINE_ENABLE == 1)
+				// Use memory engine - ensures sensitive data does not persist if MySQL is stopped/restarted
+				qrylen = snprintf(query, MAXBITMAPQUERYSIZE, "CREATE TABLE IF NOT EXISTS %s(id BIGINT UNSIGNED NOT NULL AUTO_INCREMENT PRIMARY KEY, hostmsb BIGINT UNSIGNED DEFAULT 0, hostlsb BIGINT UNSIGNED DEFAULT 0, createdate BIGINT UNSIGNED DEFAULT 0, session BIGINT UNSIGNED DEFAULT 0, proto BIGINT UNSIGNED DEFAULT 0, portresult BIGINT UNSIGNED DEFAULT 0, portcount BIGINT UNSIGNED DEFAULT 0, bitmap VARBINARY(%d) ) ENGINE = MEMORY", MYSQL_BITMAP_TBLNAME, IPSCAN_BITMAP_BYTES);
+				#else
+				// Use the default engine - sensitive data may persist until next tidy_up_db() call
+				qrylen = snprintf(query, MAXBITMAPQUERYSIZE, "CREATE TABLE IF NOT EXISTS %s(id BIGINT UNSIGNED NOT NULL AUTO_INCREMENT PRIMARY KEY, hostmsb BIGINT UNSIGNED DEFAULT 0, hostlsb BIGINT UNSIGNED DEFAULT 0, createdate BIGINT UNSIGNED DEFAULT 0, session BIGINT UNSIGNED DEFAULT 0, proto BIGINT UNSIGNED DEFAULT 0, portresult BIGINT UNSIGNED DEFAULT 0, portcount BIGINT UNSIGNED DEFAULT 0, bitmap VARBINARY(%d) )", MYSQL_BITMAP_TBLNAME, IPSCAN_BITMAP_BYTES);
+				#endif
+				if (qrylen > 0 && qrylen < MAXBITMAPQUERYSIZE)
+				{
+					rc = mysql_real_query(connection, query, qrylen);
+					if (0 == rc)
+					{
+						// The bitmap is written as a hexadecimal literal
+						qrylen = snprintf(query, MAXBITMAPQUERYSIZE, "INSERT INTO `%s` (hostmsb, hostlsb, createdate, session, proto, portresult, portcount, bitmap) VALUES ( %"PRIu64", %"PRIu64", %"PRIu64", %"PRIu64", %u, %d, %u, X'", MYSQL_BITMAP_TBLNAME, host_msb, host_lsb, timestamp, session, proto, result, count);
+						if (qrylen > 0 && (qrylen + (2 * IPSCAN_BITMAP_BYTES) + 3) < MAXBITMAPQUERYSIZE)
+						{
+							for (i = 0 ; i < IPSCAN_BITMAP_BYTES ; i++)
+							{
+								query[qrylen++] = "0123456789ABCDEF"[(bits[i] >> 4) & 0xF];
+								query[qrylen++] = "0123456789ABCDEF"[bits[i] & 0xF];
+							}
+							query[qrylen++] = '\'';
+							query[qrylen++] = ')';
+							query[qrylen] = 0;
+
+							rc = mysql_real_query(connection, query, qrylen);
+							if (0 == rc)
+							{
+								retval = 0;
+							}
+							else
+							{
+								IPSCAN_LOG( LOGPREFIX "write_db_bitmap: ERROR: Failed to execute insert query for result %d, %d (%s)\n",\
+										result, mysql_errno(connection), mysql_error(connection) );
+								retval = 7;
+							}
+						}
+						else
+						{
+							IPSCAN_LOG( LOGPREFIX "write_db_bitmap: ERROR: Failed to create insert query, length returned was %d, max was %d\n", qrylen, MAXBITMAPQUERYSIZE);
+							retval = 8;
+						}
+					}
+					else
+					{
+						IPSCAN_LOG( LOGPREFIX "write_db_bitmap: ERROR: Failed to execute create_table query \"%s\" %d (%s)\n",\
+								query, mysql_errno(connection), mysql_error(connection) );
+						retval = 6;
+					}
+				}
+				else
+				{
+					IPSCAN_LOG( LOGPREFIX "write_db_bitmap: ERROR: Failed to create create_table query, length returned was %d, max was %d\n", qrylen, MAXBITMAPQUERYSIZE);
+					retval = 5;
+				}
+			}
+		}
+		else
+		{
+			IPSCAN_LOG( LOGPREFIX "write_db_bitmap: mysql_options() failed - check your my.cnf file\n");
+			retval = 2;
+		}
+		// Tidy up
+		mysql_commit(connection);
+		mysql_close(connection);
+	}
+
+	#ifdef DBDEBUG
+	if (0 != retval) IPSCAN_LOG( LOGPREFIX "write_db_bitmap: returning with retval = %d\n",retval);
+	#endif
+	return (retval);
+}
+
+//
+// Read back every bitmap stored for the given protocol, returning 0 on success
+//
+
+int read_db_bitmap(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, uint32_t proto, struct portbitmap_struc *bitmap)
+{
+	int rc;
+	int rcres, rccount;
+	int retval = 0;
+	int res;
+	unsigned int count;
+	int qrylen;
+	char query[MAXDBQUERYSIZE];
+	MYSQL *connection;
+	MYSQL *mysqlrc;
+	MYSQL_RES *result;
+	MYSQL_ROW row;
+	unsigned long *lengths;
+
+	memset(bitmap, 0, sizeof(struct portbitmap_struc));
+
+	connection = mysql_init(NULL);
+	if (NULL == connection)
+	{
+		IPSCAN_LOG( LOGPREFIX "read_db_bitmap: ERROR: Failed to initialise MySQL\n");
+		retval = 1;
+	}
+	else
+	{
+		// By using mysql_options() the MySQL library reads the [client] and [ipscan] sections
+		// in the my.cnf file which ensures that your program works, even if someone has set
+		// up MySQL in some nonstandard way.
+		rc = mysql_options(connection, MYSQL_READ_DEFAULT_GROUP,"ipscan");
+		if (0 == rc)
+		{
+
+			mysqlrc = mysql_real_connect(connection, MYSQL_HOST, MYSQL_USER, MYSQL_PASSWD, MYSQL_DBNAME, 0, NULL, 0);
+			if (NULL == mysqlrc)
+			{
+				IPSCAN_LOG( LOGPREFIX "read_db_bitmap: ERROR: Failed to connect to MySQL database (%s) : %s\n", MYSQL_DBNAME, mysql_error(connection) );
+				IPSCAN_LOG( LOGPREFIX "read_db_bitmap: HOST %s, USER %s, PASSWD %s\n", MYSQL_HOST, MYSQL_USER, MYSQL_PASSWD);
+				retval = 3;
+			}
+			else
+			{
+				qrylen = snprintf(query, MAXDBQUERYSIZE, "SELECT portresult, portcount, bitmap FROM `%s` WHERE ( hostmsb = '%"PRIu64"' AND hostlsb = '%"PRIu64"' AND createdate = '%"PRIu64"' AND session = '%"PRIu64"' AND proto = '%u') ORDER BY id", MYSQL_BITMAP_TBLNAME, host_msb, host_lsb, timestamp, session, proto);
+				if (qrylen > 0 && qrylen < MAXDBQUERYSIZE)
+				{
+					#ifdef DBDEBUG
+					IPSCAN_LOG( LOGPREFIX "read_db_bitmap: MySQL Query is : %s\n", query);
+					#endif
+					rc = mysql_real_query(connection, query, qrylen);
+					if (0 == rc)
+					{
+						result = mysql_store_result(connection);
+						if (result)
+						{
+							while ((row = mysql_fetch_row(result)))
+							{
+								lengths = mysql_fetch_lengths(result);
+								rcres = sscanf(row[0], "%d", &res);
+								rccount = sscanf(row[1], "%u", &count);
+								if (1 == rcres && 1 == rccount && NULL != lengths && NULL != row[2] && IPSCAN_BITMAP_BYTES == lengths[2] \
+										&& 0 <= res && NUMRESULTTYPES > res)
+								{
+									memcpy(&bitmap->bits[res][0], row[2], IPSCAN_BITMAP_BYTES);
+									bitmap->count[res] = count;
+								}
+								else
+								{
+									IPSCAN_LOG( LOGPREFIX "read_db_bitmap: ERROR: Unexpected row scan results - rcres = %d, rccount = %d\n", rcres, rccount);
+									retval = 11;
+								}
+							}
+							mysql_free_result(result);
+						}
+						else
+						{
+							IPSCAN_LOG( LOGPREFIX "read_db_bitmap: ERROR: mysql_store_result() error : %s\n", mysql_error(connection));
+							retval = 10;
+						}
+					}
+					else
+					{
+						IPSCAN_LOG( LOGPREFIX "read_db_bitmap: ERROR: Failed to execute select query \"%s\" %d (%s)\n",\
+								query, mysql_errno(connection), mysql_error(connection) );
+						retval = 5;
+					}
+				}
+				else
+				{
+					IPSCAN_LOG( LOGPREFIX "read_db_bitmap: ERROR: Failed to create select query\n");
+					retval = 4;
+				}
+			}
+			mysql_commit(connection);
+			mysql_close(connection);
+		}
+		else
+		{
+			IPSCAN_LOG( LOGPREFIX "read_db_bitmap: ERROR: mysql_options() failed - check your my.cnf file\n");
+			retval = 9;
+		}
+	}
+	return (retval);
+}
+
+//
+// Dump the bitmaps of a full-range scan to the client in compact form, as a JSON array holding
+// the result, number of ports and a string listing the port ranges for each state found, e.g.
+// [ 0, 2, "22, 80", 2, 65533, "1-21, 23-79, 81-65535", -9999, -9999, "" ]
+//
+
+int dump_db_bitmap(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, uint32_t proto)
+{
+	int retval;
+	int state;
+	struct portbitmap_struc *bitmap = calloc(1, sizeof(struct portbitmap_struc));
+
+	if (NULL == bitmap)
+	{
+		IPSCAN_LOG( LOGPREFIX "dump_db_bitmap: ERROR: calloc failed\n");
+		return(1);
+	}
+
+	retval = read_db_bitmap(host_msb, host_lsb, timestamp, session, proto, bitmap);
+	if (0 == retval)
+	{
+		printf("[ ");
+		for (state = 0 ; state < NUMRESULTTYPES ; state++)
+		{
+			if (0 == bitmap->count[state]) continue;
+			printf("%d, %u, \"", state, bitmap->count[state]);
+			(void)bitmap_print_ranges(&bitmap->bits[state][0]);
+			printf("\", ");
+		}
+		printf(" -9999, -9999, \"\" ]\n");
+	}
+
+	free(bitmap);
+	return(retval);
+}
+
 // ----------------------------------------------------------------------------------------
 //
 // Function to tidy up old results from the database
@@ -817,6 +1160,33 @@ int tidy_up_db(uint64_t time_now)
 					IPSCAN_LOG( LOGPREFIX "tidy_up_db: ERROR: Failed to create select query\n");
 					retval = 4;
 				}
+
+				#if (1 == IPSCAN_BITMAP_RESULTS)
+				// Delete old (expired) full-range scan bitmaps - the table only exists once such a scan has been run
+				qrylen = snprintf(query, MAXDBQUERYSIZE, "DELETE FROM `%s` WHERE ( createdate <= '%"PRIu64"' )", MYSQL_BITMAP_TBLNAME, delete_before_time);
+				if (qrylen > 0 && qrylen < MAXDBQUERYSIZE)
+				{
+					rc = mysql_real_query(connection, query, qrylen);
+					if (0 == rc)
+					{
+						my_ulonglong affected_rows = mysql_affected_rows(connection);
+						if (0 < affected_rows && ((my_ulonglong)-1) != affected_rows)
+						{
+							IPSCAN_LOG( LOGPREFIX "tidy_up_db: Deleted %ld entries from %s database.\n", (long)affected_rows, MYSQL_BITMAP_TBLNAME);
+						}
+					}
+					else if (ER_NO_SUCH_TABLE != mysql_errno(connection))
+					{
+						IPSCAN_LOG( LOGPREFIX "tidy_up_db: ERROR: Delete failed, \"%s\" returned %d (%s).\n", query, rc, mysql_error(connection) );
+						retval = 10;
+					}
+				}
+				else
+				{
+					IPSCAN_LOG( LOGPREFIX "tidy_up_db: ERROR: Failed to create bitmap delete query\n");
+					retval = 4;
+				}
+				#endif
 			}
 			mysql_commit(connection);
 			mysql_close(connection);
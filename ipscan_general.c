@@ -29,6 +29,12 @@
 // 0.09 - update copyright dates
 // 0.10 - update copyright year
 // 0.11 - reorder entries to match definitions, add database error
+// 0.12 - add round trip time estimator for adaptive timeouts
+// 0.13 - add scan_context_init()
+// 0.14 - initialise the TCP timeout ceiling and re-probe state of the scan context
+// 0.15 - initialise the full-range scan bitmap of the scan context
+// 0.16 - account for the children of every scan phase under one limit, and share the echo train's round trip time between them
+// 0.17 - add scan_drop_privileges(), which gives up root privileges for good before anything is forked
 
 #include "ipscan.h"
 //
@@ -39,6 +45,7 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <inttypes.h>
 // toupper/tolower routines
@@ -61,6 +68,16 @@
 #include <syslog.h>
 #endif
 
+// Round trip time estimate shared between the scan's processes
+#include <sys/mman.h>
+
+//
+// Prototype declarations
+//
+
+// from ipscan_pacer.c
+uint64_t pacer_now_usecs(void);
+
 //
 // -----------------------------------------------------------------------------
 //
@@ -378,3 +395,318 @@ void result_to_string(int result, char * retstring)
 //
 // -----------------------------------------------------------------------------
 //
+
+
+//
+// -----------------------------------------------------------------------------
+//
+void rtt_init(struct rtt_struc *rtt)
+{
+	rtt->srtt = 0;
+	rtt->rttvar = 0;
+	rtt->samples = 0;
+}
+
+//
+// -----------------------------------------------------------------------------
+//
+void rtt_sample(struct rtt_struc *rtt, uint64_t sampleusecs)
+{
+	if (0 == rtt->samples)
+	{
+		// First measurement, as per RFC6298 section 2.2
+		rtt->srtt = sampleusecs;
+		rtt->rttvar = sampleusecs / 2;
+	}
+	else
+	{
+		// Subsequent measurements, alpha = 1/8 and beta = 1/4 as per RFC6298 section 2.3
+		uint64_t delta = (rtt->srtt > sampleusecs) ? (rtt->srtt - sampleusecs) : (sampleusecs - rtt->srtt);
+		rtt->rttvar = ((3 * rtt->rttvar) + delta) / 4;
+		rtt->srtt = ((7 * rtt->srtt) + sampleusecs) / 8;
+	}
+	rtt->samples++;
+}
+
+//
+// -----------------------------------------------------------------------------
+//
+uint64_t rtt_timeout(struct rtt_struc *rtt, uint64_t floorusecs, uint64_t ceilingusecs)
+{
+	uint64_t timeoutusecs;
+
+	// Without a measurement there is nothing to adapt to
+	if (0 == rtt->samples) return(ceilingusecs);
+
+	timeoutusecs = rtt->srtt + (4 * rtt->rttvar);
+	if (timeoutusecs < floorusecs) timeoutusecs = floorusecs;
+	if (timeoutusecs > ceilingusecs) timeoutusecs = ceilingusecs;
+	return(timeoutusecs);
+}
+
+//
+// -----------------------------------------------------------------------------
+//
+// Map the round trip time estimate which the echo train's child publishes for the rest of the scan.
+// Without it each process relies on its own replies alone.
+//
+void rtt_share_init(struct scan_context_struc *ctx)
+{
+	ctx->rttshare = mmap(NULL, sizeof(struct rtt_share_struc), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == (void *)ctx->rttshare)
+	{
+		IPSCAN_LOG( LOGPREFIX "rtt_share_init: mmap of shared round trip time failed : %d (%s)\n", errno, strerror(errno));
+		ctx->rttshare = NULL;
+		return;
+	}
+	ctx->rttshare->estimate = 0;
+	ctx->rttshare->samples = 0;
+	ctx->rttshare->finished = 0;
+}
+
+//
+// -----------------------------------------------------------------------------
+//
+// Add a round trip time sample to this process's estimate, and publish the result
+//
+void rtt_share_sample(struct scan_context_struc *ctx, uint64_t sampleusecs)
+{
+	uint64_t srtt, rttvar;
+
+	rtt_sample(&ctx->rtt, sampleusecs);
+	if (NULL == ctx->rttshare) return;
+
+	srtt = (ctx->rtt.srtt > UINT32_MAX) ? UINT32_MAX : ctx->rtt.srtt;
+	rttvar = (ctx->rtt.rttvar > UINT32_MAX) ? UINT32_MAX : ctx->rtt.rttvar;
+	__atomic_store_n(&ctx->rttshare->estimate, ((srtt << 32) | rttvar), __ATOMIC_RELEASE);
+	__atomic_store_n(&ctx->rttshare->samples, ctx->rtt.samples, __ATOMIC_RELEASE);
+}
+
+//
+// -----------------------------------------------------------------------------
+//
+// Note that no further samples will be published, so that nobody waits for them
+//
+void rtt_share_finish(struct scan_context_struc *ctx)
+{
+	if (NULL != ctx->rttshare) __atomic_store_n(&ctx->rttshare->finished, 1, __ATOMIC_RELEASE);
+}
+
+//
+// -----------------------------------------------------------------------------
+//
+// Seed this process's estimate from the published one, should it have no samples of its own.
+// Returns 1 if the estimate was seeded, otherwise 0.
+//
+int rtt_share_adopt(struct scan_context_struc *ctx)
+{
+	uint64_t estimate;
+	unsigned int samples;
+
+	if (NULL == ctx->rttshare || 0 != ctx->rtt.samples) return(0);
+
+	samples = __atomic_load_n(&ctx->rttshare->samples, __ATOMIC_ACQUIRE);
+	if (0 == samples) return(0);
+
+	estimate = __atomic_load_n(&ctx->rttshare->estimate, __ATOMIC_ACQUIRE);
+	ctx->rtt.srtt = estimate >> 32;
+	ctx->rtt.rttvar = estimate & UINT32_MAX;
+	ctx->rtt.samples = samples;
+	return(1);
+}
+
+//
+// -----------------------------------------------------------------------------
+//
+// Wait up to maxwaitusecs for the echo train's first ECHO-REPLY, or for the train to finish without
+// one, and adopt its estimate. Returns 1 if the estimate was seeded, otherwise 0.
+//
+int rtt_share_wait(struct scan_context_struc *ctx, uint64_t maxwaitusecs)
+{
+	uint64_t deadline = pacer_now_usecs() + maxwaitusecs;
+	struct timespec ts;
+
+	if (NULL == ctx->rttshare) return(0);
+
+	while (0 == rtt_share_adopt(ctx))
+	{
+		if (0 != __atomic_load_n(&ctx->rttshare->finished, __ATOMIC_ACQUIRE) || pacer_now_usecs() >= deadline)
+		{
+			return( rtt_share_adopt(ctx) );
+		}
+		ts.tv_sec = 0;
+		ts.tv_nsec = (long)IPSCAN_RTT_POLL_USECS * 1000;
+		while (-1 == nanosleep(&ts, &ts) && EINTR == errno);
+	}
+	return(1);
+}
+
+//
+// -----------------------------------------------------------------------------
+//
+int scan_context_init(struct scan_context_struc *ctx, char * hostname, uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session)
+{
+	int rc;
+
+	memset(ctx, 0, sizeof(struct scan_context_struc));
+	ctx->host_msb = host_msb;
+	ctx->host_lsb = host_lsb;
+	ctx->timestamp = timestamp;
+	ctx->session = session;
+	rtt_init(&ctx->rtt);
+	rtt_share_init(ctx);
+	ctx->udptimeoutusecs = UDPTIMEOUT_CEILING_USECS;
+	ctx->tcpceilingusecs = TCPTIMEOUT_CEILING_USECS;
+	ctx->reprobe = NULL;
+	ctx->bitmap = NULL;
+	ctx->numchildren = 0;
+
+	rc = snprintf(ctx->hostname, INET6_ADDRSTRLEN, "%s", hostname);
+	if (rc < 0 || rc >= INET6_ADDRSTRLEN)
+	{
+		IPSCAN_LOG( LOGPREFIX "scan_context_init: Bad snprintf() for hostname, returned %d\n", rc);
+		return(-1);
+	}
+
+	// Parse the literal client address once, rather than resolving it for every probe
+	ctx->remoteaddr.sin6_family = AF_INET6;
+	rc = inet_pton(AF_INET6, hostname, &(ctx->remoteaddr.sin6_addr));
+	if (1 != rc)
+	{
+		IPSCAN_LOG( LOGPREFIX "scan_context_init: Bad inet_pton() call, returned %d with errno %d (%s)\n", rc, errno, strerror(errno));
+		return(-1);
+	}
+	return(0);
+}
+
+//
+// -----------------------------------------------------------------------------
+//
+// Record a child forked by one of the scan phases, identified by its protocol
+//
+void scan_child_add(struct scan_context_struc *ctx, pid_t pid, int proto)
+{
+	int i = 0;
+
+	while (i < MAXSCANCHILDREN && 0 != ctx->childpid[i]) i++;
+	if (i >= MAXSCANCHILDREN)
+	{
+		// Callers wait for a free slot first, so this should never happen
+		IPSCAN_LOG( LOGPREFIX "scan_child_add: ERROR : no free slot for PID=%d, it will not be waited for\n", pid);
+		return;
+	}
+	ctx->childpid[i] = pid;
+	ctx->childproto[i] = proto;
+	ctx->numchildren++;
+}
+
+//
+// -----------------------------------------------------------------------------
+//
+// Wait for any one of the scan's children to exit, whichever phase it belongs to
+// Returns the number of children still running
+//
+int scan_child_reap(struct scan_context_struc *ctx)
+{
+	char protostring[IPSCAN_PROTO_STRING_MAX];
+	int childstatus = 0;
+	int i = 0;
+	pid_t pid = waitpid(-1, &childstatus, 0);
+
+	if (-1 == pid)
+	{
+		if (EINTR == errno) return(ctx->numchildren);
+		// Nothing left to wait for, so forget about any children we believed were running
+		IPSCAN_LOG( LOGPREFIX "scan_child_reap: waitpid() failed with %d (%s), %d children outstanding\n", errno, strerror(errno), ctx->numchildren);
+		memset(ctx->childpid, 0, sizeof(ctx->childpid));
+		ctx->numchildren = 0;
+		return(0);
+	}
+
+	while (i < MAXSCANCHILDREN && pid != ctx->childpid[i]) i++;
+	if (i >= MAXSCANCHILDREN)
+	{
+		IPSCAN_LOG( LOGPREFIX "scan_child_reap: WARNING: reaped unexpected PID=%d with status=%d\n", pid, childstatus);
+		return(ctx->numchildren);
+	}
+
+	ctx->childpid[i] = 0;
+	ctx->numchildren--;
+	if (0 != childstatus)
+	{
+		proto_to_string(ctx->childproto[i], protostring);
+		IPSCAN_LOG( LOGPREFIX "scan_child_reap: WARNING: %s PID=%d retired with status=%d, numchildren is now %d\n", protostring, pid, childstatus, ctx->numchildren);
+	}
+	return(ctx->numchildren);
+}
+
+//
+// -----------------------------------------------------------------------------
+//
+// Count the scan's children of the given phase which are still running
+//
+int scan_child_count(struct scan_context_struc *ctx, int proto)
+{
+	int i, count = 0;
+
+	for (i = 0 ; i < MAXSCANCHILDREN ; i++)
+	{
+		if (0 != ctx->childpid[i] && proto == ctx->childproto[i]) count++;
+	}
+	return(count);
+}
+
+//
+// -----------------------------------------------------------------------------
+//
+// Wait until another child of the given phase may be forked, both within that phase's
+// own limit and within the limit on the scan as a whole
+//
+void scan_child_slot(struct scan_context_struc *ctx, int proto, int protomax)
+{
+	while (ctx->numchildren >= MAXSCANCHILDREN || scan_child_count(ctx, proto) >= protomax)
+	{
+		(void)scan_child_reap(ctx);
+	}
+}
+
+//
+// -----------------------------------------------------------------------------
+//
+// Wait for every child of the given phase to exit, or for every child of the scan
+// should proto be negative
+//
+void scan_children_wait(struct scan_context_struc *ctx, int proto)
+{
+	while ((0 > proto) ? (0 < ctx->numchildren) : (0 < scan_child_count(ctx, proto)))
+	{
+		(void)scan_child_reap(ctx);
+	}
+}
+
+//
+// -----------------------------------------------------------------------------
+//
+// Permanently give up any root privileges gained through the setuid permission, once the
+// raw sockets which need them are open, returning to the invoking user and group
+//
+int scan_drop_privileges(void)
+{
+	if (0 != setgid(getgid()) || 0 != setuid(getuid()))
+	{
+		IPSCAN_LOG( LOGPREFIX "scan_drop_privileges: failed to revert to user-id %d: %s (%d)\n", (int)getuid(), strerror(errno), errno);
+		return(-1);
+	}
+
+	// Check that root privileges cannot be regained, unless invoked by root in the first place
+	if (0 != getuid() && 0 == setuid(0))
+	{
+		IPSCAN_LOG( LOGPREFIX "scan_drop_privileges: root privileges were not revoked\n");
+		return(-1);
+	}
+
+	#ifdef PINGDEBUG
+	IPSCAN_LOG( LOGPREFIX "scan_drop_privileges: now real UID %d real GID %d effective UID %d effective GID %d\n", getuid(), getgid(), geteuid(), getegid());
+	#endif
+	return(0);
+}
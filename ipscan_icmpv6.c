@@ -33,6 +33,20 @@
 // 0.13			update copyright year
 // 0.14			swap comparison terms, where appropriate
 // 0.15			delete old comments, update copyright year
+// 0.16			report the measured round trip time of a direct ECHO-REPLY
+// 0.17			take a token from the probe pacer rather than sleeping afterwards
+// 0.18			take the pre-parsed target address and session keys from the scan context
+// 0.19			wait for the ECHO-REPLY until a deadline held on the timer wheel, rather than polling once a second
+// 0.20			hand the ECHO-REQUEST to the persistent echo helper when it is running, and share packet
+//			construction and reply classification with it (now in ipscan_icmpv6msg.c)
+// 0.21			have the kernel filter out all but our own responses, and compare addresses directly
+// 0.22			send a paced train of ECHO-REQUESTs, timed by the kernel's receive timestamps, and report
+//			the round trip time, jitter and loss of an ECHO-REPLY
+// 0.23			add check_icmpv6_echoresponse_parll(), which runs the echo train in a child alongside the UDP and TCP scans,
+//			publishing each ECHO-REPLY's round trip time for them
+// 0.24			prefer an unprivileged ICMPv6 datagram socket, falling back to the echo helper and then a raw socket
+// 0.25			open the raw socket at startup, before root privileges are dropped for good, rather than gaining them to do so
+// 0.26			close the raw socket as soon as the datagram socket or echo helper makes it unnecessary
 
 #include "ipscan.h"
 //
@@ -43,7 +57,6 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <errno.h>
-#include <netdb.h>
 #include <unistd.h>
 #include <time.h>
 
@@ -70,283 +83,651 @@
 //Poll support
 #include <poll.h>
 
-// Define offset into ICMPv6 packet where user-defined data resides
-#define ICMP6DATAOFFSET sizeof(struct icmp6_hdr)
+// Unix domain socket to the echo helper
+#include <sys/un.h>
+
+// Decimal places to which a time (in microseconds) is noted in ms - no more than 5 characters below 10s
+#define ICMPV6_NOTE_DECIMALS(usecs) ((100000 > (usecs)) ? 2 : ((1000000 > (usecs)) ? 1 : 0))
+
+//
+// Prototype declarations
+//
+void pacer_wait(void);
+uint64_t pacer_now_usecs(void);
+
+// from ipscan_timer.c
+struct timerwheel_struc * timer_wheel(void);
+int timer_pending(const struct timer_struc *timer);
+void timer_add(struct timerwheel_struc *wheel, struct timer_struc *timer, int kind, unsigned int owner, uint64_t expires);
+void timer_cancel(struct timerwheel_struc *wheel, struct timer_struc *timer);
+int timer_wait_msecs(struct timerwheel_struc *wheel, uint64_t now);
+
+// from ipscan_icmpv6msg.c
+int icmpv6_echo_fill(char *packet, unsigned int id, unsigned int seq, uint64_t timestamp, uint64_t session);
+int icmpv6_echo_classify(const char *packet, int len, const struct sockaddr_in6 *source, const struct in6_addr *target,\
+	unsigned int txid, unsigned int txseqno, uint64_t timestamp, uint64_t session, char *router);
+int icmpv6_echo_ids(const char *packet, int len, unsigned int *id, unsigned int *seq);
+int icmpv6_filter_attach(int sock, unsigned int id, int seq, unsigned int numseq, const char *txpacket, const struct in6_addr *target);
+int icmpv6_timestamps_enable(int sock);
+int icmpv6_errqueue_classify(struct msghdr *msg, const char *packet, int len, const struct in6_addr *target, unsigned int *seq, char *router);
+uint64_t icmpv6_realtime_usecs(void);
+uint64_t icmpv6_rx_usecs(struct msghdr *msg);
+
+void icmpv6_train_linger(struct timerwheel_struc *wheel, struct timer_struc *deadline, uint64_t lasttxusecs);
+void icmpv6_train_record(struct scan_context_struc *ctx, struct icmpv6_train_struc *train, unsigned int probe, uint64_t rttusecs);
+void icmpv6_train_finish(struct icmpv6_train_struc *train, int result, char * router);
+int icmpv6_echo_send(int sock, struct sockaddr_in6 *destination, struct scan_context_struc *ctx, unsigned int txid,\
+	unsigned int probe, uint64_t *txusecs);
+int icmpv6_helper_submit(struct scan_context_struc *ctx);
+int icmpv6_helper_collect(int fd, struct scan_context_struc *ctx, char * router, struct icmpv6_train_struc *train);
+int icmpv6_dgram_open(unsigned int *txid);
+#if (1 == IPSCAN_INCLUDE_RAWPING)
+int icmpv6_raw_open(struct scan_context_struc *ctx);
+void icmpv6_raw_release(void);
+#endif
+int check_icmpv6_echoresponse(struct scan_context_struc *ctx, char * router, struct icmpv6_train_struc *train);
+
+// from ipscan_general.c
+void rtt_share_sample(struct scan_context_struc *ctx, uint64_t sampleusecs);
+void rtt_share_finish(struct scan_context_struc *ctx);
+
+// from ipscan_db.c
+int write_db_scan(struct scan_context_struc *ctx, uint32_t port, int32_t result, char *indirecthost);
 
 //
-// Send an ICMPv6 ECHO-REQUEST and see whether we receive an ECHO-REPLY in response
+// Once an ECHO-REPLY is in hand and the whole train has been sent, give the rest of the train no more
+// than ICMPV6_TRAIN_LINGER_USECS after the last ECHO-REQUEST, rather than the full deadline
 //
 
-int check_icmpv6_echoresponse(char * hostname, uint64_t starttime, uint64_t session, char * router)
+void icmpv6_train_linger(struct timerwheel_struc *wheel, struct timer_struc *deadline, uint64_t lasttxusecs)
 {
-	struct addrinfo *res;
-	struct addrinfo hints;
+	uint64_t limit = lasttxusecs + ICMPV6_TRAIN_LINGER_USECS;
 
-	struct sockaddr_in6 destination;
-	struct sockaddr_in6 source;
+	if (0 != timer_pending(deadline) && limit < deadline->expires)
+	{
+		timer_add(wheel, deadline, deadline->kind, deadline->owner, limit);
+	}
+}
 
-	int sock = -1;
-	int errsv;
+//
+// Record the round trip time of the ECHO-REPLY to a train's probe'th ECHO-REQUEST, ignoring duplicates,
+// and publish it for the UDP and TCP scans running alongside
+//
+
+void icmpv6_train_record(struct scan_context_struc *ctx, struct icmpv6_train_struc *train, unsigned int probe, uint64_t rttusecs)
+{
+	if (ICMPV6_TRAIN_COUNT <= probe || 0 != train->rttusecs[probe]) return;
+	train->rttusecs[probe] = (0 != rttusecs) ? rttusecs : 1;
+	train->received++;
+	rtt_share_sample(ctx, train->rttusecs[probe]);
+}
+
+//
+// Derive the train's round trip time statistics and, for an ECHO-REPLY, replace the router address
+// with a note of them (e.g. "rtt=1.25/1.52/2.14,jit=0.31,loss=0/5", in ms, to fewer decimal places
+// from 100ms so as to fit). Jitter is the mean difference between the round trip times of successive
+// answered ECHO-REQUESTs.
+//
+
+void icmpv6_train_finish(struct icmpv6_train_struc *train, int result, char * router)
+{
+	uint64_t total = 0, jittertotal = 0, previous = 0;
+	unsigned int probe, answered = 0;
 	int rc;
-	int error;
-	unsigned int sendsize;
 
-	struct timeval timeout;
+	train->minrtt = 0;
+	train->maxrtt = 0;
+	for (probe = 0 ; probe < ICMPV6_TRAIN_COUNT ; probe++)
+	{
+		uint64_t rtt = train->rttusecs[probe];
+		if (0 == rtt) continue;
+
+		if (0 == train->minrtt || rtt < train->minrtt) train->minrtt = rtt;
+		if (rtt > train->maxrtt) train->maxrtt = rtt;
+		total += rtt;
+		if (0 != answered) jittertotal += (rtt > previous) ? (rtt - previous) : (previous - rtt);
+		previous = rtt;
+		answered++;
+	}
+	train->avgrtt = (0 != answered) ? (total / answered) : 0;
+	train->jitter = (1 < answered) ? (jittertotal / (answered - 1)) : 0;
 
-	struct icmp6_hdr *txicmp6hdr_ptr;
-	struct icmp6_hdr *rxicmp6hdr_ptr;
+	if (ECHOREPLY != result) return;
 
-	struct icmp6_filter myfilter;
-	// reply tracker
-	unsigned int foundit = 0;
+	rc = snprintf(router, INET6_ADDRSTRLEN, "%s%.*f/%.*f/%.*f,%s%.*f,%s%u/%u", ICMPV6_RTT_NOTE,\
+		ICMPV6_NOTE_DECIMALS(train->minrtt), (double)train->minrtt / 1000.0, ICMPV6_NOTE_DECIMALS(train->avgrtt), (double)train->avgrtt / 1000.0,\
+		ICMPV6_NOTE_DECIMALS(train->maxrtt), (double)train->maxrtt / 1000.0, ICMPV6_JITTER_NOTE,\
+		ICMPV6_NOTE_DECIMALS(train->jitter), (double)train->jitter / 1000.0, ICMPV6_LOSS_NOTE, train->sent - answered, train->sent);
+	if (rc < 0 || rc >= INET6_ADDRSTRLEN)
+	{
+		IPSCAN_LOG( LOGPREFIX "icmpv6_train_finish: Failed to write round trip time note, rc was %d\n", rc);
+	}
+}
+
+//
+// Send the probe'th ECHO-REQUEST of a train, recording when it was sent. Returns 0, or -1 on failure.
+//
 
-	// send and receive message headers
+int icmpv6_echo_send(int sock, struct sockaddr_in6 *destination, struct scan_context_struc *ctx, unsigned int txid,\
+	unsigned int probe, uint64_t *txusecs)
+{
 	struct msghdr smsghdr;
-	struct msghdr rmsghdr;
-	struct iovec txiov[2], rxiov[2];
+	struct iovec txiov[2];
 	char txpackdata[ICMPV6_PACKET_BUFFER_SIZE];
-	char rxpackdata[ICMPV6_PACKET_BUFFER_SIZE];
-	char *rxpacket = &rxpackdata[0];
-	char rxbuf[ICMPV6_PACKET_BUFFER_SIZE];
-	char tmpbuf[128];
+	unsigned int sendsize;
+	int rc, errsv;
 
-	// set return value to a known default
-	int retval = PORTUNKNOWN;
+	if (0 > icmpv6_echo_fill(&txpackdata[0], txid, ICMPV6_MAGIC_SEQ + probe, ctx->timestamp, ctx->session)) return(-1);
 
-	txicmp6hdr_ptr = (struct icmp6_hdr *)txpackdata;
+	// Choose a packet slightly bigger than minimum size
+	sendsize = ICMPV6_PACKET_SIZE;
 
-	struct pollfd pollfiledesc[1];
+	// socket address
+	memset(&smsghdr, 0, sizeof(smsghdr));
+	smsghdr.msg_name = (caddr_t)destination;
+	smsghdr.msg_namelen = sizeof(struct sockaddr_in6);
 
-	unsigned int txid = (unsigned int)(session & 0xFFFF); // Maximum 16 bits
-	unsigned int rxid;
-	unsigned int txseqno = ICMPV6_MAGIC_SEQ; // MAGIC number - assume no reason to start at 1?
-	unsigned int rxseqno;
+	// scatter/gather array
+	memset(&txiov, 0, sizeof(txiov));
+	txiov[0].iov_base = (caddr_t)&txpackdata;
+	txiov[0].iov_len = sendsize;
+	smsghdr.msg_iov = txiov;
+	smsghdr.msg_iovlen = 1;
 
-	unsigned int rxicmp6_type, rxicmp6_code;
+	// Each ECHO-REQUEST is paced alongside the port probes
+	pacer_wait();
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET6;
-	hints.ai_flags = AI_CANONNAME;
-	hints.ai_socktype = SOCK_RAW;
-	hints.ai_protocol = IPPROTO_ICMPV6;
+	*txusecs = icmpv6_realtime_usecs();
+	rc = sendmsg(sock, &smsghdr, 0);
+	errsv = errno;
 
-	error = getaddrinfo(hostname, NULL, &hints, &res);
-	if (error != 0)
+	if (rc < 0)
 	{
-		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: getaddrinfo: failed1 %s for host %s\n", gai_strerror(error), hostname);
-		return (PORTINTERROR);
+		IPSCAN_LOG( LOGPREFIX "icmpv6_echo_send: sendmsg returned error, with errno %d (%s)\n", errsv, strerror(errsv));
+		return(-1);
 	}
 
-	if (!res->ai_addr)
+	if (rc != (int)sendsize)
 	{
-		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: getaddrinfo: failed2 %s for host %s\n",gai_strerror(error), hostname);
-		freeaddrinfo(res);
-		return (PORTINTERROR);
+		IPSCAN_LOG( LOGPREFIX "icmpv6_echo_send: requested sendmsg sent %d chars to %s but sendmsg returned %d\n", sendsize, ctx->hostname, rc);
+		return(-1);
 	}
 
-	// Copy the resulting address into our destination
-	memcpy(&destination, res->ai_addr, res->ai_addrlen);
-	// Done with the address info now, so free the area
-	freeaddrinfo(res);
+	#ifdef PINGDEBUG
+	IPSCAN_LOG( LOGPREFIX "icmpv6_echo_send: sent ECHO-REQUEST %u of %u\n", probe + 1, ICMPV6_TRAIN_COUNT);
+	#endif
+	return(0);
+}
 
-	// Set default logged router address to "unset"
-	rc = snprintf(router, INET6_ADDRSTRLEN, "unset");
-	if (rc < 0 || rc >= INET6_ADDRSTRLEN)
+//
+// Hand our ECHO-REQUEST to the persistent echo helper, if it is running. Returns the connection
+// on which the helper will report the outcome, or -1 if it could not be reached.
+//
+
+int icmpv6_helper_submit(struct scan_context_struc *ctx)
+{
+	struct sockaddr_un helperaddr;
+	struct pingd_request_struc request;
+	unsigned int probe;
+	int fd, rc, errsv;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	errsv = errno;
+	if (0 > fd)
 	{
-		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: Failed to unset logged router address, rc was %d\n", rc);
-		retval = PORTINTERROR;
+		IPSCAN_LOG( LOGPREFIX "icmpv6_helper_submit: socket returned error %d (%s)\n", errsv, strerror(errsv));
+		return(-1);
 	}
 
-	// Get root privileges in order to create the raw socket
+	memset(&helperaddr, 0, sizeof(helperaddr));
+	helperaddr.sun_family = AF_UNIX;
+	strncpy(helperaddr.sun_path, IPSCAN_PINGD_SOCKET, sizeof(helperaddr.sun_path) - 1);
 
-	uid_t uid = getuid();
-	uid_t gid = getgid();
+	// The helper is optional, so failing to reach it is only of interest whilst debugging
+	rc = connect(fd, (struct sockaddr *)&helperaddr, sizeof(helperaddr));
+	errsv = errno;
+	if (0 > rc)
+	{
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_helper_submit: connect to %s returned error %d (%s)\n", IPSCAN_PINGD_SOCKET, errsv, strerror(errsv));
+		#endif
+		close(fd);
+		return(-1);
+	}
 
-	#ifdef PINGDEBUG
-	uid_t euid = geteuid();
-	uid_t egid = getegid();
-	#endif
+	memset(&request, 0, sizeof(request));
+	request.magic = IPSCAN_PINGD_MAGIC;
+	request.tag = (uint32_t)(ctx->session & 0xFFFFFFFF);
+	memcpy(&request.target, &(ctx->remoteaddr.sin6_addr), sizeof(request.target));
+	request.timestamp = ctx->timestamp;
+	request.session = ctx->session;
+	request.timeoutusecs = ICMPV6_TIMEOUT_USECS;
+	request.count = ICMPV6_TRAIN_COUNT;
+	request.spacingusecs = ICMPV6_TRAIN_SPACING_USECS;
 
-	#ifdef PINGDEBUG
-	IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: Entered with real UID  %d  real GID  %d  effective UID %d  effective GID %d\n", uid, gid, euid, egid);
-	#endif
+	// Each of the train's ECHO-REQUESTs is paced alongside the port probes
+	for (probe = 0 ; probe < ICMPV6_TRAIN_COUNT ; probe++) pacer_wait();
 
-	rc = setuid(0);
-	if (rc != 0)
+	rc = (int)send(fd, &request, sizeof(request), MSG_NOSIGNAL);
+	errsv = errno;
+	if (rc != (int)sizeof(request))
 	{
-		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: setuid: failed to gain root privileges - is setuid permission set?\n");
-		retval = PORTINTERROR;
+		IPSCAN_LOG( LOGPREFIX "icmpv6_helper_submit: send returned %d, errno %d (%s)\n", rc, errsv, strerror(errsv));
+		close(fd);
+		return(-1);
 	}
+	return(fd);
+}
 
-	rc = setgid(0);
-	if (rc != 0)
-	{
-		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: setgid: failed to gain root privileges - is setgid permission set?\n");
-		retval = PORTINTERROR;
-	}
+//
+// Wait for the echo helper to report the outcome of each of our ECHO-REQUESTs, and close the connection.
+// Returns the result as check_icmpv6_echoresponse() would, or -1 if the helper failed to report.
+//
 
-	// run with ROOT privileges, keep section to a minimum
-	if (PORTUNKNOWN == retval)
+int icmpv6_helper_collect(int fd, struct scan_context_struc *ctx, char * router, struct icmpv6_train_struc *train)
+{
+	struct pingd_reply_struc reply;
+	struct pollfd pollfiledesc[1];
+	unsigned int reported = 0;
+	int retval = ECHONOREPLY;
+	int rc, errsv;
+	uint64_t starttime = pacer_now_usecs();
+
+	// The helper sends the whole train, and reports a lost ECHO-REQUEST itself, so only wait a little longer than it would
+	struct timerwheel_struc *wheel = timer_wheel();
+	struct timer_struc deadline;
+	memset(&deadline, 0, sizeof(deadline));
+	timer_add(wheel, &deadline, TIMER_ICMPV6_DEADLINE, 0, starttime + ICMPV6_TIMEOUT_USECS + IPSCAN_PINGD_GRACE_USECS);
+	train->sent = ICMPV6_TRAIN_COUNT;
+
+	while (0 != timer_pending(&deadline) && reported < ICMPV6_TRAIN_COUNT)
 	{
-		sock = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
+		pollfiledesc[0].fd = fd;
+		pollfiledesc[0].events = POLLIN;
+		rc = poll(pollfiledesc, 1, timer_wait_msecs(wheel, pacer_now_usecs()));
 		errsv = errno;
-		if (sock < 0)
+		if (pacer_now_usecs() >= deadline.expires)
 		{
-			IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: socket: Error : %s (%d) for host %s\n", strerror(errsv), errsv, hostname);
-			retval = PORTINTERROR;
+			timer_cancel(wheel, &deadline);
+			if (0 == reported) IPSCAN_LOG( LOGPREFIX "icmpv6_helper_collect: no report from the echo helper for host %s\n", ctx->hostname);
 		}
-		else
+
+		if (rc < 0)
+		{
+			if (EINTR == errsv) continue;
+			IPSCAN_LOG( LOGPREFIX "icmpv6_helper_collect: poll returned error %d (%s)\n", errsv, strerror(errsv));
+			retval = -1;
+			break;
+		}
+		else if (rc == 0)
 		{
-			memset(&timeout, 0, sizeof(timeout));
-			timeout.tv_sec = TIMEOUTSECS;
-			timeout.tv_usec = TIMEOUTMICROSECS;
+			continue;
+		}
 
-			rc = setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
-			errsv = errno;
-			if (rc < 0)
-			{
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: Bad setsockopt SO_SNDTIMEO set, returned %d (%s)\n", errsv, strerror(errsv));
-				retval = PORTINTERROR;
-			}
+		rc = (int)recv(fd, &reply, sizeof(reply), 0);
+		errsv = errno;
+		if (rc != (int)sizeof(reply) || IPSCAN_PINGD_MAGIC != reply.magic || (uint32_t)(ctx->session & 0xFFFFFFFF) != reply.tag\
+			|| ICMPV6_TRAIN_COUNT <= reply.probe || 0 > reply.result || NUMRESULTTYPES <= (reply.result & IPSCAN_INDIRECT_MASK))
+		{
+			// Most likely the helper closed the connection, perhaps because it was already serving its limit of scans
+			IPSCAN_LOG( LOGPREFIX "icmpv6_helper_collect: no valid report from the echo helper, recv returned %d, errno %d (%s)\n", rc, errsv, strerror(errsv));
+			retval = -1;
+			break;
+		}
+		reported++;
 
-			memset(&timeout, 0, sizeof(timeout));
-			timeout.tv_sec = TIMEOUTSECS;
-			timeout.tv_usec = TIMEOUTMICROSECS;
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_helper_collect: echo helper reported result %d for ECHO-REQUEST %u, rtt %"PRIu64" usecs\n", reply.result, reply.probe + 1, reply.rttusecs);
+		#endif
 
-			rc = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-			errsv = errno;
-			if (rc < 0)
+		if (ECHOREPLY == reply.result)
+		{
+			icmpv6_train_record(ctx, train, reply.probe, reply.rttusecs);
+			retval = ECHOREPLY;
+			icmpv6_train_linger(wheel, &deadline, starttime + ((uint64_t)(ICMPV6_TRAIN_COUNT - 1) * ICMPV6_TRAIN_SPACING_USECS));
+		}
+		else if (ECHONOREPLY != reply.result)
+		{
+			// An ICMPv6 error in response to any of our ECHO-REQUESTs ends the wait
+			reply.router[INET6_ADDRSTRLEN - 1] = 0;
+			rc = snprintf(router, INET6_ADDRSTRLEN, "%s", reply.router);
+			if (rc < 0 || rc >= INET6_ADDRSTRLEN)
 			{
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: Bad setsockopt SO_RCVTIMEO set, returned %d (%s)\n", errsv, strerror(errsv));
-				retval = PORTINTERROR;
+				IPSCAN_LOG( LOGPREFIX "icmpv6_helper_collect: Failed to copy router address, rc was %d\n", rc);
 			}
+			retval = reply.result;
+			break;
+		}
+	}
 
-			// Filter out everything except the responses we're looking for
-			// taken from RFC3542
-			ICMP6_FILTER_SETBLOCKALL(&myfilter);
-			ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &myfilter);
-			ICMP6_FILTER_SETPASS(ICMP6_DST_UNREACH, &myfilter);
-			ICMP6_FILTER_SETPASS(ICMP6_PARAM_PROB, &myfilter);
-			ICMP6_FILTER_SETPASS(ICMP6_TIME_EXCEEDED, &myfilter);
-			ICMP6_FILTER_SETPASS(ICMP6_PACKET_TOO_BIG, &myfilter);
-			rc = setsockopt(sock, IPPROTO_ICMPV6, ICMP6_FILTER, &myfilter, sizeof(myfilter));
-			errsv = errno;
-			if (rc < 0)
-			{
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: setsockopt: Error setting ICMPv6 filter: %s (%d)\n", strerror(errsv), errsv);
-				retval = PORTINTERROR;
-			}
+	timer_cancel(wheel, &deadline);
+	close(fd);
+	return(retval);
+}
 
-			#ifdef PINGDEBUG
-			IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: Exiting privileged user code section\n");
-			#endif
+//
+// Open an ICMPv6 datagram socket, which needs no privileges where net.ipv4.ping_group_range includes our
+// group. The kernel replaces the identifier of each ECHO-REQUEST with the socket's own, and only passes
+// on ECHO-REPLYs which carry it, so ask for ours, or learn the one it chooses should ours be taken.
+// ICMPv6 errors are reported through the socket's error queue. Returns the socket, or -1 if unavailable.
+//
 
-		} // end if (socket created successfully)
-	}
+int icmpv6_dgram_open(unsigned int *txid)
+{
+	struct sockaddr_in6 local;
+	socklen_t locallen = sizeof(local);
+	int one = 1;
+	int sock, errsv;
 
-	// END OF ROOT PRIVILEGES - Revert to previous privilege level
-	rc = setgid(gid);
-	if (rc != 0)
+	sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_ICMPV6);
+	errsv = errno;
+	if (sock < 0)
 	{
-		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: setgid: failed to revoke root gid privileges\n");
-		retval = PORTINTERROR;
+		// Refused (EACCES) wherever ping_group_range excludes us, which is only of interest when debugging
+		#ifndef PINGDEBUG
+		if (EACCES != errsv)
+		#endif
+		{
+			IPSCAN_LOG( LOGPREFIX "icmpv6_dgram_open: socket: Error : %s (%d)\n", strerror(errsv), errsv);
+		}
+		return(-1);
 	}
 
-	rc = setuid(uid);
-	if (rc != 0)
+	memset(&local, 0, sizeof(local));
+	local.sin6_family = AF_INET6;
+	local.sin6_port = htons((uint16_t)*txid);
+	if (0 != bind(sock, (struct sockaddr *)&local, sizeof(local)))
 	{
-		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: setuid: failed to revoke root uid privileges\n");
-		retval = PORTINTERROR;
+		local.sin6_port = 0;
+		if (0 != bind(sock, (struct sockaddr *)&local, sizeof(local)) || 0 != getsockname(sock, (struct sockaddr *)&local, &locallen))
+		{
+			IPSCAN_LOG( LOGPREFIX "icmpv6_dgram_open: Bad bind, returned %d (%s)\n", errno, strerror(errno));
+			close(sock);
+			return(-1);
+		}
+		*txid = ntohs(local.sin6_port);
 	}
 
-	// If something bad has happened then return now ...
-	// mustn't return to caller with root privileges, hence done here ...
-	if (PORTUNKNOWN != retval)
+	if (0 != setsockopt(sock, IPPROTO_IPV6, IPV6_RECVERR, &one, sizeof(one)))
 	{
-		if (-1 != sock) close(sock); // close socket if appropriate
-		return(retval);
+		IPSCAN_LOG( LOGPREFIX "icmpv6_dgram_open: Bad setsockopt IPV6_RECVERR set, returned %d (%s)\n", errno, strerror(errno));
+		close(sock);
+		return(-1);
 	}
 
 	#ifdef PINGDEBUG
-	IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: Post-revoke real UID  %d real GID  %d effective UID %d effective GID %d\n", getuid (), getgid (), geteuid(), getegid());
+	IPSCAN_LOG( LOGPREFIX "icmpv6_dgram_open: using an unprivileged ICMPv6 socket with identifier %u\n", *txid);
 	#endif
+	return(sock);
+}
 
-	// -----------------------------------------------
-	//
-	// ICMPv6 ECHO-REQUEST TRANSMIT
-	//
-	// -----------------------------------------------
+#if (1 == IPSCAN_INCLUDE_RAWPING)
+// Raw ICMPv6 socket opened whilst the scanner still held root privileges, or -1
+static int icmpv6rawsock = -1;
 
-	memset( txicmp6hdr_ptr, 0, sizeof(struct icmp6_hdr));
-	txicmp6hdr_ptr->icmp6_cksum = 0;
-	txicmp6hdr_ptr->icmp6_type = ICMP6_ECHO_REQUEST;
-	txicmp6hdr_ptr->icmp6_code = 0;
-	txicmp6hdr_ptr->icmp6_id = htons(txid);
-	txicmp6hdr_ptr->icmp6_seq = htons(txseqno);
+//
+// Open the raw ICMPv6 socket, the ICMPv6 test's last resort - must be called before root privileges
+// are dropped, which happens before anything else is done. It passes nothing until it is used, so
+// queues nothing in the meantime. Returns 0 on success, or -1 on failure.
+//
 
-	// socket address
-	memset(&smsghdr, 0, sizeof(smsghdr));
-	smsghdr.msg_name = (caddr_t)&destination;
-	smsghdr.msg_namelen = sizeof(destination);
+int icmpv6_raw_prepare(void)
+{
+	struct icmp6_filter myfilter;
+	int errsv;
+
+	// Quietly leave it unavailable if not installed setuid root - it is reported should it be needed
+	if (0 != geteuid()) return(-1);
+
+	icmpv6rawsock = socket(AF_INET6, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_ICMPV6);
+	if (-1 == icmpv6rawsock)
+	{
+		errsv = errno;
+		IPSCAN_LOG( LOGPREFIX "icmpv6_raw_prepare: socket: Error : %s (%d)\n", strerror(errsv), errsv);
+		return(-1);
+	}
+
+	ICMP6_FILTER_SETBLOCKALL(&myfilter);
+	if (0 > setsockopt(icmpv6rawsock, IPPROTO_ICMPV6, ICMP6_FILTER, &myfilter, sizeof(myfilter)))
+	{
+		errsv = errno;
+		IPSCAN_LOG( LOGPREFIX "icmpv6_raw_prepare: setsockopt: Error setting ICMPv6 filter: %s (%d)\n", strerror(errsv), errsv);
+		close(icmpv6rawsock);
+		icmpv6rawsock = -1;
+		return(-1);
+	}
+	return(0);
+}
+
+//
+// Close the raw ICMPv6 socket, in a process which will not use it
+//
+
+void icmpv6_raw_release(void)
+{
+	if (-1 != icmpv6rawsock) close(icmpv6rawsock);
+	icmpv6rawsock = -1;
+}
+
+//
+// Take the raw ICMPv6 socket opened at startup and set it up for the ICMPv6 test.
+// Returns the socket, or -1 on failure.
+//
+
+int icmpv6_raw_open(struct scan_context_struc *ctx)
+{
+	struct timeval timeout;
+	struct icmp6_filter myfilter;
+	int sock = icmpv6rawsock;
+	int errsv;
+	int rc;
+
+	// set return value to a known default
+	int retval = PORTUNKNOWN;
+
+	icmpv6rawsock = -1;
+	if (-1 == sock)
+	{
+		IPSCAN_LOG( LOGPREFIX "icmpv6_raw_open: no raw ICMPv6 socket for host %s - is setuid permission set?\n", ctx->hostname);
+		return(-1);
+	}
 
-	// Insert the unique data
 	#ifdef PINGDEBUG
-	IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: Sending PING unique data starttime=%"PRId64" session=%"PRId64"\n", starttime, session);
+	IPSCAN_LOG( LOGPREFIX "icmpv6_raw_open: using the raw socket opened at startup, with real UID %d real GID %d effective UID %d effective GID %d\n", getuid(), getgid(), geteuid(), getegid());
 	#endif
 
-	rc = snprintf(&txpackdata[ICMP6DATAOFFSET],(ICMPV6_PACKET_SIZE-ICMP6DATAOFFSET),"%"PRIu64" %"PRIu64" %u %u", starttime, session, ICMPV6_MAGIC_VALUE1, ICMPV6_MAGIC_VALUE2);
-	if (rc < (int)0 || rc >= (int)(ICMPV6_PACKET_SIZE-ICMP6DATAOFFSET))
+	memset(&timeout, 0, sizeof(timeout));
+	timeout.tv_sec = TIMEOUTSECS;
+	timeout.tv_usec = TIMEOUTMICROSECS;
+
+	rc = setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	errsv = errno;
+	if (rc < 0)
 	{
-		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: txpackdata snprintf returned %d, expected >=0 but < %d\n", rc, (int)(ICMPV6_PACKET_SIZE-ICMP6DATAOFFSET));
+		IPSCAN_LOG( LOGPREFIX "icmpv6_raw_open: Bad setsockopt SO_SNDTIMEO set, returned %d (%s)\n", errsv, strerror(errsv));
 		retval = PORTINTERROR;
-		if (-1 != sock) close(sock); // close socket if appropriate
-		return(retval);
 	}
 
-	// Choose a packet slightly bigger than minimum size
-	sendsize = ICMPV6_PACKET_SIZE;
+	memset(&timeout, 0, sizeof(timeout));
+	timeout.tv_sec = TIMEOUTSECS;
+	timeout.tv_usec = TIMEOUTMICROSECS;
 
-	rc = getnameinfo((struct sockaddr *)&destination, sizeof(destination), tmpbuf, sizeof(tmpbuf), NULL, 0, NI_NUMERICHOST);
+	rc = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 	errsv = errno;
-	if (0 == rc)
+	if (rc < 0)
 	{
-		#ifdef PINGDEBUG
-		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: Transmitted destination address was %s\n", tmpbuf);
-		#endif
+		IPSCAN_LOG( LOGPREFIX "icmpv6_raw_open: Bad setsockopt SO_RCVTIMEO set, returned %d (%s)\n", errsv, strerror(errsv));
+		retval = PORTINTERROR;
 	}
-	else
+
+	// Filter out everything except the responses we're looking for
+	// taken from RFC3542
+	ICMP6_FILTER_SETBLOCKALL(&myfilter);
+	ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &myfilter);
+	ICMP6_FILTER_SETPASS(ICMP6_DST_UNREACH, &myfilter);
+	ICMP6_FILTER_SETPASS(ICMP6_PARAM_PROB, &myfilter);
+	ICMP6_FILTER_SETPASS(ICMP6_TIME_EXCEEDED, &myfilter);
+	ICMP6_FILTER_SETPASS(ICMP6_PACKET_TOO_BIG, &myfilter);
+	rc = setsockopt(sock, IPPROTO_ICMPV6, ICMP6_FILTER, &myfilter, sizeof(myfilter));
+	errsv = errno;
+	if (rc < 0)
 	{
-		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: RESTART: getnameinfo returned bad indication %d (%s)\n",errsv, gai_strerror(errsv));
+		IPSCAN_LOG( LOGPREFIX "icmpv6_raw_open: setsockopt: Error setting ICMPv6 filter: %s (%d)\n", strerror(errsv), errsv);
 		retval = PORTINTERROR;
-		if (-1 != sock) close(sock); // close socket if appropriate
-		return(retval);
 	}
 
-	// scatter/gather array
-	memset(&txiov, 0, sizeof(txiov));
-	txiov[0].iov_base = (caddr_t)&txpackdata;
-	txiov[0].iov_len = sendsize;
-	smsghdr.msg_iov = txiov;
-	smsghdr.msg_iovlen = 1;
+	if (PORTUNKNOWN != retval)
+	{
+		close(sock);
+		return(-1);
+	}
+	return(sock);
+}
+#endif
 
-	rc = sendmsg(sock, &smsghdr, 0);
-	errsv = errno;
+//
+// Send a train of ICMPv6 ECHO-REQUESTs and see whether we receive ECHO-REPLYs in response
+//
 
-	if (rc < 0)
+int check_icmpv6_echoresponse(struct scan_context_struc *ctx, char * router, struct icmpv6_train_struc *train)
+{
+	struct sockaddr_in6 destination;
+	struct sockaddr_in6 source;
+
+	int sock = -1;
+	int errsv;
+	int rc;
+
+	// set if using a datagram rather than a raw socket
+	int dgram = 0;
+
+	// receive message header
+	struct msghdr rmsghdr;
+	struct iovec rxiov[2];
+	char txpackdata[ICMPV6_PACKET_BUFFER_SIZE];
+	char rxpackdata[ICMPV6_PACKET_BUFFER_SIZE];
+	char *rxpacket = &rxpackdata[0];
+	char rxbuf[ICMPV6_PACKET_BUFFER_SIZE];
+
+	// set return value to a known default
+	int retval = PORTUNKNOWN;
+
+	struct pollfd pollfiledesc[1];
+
+	unsigned int txid = (unsigned int)(ctx->session & 0xFFFF); // Maximum 16 bits
+	unsigned int txseqno = ICMPV6_MAGIC_SEQ; // MAGIC number - assume no reason to start at 1?
+	unsigned int rxid, rxseqno;
+
+	// when each of the train's ECHO-REQUESTs was sent, on the real time clock of the kernel's receive timestamps
+	uint64_t txusecs[ICMPV6_TRAIN_COUNT];
+	uint64_t trainstart, lasttx;
+	memset(train, 0, sizeof(struct icmpv6_train_struc));
+	memset(&txusecs, 0, sizeof(txusecs));
+
+	// Target address was parsed once when the scan context was set up
+	memcpy(&destination, &(ctx->remoteaddr), sizeof(destination));
+
+	// Set default logged router address to "unset"
+	rc = snprintf(router, INET6_ADDRSTRLEN, "unset");
+	if (rc < 0 || rc >= INET6_ADDRSTRLEN)
+	{
+		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: Failed to unset logged router address, rc was %d\n", rc);
+		retval = PORTINTERROR;
+	}
+
+	// Prefer an unprivileged ICMPv6 datagram socket, where net.ipv4.ping_group_range allows it,
+	// for which the kernel matches our identifier and filters out anything not in response to us
+	if (PORTUNKNOWN == retval)
+	{
+		sock = icmpv6_dgram_open(&txid);
+		if (-1 != sock) dgram = 1;
+	}
+
+	#if (1 == IPSCAN_INCLUDE_RAWPING)
+	// The raw socket opened at startup is then not needed, so close it rather than holding it open
+	if (1 == dgram) icmpv6_raw_release();
+	#endif
+
+	#if (1 == IPSCAN_PINGD)
+	// Otherwise prefer the persistent echo helper, if running, which spares the raw socket opened at startup
+	if (PORTUNKNOWN == retval && -1 == sock)
+	{
+		int helperfd = icmpv6_helper_submit(ctx);
+		if (0 <= helperfd)
+		{
+			rc = icmpv6_helper_collect(helperfd, ctx, router, train);
+			if (0 <= rc)
+			{
+				#if (1 == IPSCAN_INCLUDE_RAWPING)
+				icmpv6_raw_release();
+				#endif
+				icmpv6_train_finish(train, rc, router);
+				return(rc);
+			}
+			IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: echo helper failed, so pinging host %s directly\n", ctx->hostname);
+			memset(train, 0, sizeof(struct icmpv6_train_struc));
+		}
+	}
+	#endif
+
+	// Fall back to a raw socket, should neither be available
+	if (PORTUNKNOWN == retval && -1 == sock)
+	{
+		#if (1 == IPSCAN_INCLUDE_RAWPING)
+		sock = icmpv6_raw_open(ctx);
+		#else
+		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: no unprivileged ICMPv6 socket (check net.ipv4.ping_group_range) or echo helper available\n");
+		#endif
+		if (-1 == sock) retval = PORTINTERROR;
+	}
+
+	if (PORTUNKNOWN != retval) return(retval);
+
+	// -----------------------------------------------
+	//
+	// ICMPv6 ECHO-REQUEST TRANSMIT
+	//
+	// -----------------------------------------------
+
+	// Insert the unique data
+	#ifdef PINGDEBUG
+	IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: Sending PING unique data starttime=%"PRId64" session=%"PRId64"\n", ctx->timestamp, ctx->session);
+	#endif
+
+	// The first ECHO-REQUEST is built here only for its data, which each in the train shares
+	if (0 > icmpv6_echo_fill(&txpackdata[0], txid, txseqno, ctx->timestamp, ctx->session))
 	{
-		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: sendmsg returned error, with errno %d (%s)\n", errsv, strerror(errsv));
 		retval = PORTINTERROR;
 		if (-1 != sock) close(sock); // close socket if appropriate
 		return(retval);
 	}
 
-	if (rc != (int)sendsize)
+	// Only our own responses should wake us, so have the kernel discard anything else. Should that
+	// fail, the same checks are made of each packet received in any case. A datagram socket needs no
+	// filter, since the kernel only passes on responses to its own ECHO-REQUESTs.
+	if (0 == dgram && 0 != icmpv6_filter_attach(sock, txid, (int)txseqno, ICMPV6_TRAIN_COUNT, &txpackdata[0], &(destination.sin6_addr)))
+	{
+		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: continuing without an ICMPv6 receive filter\n");
+	}
+
+	// Round trip times are measured to the moment the kernel received each ECHO-REPLY, where possible
+	(void)icmpv6_timestamps_enable(sock);
+
+	#ifdef PINGDEBUG
+	char txdstaddr[INET6_ADDRSTRLEN];
+	inet_ntop(AF_INET6, &(destination.sin6_addr), txdstaddr, INET6_ADDRSTRLEN);
+	IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: Transmitting to destination address %s\n", txdstaddr);
+	#endif
+
+	trainstart = pacer_now_usecs();
+	if (0 != icmpv6_echo_send(sock, &destination, ctx, txid, 0, &txusecs[0]))
 	{
-		IPSCAN_LOG( LOGPREFIX"check_icmpv6_echoresponse: requested sendmsg sent %d chars to %s but sendmsg returned %d\n", sendsize, hostname, rc);
 		retval = PORTINTERROR;
 		if (-1 != sock) close(sock); // close socket if appropriate
 		return(retval);
 	}
+	train->sent = 1;
+	lasttx = pacer_now_usecs();
 
 	// -----------------------------------------------
 	//
@@ -354,20 +735,21 @@ int check_icmpv6_echoresponse(char * hostname, uint64_t starttime, uint64_t sess
 	//
 	// -----------------------------------------------
 
-	// indirect determines whether a host other than the intended target has replied
-	int indirect = 0;
-	time_t timestart = time(0);
-	if (timestart < 0)
-	{
-		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: ERROR: time() returned bad value for timestart %d (%s)\n", errno, strerror(errno));
-	}
-	time_t timenow = timestart;
 	unsigned int loopcount = 0;
 
+	// The replies must arrive within the deadline, and the rest of the train is sent as its timer
+	// expires, both held on the wheel alongside any other probes'
+	struct timerwheel_struc *wheel = timer_wheel();
+	struct timer_struc deadline, nexttx;
+	memset(&deadline, 0, sizeof(deadline));
+	memset(&nexttx, 0, sizeof(nexttx));
+	timer_add(wheel, &deadline, TIMER_ICMPV6_DEADLINE, 0, trainstart + ICMPV6_TIMEOUT_USECS);
+	if (ICMPV6_TRAIN_COUNT > train->sent) timer_add(wheel, &nexttx, TIMER_ICMPV6_TRAIN, 0, trainstart + ICMPV6_TRAIN_SPACING_USECS);
+
 	// Effectively a promiscuous receive of ICMPv6 packets, so need to discern which are for us
 	// ... may need to go round this loop more than once ...
 
-	while ( ((timenow - timestart) <= 1+TIMEOUTSECS) && foundit == 0)
+	while (0 != timer_pending(&deadline) && (train->sent > train->received || 0 != timer_pending(&nexttx)))
 	{
 		loopcount++;
 		#ifdef PINGDEBUG
@@ -377,13 +759,25 @@ int check_icmpv6_echoresponse(char * hostname, uint64_t starttime, uint64_t sess
 		pollfiledesc[0].fd = sock;
 		// Want indication that there is something to read
 		pollfiledesc[0].events = POLLIN;
-		rc = poll(pollfiledesc, 1, 1000*TIMEOUTSECS);
+		rc = poll(pollfiledesc, 1, timer_wait_msecs(wheel, pacer_now_usecs()));
 		errsv = errno;
-		// Capture current time for next timeout comparison
-		timenow = time(0);
-		if (timenow < 0)
+		// Expire the deadline if it has passed, leaving any other timers to their owners
+		if (pacer_now_usecs() >= deadline.expires) timer_cancel(wheel, &deadline);
+
+		// Send the train's next ECHO-REQUEST when due - a failure ends the train early
+		if (0 != timer_pending(&nexttx) && pacer_now_usecs() >= nexttx.expires)
 		{
-			IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: ERROR: time() returned bad value for timenow %d (%s)\n", errno, strerror(errno));
+			timer_cancel(wheel, &nexttx);
+			if (0 == icmpv6_echo_send(sock, &destination, ctx, txid, train->sent, &txusecs[train->sent]))
+			{
+				train->sent++;
+				lasttx = pacer_now_usecs();
+				if (ICMPV6_TRAIN_COUNT > train->sent)
+				{
+					timer_add(wheel, &nexttx, TIMER_ICMPV6_TRAIN, 0, trainstart + ((uint64_t)train->sent * ICMPV6_TRAIN_SPACING_USECS));
+				}
+			}
+			if (0 != train->received && 0 == timer_pending(&nexttx)) icmpv6_train_linger(wheel, &deadline, lasttx);
 		}
 
 		if (rc < 0)
@@ -403,7 +797,13 @@ int check_icmpv6_echoresponse(char * hostname, uint64_t starttime, uint64_t sess
 		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: poll returned events = %d\n", pollfiledesc[0].revents);
 		#endif
 
-		if ( (pollfiledesc[0].revents & POLLIN) != POLLIN)
+		// A datagram socket reports ICMPv6 errors through its error queue, rather than as packets
+		int rxflags = 0;
+		if (1 == dgram && POLLERR == (pollfiledesc[0].revents & POLLERR))
+		{
+			rxflags = MSG_ERRQUEUE;
+		}
+		else if ( (pollfiledesc[0].revents & POLLIN) != POLLIN)
 		{
 			IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: RESTART: poll returned but failed to find POLLIN set: %d\n",pollfiledesc[0].revents);
 			continue;
@@ -419,11 +819,18 @@ int check_icmpv6_echoresponse(char * hostname, uint64_t starttime, uint64_t sess
 		rmsghdr.msg_control = (caddr_t)rxbuf;
 		rmsghdr.msg_controllen = sizeof(rxbuf);
 		rmsghdr.msg_flags = 0; // filled on receive
-		rc = recvmsg(sock, &rmsghdr, 0);
+		rc = recvmsg(sock, &rmsghdr, rxflags);
 		errsv = errno;
 		if (rc < 0)
 		{
 			IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: RESTART: recvmsg returned bad things : %d (%s)\n", errsv, strerror(errsv));
+			// Clear any pending error which was not queued, which would otherwise wake us again at once
+			if (MSG_ERRQUEUE == rxflags)
+			{
+				int soerr;
+				socklen_t soerrlen = sizeof(soerr);
+				(void)getsockopt(sock, SOL_SOCKET, SO_ERROR, &soerr, &soerrlen);
+			}
 			continue;
 		}
 		else if (rc == 0)
@@ -438,14 +845,6 @@ int check_icmpv6_echoresponse(char * hostname, uint64_t starttime, uint64_t sess
 			IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: recvmsg returned indicating %d bytes received\n",rc);
 			#endif
 
-			if (rxpacketsize < (int)sizeof(struct icmp6_hdr))
-			{
-				#ifdef PINGDEBUG
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: Received packet too small - expected at least %d, got %d\n",(int)sizeof(struct icmp6_hdr),rxpacketsize);
-				#endif
-				continue;
-			}
-
 			if (rmsghdr.msg_namelen != sizeof(struct sockaddr_in6))
 			{
 				#ifdef PINGDEBUG
@@ -462,398 +861,101 @@ int check_icmpv6_echoresponse(char * hostname, uint64_t starttime, uint64_t sess
 				continue;
 			}
 
-			rc = getnameinfo((struct sockaddr *)&source, sizeof(source), tmpbuf, sizeof(tmpbuf), NULL, 0, NI_NUMERICHOST);
-			errsv = errno;
-			if (0 == rc)
+			if (MSG_ERRQUEUE == rxflags)
 			{
-				#ifdef PINGDEBUG
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: Received source address was %s\n", tmpbuf);
-				#endif
+				// The queued packet is the ECHO-REQUEST itself, as sent from this socket
+				rc = icmpv6_errqueue_classify(&rmsghdr, rxpacket, rxpacketsize, &(destination.sin6_addr), &rxseqno, router);
+				if (0 > rc || rxseqno < txseqno || rxseqno >= (txseqno + train->sent)) continue;
 			}
 			else
 			{
-				#ifdef PINGDEBUG
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: getnameinfo returned bad indication %d (%s)\n",errsv, gai_strerror(errsv));
-				#endif
-				continue;
-			}
-
-			// Store the outer packet address in case we do have a valid response from a machine(router) other than
-			// the intended target
-			inet_ntop(AF_INET6, &(source.sin6_addr), router, INET6_ADDRSTRLEN);
-
-			// Extract ICMPv6 type and code for checking and reporting
-			rxicmp6hdr_ptr = (struct icmp6_hdr *)rxpacket;
-			rxicmp6_type = rxicmp6hdr_ptr->icmp6_type;
-			rxicmp6_code = rxicmp6hdr_ptr->icmp6_code;
-			// Extract sequence number and ID
-			rxseqno = htons(rxicmp6hdr_ptr->icmp6_seq);
-			rxid = htons(rxicmp6hdr_ptr->icmp6_id);
-
-			#ifdef PINGDEBUG
-			IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-			#endif
-
-			// Check whether our tx destination address equals our rx source
-			// RFC3542 section 2.3 macro returns non-zero if addresses equal, otherwise 0
-			if ( IN6_ARE_ADDR_EQUAL( &(source.sin6_addr), &(destination.sin6_addr) ) == 0 )
-			{
-
-				#ifdef PINGDEBUG
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: OUTER IPv6 hdr src address (%s) did not match our tx dest address\n", router);
-				#endif
-
-				// if a router replied instead of the host under test then size will be original packet plus an IPv6 header
-				if ( rxpacketsize == (int)(sizeof(struct ip6_hdr) + 8 + sendsize) )
-				{
-					char tx_dst_addr[INET6_ADDRSTRLEN], orig_src_addr[INET6_ADDRSTRLEN], orig_dst_addr[INET6_ADDRSTRLEN];
-					struct ip6_hdr *rx2ip6hdr_ptr;
-					struct icmp6_hdr *rx2icmp6hdr_ptr;
-					rx2ip6hdr_ptr = (struct ip6_hdr *)&rxpacket[sizeof(struct icmp6_hdr)];
-					// struct in6_addr ip6_src and ip6_dst
-					struct in6_addr orig_dst = rx2ip6hdr_ptr->ip6_dst;
-					struct in6_addr orig_src = rx2ip6hdr_ptr->ip6_src;
-					unsigned int nextheader = rx2ip6hdr_ptr->ip6_nxt;
-
-					inet_ntop(AF_INET6, &orig_src, orig_src_addr, INET6_ADDRSTRLEN);
-					// original source address would be our IPv6 address
-					// TODO - perhaps we should be checking this for completeness ...
-
-					inet_ntop(AF_INET6, &orig_dst, orig_dst_addr, INET6_ADDRSTRLEN);
-					// original destination should match our transmitted destination address
-
-					inet_ntop(AF_INET6, &(destination.sin6_addr), tx_dst_addr, INET6_ADDRSTRLEN);
-
-					#ifdef PINGDEBUG
-					IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: INNER packet details: src %s ; dst %s; nextheader %d\n", orig_src_addr, orig_dst_addr, nextheader);
-					#endif
-
-					// if addresses don't match then it was returned in response to another packet,
-					// so this packet is not relevant to us ...
-					if ( IN6_ARE_ADDR_EQUAL( &orig_dst, &(destination.sin6_addr) ) == 0)
-					{
-						#ifdef PINGDEBUG
-						IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: INNER IPv6 hdr dst %s was != our Tx dst %s\n", orig_dst_addr, tx_dst_addr);
-						#endif
-						continue;
-					}
-
-					// Check that the next header is ICMPv6, otherwise not in response to our tx
-					if (nextheader == IPPROTO_ICMPV6)
-					{
-						rx2icmp6hdr_ptr = (struct icmp6_hdr *)&rxpacket[sizeof(struct icmp6_hdr)+sizeof(struct ip6_hdr)];
-						unsigned int rx2icmp6_type = rx2icmp6hdr_ptr->icmp6_type;
-						unsigned int rx2icmp6_code = rx2icmp6hdr_ptr->icmp6_code;
-						// Extract sequence number and ID
-						unsigned int rx2seqno = htons(rx2icmp6hdr_ptr->icmp6_seq);
-						unsigned int rx2id = htons(rx2icmp6hdr_ptr->icmp6_id);
-
-						// Check inner ICMPv6 packet was an ECHO_REQUEST
-						if (rx2icmp6_type != ICMP6_ECHO_REQUEST)
-						{
-							#ifdef PINGDEBUG
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: INNER ICMPv6_TYPE was not ECHO_REQUEST : %d\n", rx2icmp6_type);
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet details: src %s ; dst %s; nextheader %d\n", orig_src_addr, orig_dst_addr, nextheader);
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet icmp6 details: type %d; code %d; seq %d; id %d\n", rx2icmp6_type, rx2icmp6_code, rx2seqno, rx2id);
-							#endif
-							continue;
-						}
-
-						// Check inner ICMPv6 code was 0
-						if (rx2icmp6_code != 0)
-						{
-							#ifdef PINGDEBUG
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: INNER ICMPv6_CODE was not 0\n");
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet details: src %s ; dst %s; nextheader %d\n", orig_src_addr, orig_dst_addr, nextheader);
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet icmp6 details: type %d; code %d; seq %d; id %d\n", rx2icmp6_type, rx2icmp6_code, rx2seqno, rx2id);
-							#endif
-							continue;
-						}
-
-						// Check sequence number matches what we transmitted
-						if (rx2seqno != txseqno)
-						{
-							#ifdef PINGDEBUG
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: INNER ICMPv6_SEQN was not %d\n", txseqno);
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet details: src %s ; dst %s; nextheader %d\n", orig_src_addr, orig_dst_addr, nextheader);
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet icmp6 details: type %d; code %d; seq %d; id %d\n", rx2icmp6_type, rx2icmp6_code, rx2seqno, rx2id);
-							#endif
-							continue;
-						}
-
-						// Check ID matches what we transmitted
-						if (rx2id != txid)
-						{
-							#ifdef PINGDEBUG
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: INNER ICMPv6_ID was not %d\n", txid);
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet details: src %s ; dst %s; nextheader %d\n", orig_src_addr, orig_dst_addr, nextheader);
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet icmp6 details: type %d; code %d; seq %d; id %d\n", rx2icmp6_type, rx2icmp6_code, rx2seqno, rx2id);
-							#endif
-							continue;
-						}
-
-						// Check for the expected received data
-						// sent:
-						// "%"PRIu64" %"PRIu64" %u %u", starttime, session, ICMPV6_MAGIC_VALUE1, ICMPV6_MAGIC_VALUE2
-						uint64_t rx2starttime, rx2session;
-						unsigned int rx2magic1, rx2magic2;
-
-						rc = sscanf(&rxpackdata[sizeof(struct icmp6_hdr)+sizeof(struct ip6_hdr)+ICMP6DATAOFFSET], "%"PRIu64" %"PRIu64" %u %u", &rx2starttime, &rx2session, &rx2magic1, &rx2magic2);
-						if (rc == 4)
-						{
-							if (rx2starttime != starttime)
-							{
-								#ifdef PINGDEBUG
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: INNER ICMPv6 magic data rx2starttime (%"PRId64") != starttime (%"PRId64")\n", rx2starttime, starttime);
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet details: src %s ; dst %s; nextheader %d\n", orig_src_addr, orig_dst_addr, nextheader);
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet icmp6 details: type %d; code %d; seq %d; id %d\n", rx2icmp6_type, rx2icmp6_code, rx2seqno, rx2id);
-								#endif
-								continue;
-							}
-							if (rx2session != session)
-							{
-								#ifdef PINGDEBUG
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: INNER ICMPv6 magic data rx2session (%"PRId64") != session (%"PRId64")\n", rx2session, session);
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet details: src %s ; dst %s; nextheader %d\n", orig_src_addr, orig_dst_addr, nextheader);
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet icmp6 details: type %d; code %d; seq %d; id %d\n", rx2icmp6_type, rx2icmp6_code, rx2seqno, rx2id);
-								#endif
-								continue;
-							}
-							if (ICMPV6_MAGIC_VALUE1 != rx2magic1)
-							{
-								#ifdef PINGDEBUG
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: INNER ICMPv6 magic data rx2magic1 (%d) != expected %d\n", rx2magic1, ICMPV6_MAGIC_VALUE1);
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet details: src %s ; dst %s; nextheader %d\n", orig_src_addr, orig_dst_addr, nextheader);
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet icmp6 details: type %d; code %d; seq %d; id %d\n", rx2icmp6_type, rx2icmp6_code, rx2seqno, rx2id);
-								#endif
-								continue;
-							}
-							if (ICMPV6_MAGIC_VALUE2 != rx2magic2)
-							{
-								#ifdef PINGDEBUG
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: INNER ICMPv6 magic data rx2magic2 (%d) != expected %d\n", rx2magic2, ICMPV6_MAGIC_VALUE2);
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet details: src %s ; dst %s; nextheader %d\n", orig_src_addr, orig_dst_addr, nextheader);
-								IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet icmp6 details: type %d; code %d; seq %d; id %d\n", rx2icmp6_type, rx2icmp6_code, rx2seqno, rx2id);
-								#endif
-								continue;
-							}
-
-							//
-							// If we get to this point then the returned packet was in response to the packet we originally
-							// transmitted
-							//
-							#ifdef PINGDEBUG
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: Packet from %s contained our tx ECHO-REQUEST, so flagging INDIRECT response\n", router);
-							#endif
-							indirect = IPSCAN_INDIRECT_RESPONSE;
-						}
-						else
-						{
-							// wrong number of parameters
-							#ifdef PINGDEBUG
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: INNER ICMPv6 packet returned number of magic parameters (%d) != 4\n", rc);
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet details: src %s ; dst %s; nextheader %d\n", orig_src_addr, orig_dst_addr, nextheader);
-							IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED INNER packet icmp6 details: type %d; code %d; seq %d; id %d\n", rx2icmp6_type, rx2icmp6_code, rx2seqno, rx2id);
-							#endif
-							continue;
-						}
-					}
-					else
-					{
-						#ifdef PINGDEBUG
-						IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: INNER IPv6 next header didn't indicate an ICMPv6 packet inside\n");
-						IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-						IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: INNER packet details: src %s ; dst %s; nextheader %d\n", orig_src_addr, orig_dst_addr, nextheader);
-						#endif
-						continue;
-					}
-				}
-				else
+				// Only the ECHO-REQUESTs sent so far can be answered
+				if (0 != icmpv6_echo_ids(rxpacket, rxpacketsize, &rxid, &rxseqno) || rxseqno < txseqno || rxseqno >= (txseqno + train->sent))
 				{
 					#ifdef PINGDEBUG
-					IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: OUTER address mismatch with INNER unexpected size : %d\n", rxpacketsize);
-					IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
+					IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: not in response to an ECHO-REQUEST of this train\n");
 					#endif
 					continue;
 				}
 
+				rc = icmpv6_echo_classify(rxpacket, rxpacketsize, &source, &(destination.sin6_addr), txid, rxseqno, ctx->timestamp, ctx->session, router);
+				if (0 > rc) continue;
 			}
 
-			//
-			// Check what type of ICMPv6 packet we received and set return value appropriately ...
-			//
-			if (rxicmp6_type == ICMP6_ECHO_REPLY)
+			// An ICMPv6 error in response to any of our ECHO-REQUESTs ends the wait
+			if (ECHOREPLY != rc)
 			{
-				#ifdef PINGDEBUG
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: ICMP6_TYPE was ICMP6_ECHO_REPLY, with code %d\n", rxicmp6_code);
-				#endif
-			}
-			else if ( rxicmp6_type == ICMP6_DST_UNREACH )
-			{
-				switch ( rxicmp6_code )
-				{
-				case ICMP6_DST_UNREACH_NOROUTE:
-					retval = PORTUNREACHABLE;
-					break;
-				case ICMP6_DST_UNREACH_ADMIN:
-					retval = PORTPROHIBITED;
-					break;
-				case ICMP6_DST_UNREACH_ADDR:
-					retval = PORTNOROUTE;
-					break;
-				case ICMP6_DST_UNREACH_NOPORT:
-					retval = PORTREFUSED;
-					break;
-				default:
-					retval = PORTUNREACHABLE;
-					break;
-				}
-
-				#ifdef PINGDEBUG
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: ICMP6_TYPE was DST_UNREACH, with code %d (%s)\n", rxicmp6_code, resultsstruct[retval].label);
-				#endif
-
+				timer_cancel(wheel, &deadline);
+				timer_cancel(wheel, &nexttx);
+				icmpv6_train_finish(train, rc, router);
 				if (-1 != sock) close(sock); // close socket if appropriate
-				return(retval+indirect);
-			}
-			else if (rxicmp6_type == ICMP6_PARAM_PROB)
-			{
-				#ifdef PINGDEBUG
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: ICMP6_TYPE was PARAM_PROB, with code %d\n", rxicmp6_code);
-				#endif
-
-				retval = PORTPARAMPROB;
-				if (-1 != sock) close(sock); // close socket if appropriate
-				return(retval+indirect);
-			}
-			else if (rxicmp6_type == ICMP6_TIME_EXCEEDED)
-			{
-				#ifdef PINGDEBUG
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: ICMP6_TYPE was TIME_EXCEEDED, with code %d\n", rxicmp6_code);
-				#endif
-
-				retval = PORTNOROUTE;
-				if (-1 != sock) close(sock); // close socket if appropriate
-				return(retval+indirect);
-			}
-			else if (rxicmp6_type == ICMP6_PACKET_TOO_BIG)
-			{
-				#ifdef PINGDEBUG
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: ICMP6_TYPE was PACKET_TOO_BIG, with code %d\n", rxicmp6_code);
-				#endif
-
-				retval = PORTPKTTOOBIG;
-				if (-1 != sock) close(sock); // close socket if appropriate
-				return(retval+indirect);
-			}
-			else
-			{
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: RESTART: unhandled ICMPv6 packet TYPE was %d CODE was %d\n", rxicmp6_type, rxicmp6_code);
-				continue;
-			}
-
-			//
-			// If we get this far then packet is a direct ECHO-REPLY, so we can check the contents
-			//
-
-			if (rxseqno != txseqno)
-			{
-				#ifdef PINGDEBUG
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: Sequence number mismatch - expected %d\n", txseqno);
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-				#endif
-				continue;
-			}
-
-			if (rxid != txid)
-			{
-				#ifdef PINGDEBUG
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: ICMP6 id mismatch - expected %d\n", txid);
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-				#endif
-				continue;
-			}
-
-			// Check for the expected received data
-			// sent:
-			// "%"PRIu64" %"PRIu64" %u %u", starttime, session, ICMPV6_MAGIC_VALUE1, ICMPV6_MAGIC_VALUE2
-			uint64_t rxstarttime, rxsession;
-			unsigned int rxmagic1, rxmagic2;
-
-			rc = sscanf(&rxpackdata[ICMP6DATAOFFSET], "%"PRIu64" %"PRIu64" %u %u", &rxstarttime, &rxsession, &rxmagic1, &rxmagic2);
-			if (rc == 4)
-			{
-				if (rxstarttime != starttime)
-				{
-					#ifdef PINGDEBUG
-					IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: magic data rxstarttime (%"PRId64") != starttime (%"PRId64")\n", rxstarttime, starttime);
-					IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-					#endif
-					continue;
-				}
-				if (rxsession != session)
-				{
-					#ifdef PINGDEBUG
-					IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: magic data rxsession (%"PRId64") != session (%"PRId64")\n", rxsession, session);
-					IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-					#endif
-					continue;
-				}
-				if (ICMPV6_MAGIC_VALUE1 != rxmagic1)
-				{
-					#ifdef PINGDEBUG
-					IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: RX magic data 1 (%d) != expected %d\n", rxmagic1, ICMPV6_MAGIC_VALUE1);
-					IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-					#endif
-					continue;
-				}
-				if (ICMPV6_MAGIC_VALUE2 != rxmagic2)
-				{
-					#ifdef PINGDEBUG
-					IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: RX magic data 2 (%d) != expected %d\n", rxmagic2, ICMPV6_MAGIC_VALUE2);
-					IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-					#endif
-					continue;
-				}
-
-				//
-				// if we get to this point then everything matches ...
-				//
-				#ifdef PINGDEBUG
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: Everything matches - it was our expected ICMPv6 ECHO_RESPONSE\n");
-				#endif
-				foundit = 1;
-			}
-			else
-			{
-				#ifdef PINGDEBUG
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARD: number of magic parameters mismatched, got %d, expected 4\n", rc);
-				IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: DISCARDED OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
-				#endif
-				continue;
+				return(rc);
 			}
 
+			// Record the round trip time of this ECHO-REQUEST
+			uint64_t rxusecs = icmpv6_rx_usecs(&rmsghdr);
+			icmpv6_train_record(ctx, train, rxseqno - txseqno, (rxusecs > txusecs[rxseqno - txseqno]) ? (rxusecs - txusecs[rxseqno - txseqno]) : 1);
+			if (0 == timer_pending(&nexttx)) icmpv6_train_linger(wheel, &deadline, lasttx);
 		} // end of if (received some bytes)
 
 	} // end of while
 
-	if (foundit == 1) retval = ECHOREPLY; else retval = ECHONOREPLY;
+	timer_cancel(wheel, &deadline);
+	timer_cancel(wheel, &nexttx);
+	if (0 != train->received) retval = ECHOREPLY; else retval = ECHONOREPLY;
+	icmpv6_train_finish(train, retval, router);
+
+	#ifdef PINGDEBUG
+	IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse: %u of %u ECHO-REQUESTs answered, %s\n", train->received, train->sent, router);
+	#endif
 
 	// return the status
 	if (-1 != sock) close(sock); // close socket if appropriate
 
-	// Make sure we wait long enough in all cases
-	sleep(IPSCAN_MINTIME_PER_PORT);
-
 	return(retval);
 }
 
+//
+// Send the echo train from a child, so that it overlaps the UDP and TCP scans, and store its result
+// (with the responding router, or the train's statistics, as the note) for the parent to read back
+//
+
+int check_icmpv6_echoresponse_parll(struct scan_context_struc *ctx)
+{
+	pid_t childpid = fork();
+	if (childpid > 0)
+	{
+		// parent
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse_parll(): forked and started child PID=%d\n",childpid);
+		#endif
+		#if (1 == IPSCAN_INCLUDE_RAWPING)
+		// Only the child pings, so the parent (and its later children) have no use for the raw socket
+		icmpv6_raw_release();
+		#endif
+	}
+	else if (childpid == 0)
+	{
+		// child - actually do the work here - and then exit successfully
+		char router[INET6_ADDRSTRLEN+1] = "";
+		struct icmpv6_train_struc train;
+		int pingresult = check_icmpv6_echoresponse(ctx, router, &train);
+		int rc;
+
+		// Nobody need wait any longer for an ECHO-REPLY's round trip time
+		rtt_share_finish(ctx);
+		rc = write_db_scan(ctx, (0 + (IPSCAN_PROTO_ICMPV6 << IPSCAN_PROTO_SHIFT)), pingresult, router);
+		if (rc != 0)
+		{
+			IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse_parll(): ERROR: write_db_scan for ping result returned %d\n", rc);
+		}
+		// Usual practice to have children _exit() whilst the parent calls exit()
+		_exit(EXIT_SUCCESS);
+	}
+	else
+	{
+		IPSCAN_LOG( LOGPREFIX "check_icmpv6_echoresponse_parll(): fork() failed childpid=%d, errno=%d(%s)\n", childpid, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return( (int)childpid );
+}
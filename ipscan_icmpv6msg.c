@@ -0,0 +1,709 @@
+//    IPscan - an HTTP-initiated IPv6 port scanner.
+//
+//    Copyright (C) 2011-2021 Tim Chappell.
+//
+//    This file is part of IPscan.
+//
+//    IPscan is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with IPscan.  If not, see <http://www.gnu.org/licenses/>.
+
+// ipscan_icmpv6msg.c 	version
+// 0.01			initial version - ECHO-REQUEST construction and reply classification, split from ipscan_icmpv6.c
+//			so that they are shared by the scans and the persistent echo helper
+// 0.02			add an in-kernel classic BPF filter, so that only our responses wake the receiver
+// 0.03			accept a range of sequence numbers in the filter, for echo trains, and add kernel receive timestamps
+// 0.04			classify the ICMPv6 errors which a datagram (unprivileged ping) socket reports through its error queue
+
+#include "ipscan.h"
+//
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <time.h>
+
+// IPv6 address conversion
+#include <arpa/inet.h>
+
+// Logging with syslog requires additional include
+#if (LOGMODE == 1)
+#include <syslog.h>
+#endif
+
+// Others that FreeBSD highlighted
+#include <netinet/in.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+// Other IPv6 related
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+
+// Classic BPF socket filters
+#include <errno.h>
+#include <unistd.h>
+#include <linux/filter.h>
+
+// IPV6_RECVERR error queue
+#include <linux/errqueue.h>
+
+// Define offset into ICMPv6 packet where user-defined data resides
+#define ICMP6DATAOFFSET sizeof(struct icmp6_hdr)
+
+// Longest filter program icmpv6_filter_attach() may build - two instructions per comparison (three for
+// a range of sequence numbers), with the identifier, sequence number, address and all of the data
+// compared for both ECHO-REPLYs and errors
+#define ICMP6FILTERMAXINSNS 160
+
+//
+// Prototype declarations
+//
+int icmpv6_echo_fill(char *packet, unsigned int id, unsigned int seq, uint64_t timestamp, uint64_t session);
+int icmpv6_echo_ids(const char *packet, int len, unsigned int *id, unsigned int *seq);
+int icmpv6_error_result(unsigned int type, unsigned int code);
+int icmpv6_errqueue_classify(struct msghdr *msg, const char *packet, int len, const struct in6_addr *target, unsigned int *seq, char *router);
+int icmpv6_echo_classify(const char *packet, int len, const struct sockaddr_in6 *source, const struct in6_addr *target,\
+	unsigned int txid, unsigned int txseqno, uint64_t timestamp, uint64_t session, char *router);
+void icmpv6_filter_match(struct sock_filter *prog, unsigned int *len, unsigned int *drops, unsigned int *numdrops,\
+	unsigned int size, uint32_t offset, uint32_t value);
+void icmpv6_filter_range(struct sock_filter *prog, unsigned int *len, unsigned int *drops, unsigned int *numdrops,\
+	uint32_t offset, uint32_t first, uint32_t count);
+int icmpv6_filter_attach(int sock, unsigned int id, int seq, unsigned int numseq, const char *txpacket, const struct in6_addr *target);
+int icmpv6_timestamps_enable(int sock);
+uint64_t icmpv6_realtime_usecs(void);
+uint64_t icmpv6_rx_usecs(struct msghdr *msg);
+
+//
+// Build an ECHO-REQUEST of ICMPV6_PACKET_SIZE bytes, with our magic data following the header.
+// Returns the size of the packet, or -1 if the data would not fit.
+//
+
+int icmpv6_echo_fill(char *packet, unsigned int id, unsigned int seq, uint64_t timestamp, uint64_t session)
+{
+	struct icmp6_hdr *txicmp6hdr_ptr = (struct icmp6_hdr *)packet;
+	int rc;
+
+	memset(packet, 0, ICMPV6_PACKET_SIZE);
+	txicmp6hdr_ptr->icmp6_cksum = 0;
+	txicmp6hdr_ptr->icmp6_type = ICMP6_ECHO_REQUEST;
+	txicmp6hdr_ptr->icmp6_code = 0;
+	txicmp6hdr_ptr->icmp6_id = htons(id);
+	txicmp6hdr_ptr->icmp6_seq = htons(seq);
+
+	rc = snprintf(&packet[ICMP6DATAOFFSET],(ICMPV6_PACKET_SIZE-ICMP6DATAOFFSET),"%"PRIu64" %"PRIu64" %u %u", timestamp, session, ICMPV6_MAGIC_VALUE1, ICMPV6_MAGIC_VALUE2);
+	if (rc < (int)0 || rc >= (int)(ICMPV6_PACKET_SIZE-ICMP6DATAOFFSET))
+	{
+		IPSCAN_LOG( LOGPREFIX "icmpv6_echo_fill: snprintf returned %d, expected >=0 but < %d\n", rc, (int)(ICMPV6_PACKET_SIZE-ICMP6DATAOFFSET));
+		return(-1);
+	}
+	return(ICMPV6_PACKET_SIZE);
+}
+
+//
+// Extract the identifier and sequence number of the ECHO-REQUEST which a received packet concerns -
+// its own for an ECHO-REPLY, otherwise those of the ECHO-REQUEST quoted within an ICMPv6 error.
+// Returns 0, or -1 if the packet concerns no ECHO-REQUEST.
+//
+
+int icmpv6_echo_ids(const char *packet, int len, unsigned int *id, unsigned int *seq)
+{
+	const struct icmp6_hdr *rxicmp6hdr_ptr = (const struct icmp6_hdr *)packet;
+	const struct ip6_hdr *rx2ip6hdr_ptr;
+	const struct icmp6_hdr *rx2icmp6hdr_ptr;
+
+	if (len < (int)sizeof(struct icmp6_hdr)) return(-1);
+
+	if (ICMP6_ECHO_REPLY == rxicmp6hdr_ptr->icmp6_type)
+	{
+		*id = ntohs(rxicmp6hdr_ptr->icmp6_id);
+		*seq = ntohs(rxicmp6hdr_ptr->icmp6_seq);
+		return(0);
+	}
+
+	if (len < (int)(sizeof(struct icmp6_hdr) + sizeof(struct ip6_hdr) + sizeof(struct icmp6_hdr))) return(-1);
+
+	rx2ip6hdr_ptr = (const struct ip6_hdr *)&packet[sizeof(struct icmp6_hdr)];
+	if (IPPROTO_ICMPV6 != rx2ip6hdr_ptr->ip6_nxt) return(-1);
+
+	rx2icmp6hdr_ptr = (const struct icmp6_hdr *)&packet[sizeof(struct icmp6_hdr)+sizeof(struct ip6_hdr)];
+	if (ICMP6_ECHO_REQUEST != rx2icmp6hdr_ptr->icmp6_type) return(-1);
+
+	*id = ntohs(rx2icmp6hdr_ptr->icmp6_id);
+	*seq = ntohs(rx2icmp6hdr_ptr->icmp6_seq);
+	return(0);
+}
+
+//
+// Map the type and code of an ICMPv6 error onto the matching result, or return -1 for any other type
+//
+
+int icmpv6_error_result(unsigned int type, unsigned int code)
+{
+	int retval;
+
+	if (ICMP6_DST_UNREACH == type)
+	{
+		switch ( code )
+		{
+		case ICMP6_DST_UNREACH_NOROUTE:
+			retval = PORTUNREACHABLE;
+			break;
+		case ICMP6_DST_UNREACH_ADMIN:
+			retval = PORTPROHIBITED;
+			break;
+		case ICMP6_DST_UNREACH_ADDR:
+			retval = PORTNOROUTE;
+			break;
+		case ICMP6_DST_UNREACH_NOPORT:
+			retval = PORTREFUSED;
+			break;
+		default:
+			retval = PORTUNREACHABLE;
+			break;
+		}
+
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_error_result: ICMP6_TYPE was DST_UNREACH, with code %d (result %d)\n", code, retval);
+		#endif
+		return(retval);
+	}
+	else if (ICMP6_PARAM_PROB == type)
+	{
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_error_result: ICMP6_TYPE was PARAM_PROB, with code %d\n", code);
+		#endif
+		return(PORTPARAMPROB);
+	}
+	else if (ICMP6_TIME_EXCEEDED == type)
+	{
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_error_result: ICMP6_TYPE was TIME_EXCEEDED, with code %d\n", code);
+		#endif
+		return(PORTNOROUTE);
+	}
+	else if (ICMP6_PACKET_TOO_BIG == type)
+	{
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_error_result: ICMP6_TYPE was PACKET_TOO_BIG, with code %d\n", code);
+		#endif
+		return(PORTPKTTOOBIG);
+	}
+	else
+	{
+		IPSCAN_LOG( LOGPREFIX "icmpv6_error_result: RESTART: unhandled ICMPv6 packet TYPE was %d CODE was %d\n", type, code);
+		return(-1);
+	}
+}
+
+//
+// Determine whether a received ICMPv6 packet is in response to our ECHO-REQUEST to target, and if so
+// what it indicates. Returns ECHOREPLY for our ECHO-REPLY, the result (plus IPSCAN_INDIRECT_RESPONSE
+// if sent by a router rather than the target) for an ICMPv6 error, or -1 if the packet is not ours.
+// router receives the packet's source address.
+//
+
+int icmpv6_echo_classify(const char *packet, int len, const struct sockaddr_in6 *source, const struct in6_addr *target,\
+	unsigned int txid, unsigned int txseqno, uint64_t timestamp, uint64_t session, char *router)
+{
+	const struct icmp6_hdr *rxicmp6hdr_ptr;
+	unsigned int rxicmp6_type, rxicmp6_code;
+	unsigned int rxid, rxseqno;
+	int rxpacketsize = len;
+	int retval;
+	int rc;
+
+	// indirect determines whether a host other than the intended target has replied
+	int indirect = 0;
+
+	if (rxpacketsize < (int)sizeof(struct icmp6_hdr))
+	{
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: DISCARD: Received packet too small - expected at least %d, got %d\n",(int)sizeof(struct icmp6_hdr),rxpacketsize);
+		#endif
+		return(-1);
+	}
+
+	// Store the outer packet address in case we do have a valid response from a machine(router) other than
+	// the intended target
+	inet_ntop(AF_INET6, &(source->sin6_addr), router, INET6_ADDRSTRLEN);
+
+	// Extract ICMPv6 type and code for checking and reporting
+	rxicmp6hdr_ptr = (const struct icmp6_hdr *)packet;
+	rxicmp6_type = rxicmp6hdr_ptr->icmp6_type;
+	rxicmp6_code = rxicmp6hdr_ptr->icmp6_code;
+	// Extract sequence number and ID
+	rxseqno = ntohs(rxicmp6hdr_ptr->icmp6_seq);
+	rxid = ntohs(rxicmp6hdr_ptr->icmp6_id);
+
+	#ifdef PINGDEBUG
+	IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: OUTER packet details: src %s; type %d; code %d; id %d; seqno %d\n", router, rxicmp6_type, rxicmp6_code, rxid, rxseqno);
+	#endif
+
+	// Check whether our tx destination address equals our rx source
+	// RFC3542 section 2.3 macro returns non-zero if addresses equal, otherwise 0
+	if ( IN6_ARE_ADDR_EQUAL( &(source->sin6_addr), target ) == 0 )
+	{
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: OUTER IPv6 hdr src address (%s) did not match our tx dest address\n", router);
+		#endif
+
+		// if a router replied instead of the host under test then size will be original packet plus an IPv6 header
+		if ( rxpacketsize != (int)(sizeof(struct ip6_hdr) + 8 + ICMPV6_PACKET_SIZE) )
+		{
+			#ifdef PINGDEBUG
+			IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: DISCARD: OUTER address mismatch with INNER unexpected size : %d\n", rxpacketsize);
+			#endif
+			return(-1);
+		}
+
+		const struct ip6_hdr *rx2ip6hdr_ptr = (const struct ip6_hdr *)&packet[sizeof(struct icmp6_hdr)];
+		struct in6_addr orig_dst = rx2ip6hdr_ptr->ip6_dst;
+		unsigned int nextheader = rx2ip6hdr_ptr->ip6_nxt;
+
+		#ifdef PINGDEBUG
+		char orig_src_addr[INET6_ADDRSTRLEN], orig_dst_addr[INET6_ADDRSTRLEN];
+		struct in6_addr orig_src = rx2ip6hdr_ptr->ip6_src;
+		inet_ntop(AF_INET6, &orig_src, orig_src_addr, INET6_ADDRSTRLEN);
+		inet_ntop(AF_INET6, &orig_dst, orig_dst_addr, INET6_ADDRSTRLEN);
+		IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: INNER packet details: src %s ; dst %s; nextheader %d\n", orig_src_addr, orig_dst_addr, nextheader);
+		#endif
+
+		// if addresses don't match then it was returned in response to another packet,
+		// so this packet is not relevant to us ...
+		if ( IN6_ARE_ADDR_EQUAL( &orig_dst, target ) == 0)
+		{
+			#ifdef PINGDEBUG
+			IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: DISCARD: INNER IPv6 hdr dst was not our Tx dst\n");
+			#endif
+			return(-1);
+		}
+
+		// Check that the next header is ICMPv6, otherwise not in response to our tx
+		if (nextheader != IPPROTO_ICMPV6)
+		{
+			#ifdef PINGDEBUG
+			IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: DISCARD: INNER IPv6 next header didn't indicate an ICMPv6 packet inside\n");
+			#endif
+			return(-1);
+		}
+
+		const struct icmp6_hdr *rx2icmp6hdr_ptr = (const struct icmp6_hdr *)&packet[sizeof(struct icmp6_hdr)+sizeof(struct ip6_hdr)];
+		unsigned int rx2icmp6_type = rx2icmp6hdr_ptr->icmp6_type;
+		unsigned int rx2icmp6_code = rx2icmp6hdr_ptr->icmp6_code;
+		// Extract sequence number and ID
+		unsigned int rx2seqno = ntohs(rx2icmp6hdr_ptr->icmp6_seq);
+		unsigned int rx2id = ntohs(rx2icmp6hdr_ptr->icmp6_id);
+
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: INNER packet icmp6 details: type %d; code %d; seq %d; id %d\n", rx2icmp6_type, rx2icmp6_code, rx2seqno, rx2id);
+		#endif
+
+		// Check inner ICMPv6 packet was an ECHO_REQUEST, with code 0, and our sequence number and ID
+		if (rx2icmp6_type != ICMP6_ECHO_REQUEST || rx2icmp6_code != 0 || rx2seqno != txseqno || rx2id != txid)
+		{
+			#ifdef PINGDEBUG
+			IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: DISCARD: INNER ICMPv6 was not our ECHO_REQUEST (expected seq %d id %d)\n", txseqno, txid);
+			#endif
+			return(-1);
+		}
+
+		// Check for the expected received data
+		// sent:
+		// "%"PRIu64" %"PRIu64" %u %u", starttime, session, ICMPV6_MAGIC_VALUE1, ICMPV6_MAGIC_VALUE2
+		uint64_t rx2starttime, rx2session;
+		unsigned int rx2magic1, rx2magic2;
+		char rx2data[ICMPV6_PACKET_SIZE - ICMP6DATAOFFSET + 1];
+
+		// The quoted data is not necessarily terminated, so copy it out first
+		memcpy(rx2data, &packet[sizeof(struct icmp6_hdr)+sizeof(struct ip6_hdr)+ICMP6DATAOFFSET], ICMPV6_PACKET_SIZE - ICMP6DATAOFFSET);
+		rx2data[ICMPV6_PACKET_SIZE - ICMP6DATAOFFSET] = 0;
+
+		rc = sscanf(rx2data, "%"PRIu64" %"PRIu64" %u %u", &rx2starttime, &rx2session, &rx2magic1, &rx2magic2);
+		if (rc != 4)
+		{
+			#ifdef PINGDEBUG
+			IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: DISCARD: INNER ICMPv6 packet returned number of magic parameters (%d) != 4\n", rc);
+			#endif
+			return(-1);
+		}
+		if (rx2starttime != timestamp || rx2session != session || ICMPV6_MAGIC_VALUE1 != rx2magic1 || ICMPV6_MAGIC_VALUE2 != rx2magic2)
+		{
+			#ifdef PINGDEBUG
+			IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: DISCARD: INNER ICMPv6 magic data mismatch (%"PRIu64" %"PRIu64" %u %u)\n", rx2starttime, rx2session, rx2magic1, rx2magic2);
+			#endif
+			return(-1);
+		}
+
+		//
+		// If we get to this point then the returned packet was in response to the packet we originally
+		// transmitted
+		//
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: Packet from %s contained our tx ECHO-REQUEST, so flagging INDIRECT response\n", router);
+		#endif
+		indirect = IPSCAN_INDIRECT_RESPONSE;
+	}
+
+	//
+	// Check what type of ICMPv6 packet we received and set return value appropriately ...
+	//
+	if (rxicmp6_type == ICMP6_ECHO_REPLY)
+	{
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: ICMP6_TYPE was ICMP6_ECHO_REPLY, with code %d\n", rxicmp6_code);
+		#endif
+	}
+	else
+	{
+		retval = icmpv6_error_result(rxicmp6_type, rxicmp6_code);
+		if (0 > retval) return(-1);
+		return(retval+indirect);
+	}
+
+	//
+	// If we get this far then packet is a direct ECHO-REPLY, so we can check the contents
+	//
+
+	if (rxseqno != txseqno || rxid != txid)
+	{
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: DISCARD: sequence number or id mismatch - expected seq %d id %d\n", txseqno, txid);
+		#endif
+		return(-1);
+	}
+
+	// Check for the expected received data
+	// sent:
+	// "%"PRIu64" %"PRIu64" %u %u", starttime, session, ICMPV6_MAGIC_VALUE1, ICMPV6_MAGIC_VALUE2
+	uint64_t rxstarttime, rxsession;
+	unsigned int rxmagic1, rxmagic2;
+	char rxdata[ICMPV6_PACKET_SIZE - ICMP6DATAOFFSET + 1];
+	int rxdatalen = rxpacketsize - (int)ICMP6DATAOFFSET;
+
+	if (rxdatalen > (int)(ICMPV6_PACKET_SIZE - ICMP6DATAOFFSET)) rxdatalen = (int)(ICMPV6_PACKET_SIZE - ICMP6DATAOFFSET);
+	memcpy(rxdata, &packet[ICMP6DATAOFFSET], (size_t)rxdatalen);
+	rxdata[rxdatalen] = 0;
+
+	rc = sscanf(rxdata, "%"PRIu64" %"PRIu64" %u %u", &rxstarttime, &rxsession, &rxmagic1, &rxmagic2);
+	if (rc != 4)
+	{
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: DISCARD: number of magic parameters mismatched, got %d, expected 4\n", rc);
+		#endif
+		return(-1);
+	}
+	if (rxstarttime != timestamp || rxsession != session || ICMPV6_MAGIC_VALUE1 != rxmagic1 || ICMPV6_MAGIC_VALUE2 != rxmagic2)
+	{
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: DISCARD: magic data mismatch (%"PRIu64" %"PRIu64" %u %u)\n", rxstarttime, rxsession, rxmagic1, rxmagic2);
+		#endif
+		return(-1);
+	}
+
+	//
+	// if we get to this point then everything matches ...
+	//
+	#ifdef PINGDEBUG
+	IPSCAN_LOG( LOGPREFIX "icmpv6_echo_classify: Everything matches - it was our expected ICMPv6 ECHO_RESPONSE\n");
+	#endif
+	return(ECHOREPLY);
+}
+
+//
+// Classify an ICMPv6 error read from the error queue of a datagram (unprivileged ping) socket, for which
+// the kernel reports the error's type, code and sender alongside the ECHO-REQUEST which caused it.
+// Returns the result (plus IPSCAN_INDIRECT_RESPONSE if sent by a router rather than the target), or -1
+// if the error is not one we are interested in. seq receives the sequence number of the ECHO-REQUEST
+// and router the error's source address.
+//
+
+int icmpv6_errqueue_classify(struct msghdr *msg, const char *packet, int len, const struct in6_addr *target, unsigned int *seq, char *router)
+{
+	const struct icmp6_hdr *txicmp6hdr_ptr = (const struct icmp6_hdr *)packet;
+	const struct sock_extended_err *ee = NULL;
+	const struct sockaddr_in6 *offender;
+	struct cmsghdr *cmsg;
+	int retval;
+
+	for (cmsg = CMSG_FIRSTHDR(msg) ; NULL != cmsg ; cmsg = CMSG_NXTHDR(msg, cmsg))
+	{
+		if (IPPROTO_IPV6 == cmsg->cmsg_level && IPV6_RECVERR == cmsg->cmsg_type)
+		{
+			ee = (const struct sock_extended_err *)CMSG_DATA(cmsg);
+		}
+	}
+
+	// Errors raised locally, e.g. for want of a route, carry no ICMPv6 type
+	if (NULL == ee || SO_EE_ORIGIN_ICMP6 != ee->ee_origin)
+	{
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_errqueue_classify: DISCARD: not an ICMPv6 error\n");
+		#endif
+		return(-1);
+	}
+
+	// The name is the destination of the ECHO-REQUEST, which the queued packet is
+	if (len < (int)sizeof(struct icmp6_hdr) || ICMP6_ECHO_REQUEST != txicmp6hdr_ptr->icmp6_type\
+		|| NULL == msg->msg_name || 0 == IN6_ARE_ADDR_EQUAL( &(((const struct sockaddr_in6 *)msg->msg_name)->sin6_addr), target ))
+	{
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "icmpv6_errqueue_classify: DISCARD: not in response to an ECHO-REQUEST to our target\n");
+		#endif
+		return(-1);
+	}
+	*seq = ntohs(txicmp6hdr_ptr->icmp6_seq);
+
+	offender = (const struct sockaddr_in6 *)SO_EE_OFFENDER(ee);
+	inet_ntop(AF_INET6, &(offender->sin6_addr), router, INET6_ADDRSTRLEN);
+
+	#ifdef PINGDEBUG
+	IPSCAN_LOG( LOGPREFIX "icmpv6_errqueue_classify: src %s; type %d; code %d; seqno %d\n", router, ee->ee_type, ee->ee_code, *seq);
+	#endif
+
+	retval = icmpv6_error_result(ee->ee_type, ee->ee_code);
+	if (0 > retval) return(-1);
+
+	// indirect if a host other than the intended target has replied
+	if (0 == IN6_ARE_ADDR_EQUAL( &(offender->sin6_addr), target )) retval += IPSCAN_INDIRECT_RESPONSE;
+	return(retval);
+}
+
+//
+// Append a comparison of the byte, 16-bit or 32-bit word at offset within the packet, leaving the
+// filter (by way of a jump patched up later) unless it equals value
+//
+
+void icmpv6_filter_match(struct sock_filter *prog, unsigned int *len, unsigned int *drops, unsigned int *numdrops,\
+	unsigned int size, uint32_t offset, uint32_t value)
+{
+	prog[*len].code = (uint16_t)(BPF_LD | size | BPF_ABS);
+	prog[*len].jt = 0;
+	prog[*len].jf = 0;
+	prog[*len].k = offset;
+	(*len)++;
+
+	prog[*len].code = (uint16_t)(BPF_JMP | BPF_JEQ | BPF_K);
+	prog[*len].jt = 0;
+	prog[*len].jf = 0;
+	prog[*len].k = value;
+	drops[*numdrops] = *len;
+	(*numdrops)++;
+	(*len)++;
+}
+
+//
+// Append a check that the 16-bit word at offset lies within first to first + count - 1, leaving the
+// filter otherwise. The word less first wraps around if below first, so one unsigned comparison
+// suffices, although it must leave the filter when true rather than when false.
+//
+
+void icmpv6_filter_range(struct sock_filter *prog, unsigned int *len, unsigned int *drops, unsigned int *numdrops,\
+	uint32_t offset, uint32_t first, uint32_t count)
+{
+	prog[*len].code = (uint16_t)(BPF_LD | BPF_H | BPF_ABS);
+	prog[*len].jt = 0;
+	prog[*len].jf = 0;
+	prog[*len].k = offset;
+	(*len)++;
+
+	prog[*len].code = (uint16_t)(BPF_ALU | BPF_SUB | BPF_K);
+	prog[*len].jt = 0;
+	prog[*len].jf = 0;
+	prog[*len].k = first;
+	(*len)++;
+
+	prog[*len].code = (uint16_t)(BPF_JMP | BPF_JGE | BPF_K);
+	prog[*len].jt = 0;
+	prog[*len].jf = 0;
+	prog[*len].k = count;
+	drops[*numdrops] = *len;
+	(*numdrops)++;
+	(*len)++;
+}
+
+//
+// Attach a classic BPF program to a raw ICMPv6 socket, so that the kernel only queues (and wakes us
+// for) the ECHO-REPLY to our ECHO-REQUEST, or an ICMPv6 error quoting it. The socket sees each
+// packet from its ICMPv6 header onwards, so an error quotes our ECHO-REQUEST's IPv6 header from
+// offset 8 and its ICMPv6 header from offset 48. The identifier must match, as must the sequence
+// number (one of numseq consecutive sequence numbers from seq) unless seq is negative. If txpacket is given then its magic data must match too, and if
+// target is given then so must the ECHO-REPLY's source address or the quoted destination address.
+// Anything queued before the filter was attached is then discarded. Returns 0, or -1 on failure,
+// in which case the socket remains unfiltered.
+//
+
+int icmpv6_filter_attach(int sock, unsigned int id, int seq, unsigned int numseq, const char *txpacket, const struct in6_addr *target)
+{
+	struct sock_filter prog[ICMP6FILTERMAXINSNS];
+	struct sock_fprog fprog;
+	unsigned int drops[ICMP6FILTERMAXINSNS];
+	unsigned int len = 0, numdrops = 0, errorsection = 0, section, i, datawords = 0;
+	uint32_t word, base;
+	const uint8_t *addr;
+	char discard[1];
+	int rc, errsv;
+
+	// Our magic data is text, padded with zeroes, so compare whole words up to its end
+	if (NULL != txpacket)
+	{
+		datawords = (unsigned int)((strnlen(&txpacket[ICMP6DATAOFFSET], ICMPV6_PACKET_SIZE - ICMP6DATAOFFSET) + 4) / 4);
+		if (datawords > ((ICMPV6_PACKET_SIZE - ICMP6DATAOFFSET) / 4)) datawords = (ICMPV6_PACKET_SIZE - ICMP6DATAOFFSET) / 4;
+	}
+
+	// An ECHO-REPLY is checked first, and anything else is taken to be an error
+	prog[len].code = (uint16_t)(BPF_LD | BPF_B | BPF_ABS);
+	prog[len].jt = 0;
+	prog[len].jf = 0;
+	prog[len].k = 0;
+	len++;
+	prog[len].code = (uint16_t)(BPF_JMP | BPF_JEQ | BPF_K);
+	prog[len].jt = 0;
+	prog[len].jf = 0;
+	prog[len].k = ICMP6_ECHO_REPLY;
+	errorsection = len;
+	len++;
+
+	for (section = 0 ; section < 2 ; section++)
+	{
+		// For an ECHO-REPLY our ICMPv6 header is at offset 0, and for an error at offset 48
+		base = (0 == section) ? 0 : (uint32_t)(sizeof(struct icmp6_hdr) + sizeof(struct ip6_hdr));
+
+		if (1 == section)
+		{
+			prog[errorsection].jf = (uint8_t)(len - errorsection - 1);
+			icmpv6_filter_match(prog, &len, drops, &numdrops, BPF_B, (uint32_t)(sizeof(struct icmp6_hdr) + offsetof(struct ip6_hdr, ip6_nxt)), IPPROTO_ICMPV6);
+			icmpv6_filter_match(prog, &len, drops, &numdrops, BPF_B, base, ICMP6_ECHO_REQUEST);
+		}
+
+		icmpv6_filter_match(prog, &len, drops, &numdrops, BPF_H, base + (uint32_t)offsetof(struct icmp6_hdr, icmp6_id), id & 0xFFFF);
+		if (0 <= seq && 1 >= numseq)
+		{
+			icmpv6_filter_match(prog, &len, drops, &numdrops, BPF_H, base + (uint32_t)offsetof(struct icmp6_hdr, icmp6_seq), (uint32_t)seq & 0xFFFF);
+		}
+		else if (0 <= seq)
+		{
+			icmpv6_filter_range(prog, &len, drops, &numdrops, base + (uint32_t)offsetof(struct icmp6_hdr, icmp6_seq), (uint32_t)seq & 0xFFFF, numseq);
+		}
+
+		// The ECHO-REPLY's source address lies in the IPv6 header, reached through SKF_NET_OFF
+		if (NULL != target)
+		{
+			addr = (const uint8_t *)target;
+			for (i = 0 ; i < 4 ; i++)
+			{
+				word = ((uint32_t)addr[4*i] << 24) | ((uint32_t)addr[4*i+1] << 16) | ((uint32_t)addr[4*i+2] << 8) | (uint32_t)addr[4*i+3];
+				icmpv6_filter_match(prog, &len, drops, &numdrops, BPF_W, (0 == section) ? (uint32_t)(SKF_NET_OFF + offsetof(struct ip6_hdr, ip6_src) + (4*i))\
+					: (uint32_t)(sizeof(struct icmp6_hdr) + offsetof(struct ip6_hdr, ip6_dst) + (4*i)), word);
+			}
+		}
+
+		for (i = 0 ; i < datawords ; i++)
+		{
+			addr = (const uint8_t *)&txpacket[ICMP6DATAOFFSET + (4*i)];
+			word = ((uint32_t)addr[0] << 24) | ((uint32_t)addr[1] << 16) | ((uint32_t)addr[2] << 8) | (uint32_t)addr[3];
+			icmpv6_filter_match(prog, &len, drops, &numdrops, BPF_W, base + (uint32_t)ICMP6DATAOFFSET + (4*i), word);
+		}
+
+		// Everything matched, so pass the whole packet
+		prog[len].code = (uint16_t)(BPF_RET | BPF_K);
+		prog[len].jt = 0;
+		prog[len].jf = 0;
+		prog[len].k = 0xFFFF;
+		len++;
+	}
+
+	// Any mismatch leads here, and the packet is dropped - a range check leaves when true, all else when false
+	prog[len].code = (uint16_t)(BPF_RET | BPF_K);
+	prog[len].jt = 0;
+	prog[len].jf = 0;
+	prog[len].k = 0;
+	for (i = 0 ; i < numdrops ; i++)
+	{
+		if (BPF_JGE == BPF_OP(prog[drops[i]].code)) prog[drops[i]].jt = (uint8_t)(len - drops[i] - 1);
+		else prog[drops[i]].jf = (uint8_t)(len - drops[i] - 1);
+	}
+	len++;
+
+	memset(&fprog, 0, sizeof(fprog));
+	fprog.len = (unsigned short)len;
+	fprog.filter = prog;
+	rc = setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+	errsv = errno;
+	if (0 > rc)
+	{
+		IPSCAN_LOG( LOGPREFIX "icmpv6_filter_attach: setsockopt SO_ATTACH_FILTER returned error %d (%s)\n", errsv, strerror(errsv));
+		return(-1);
+	}
+
+	#ifdef PINGDEBUG
+	IPSCAN_LOG( LOGPREFIX "icmpv6_filter_attach: attached %u instruction filter for id %u seq %d (%u)\n", len, id, seq, numseq);
+	#endif
+
+	// Packets which arrived before the filter was attached were queued regardless of it
+	while (0 <= recv(sock, discard, sizeof(discard), MSG_DONTWAIT));
+	return(0);
+}
+
+//
+// Have the kernel timestamp each packet as it is received, so that round trip times exclude the time
+// taken to wake us. Returns 0, or -1 on failure, in which case icmpv6_rx_usecs() reads the clock instead.
+//
+
+int icmpv6_timestamps_enable(int sock)
+{
+	int on = 1;
+	int rc, errsv;
+
+	rc = setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+	errsv = errno;
+	if (0 > rc)
+	{
+		IPSCAN_LOG( LOGPREFIX "icmpv6_timestamps_enable: setsockopt SO_TIMESTAMPNS returned error %d (%s)\n", errsv, strerror(errsv));
+		return(-1);
+	}
+	return(0);
+}
+
+//
+// The kernel's receive timestamps are taken from the real time clock, so transmissions must be too
+//
+
+uint64_t icmpv6_realtime_usecs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return( ((uint64_t)ts.tv_sec * 1000000) + ((uint64_t)ts.tv_nsec / 1000) );
+}
+
+//
+// Return the kernel's receive timestamp of the packet just read with recvmsg(), or the current time
+// if the kernel did not provide one
+//
+
+uint64_t icmpv6_rx_usecs(struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	struct timespec ts;
+
+	for (cmsg = CMSG_FIRSTHDR(msg) ; NULL != cmsg ; cmsg = CMSG_NXTHDR(msg, cmsg))
+	{
+		if (SOL_SOCKET == cmsg->cmsg_level && SCM_TIMESTAMPNS == cmsg->cmsg_type && CMSG_LEN(sizeof(ts)) <= cmsg->cmsg_len)
+		{
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			return( ((uint64_t)ts.tv_sec * 1000000) + ((uint64_t)ts.tv_nsec / 1000) );
+		}
+	}
+	return(icmpv6_realtime_usecs());
+}
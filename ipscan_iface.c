@@ -0,0 +1,258 @@
+//    IPscan - an HTTP-initiated IPv6 port scanner.
+//
+//    Copyright (C) 2011-2021 Tim Chappell.
+//
+//    This file is part of IPscan.
+//
+//    IPscan is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with IPscan.  If not, see <http://www.gnu.org/licenses/>.
+
+// ipscan_iface.c 	version
+// 0.01			initial version - cached local interface address and MAC, refreshed via netlink
+
+#include "ipscan.h"
+//
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// IPv6 address conversion
+#include <arpa/inet.h>
+
+// Logging with syslog requires additional include
+#if (LOGMODE == 1)
+#include <syslog.h>
+#endif
+
+// getifaddrs()
+#include <ifaddrs.h>
+
+// Link layer
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+
+// Address and link change notifications
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+// Others that FreeBSD highlighted
+#include <netinet/in.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+//
+// Prototype declarations
+//
+int iface_init(void);
+void iface_refresh(void);
+int iface_changed(void);
+
+//
+// The cache lives in shared memory so that every scan child sees the same copy, and whichever
+// process notices a change refreshes it for all of them. Readers retry should they overlap an
+// update, i.e. the generation is odd or changes whilst they copy.
+//
+static struct iface_struc *ifcache = NULL;
+
+// Private fallback should the shared mapping fail - changes are then only seen per process
+static struct iface_struc ifcache_private;
+
+// Netlink socket subscribed to IPv6 address and link changes, or -1 if unavailable
+static int iface_nlfd = -1;
+
+//
+// Walk the interfaces once, to find IPSCAN_INTERFACE_NAME's IPv6 and MAC addresses
+//
+
+void iface_refresh(void)
+{
+	struct ifaddrs *ifaddr, *ifa;
+	struct iface_struc found;
+	uint32_t generation;
+	unsigned int i;
+
+	memset(&found, 0, sizeof(found));
+
+	// Modify IPSCAN_INTERFACE_NAME in ipscan.h to match the server
+	if (-1 == getifaddrs( &ifaddr ))
+	{
+		IPSCAN_LOG( LOGPREFIX "iface_refresh: getifaddrs failed, returned %d (%s)\n", errno, strerror(errno));
+		return;
+	}
+
+	for (ifa = ifaddr; (NULL != ifa); ifa = ifa->ifa_next)
+	{
+		if (NULL == ifa->ifa_addr || 0 != strcasecmp(IPSCAN_INTERFACE_NAME, ifa->ifa_name)) continue;
+
+		if (AF_INET6 == ifa->ifa_addr->sa_family && 0 == found.addrvalid)
+		{
+			// Used as the source address in MPLS LSP Ping
+			memcpy(&found.addr, &((*((struct sockaddr_in6*)ifa->ifa_addr)).sin6_addr), sizeof(struct in6_addr));
+			found.addrvalid = 1;
+			#ifdef UDPDEBUG
+			char localaddrstr[INET6_ADDRSTRLEN+1];
+			if (NULL != inet_ntop(AF_INET6, &found.addr, localaddrstr, INET6_ADDRSTRLEN))
+			{
+				IPSCAN_LOG( LOGPREFIX "iface_refresh: found localaddr = %s\n", localaddrstr);
+			}
+			#endif
+		}
+
+		if (AF_PACKET == ifa->ifa_addr->sa_family && 0 == found.macvalid)
+		{
+			// Used as the client link-layer address in DHCPv6
+			struct sockaddr_ll *sa_ll = (struct sockaddr_ll * )ifa->ifa_addr;
+			for (i = 0; i < 6; i++) found.mac[i] = sa_ll->sll_addr[i];
+			found.macvalid = 1;
+			#ifdef UDPDEBUG
+			IPSCAN_LOG( LOGPREFIX "iface_refresh: found MAC address %02x:%02x:%02x:%02x:%02x:%02x\n", found.mac[0], found.mac[1], found.mac[2], found.mac[3], found.mac[4], found.mac[5]);
+			#endif
+		}
+	}
+	freeifaddrs(ifaddr);
+
+	if (0 == found.addrvalid && 0 == found.macvalid)
+	{
+		IPSCAN_LOG( LOGPREFIX "iface_refresh: WARNING - Failed to determine the link-local or MAC address for interface %s\n", IPSCAN_INTERFACE_NAME);
+		IPSCAN_LOG( LOGPREFIX "iface_refresh: Check whether IPSCAN_INTERFACE_NAME defined in ipscan.h is correct.\n");
+	}
+
+	// Claim the cache by making its generation odd - if another process already has, it is
+	// refreshing from an equally recent walk, so leave it to finish
+	generation = __atomic_load_n(&ifcache->generation, __ATOMIC_ACQUIRE);
+	if (0 != (generation & 1)) return;
+	if (!__atomic_compare_exchange_n(&ifcache->generation, &generation, generation + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return;
+
+	ifcache->addrvalid = found.addrvalid;
+	ifcache->macvalid = found.macvalid;
+	memcpy(ifcache->mac, found.mac, sizeof(found.mac));
+	memcpy(&ifcache->addr, &found.addr, sizeof(struct in6_addr));
+
+	__atomic_store_n(&ifcache->generation, generation + 2, __ATOMIC_RELEASE);
+}
+
+//
+// Set up the cache - must be called before any scan children are forked so that they share it
+//
+
+int iface_init(void)
+{
+	struct sockaddr_nl snl;
+	int rc = 0;
+
+	if (NULL != ifcache) return(0);
+
+	ifcache = mmap(NULL, sizeof(struct iface_struc), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == (void *)ifcache)
+	{
+		IPSCAN_LOG( LOGPREFIX "iface_init: mmap failed : %d (%s), caching per process only\n", errno, strerror(errno));
+		ifcache = &ifcache_private;
+		rc = -1;
+	}
+	memset(ifcache, 0, sizeof(struct iface_struc));
+
+	// Subscribe before the first walk, so that no change can slip between the two
+	iface_nlfd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (-1 == iface_nlfd)
+	{
+		IPSCAN_LOG( LOGPREFIX "iface_init: netlink socket failed : %d (%s), interface changes will not be seen\n", errno, strerror(errno));
+		rc = -1;
+	}
+	else
+	{
+		memset(&snl, 0, sizeof(snl));
+		snl.nl_family = AF_NETLINK;
+		snl.nl_groups = RTMGRP_LINK | RTMGRP_IPV6_IFADDR;
+		if (0 != bind(iface_nlfd, (struct sockaddr *)&snl, sizeof(snl)))
+		{
+			IPSCAN_LOG( LOGPREFIX "iface_init: netlink bind failed : %d (%s), interface changes will not be seen\n", errno, strerror(errno));
+			close(iface_nlfd);
+			iface_nlfd = -1;
+			rc = -1;
+		}
+	}
+
+	iface_refresh();
+	return(rc);
+}
+
+//
+// Drain any pending notifications, returning 1 if any reported an address or link change
+//
+
+int iface_changed(void)
+{
+	char buffer[IPSCAN_NETLINK_BUFSIZE];
+	struct nlmsghdr *nlh;
+	ssize_t len;
+	int changed = 0;
+
+	if (-1 == iface_nlfd) return(0);
+
+	while (0 < (len = recv(iface_nlfd, buffer, sizeof(buffer), MSG_DONTWAIT)))
+	{
+		for (nlh = (struct nlmsghdr *)buffer; NLMSG_OK(nlh, (unsigned int)len); nlh = NLMSG_NEXT(nlh, len))
+		{
+			if (RTM_NEWADDR == nlh->nlmsg_type || RTM_DELADDR == nlh->nlmsg_type || RTM_NEWLINK == nlh->nlmsg_type || RTM_DELLINK == nlh->nlmsg_type)
+			{
+				changed = 1;
+			}
+		}
+	}
+
+	if (0 > len && EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+	{
+		// The socket buffer overflowed, so notifications were lost - assume the worst
+		if (ENOBUFS == errno)
+		{
+			changed = 1;
+		}
+		else
+		{
+			IPSCAN_LOG( LOGPREFIX "iface_changed: netlink recv failed : %d (%s), interface changes will not be seen\n", errno, strerror(errno));
+			close(iface_nlfd);
+			iface_nlfd = -1;
+		}
+	}
+	return(changed);
+}
+
+//
+// Fetch the cached addresses, refreshing them first if they have changed since last time.
+// Either output is left untouched if it could not be determined, so callers can pre-fill a default.
+//
+
+void iface_lookup(struct in6_addr *addr, unsigned char *mac)
+{
+	struct iface_struc copy;
+	uint32_t generation;
+
+	if (NULL == ifcache) (void)iface_init();
+	if (0 != iface_changed()) iface_refresh();
+
+	do
+	{
+		generation = __atomic_load_n(&ifcache->generation, __ATOMIC_ACQUIRE);
+		memcpy(&copy, ifcache, sizeof(copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (0 != (generation & 1) || generation != __atomic_load_n(&ifcache->generation, __ATOMIC_ACQUIRE));
+
+	if (0 != copy.addrvalid && NULL != addr) memcpy(addr, &copy.addr, sizeof(struct in6_addr));
+	if (0 != copy.macvalid && NULL != mac) memcpy(mac, copy.mac, sizeof(copy.mac));
+}
@@ -0,0 +1,306 @@
+//    IPscan - an HTTP-initiated IPv6 port scanner.
+//
+//    Copyright (C) 2011-2021 Tim Chappell.
+//
+//    This file is part of IPscan.
+//
+//    IPscan is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with IPscan.  If not, see <http://www.gnu.org/licenses/>.
+
+// ipscan_pacer.c 	version
+// 0.01			initial version - shared token-bucket probe pacer
+// 0.02			add pacer_set_rate() for full-range scans
+// 0.03			add pacer_sleep(), so that callers may batch probes sent within the burst
+// 0.04			keep the host-wide bucket in a private state directory, refusing files which others could control
+
+#include "ipscan.h"
+//
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Logging with syslog requires additional include
+#if (LOGMODE == 1)
+#include <syslog.h>
+#endif
+
+// Others that FreeBSD highlighted
+#include <stdint.h>
+#include <inttypes.h>
+
+// Largest amount by which a bucket may run ahead of the clock before it is considered stale,
+// e.g. a host-wide bucket left behind from before a reboot
+#define PACER_STALE_USECS 60000000ULL
+
+//
+// Prototype declarations
+//
+uint64_t pacer_now_usecs(void);
+void * pacer_state_map(const char *name, size_t size);
+unsigned int pacer_env_rate(const char * envname, unsigned int defaultrate);
+void pacer_sleep(uint64_t wait);
+
+//
+// The bucket is implemented as a generic cell rate algorithm, which behaves identically to a
+// token bucket but needs only a single word of state - the theoretical arrival time (TAT) of
+// the next probe. That word lives in shared memory and is updated with compare-and-swap, so
+// any number of processes can draw on the same bucket without a lock.
+//
+struct pacer_struc
+{
+	uint64_t *tat;
+	uint64_t intervalusecs;
+	uint64_t toleranceusecs;
+	unsigned int rate;
+};
+
+static struct pacer_struc scanpacer = { NULL, 0, 0, 0 };
+static struct pacer_struc hostpacer = { NULL, 0, 0, 0 };
+
+// Private fallback should the shared mapping fail - pacing then applies per process only
+static uint64_t scanpacer_private = 0;
+
+// Current monotonic time in microseconds - common to every process on the host
+uint64_t pacer_now_usecs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return( ((uint64_t)ts.tv_sec * 1000000) + ((uint64_t)ts.tv_nsec / 1000) );
+}
+
+//
+// Determine a rate from the environment, falling back to the compiled-in default
+//
+
+unsigned int pacer_env_rate(const char * envname, unsigned int defaultrate)
+{
+	char * ratevar = getenv(envname);
+	char * endptr = NULL;
+	long rate;
+
+	if (NULL == ratevar) return(defaultrate);
+
+	errno = 0;
+	rate = strtol(ratevar, &endptr, 10);
+	if (0 != errno || endptr == ratevar || '\0' != *endptr || 0 > rate || 1000000 < rate)
+	{
+		IPSCAN_LOG( LOGPREFIX "pacer_env_rate: ignoring invalid %s value, using %u\n", envname, defaultrate);
+		return(defaultrate);
+	}
+	return((unsigned int)rate);
+}
+
+void pacer_configure(struct pacer_struc *pacer, unsigned int rate, unsigned int burst)
+{
+	pacer->rate = rate;
+	pacer->intervalusecs = (0 < rate) ? (1000000 / rate) : 0;
+	if (0 == pacer->intervalusecs && 0 < rate) pacer->intervalusecs = 1;
+	pacer->toleranceusecs = (1 < burst) ? ((uint64_t)(burst - 1) * pacer->intervalusecs) : 0;
+}
+
+//
+// Reserve the next token from a bucket, returning how long the caller must wait before using it
+//
+
+uint64_t pacer_take(struct pacer_struc *pacer, uint64_t now)
+{
+	uint64_t tat, newtat, start;
+
+	if (NULL == pacer->tat || 0 == pacer->rate) return(0);
+
+	tat = __atomic_load_n(pacer->tat, __ATOMIC_ACQUIRE);
+	do
+	{
+		start = (tat > now && (tat - now) < PACER_STALE_USECS) ? tat : now;
+		newtat = start + pacer->intervalusecs;
+	} while (!__atomic_compare_exchange_n(pacer->tat, &tat, newtat, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	// The token is conforming once the TAT is no more than the burst tolerance ahead of us
+	return( (start > (now + pacer->toleranceusecs)) ? (start - now - pacer->toleranceusecs) : 0 );
+}
+
+//
+// Map the named file within IPSCAN_STATE_DIR, creating it (zero-filled) if required. The directory
+// is world-visible, so neither it nor the file is trusted unless owned by this user (or, for the
+// directory, root), writable by nobody else and not reached through a symbolic link. Returns NULL
+// should the file be refused or the mapping fail.
+//
+
+void * pacer_state_map(const char *name, size_t size)
+{
+	struct stat dirstat, filestat;
+	void *map = NULL;
+	int dirfd, fd;
+
+	dirfd = open(IPSCAN_STATE_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (-1 == dirfd)
+	{
+		IPSCAN_LOG( LOGPREFIX "pacer_state_map: open of %s failed : %d (%s)\n", IPSCAN_STATE_DIR, errno, strerror(errno));
+		return(NULL);
+	}
+	if (0 != fstat(dirfd, &dirstat) || (geteuid() != dirstat.st_uid && 0 != dirstat.st_uid) || 0 != (dirstat.st_mode & (S_IWGRP | S_IWOTH)))
+	{
+		IPSCAN_LOG( LOGPREFIX "pacer_state_map: %s must be owned by user-id %d (or root) and writable by nobody else\n", IPSCAN_STATE_DIR, (int)geteuid());
+		close(dirfd);
+		return(NULL);
+	}
+
+	fd = openat(dirfd, name, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	close(dirfd);
+	if (-1 == fd)
+	{
+		IPSCAN_LOG( LOGPREFIX "pacer_state_map: open of %s/%s failed : %d (%s)\n", IPSCAN_STATE_DIR, name, errno, strerror(errno));
+		return(NULL);
+	}
+	if (0 != fstat(fd, &filestat) || !S_ISREG(filestat.st_mode) || 1 != filestat.st_nlink || geteuid() != filestat.st_uid\
+		|| 0 != (filestat.st_mode & (S_IRWXG | S_IRWXO)))
+	{
+		IPSCAN_LOG( LOGPREFIX "pacer_state_map: %s/%s must be a regular file owned by user-id %d and private to it\n", IPSCAN_STATE_DIR, name, (int)geteuid());
+	}
+	// Extending the file zero-fills it, and each user of it treats zero as its idle state
+	else if ((off_t)size != filestat.st_size && 0 != ftruncate(fd, (off_t)size))
+	{
+		IPSCAN_LOG( LOGPREFIX "pacer_state_map: ftruncate of %s/%s failed : %d (%s)\n", IPSCAN_STATE_DIR, name, errno, strerror(errno));
+	}
+	else
+	{
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (MAP_FAILED == map)
+		{
+			IPSCAN_LOG( LOGPREFIX "pacer_state_map: mmap of %s/%s failed : %d (%s)\n", IPSCAN_STATE_DIR, name, errno, strerror(errno));
+			map = NULL;
+		}
+	}
+	close(fd);
+	return(map);
+}
+
+//
+// Set up the pacer - must be called before any scan children are forked so that they share the bucket
+//
+
+int pacer_init(void)
+{
+	int rc = 0;
+
+	pacer_configure(&scanpacer, pacer_env_rate(IPSCAN_PACER_RATE_ENV, IPSCAN_PACER_RATE), IPSCAN_PACER_BURST);
+	scanpacer.tat = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == (void *)scanpacer.tat)
+	{
+		IPSCAN_LOG( LOGPREFIX "pacer_init: mmap of scan bucket failed : %d (%s), pacing per process only\n", errno, strerror(errno));
+		scanpacer.tat = &scanpacer_private;
+		rc = -1;
+	}
+	*scanpacer.tat = 0;
+
+	#if (1 == IPSCAN_PACER_HOSTWIDE)
+	pacer_configure(&hostpacer, pacer_env_rate(IPSCAN_PACER_HOSTRATE_ENV, IPSCAN_PACER_HOSTRATE), IPSCAN_PACER_HOSTBURST);
+	if (0 < hostpacer.rate)
+	{
+		// A zero-filled bucket is idle
+		hostpacer.tat = pacer_state_map(IPSCAN_PACER_HOSTFILE, sizeof(uint64_t));
+		if (NULL == hostpacer.tat)
+		{
+			IPSCAN_LOG( LOGPREFIX "pacer_init: host-wide pacing disabled\n");
+			rc = -1;
+		}
+	}
+	#endif
+
+	return(rc);
+}
+
+//
+// The configured probe rate for this scan, in probes per second (0 if unpaced)
+//
+
+unsigned int pacer_rate(void)
+{
+	return(scanpacer.rate);
+}
+
+//
+// Change the rate of this scan's bucket, e.g. for the TCP phase of a full-range scan. Only this
+// process, and any it forks afterwards, see the new rate.
+//
+
+void pacer_set_rate(unsigned int rate)
+{
+	pacer_configure(&scanpacer, rate, IPSCAN_PACER_BURST);
+}
+
+//
+// Reserve a token, returning the number of microseconds until the probe may be sent
+//
+
+uint64_t pacer_reserve(void)
+{
+	uint64_t now = pacer_now_usecs();
+	uint64_t scanwait = pacer_take(&scanpacer, now);
+	uint64_t hostwait = pacer_take(&hostpacer, now);
+	return( (scanwait > hostwait) ? scanwait : hostwait );
+}
+
+//
+// Admission check for the concurrent engines, which must never block. A slot's holdoff records
+// when its reserved token becomes valid, so returns 1 if the probe may be sent at time now,
+// otherwise reserves a token if required and returns 0 with the holdoff set.
+//
+
+int pacer_admit(uint64_t *holdoff, uint64_t now)
+{
+	uint64_t wait;
+
+	if (0 != *holdoff)
+	{
+		if (*holdoff > now) return(0);
+		*holdoff = 0;
+		return(1);
+	}
+
+	wait = pacer_reserve();
+	if (0 == wait) return(1);
+	*holdoff = now + wait;
+	return(0);
+}
+
+//
+// Sleep until a reserved token becomes valid
+//
+
+void pacer_sleep(uint64_t wait)
+{
+	if (0 < wait)
+	{
+		struct timespec ts;
+		ts.tv_sec = (time_t)(wait / 1000000);
+		ts.tv_nsec = (long)((wait % 1000000) * 1000);
+		while (-1 == nanosleep(&ts, &ts) && EINTR == errno);
+	}
+}
+
+//
+// Blocking form for the sequential (forked child) scanners - only sleeps if the bucket is empty
+//
+
+void pacer_wait(void)
+{
+	pacer_sleep(pacer_reserve());
+}
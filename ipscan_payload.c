@@ -0,0 +1,2072 @@
+//    IPscan - an HTTP-initiated IPv6 port scanner.
+//
+//    Copyright (C) 2011-2021 Tim Chappell.
+//
+//    This file is part of IPscan.
+//
+//    IPscan is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with IPscan.  If not, see <http://www.gnu.org/licenses/>.
+
+// ipscan_payload.c 	version
+// 0.01			initial version - UDP probe payloads built once into templates, split from ipscan_udp.c
+// 0.02			identify which of a port's tests a reply belongs to, so that they can share a socket
+// 0.03			validate replies against the identifiers of the probe they claim to answer
+// 0.04			one builder and validator per probe, found through the probe registry
+
+#include "ipscan.h"
+//
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+// Logging with syslog requires additional include
+#if (LOGMODE == 1)
+#include <syslog.h>
+#endif
+
+// gettimeofday()
+#include <sys/time.h>
+
+// Others that FreeBSD highlighted
+#include <netinet/in.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+//
+// Prototype declarations
+//
+void iface_lookup(struct in6_addr *addr, unsigned char *mac);
+void udp_template_patch(struct udp_template_struc *t, uint8_t type, int offset, uint8_t len);
+int udp_template_build(struct udp_template_struc *t, uint16_t port, uint8_t special, const char *hostname);
+uint32_t udp_probeid_field(uint32_t probeid, unsigned int len);
+int ber_header(const unsigned char *buf, int buflen, int *pos, unsigned char *tag, int *itemlen);
+int ber_integer(const unsigned char *buf, int buflen, int *pos, uint32_t *value);
+int udp_response_match(const struct udp_template_struc *t, uint32_t probeid, const char *reply, int len);
+const struct udp_probedesc_struc * udp_probe_find(uint16_t port, uint8_t special);
+void udp_probes_order(struct portlist_struc *list, unsigned int num, const char *hostname);
+int udp_build_unspecified(struct udp_template_struc *t, const char *hostname);
+
+//
+// Templates are built on first use, or up front by udp_templates_init() before the UDP children
+// are forked, after which they are only ever read. Should the table fill, further payloads are
+// built into the scratch template each time they are needed.
+//
+static struct udp_template_struc udptemplates[UDP_MAXTEMPLATES];
+static unsigned int numudptemplates = 0;
+static struct udp_template_struc udptemplate_scratch;
+
+// Per-process probe identifier, see udp_next_probeid()
+static uint32_t udp_probeid = 0;
+
+//
+// Record a field which must be filled in as each probe is sent
+//
+
+void udp_template_patch(struct udp_template_struc *t, uint8_t type, int offset, uint8_t len)
+{
+	if (UDP_MAXPATCHES <= t->numpatches || 0 > offset || UDP_BUFFER_SIZE < (offset + len))
+	{
+		IPSCAN_LOG( LOGPREFIX "udp_template_patch: unable to add patch type %d for port %d:%d\n", type, t->port, t->special);
+		return;
+	}
+	t->patch[t->numpatches].type = type;
+	t->patch[t->numpatches].len = len;
+	t->patch[t->numpatches].offset = (uint16_t)offset;
+	t->numpatches++;
+}
+
+//
+// DNS query for a AAAA record
+//
+
+int udp_build_dns(struct udp_template_struc *t, const char *hostname)
+{
+	char *txmessage = &t->payload[0];
+	int rc = 0;
+	int len = 0;
+	int retval = PORTUNKNOWN;
+
+	(void)hostname;
+
+	// Host name to query
+	char dnsquery1[] = "www6";
+	char dnsquery2[] = "chappell-family";
+	char dnsquery3[] = "co";
+	char dnsquery4[] = "uk";
+
+	/*
+		Header - 12 bytes
+		Contains fields that describe the type of message and provide important information about it.
+		Also contains fields that indicate the number of entries in the other sections of the message.
+		Question carries one or more �questions�, that is, queries for information being sent to a DNS name server.
+		Answer carries one or more resource records that answer the question(s) indicated in the Question section above.
+		Authority contains one or more resource records that point to authoritative name servers that can be used to
+		continue the resolution process.
+		Additional conveys one or more resource records that contain additional information related to the query that
+		is not strictly necessary to answer the queries (questions) in the message.
+	 */
+	// ID - identifier - 16 bit field, refreshed for each probe
+	udp_template_patch(t, UDP_PATCH_ID, len, 2);
+	txmessage[len++]= 21;
+	txmessage[len++]= 6;
+	// QR - query/response flag - 0=query. 1 bit field
+	// OP - opcode - 0=query,2=status. 4 bit field
+	// AA - Authoritative Answer flag. 1 bit field
+	// TC - truncation flag. 1 bit field
+	// RD - recursion desired - 0=not desired, 1=desired. 1 bit field
+	// RA - recursion available. 1 bit field
+	// Z  - reserved. 3 bit field
+	// Rcode - result code - 0=no error, 4=not implemented
+	txmessage[len++]= 1; // 0=Standard Query, 1=Recursion, 16 for server status query
+	txmessage[len++]= 0;
+	// QDCOUNT - question count - 16 bit field
+	txmessage[len++]= 0;
+	txmessage[len++]= 1;
+	// ANCOUNT - answer record count - 16 bit field
+	txmessage[len++]= 0;
+	txmessage[len++]= 0;
+	// NSCOUNT - authority record count (NS=name server) - 16 bit field
+	txmessage[len++]= 0;
+	txmessage[len++]= 0;
+	// ARCOUNT - 16 bit field
+	txmessage[len++]= 0;
+	txmessage[len++]= 0;
+	// Question section
+
+	txmessage[len++] = (char)strlen(dnsquery1);
+	// Need one extra octet for trailing 0, however this will be overwritten
+	// by the length of the next part of the host name in standard DNS format
+	rc = snprintf(&txmessage[len], (size_t)(UDP_BUFFER_SIZE-len), "%s", dnsquery1);
+	if (rc < 0 || rc >=( UDP_BUFFER_SIZE-len ))
+	{
+		IPSCAN_LOG( LOGPREFIX "udp_build_dns: Bad snprintf() for DNS query, returned %d\n", rc);
+		retval = PORTINTERROR;
+	}
+	else
+	{
+		len += rc;
+	}
+
+	// Only add new octets if no internal error has been encountered
+	//
+	if (PORTUNKNOWN == retval)
+	{
+		txmessage[len++]= (char)strlen(dnsquery2);
+		rc = snprintf(&txmessage[len], (size_t)(UDP_BUFFER_SIZE-len), "%s", dnsquery2);
+		if (rc < 0 || rc >= ( UDP_BUFFER_SIZE-len ))
+		{
+			IPSCAN_LOG( LOGPREFIX "udp_build_dns: Bad snprintf() for DNS query, returned %d\n", rc);
+			retval = PORTINTERROR;
+		}
+		else
+		{
+			len += rc;
+		}
+	}
+
+	// Only add new octets if no internal error has been encountered
+	//
+	if (PORTUNKNOWN == retval)
+	{
+		txmessage[len++]= (char)strlen(dnsquery3);
+		rc = snprintf(&txmessage[len], (size_t)(UDP_BUFFER_SIZE-len), "%s", dnsquery3);
+		if (rc < 0 || rc >= ( UDP_BUFFER_SIZE-len ))
+		{
+			IPSCAN_LOG( LOGPREFIX "udp_build_dns: Bad snprintf() for DNS query, returned %d\n", rc);
+			retval = PORTINTERROR;
+		}
+		else
+		{
+			len += rc;
+		}
+	}
+
+	// Only add new octets if no internal error has been encountered
+	//
+	if (PORTUNKNOWN == retval)
+	{
+		txmessage[len++]= (char)strlen(dnsquery4);
+		rc = snprintf(&txmessage[len], (size_t)(UDP_BUFFER_SIZE-len), "%s", dnsquery4);
+		if (rc < 0 || rc >= ( UDP_BUFFER_SIZE-len ))
+		{
+			IPSCAN_LOG( LOGPREFIX "udp_build_dns: Bad snprintf() for DNS query, returned %d\n", rc);
+			retval = PORTINTERROR;
+		}
+		else
+		{
+			len += rc;
+		}
+	}
+
+	// Only add new octets if no internal error has been encountered
+	//
+	if (PORTUNKNOWN == retval)
+	{
+		// End of name
+		txmessage[len++]= 0;
+
+		// Question type - 1 = host address, 2=NS, 255 is request all
+		txmessage[len++] = 0;
+		txmessage[len++] = 255;
+		// Qclass - 1=INternet
+		txmessage[len++] = 0;
+		txmessage[len++] = 1;
+	}
+
+	if (PORTUNKNOWN != retval) return(-1);
+	return(len);
+}
+
+//
+// TFTP read request
+//
+
+int udp_build_tftp(struct udp_template_struc *t, const char *hostname)
+{
+	char *txmessage = &t->payload[0];
+	int len = 0;
+	int retval = PORTUNKNOWN;
+
+	(void)hostname;
+
+	/* TFTP
+		TFTP supports five types of packets, all of which have been mentioned
+		   above:
+
+		          opcode  operation
+		            1     Read request (RRQ)
+		            2     Write request (WRQ)
+		            3     Data (DATA)
+		            4     Acknowledgment (ACK)
+		            5     Error (ERROR)
+
+		   The TFTP header of a packet contains the  opcode  associated  with
+		   that packet.
+
+		            2 bytes     string    1 byte     string   1 byte
+		            ------------------------------------------------
+		           | Opcode |  Filename  |   0  |    Mode    |   0  |
+		            ------------------------------------------------
+
+		                       Figure 5-1: RRQ/WRQ packet
+
+		    The mode field contains the string "netascii", "octet", or "mail"
+		    (or any combination of upper and lower case, such as "NETASCII",
+		    NetAscii", etc.) in netascii indicating the three modes defined in
+		    the protocol.                                                   */
+
+	// Create a pseudo-random filename based on the current pid
+	len = snprintf(&txmessage[0], UDP_BUFFER_SIZE, "%c%c%s%d%coctet%c",0,1,"/filename_tjc_",getpid(),0,0);
+	if (len < 0)
+	{
+		IPSCAN_LOG( LOGPREFIX "udp_build_tftp: Bad snprintf() for tftp, returned %d\n", len);
+		len = 0;
+		retval = PORTINTERROR;
+	}
+
+	if (PORTUNKNOWN != retval) return(-1);
+	return(len);
+}
+
+//
+// NTP client query (special 0) or MONLIST request (special 1)
+//
+
+int udp_build_ntp(struct udp_template_struc *t, const char *hostname)
+{
+	char *txmessage = &t->payload[0];
+	int len = 0;
+
+	(void)hostname;
+
+	/* NTP
+	 * from RFC4330
+						1                   2                   3
+		  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9  0  1
+		 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+		 |LI | VN  |Mode |    Stratum    |     Poll      |   Precision    |
+		 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+		 |                          Root  Delay                           |
+		 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+		 |                       Root  Dispersion                         |
+		 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+		 |                     Reference Identifier                       |
+		 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+		 |                                                                |
+		 |                    Reference Timestamp (64)                    |
+		 |                                                                |
+		 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+		 |                                                                |
+		 |                    Originate Timestamp (64)                    |
+		 |                                                                |
+		 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+		 |                                                                |
+		 |                     Receive Timestamp (64)                     |
+		 |                                                                |
+		 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+		 |                                                                |
+		 |                     Transmit Timestamp (64)                    |
+		 |                                                                |
+		 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+  */
+
+	// Replies to the client query are mode 4, whereas MONLIST replies are mode 7
+	t->flags |= UDP_TEMPLATE_DISTINCT;
+	if (1 == t->special) // NTP monlist case
+	{
+		txmessage[0] = 0x17; 	// NTP version 2, NTP_MODE = 7 (Private use)
+		txmessage[1] = 0; 		// (Auth bit and sequence number)
+		txmessage[2] = 0x03;	// Implementation is XNTPD
+		txmessage[3] = 0X2a;	// MON_GETLIST_1
+		len = 256;
+	}
+	else // Standard NTP client query
+	{
+		txmessage[0] = ((NTP_LI << 5) + (NTP_VN << 3) + ( NTP_MODE ));
+		txmessage[1] = NTP_STRATUM;
+		txmessage[2] = NTP_POLL;
+		txmessage[3] = NTP_PRECISION;
+		// Pad out 11 32-bit words (Root Delay through transmit timestamp)
+		len = 48;
+		// Transmit timestamp is filled in as each probe is sent, its fraction carrying the
+		// probe identifier since servers return it as the origin timestamp
+		udp_template_patch(t, UDP_PATCH_NTPTIME, 40, 8);
+		udp_template_patch(t, UDP_PATCH_ID, 44, 4);
+	}
+
+	return(len);
+}
+
+//
+// SNMPv1 (special 0) or SNMPv2c (special 1) get of sysDescr, or SNMPv3 engine discovery (special 2)
+//
+
+int udp_build_snmp(struct udp_template_struc *t, const char *hostname)
+{
+	char *txmessage = &t->payload[0];
+	// Use different community strings for SNMPv1 (index 0) and SNMPv2c (index 1)
+	char community[2][16] = { "public", "private" };
+	int rc = 0;
+	unsigned int i = 0;
+	int len = 0;
+	int retval = PORTUNKNOWN;
+
+	(void)hostname;
+
+	// Replies carry the SNMP version of the request
+	t->flags |= UDP_TEMPLATE_DISTINCT;
+
+	if (0 == t->special || 1 == t->special)
+	{
+		// SNMPv1 or SNMPv2c get
+		// Note this code will need amending if you modify the mib string and it includes IDs with values >=128
+		char mib[32] = {1,2,1,1,1,0}; // system.sysDescr.0 - System Description minus 1.3.6 prefix
+		unsigned int miblen = 6;
+
+		// SNMP packet start
+		txmessage[len++] = 0x30;
+		txmessage[len++] = (char)(29 + strlen(community[t->special]) + miblen);
+		// SNMP version 1
+		txmessage[len++] = 0x02; //int
+		txmessage[len++] = 0x01; //length of 1
+		txmessage[len++] = (t->special & 0xff); // 0 = SNMPv1, 1 = SNMPv2c
+		// Community name
+		txmessage[len++] = 0x04; //string
+		txmessage[len++] = (char)strlen(community[t->special]);
+		rc = snprintf(&txmessage[len], (size_t)(UDP_BUFFER_SIZE-len), "%s", community[t->special]);
+		if (rc < 0 || rc >= (UDP_BUFFER_SIZE-len))
+		{
+			IPSCAN_LOG( LOGPREFIX "udp_build_snmp: Bad snprintf() for SNMP, returned %d\n", rc);
+			retval = PORTINTERROR;
+		}
+		else
+		{
+			len += rc;
+		}
+
+		// MIB - check there's enough room before adding
+		if (PORTUNKNOWN == retval && (len < (int)(UDP_BUFFER_SIZE-24-miblen)) )
+		{
+			txmessage[len++] = 0xA0; // SNMP GET request
+			txmessage[len++] = (char)(22 + miblen); //0x1c
+
+			txmessage[len++] = 0x02; // Request ID
+			txmessage[len++] = 0x04; // 4 octets length
+			udp_template_patch(t, UDP_PATCH_ID, len, 4);
+			txmessage[len++] = 0x21; // "Random" value, refreshed for each probe
+			txmessage[len++] = 0x06;
+			txmessage[len++] = 0x01;
+			txmessage[len++] = 0x08;
+
+			// Error status (0=noError)
+			txmessage[len++] = 0x02; //int
+			txmessage[len++] = 0x01; //length of 1
+			txmessage[len++] = 0x00; // SNMP error status
+			// Error index (0)
+			txmessage[len++] = 0x02; //int
+			txmessage[len++] = 0x01; //length of 1
+			txmessage[len++] = 0x00; // SNMP error index
+			// Variable bindings
+			txmessage[len++] = 0x30; //var-bind sequence
+			txmessage[len++] = (char)(8 + miblen);
+
+			txmessage[len++] = 0x30; //var-bind
+			txmessage[len++] = (char)(miblen +6 );
+
+			txmessage[len++] = 0x06; // Object
+			txmessage[len++] = (char)(miblen + 2); // MIB length
+
+			txmessage[len++] = 0x2b;
+			txmessage[len++] = 0x06;
+			// Insert the OID
+			for (i = 0; i <miblen; i++)
+			{
+				txmessage[len++] = mib[i];
+			}
+			txmessage[len++] = 0x05; // Null object
+			txmessage[len++] = 0x00; // length of 0
+		}
+		else if (PORTUNKNOWN == retval && (len >= (int)(UDP_BUFFER_SIZE-24-miblen)))
+		{
+			IPSCAN_LOG( LOGPREFIX "udp_build_snmp: Insufficient room to add OID, len = %d\n", len);
+			retval = PORTINTERROR;
+		}
+	}
+	else if (2 == t->special)
+	{
+		// SNMPv3 engine discovery
+		txmessage[len++] = 0x30;
+		txmessage[len++] = 0x38;
+
+		// SNMP version 3
+		txmessage[len++] = 0x02; // int
+		txmessage[len++] = 0x01; // length of 1
+		txmessage[len++] = 0x03; // SNMP v3
+
+		// msgGlobalData
+		txmessage[len++] = 0x30;
+		txmessage[len++] = 0x0e;
+
+		txmessage[len++] = 0x02;
+		txmessage[len++] = 0x01;
+		udp_template_patch(t, UDP_PATCH_ID, len, 1);
+		txmessage[len++] = 0x02; // msgID (refreshed for each probe)
+
+		txmessage[len++] = 0x02; //
+		txmessage[len++] = 0x03; //
+		txmessage[len++] = 0x00; // Max message size (less than 64K)
+		txmessage[len++] = 0xff; //
+		txmessage[len++] = 0xe3; //
+
+		txmessage[len++] = 0x04;
+		txmessage[len++] = 0x01;
+		txmessage[len++] = 0x04; // flags (reportable, not encrypted, not authenticated)
+
+		txmessage[len++] = 0x02;
+		txmessage[len++] = 0x01;
+		txmessage[len++] = 0x03; // msgSecurityModel is USM (3)
+
+		// end of GlobalData
+
+		txmessage[len++] = 0x04;
+		txmessage[len++] = 0x10; //
+
+		txmessage[len++] = 0x30; //
+		txmessage[len++] = 0x0e; // length to end of this varbind
+
+		txmessage[len++] = 0x04; //
+		txmessage[len++] = 0x00; // EngineID
+
+		txmessage[len++] = 0x02;
+		txmessage[len++] = 0x01;
+		txmessage[len++] = 0x00; // EngineBoots
+
+		txmessage[len++] = 0x02;
+		txmessage[len++] = 0x01;
+		txmessage[len++] = 0x00; // EngineTime
+
+		txmessage[len++] = 0x04; // UserName
+		txmessage[len++] = 0x00;
+
+		txmessage[len++] = 0x04; // Authentication Parameters
+		txmessage[len++] = 0x00;
+
+		txmessage[len++] = 0x04; // Privacy Parameters
+		txmessage[len++] = 0x00;
+
+		// msgData
+		txmessage[len++] = 0x30; //
+		txmessage[len++] = 0x11; //
+
+		txmessage[len++] = 0x04; //  Context Engine ID (missing)
+		txmessage[len++] = 0x00; //
+
+		txmessage[len++] = 0x04; //  Context Name (missing)
+		txmessage[len++] = 0x00; //
+
+		txmessage[len++] = 0xa0; //  Get Request
+		txmessage[len++] = 0x0b; //
+
+		txmessage[len++] = 0x02; // Request ID (is 0x14, refreshed for each probe)
+		txmessage[len++] = 0x01; //
+		udp_template_patch(t, UDP_PATCH_ID, len, 1);
+		txmessage[len++] = 0x14; //
+
+		// Error status (0=noError)
+		txmessage[len++] = 0x02; //int
+		txmessage[len++] = 0x01; //length of 1
+		txmessage[len++] = 0x00; // SNMP error status
+		// Error index (0)
+		txmessage[len++] = 0x02; //int
+		txmessage[len++] = 0x01; //length of 1
+		txmessage[len++] = 0x00; // SNMP error index
+		// Variable bindings (none)
+		txmessage[len++] = 0x30; //var-bind sequence
+		txmessage[len++] = 0x00;
+
+		// End of msgData
+	}
+
+	if (PORTUNKNOWN != retval) return(-1);
+	return(len);
+}
+
+//
+// IKEv2 SA_INIT, for both IKE and NAT-T
+//
+
+int udp_build_ike(struct udp_template_struc *t, const char *hostname)
+{
+	char *txmessage = &t->payload[0];
+	int len = 0;
+
+	(void)hostname;
+
+	// ISAKMP
+	// Initiator cookie (8 bytes), the second half refreshed for each probe
+	udp_template_patch(t, UDP_PATCH_ID, 4, 4);
+	txmessage[len++] = 0xde;
+	txmessage[len++] = 0xad;
+	txmessage[len++] = 0xfa;
+	txmessage[len++] = 0xce;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 1;
+	// Responder cookie (8 bytes)
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	// Next payload 0=None, 2=proposal, 4=key exchange, 33=SA
+	txmessage[len++] = 33;
+	// Version Major/Minor 2.0
+	txmessage[len++] = 32;
+	// Exchange type 4=aggressive, 34=IKE_SA_INIT
+	txmessage[len++] = 34;
+	// Flags 8=initiator
+	txmessage[len++] = 8;
+
+	// Message ID (4 bytes)
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	// Length (4 bytes)
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0x01;
+	txmessage[len++] = 0x2c; // includes key exchange payload
+
+	// SA=33
+	// Next payload 0=None, 2=proposal, 4=key exchange, 33=SA, 34=KeyEx
+	txmessage[len++] = 34;
+	txmessage[len++] = 0; // Not critical
+	txmessage[len++] = 0; // Length 44
+	txmessage[len++] = 44;
+
+	txmessage[len++] = 0x00; // No next payload
+	txmessage[len++] = 0x00; // Not critical
+	txmessage[len++] = 0x00; // Length 40
+	txmessage[len++] = 0x28;
+	txmessage[len++] = 0x01; // Proposal 1
+	txmessage[len++] = 0x01; // IKE
+	txmessage[len++] = 0x00; // SPI size 0
+	txmessage[len++] = 0x04; // Number of transforms
+	txmessage[len++] = 0x03; // Payload type is transform
+	txmessage[len++] = 0x00; // Not critical
+	txmessage[len++] = 0x00; // Length 8
+	txmessage[len++] = 0x08;
+	txmessage[len++] = 0x01; // ENCRYPTION Algorithm
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00; // 3=3DES
+	txmessage[len++] = 0x03;
+	txmessage[len++] = 0x03; // Payload type is transform
+	txmessage[len++] = 0x00; // Not critical
+	txmessage[len++] = 0x00; // Length 8
+	txmessage[len++] = 0x08;
+	txmessage[len++] = 0x03; // INTEGRITY Algorithm
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00; // 2=AUTH_HMAC_SHA1_96
+	txmessage[len++] = 0x02;
+	txmessage[len++] = 0x03; // Payload type is transform
+	txmessage[len++] = 0x00; // Not critical
+	txmessage[len++] = 0x00; // Length 8
+	txmessage[len++] = 0x08;
+	txmessage[len++] = 0x02; // PRF Algorithm
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00; // 2=PRF_HMAC_SHA1
+	txmessage[len++] = 0x02;
+	txmessage[len++] = 0x00; // Next Payload type is NONE
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00; // Length 8
+	txmessage[len++] = 0x08;
+	txmessage[len++] = 0x04; // 4=Diffie-Hellman Group
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00; // 1024-bit MODP group
+	txmessage[len++] = 0x02;
+
+	// Key Exchange payload
+	//      		   	  1                   2                   3
+	//0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+	//+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//! Next Payload  !   RESERVED    !         Payload Length        !
+	//+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//!                                                               !
+	//~                       Key Exchange Data                       ~
+	//!                                                               !
+	//+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//
+
+	txmessage[len++] = 0x28; // Next Payload type is None (40)
+	txmessage[len++] = 0x00; // Not critical
+	txmessage[len++] = 0x00; // Length 136
+	txmessage[len++] = 0x88;
+	txmessage[len++] = 0x00; // DH group 1024-bit MODP (2)
+	txmessage[len++] = 0x02;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x2d; // Key Exchange data (128 octets)
+	txmessage[len++] = 0x54;
+	txmessage[len++] = 0x91;
+	txmessage[len++] = 0xfa;
+	txmessage[len++] = 0x0c;
+	txmessage[len++] = 0xd4;
+	txmessage[len++] = 0xd4;
+	txmessage[len++] = 0xcc;
+	txmessage[len++] = 0x77;
+	txmessage[len++] = 0xf8;
+	txmessage[len++] = 0xce;
+	txmessage[len++] = 0x08;
+	txmessage[len++] = 0x98;
+	txmessage[len++] = 0x45;
+	txmessage[len++] = 0x40;
+	txmessage[len++] = 0xb7;
+	txmessage[len++] = 0xc6;
+	txmessage[len++] = 0x8c;
+	txmessage[len++] = 0x08;
+	txmessage[len++] = 0x93;
+	txmessage[len++] = 0x2c;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0xf7;
+	txmessage[len++] = 0xc1;
+	txmessage[len++] = 0x5b;
+	txmessage[len++] = 0xf1;
+	txmessage[len++] = 0x04;
+	txmessage[len++] = 0xb0;
+	txmessage[len++] = 0x94;
+	txmessage[len++] = 0x02;
+	txmessage[len++] = 0x1a;
+	txmessage[len++] = 0xf9;
+	txmessage[len++] = 0x95;
+	txmessage[len++] = 0x29;
+	txmessage[len++] = 0x6c;
+	txmessage[len++] = 0x4a;
+	txmessage[len++] = 0x26;
+	txmessage[len++] = 0x12;
+	txmessage[len++] = 0x18;
+	txmessage[len++] = 0x75;
+	txmessage[len++] = 0x21;
+	txmessage[len++] = 0x0e;
+	txmessage[len++] = 0x02;
+	txmessage[len++] = 0x06;
+	txmessage[len++] = 0x11;
+	txmessage[len++] = 0x49;
+	txmessage[len++] = 0xc1;
+	txmessage[len++] = 0xa0;
+	txmessage[len++] = 0xc5;
+	txmessage[len++] = 0x82;
+	txmessage[len++] = 0xe1;
+	txmessage[len++] = 0x11;
+	txmessage[len++] = 0x30;
+	txmessage[len++] = 0xab;
+	txmessage[len++] = 0xc4;
+	txmessage[len++] = 0x31;
+	txmessage[len++] = 0xde;
+	txmessage[len++] = 0x49;
+	txmessage[len++] = 0x7d;
+	txmessage[len++] = 0xd3;
+	txmessage[len++] = 0xe6;
+	txmessage[len++] = 0xfb;
+	txmessage[len++] = 0x42;
+	txmessage[len++] = 0x08;
+	txmessage[len++] = 0xfd;
+	txmessage[len++] = 0x72;
+	txmessage[len++] = 0x74;
+	txmessage[len++] = 0xbf;
+	txmessage[len++] = 0x34;
+	txmessage[len++] = 0x60;
+	txmessage[len++] = 0xdc;
+	txmessage[len++] = 0x98;
+	txmessage[len++] = 0x97;
+	txmessage[len++] = 0xd3;
+	txmessage[len++] = 0xb5;
+	txmessage[len++] = 0x5b;
+	txmessage[len++] = 0x82;
+	txmessage[len++] = 0xec;
+	txmessage[len++] = 0x77;
+	txmessage[len++] = 0x0d;
+	txmessage[len++] = 0xae;
+	txmessage[len++] = 0xca;
+	txmessage[len++] = 0x39;
+	txmessage[len++] = 0xfd;
+	txmessage[len++] = 0x9a;
+	txmessage[len++] = 0x08;
+	txmessage[len++] = 0x8f;
+	txmessage[len++] = 0x5a;
+	txmessage[len++] = 0x73;
+	txmessage[len++] = 0xa1;
+	txmessage[len++] = 0xfd;
+	txmessage[len++] = 0x60;
+	txmessage[len++] = 0x98;
+	txmessage[len++] = 0xa8;
+	txmessage[len++] = 0xc8;
+	txmessage[len++] = 0xdf;
+	txmessage[len++] = 0x16;
+	txmessage[len++] = 0x3d;
+	txmessage[len++] = 0x55;
+	txmessage[len++] = 0xff;
+	txmessage[len++] = 0x6d;
+	txmessage[len++] = 0xe0;
+	txmessage[len++] = 0x94;
+	txmessage[len++] = 0xd7;
+	txmessage[len++] = 0x93;
+	txmessage[len++] = 0xa6;
+	txmessage[len++] = 0x82;
+	txmessage[len++] = 0x1f;
+	txmessage[len++] = 0xce;
+	txmessage[len++] = 0x07;
+	txmessage[len++] = 0x0a;
+	txmessage[len++] = 0x17;
+	txmessage[len++] = 0xf4;
+	txmessage[len++] = 0x87;
+	txmessage[len++] = 0x0b;
+	txmessage[len++] = 0xc7;
+	txmessage[len++] = 0x90;
+	txmessage[len++] = 0xa2;
+	txmessage[len++] = 0x47;
+	txmessage[len++] = 0x51;
+	txmessage[len++] = 0xca;
+	txmessage[len++] = 0x2c;
+	txmessage[len++] = 0xe8;
+	txmessage[len++] = 0x33;
+	txmessage[len++] = 0x3a;
+	txmessage[len++] = 0x4d;
+	txmessage[len++] = 0x5f;
+	txmessage[len++] = 0xae;
+
+	// Payload is Nonce
+	txmessage[len++] = 0x29; // Next payload is Notify (41)
+	txmessage[len++] = 0x00; // Not critical
+	txmessage[len++] = 0x00; // Length 36
+	txmessage[len++] = 0x24; // Nonce data
+	txmessage[len++] = 0xfb;
+	txmessage[len++] = 0xe5;
+	txmessage[len++] = 0x90;
+	txmessage[len++] = 0x3f;
+	txmessage[len++] = 0xc9;
+	txmessage[len++] = 0xdf;
+	txmessage[len++] = 0x47;
+	txmessage[len++] = 0x09;
+	txmessage[len++] = 0xe5;
+	txmessage[len++] = 0xd4;
+	txmessage[len++] = 0xab;
+	txmessage[len++] = 0x0a;
+	txmessage[len++] = 0xa6;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0xb3;
+	txmessage[len++] = 0xbe;
+	txmessage[len++] = 0x36;
+	txmessage[len++] = 0xeb;
+	txmessage[len++] = 0x35;
+	txmessage[len++] = 0xa6;
+	txmessage[len++] = 0xf5;
+	txmessage[len++] = 0x54;
+	txmessage[len++] = 0x47;
+	txmessage[len++] = 0xfe;
+	txmessage[len++] = 0xda;
+	txmessage[len++] = 0xb9;
+	txmessage[len++] = 0x0d;
+	txmessage[len++] = 0x67;
+	txmessage[len++] = 0x66;
+	txmessage[len++] = 0x9f;
+	txmessage[len++] = 0xab;
+	txmessage[len++] = 0x96;
+
+	// Payload is Notify
+	txmessage[len++] = 0x29; // Next payload is also notify
+	txmessage[len++] = 0x00; // Not critical
+	txmessage[len++] = 0x00; // Length 28
+	txmessage[len++] = 0x1c;
+	txmessage[len++] = 0x00; // Protocol ID is RESERVED (0)
+	txmessage[len++] = 0x00; // SPI size is 0
+	txmessage[len++] = 0x40; // NAT_DETECTION_SOURCE_IP (16388)
+	txmessage[len++] = 0x04;
+	// data is SHA1(SPIs, source IP address, source port)
+	// however, we're just looking for a response, not a valid
+	// packet
+	txmessage[len++] = 0xc6; // Notification data
+	txmessage[len++] = 0x93;
+	txmessage[len++] = 0x14;
+	txmessage[len++] = 0x61;
+	txmessage[len++] = 0x31;
+	txmessage[len++] = 0xa7;
+	txmessage[len++] = 0x7f;
+	txmessage[len++] = 0xe9;
+	txmessage[len++] = 0x93;
+	txmessage[len++] = 0x47;
+	txmessage[len++] = 0x26;
+	txmessage[len++] = 0xe5;
+	txmessage[len++] = 0x23;
+	txmessage[len++] = 0x17;
+	txmessage[len++] = 0xd4;
+	txmessage[len++] = 0xec;
+	txmessage[len++] = 0x5f;
+	txmessage[len++] = 0x64;
+	txmessage[len++] = 0x45;
+	txmessage[len++] = 0xf1;
+
+	// Payload is Notify
+	txmessage[len++] = 0x00; // Next payload is NONE
+	txmessage[len++] = 0x00; // Not critical
+	txmessage[len++] = 0x00; // :ength 28
+	txmessage[len++] = 0x1c;
+	txmessage[len++] = 0x00; // Protocol ID is RESERVED(0)
+	txmessage[len++] = 0x00; // SPI size = 0
+	txmessage[len++] = 0x40; // NAT_DETECTION_DESTIANTION_IP (16389)
+	txmessage[len++] = 0x05;
+	// data is SHA1(SPIs, source IP address, source port)
+	// however, we're just looking for a response, not a valid
+	// packet
+	txmessage[len++] = 0xf9; // Notification data
+	txmessage[len++] = 0x33;
+	txmessage[len++] = 0xa1;
+	txmessage[len++] = 0x9a;
+	txmessage[len++] = 0x65;
+	txmessage[len++] = 0x1a;
+	txmessage[len++] = 0xc3;
+	txmessage[len++] = 0x73;
+	txmessage[len++] = 0x8b;
+	txmessage[len++] = 0xb7;
+	txmessage[len++] = 0xf6;
+	txmessage[len++] = 0x04;
+	txmessage[len++] = 0x43;
+	txmessage[len++] = 0x6f;
+	txmessage[len++] = 0x80;
+	txmessage[len++] = 0x12;
+	txmessage[len++] = 0x69;
+	txmessage[len++] = 0x3e;
+	txmessage[len++] = 0x6a;
+	txmessage[len++] = 0x2a;
+
+	return(len);
+}
+
+//
+// RIPng request for the whole routing table
+//
+
+int udp_build_ripng(struct udp_template_struc *t, const char *hostname)
+{
+	char *txmessage = &t->payload[0];
+	int len = 0;
+
+	(void)hostname;
+
+	txmessage[len++] = 0x01; // Command is REQUEST
+	txmessage[len++] = 0x01; // Version 1
+	txmessage[len++] = 0x00; // Reserved
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00; // ::
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00; // Route Tag
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00; // Prefix length
+	txmessage[len++] = 0x10; // Metric
+
+	return(len);
+}
+
+//
+// DHCPv6 Solicit
+//
+
+int udp_build_dhcpv6(struct udp_template_struc *t, const char *hostname)
+{
+	char *txmessage = &t->payload[0];
+	int len = 0;
+
+	(void)hostname;
+
+	// DHCPv6 defined in https://tools.ietf.org/html/rfc3315
+	//       0                   1                   2                   3
+	//       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      |    msg-type   |               transaction-id                  |
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      |                                                               |
+	//      .                            options                            .
+	//      .                           (variable)                          .
+	//      |                                                               |
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//
+	txmessage[len++] = 0x01; // msg-type = 0x01 (Solicit)
+	udp_template_patch(t, UDP_PATCH_ID, len, 3);
+	txmessage[len++] = 0xde; // transaction-id (refreshed for each probe)
+	txmessage[len++] = 0xad;
+	txmessage[len++] = 0xfa;
+
+	//       0                   1                   2                   3
+	//       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      |        OPTION_CLIENTID        |          option-len           |
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      .                                                               .
+	//      .                              DUID                             .
+	//      .                        (variable length)                      .
+	//      .                                                               .
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+
+	txmessage[len++] = 0x00; // Option 1 is Client Identifier
+	txmessage[len++] = 0x01;
+
+	txmessage[len++] = 0x00; // Length field
+	txmessage[len++] = 0x0e;
+
+
+	// The following diagram illustrates the format of a DUID-LLT:
+	//
+	//     0                   1                   2                   3
+	//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//    |               1               |    hardware type (16 bits)    |
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//    |                        time (32 bits)                         |
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//    .                                                               .
+	//    .             link-layer address (variable length)              .
+	//    .                                                               .
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//
+
+	txmessage[len++] = 0x00; // DUID-LLT
+	txmessage[len++] = 0x01;
+
+	txmessage[len++] = 0x00; // Hardware type: Ethernet
+	txmessage[len++] = 0x01;
+
+	txmessage[len++] = 0x00; // Time
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x01;
+
+	// The local MAC address is copied in as the Link-layer address as each probe is sent
+	udp_template_patch(t, UDP_PATCH_MAC, len, 6);
+	len += 6;
+
+	//  0                   1                   2                   3
+	//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//    |     OPTION_RECONF_ACCEPT      |               0               |
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//
+	//      option-code   OPTION_RECONF_ACCEPT (20).
+	//
+	//      option-len    0.
+	//
+
+	txmessage[len++] = 0x00; // Reconfigure Accept option
+	txmessage[len++] = 0x14;
+
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+
+	// The format of the IA_NA option is:
+	//
+	//       0                   1                   2                   3
+	//       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      |          OPTION_IA_NA         |          option-len           |
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      |                        IAID (4 octets)                        |
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      |                              T1                               |
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      |                              T2                               |
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      |                                                               |
+	//      .                         IA_NA-options                         .
+	//      .                                                               .
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//
+	//      option-code          OPTION_IA_NA (3).
+	//
+	//      option-len           12 + length of IA_NA-options field.
+	//
+	//      IAID                 The unique identifier for this IA_NA; the
+	//                           IAID must be unique among the identifiers for
+	//                           all of this client's IA_NAs.  The number
+	//                           space for IA_NA IAIDs is separate from the
+	//                           number space for IA_TA IAIDs.
+	//
+	//      T1                   The time at which the client contacts the
+	//                           server from which the addresses in the IA_NA
+	//                           were obtained to extend the lifetimes of the
+	//                           addresses assigned to the IA_NA; T1 is a
+	//                           time duration relative to the current time
+	//                           expressed in units of seconds.
+	//
+	//      T2                   The time at which the client contacts any
+	//                           available server to extend the lifetimes of
+	//                           the addresses assigned to the IA_NA; T2 is a
+	//                           time duration relative to the current time
+	//                           expressed in units of seconds.
+	//
+	//      IA_NA-options        Options associated with this IA_NA.
+
+	txmessage[len++] = 0x00; // Identity Association for Non-temporary Address (IA_NA) option
+	txmessage[len++] = 0x03;
+
+	txmessage[len++] = 0x00; // Length (options length = 0)
+	txmessage[len++] = 0x0c;
+
+	txmessage[len++] = 0x00; // IAID
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+
+	txmessage[len++] = 0x00; // T1
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+
+	txmessage[len++] = 0x00; // T2
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+
+	//       0                   1                   2                   3
+	//       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      |      OPTION_ELAPSED_TIME      |           option-len          |
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      |          elapsed-time         |
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//
+	//      option-code   OPTION_ELAPSED_TIME (8).
+	//
+	//      option-len    2.
+	//
+	//      elapsed-time  The amount of time since the client began its
+	//                    current DHCP transaction.  This time is expressed in
+	//                    hundredths of a second (10^-2 seconds).
+
+
+	txmessage[len++] = 0x00; // Elapsed Time Option
+	txmessage[len++] = 0x08;
+
+	txmessage[len++] = 0x00; // Length
+	txmessage[len++] = 0x02;
+
+	txmessage[len++] = 0x00; // We just started ..
+	txmessage[len++] = 0x00;
+
+	//   The Option Request option is used to identify a list of options in a
+	//   message between a client and a server.  The format of the Option
+	//   Request option is:
+	//
+	//       0                   1                   2                   3
+	//       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      |           OPTION_ORO          |           option-len          |
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      |    requested-option-code-1    |    requested-option-code-2    |
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      |                              ...                              |
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//
+	//      option-code   OPTION_ORO (6).
+	//
+	//      option-len    2 * number of requested options.
+	//
+	//      requested-option-code-n The option code for an option requested by
+	//      the client.
+
+	txmessage[len++] = 0x00; // Option Request Option Option
+	txmessage[len++] = 0x06;
+
+	txmessage[len++] = 0x00; // Option length
+	txmessage[len++] = 0x04;
+
+	txmessage[len++] = 0x00; // Recursive DNS server
+	txmessage[len++] = 0x17;
+
+	txmessage[len++] = 0x00; // Domain Search List
+	txmessage[len++] = 0x18;
+
+	// From RFC 3633
+	// The IA_PD option is used to carry a prefix delegation identity
+	//   association, the parameters associated with the IA_PD and the
+	//   prefixes associated with it.
+	//
+	//   The format of the IA_PD option is:
+	//
+	//     0                   1                   2                   3
+	//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//    |         OPTION_IA_PD          |         option-length         |
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//    |                         IAID (4 octets)                       |
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//    |                              T1                               |
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//    |                              T2                               |
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//    .                                                               .
+	//    .                          IA_PD-options                        .
+	//    .                                                               .
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//
+	//   option-code:      OPTION_IA_PD (25)
+	//
+	//   option-length:    12 + length of IA_PD-options field.
+	//
+	//   IAID:             The unique identifier for this IA_PD; the IAID must
+	//                     be unique among the identifiers for all of this
+	//                     requesting router's IA_PDs.
+	//
+	//   T1:               The time at which the requesting router should
+	//                     contact the delegating router from which the
+	//                     prefixes in the IA_PD were obtained to extend the
+	//                     lifetimes of the prefixes delegated to the IA_PD;
+	//                     T1 is a time duration relative to the current time
+	//                     expressed in units of seconds.
+	//
+	//   T2:               The time at which the requesting router should
+	//                     contact any available delegating router to extend
+	//                     the lifetimes of the prefixes assigned to the
+	//                     IA_PD; T2 is a time duration relative to the
+	//                     current time expressed in units of seconds.
+	//
+	//   IA_PD-options:    Options associated with this IA_PD.
+
+	txmessage[len++] = 0x00; // IA_PD Option
+	txmessage[len++] = 0x19;
+
+	txmessage[len++] = 0x00; // Length
+	txmessage[len++] = 0x29;
+
+	txmessage[len++] = 0x00; // IAID
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+
+	txmessage[len++] = 0x00; // T1
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+
+	txmessage[len++] = 0x00; // T2
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+
+	//   The IA_PD Prefix option is used to specify IPv6 address prefixes
+	//   associated with an IA_PD.  The IA_PD Prefix option must be
+	//   encapsulated in the IA_PD-options field of an IA_PD option.
+	//
+	//   The format of the IA_PD Prefix option is:
+	//
+	//     0                   1                   2                   3
+	//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//    |        OPTION_IAPREFIX        |         option-length         |
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//    |                      preferred-lifetime                       |
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//    |                        valid-lifetime                         |
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//    | prefix-length |                                               |
+	//    +-+-+-+-+-+-+-+-+          IPv6 prefix                          |
+	//    |                           (16 octets)                         |
+	//    |                                                               |
+	//    |                                                               |
+	//    |                                                               |
+	//    |               +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//    |               |                                               .
+	//    +-+-+-+-+-+-+-+-+                                               .
+	//    .                       IAprefix-options                        .
+	//    .                                                               .
+	//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//
+	//   option-code:      OPTION_IAPREFIX (26)
+	//
+	//   option-length:    25 + length of IAprefix-options field
+	//
+	//   preferred-lifetime: The recommended preferred lifetime for the IPv6
+	//                     prefix in the option, expressed in units of
+	//                     seconds.  A value of 0xFFFFFFFF represents
+	//                     infinity.
+	//
+	//   valid-lifetime:   The valid lifetime for the IPv6 prefix in the
+	//                     option, expressed in units of seconds.  A value of
+	//                     0xFFFFFFFF represents infinity.
+	//
+	//   prefix-length:    Length for this prefix in bits
+	//
+	//   IPv6-prefix:      An IPv6 prefix
+	//
+	//   IAprefix-options: Options associated with this prefix
+
+	txmessage[len++] = 0x00; // IA Prefix option
+	txmessage[len++] = 0x1a;
+
+	txmessage[len++] = 0x00; // Length (no additional options)
+	txmessage[len++] = 0x19;
+
+	txmessage[len++] = 0x00; // Preferred lifetime - 21600 seconds (6 hours)
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x54;
+	txmessage[len++] = 0x60;
+
+	txmessage[len++] = 0x00; // Valid lifetime - 86400 seconds (24 hours)
+	txmessage[len++] = 0x01;
+	txmessage[len++] = 0x51;
+	txmessage[len++] = 0x80;
+
+	txmessage[len++] = 0x40; // 64-bit prefix length
+
+	txmessage[len++] = 0x00; // Prefix ::
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+	txmessage[len++] = 0x00;
+
+	return(len);
+}
+
+//
+// UPnP SSDP M-SEARCH
+//
+
+int udp_build_ssdp(struct udp_template_struc *t, const char *hostname)
+{
+	char *txmessage = &t->payload[0];
+	int len = 0;
+	int retval = PORTUNKNOWN;
+
+	// UPnP
+	// taken from http://upnp.org/specs/arch/UPnP-arch-DeviceArchitecture-v1.1.pdf
+	//
+	len = snprintf(&txmessage[0], UDP_BUFFER_SIZE, \
+			"M-SEARCH * HTTP/1.1\r\nHost:[%s]:1900\r\nMan: \"ssdp:discover\"\r\nMX:%d\r\nST: \"ssdp:all\"\r\nUSER-AGENT: linux/2.6 UPnP/1.1 TimsTester/1.0\r\n\r\n", hostname, SSDP_MX_SECS);
+	if (len < 0 || len >= UDP_BUFFER_SIZE)
+	{
+		IPSCAN_LOG( LOGPREFIX "udp_build_ssdp: Bad snprintf() for UPnP, returned %d\n", len);
+		len = 0;
+		retval = PORTINTERROR;
+	}
+
+	if (PORTUNKNOWN != retval) return(-1);
+	return(len);
+}
+
+//
+// MPLS LSP Ping echo request
+//
+
+int udp_build_lspping(struct udp_template_struc *t, const char *hostname)
+{
+	char *txmessage = &t->payload[0];
+	int len = 0;
+
+	(void)hostname;
+
+	// Taken from RFC4379
+	//
+	//             0                   1                   2                   3
+	//		       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+	//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//		      |         Version Number        |         Global Flags          |
+	//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//		      |  Message Type |   Reply mode  |  Return Code  | Return Subcode|
+	//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//		      |                        Sender's Handle                        |
+	//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//		      |                        Sequence Number                        |
+	//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//		      |                    TimeStamp Sent (seconds)                   |
+	//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//		      |                  TimeStamp Sent (microseconds)                |
+	//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//		      |                  TimeStamp Received (seconds)                 |
+	//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//		      |                TimeStamp Received (microseconds)              |
+	//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//		      |                            TLVs ...                           |
+	//		      .                                                               .
+	//		      .                                                               .
+	//		      .                                                               .
+	//		      |                                                               |
+	//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	// Version
+	txmessage[len++] = 0;
+	txmessage[len++] = 1; // Version 1
+	// Global flags
+	txmessage[len++] = 0;
+	txmessage[len++] = 1; // Global Flags 1=Validate FEC Stack
+	// Message type
+	txmessage[len++] = 1; // Message type 1=echo request
+	// Reply mode
+	txmessage[len++] = 2; // Reply Mode (1=don't;2=ip udp;3=ip udp + router alert; 4 = app level control channel)
+	// Return code
+	txmessage[len++] = 0; // Filled in by responder
+	// Return subcode
+	txmessage[len++] = 0; // Filled in by responder
+	// Sender's Handle (refreshed for each probe)
+	udp_template_patch(t, UDP_PATCH_ID, len, 4);
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	// Sequence Number
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 1;
+	// Timestamp sent (seconds and microseconds, in NTP format) - filled in as each probe is sent
+	udp_template_patch(t, UDP_PATCH_NTPTIME, len, 8);
+	len += 8;
+	// Timestamp received (seconds)
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	// Timestamp received (microseconds)
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+	//
+	// TLVs
+	//
+	//			TLVs (Type-Length-Value tuples) have the following format:
+	//
+	//			       0                   1                   2                   3
+	//			       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+	//			      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//			      |             Type              |            Length             |
+	//			      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//			      |                             Value                             |
+	//			      .                                                               .
+	//			      .                                                               .
+	//			      .                                                               .
+	//			      |                                                               |
+	//			      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//
+	//			   Types are defined below; Length is the length of the Value field in
+	//			   octets.  The Value field depends on the Type; it is zero padded to
+	//			   align to a 4-octet boundary.  TLVs may be nested within other TLVs,
+	//			   in which case the nested TLVs are called sub-TLVs.  Sub-TLVs have
+	//			   independent types and MUST also be 4-octet aligned.
+	//
+	//			   A description of the Types and Values of the top-level TLVs for LSP
+	//			   ping are given below:
+	//
+	//			          Type #                  Value Field
+	//			          ------                  -----------
+	//			               1                  Target FEC Stack
+	//			               2                  Downstream Mapping
+	//			               3                  Pad
+	//			               4                  Not Assigned
+	//			               5                  Vendor Enterprise Number
+	//			               6                  Not Assigned
+	//			               7                  Interface and Label Stack
+	//			               8                  Not Assigned
+	//			               9                  Errored TLVs
+	//			              10                  Reply TOS Byte
+	//
+	// Always include a FEC TLV
+	txmessage[len++] = 0;
+	txmessage[len++] = 1; // Target FEC Stack (from types listed above)
+	txmessage[len++] = 0;
+	txmessage[len++] = 24; // length of LDP IPv6 prefix that follows
+	//
+	// A Target FEC Stack is a list of sub-TLVs.  The number of elements is
+	//   determined by looking at the sub-TLV length fields.
+	//
+	//    Sub-Type       Length            Value Field
+	//    --------       ------            -----------
+	//           1            5            LDP IPv4 prefix
+	//           2           17            LDP IPv6 prefix
+	//           3           20            RSVP IPv4 LSP
+	//           4           56            RSVP IPv6 LSP
+	//           5                         Not Assigned
+	//           6           13            VPN IPv4 prefix
+	//           7           25            VPN IPv6 prefix
+	//           8           14            L2 VPN endpoint
+	//           9           10            "FEC 128" Pseudowire (deprecated)
+	//          10           14            "FEC 128" Pseudowire
+	//          11          16+            "FEC 129" Pseudowire
+	//          12            5            BGP labeled IPv4 prefix
+	//
+	txmessage[len++] = 0;
+	txmessage[len++] = 2; // Sub-type LDP IPv6 prefix
+	txmessage[len++] = 0;
+	txmessage[len++] = 17; // LDP IPv6 prefix TLV length as listed above
+	//
+	//			The Label Distribution Protocol (LDP) IPv6 FEC
+	//			sub-TLV has the following format:
+	//
+	//       0                   1                   2                   3
+	//       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      |                          IPv6 prefix                          |
+	//      |                          (16 octets)                          |
+	//      |                                                               |
+	//      |                                                               |
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//      | Prefix Length |         Must Be Zero                          |
+	//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+	//
+	//
+	// the server's local address is copied into the FEC entry as each probe is sent
+	udp_template_patch(t, UDP_PATCH_LOCALADDR, len, 16);
+	len += 16;
+	txmessage[len++] = 128; // single host is /128
+	txmessage[len++] = 0;   // 0-padding
+	txmessage[len++] = 0;
+	txmessage[len++] = 0;
+
+	return(len);
+}
+
+//
+// memcache version request, ASCII (special 0) or binary (special 1)
+//
+
+int udp_build_memcache(struct udp_template_struc *t, const char *hostname)
+{
+	char *txmessage = &t->payload[0];
+	int rc = 0;
+	int len = 0;
+	int retval = PORTUNKNOWN;
+
+	(void)hostname;
+
+	// Replies echo the frame header's request ID, refreshed for each probe
+	t->flags |= UDP_TEMPLATE_DISTINCT;
+	udp_template_patch(t, UDP_PATCH_ID, 0, 2);
+	if (0 == t->special)
+	{
+		// ASCII mode
+		// The frame header is 8 bytes long, as follows (all values are 16-bit integers
+		// in network byte order, high byte first):
+		//
+		// 0-1 Request ID
+		// 2-3 Sequence number
+		// 4-5 Total number of datagrams in this message
+		// 6-7 Reserved for future use; must be 0
+		// <cmd>\r\n
+
+		txmessage[len++] = 0x00; // Request ID
+		txmessage[len++] = 0x01;
+		txmessage[len++] = 0x00; // Sequence ID
+		txmessage[len++] = 0x00;
+		txmessage[len++] = 0x00; // Number of datagrams
+		txmessage[len++] = 0x01;
+		txmessage[len++] = 0x00; // Reserved for future use
+		txmessage[len++] = 0x00;
+
+		char mccmd[] = "version";
+
+		rc = snprintf(&txmessage[len], (size_t)(UDP_BUFFER_SIZE-len), "%s\r\n", mccmd);
+		if (rc < 0 || rc >= ( UDP_BUFFER_SIZE-len ))
+		{
+			IPSCAN_LOG( LOGPREFIX "udp_build_memcache: Bad snprintf() for memcache command, returned %d\n", rc);
+			retval = PORTINTERROR;
+		}
+		else
+		{
+			len += rc;
+		}
+	}
+	else
+	{
+		txmessage[len++] = 0x00; // Request ID
+		txmessage[len++] = 0x01;
+		txmessage[len++] = 0x00; // Sequence ID
+		txmessage[len++] = 0x00;
+		txmessage[len++] = 0x00; // Number of datagrams
+		txmessage[len++] = 0x01;
+		txmessage[len++] = 0x00; // Reserved for future use
+		txmessage[len++] = 0x00;
+		// Binary mode
+		// https://github.com/couchbase/memcached/blob/master/docs/BinaryProtocol.md#0x0b-version
+		//
+		//  Byte/     0       |       1       |       2       |       3       |
+		//     /              |               |               |               |
+		//    |0 1 2 3 4 5 6 7|0 1 2 3 4 5 6 7|0 1 2 3 4 5 6 7|0 1 2 3 4 5 6 7|
+		//    +---------------+---------------+---------------+---------------+
+		//   0| 0x80          | 0x0b          | 0x00          | 0x00          |
+		//    +---------------+---------------+---------------+---------------+
+		//   4| 0x00          | 0x00          | 0x00          | 0x00          |
+		//    +---------------+---------------+---------------+---------------+
+		//   8| 0x00          | 0x00          | 0x00          | 0x00          |
+		//    +---------------+---------------+---------------+---------------+
+		//  12| 0x00          | 0x00          | 0x00          | 0x00          |
+		//    +---------------+---------------+---------------+---------------+
+		//  16| 0x00          | 0x00          | 0x00          | 0x00          |
+		//    +---------------+---------------+---------------+---------------+
+		//  20| 0x00          | 0x00          | 0x00          | 0x00          |
+		//    +---------------+---------------+---------------+---------------+
+		//
+		txmessage[len++] = 0x80; //	request
+		txmessage[len++] = 0x0b; //	opcode - Version
+		txmessage[len++] = 0; //	keylength
+		txmessage[len++] = 0; //	keylength
+		txmessage[len++] = 0; //	extras length -must be 0, else "multipart not supported"
+		txmessage[len++] = 1; //	data type    - must be 1, else "multipart not supported"
+		txmessage[len++] = 0; //	reserved
+		txmessage[len++] = 0; //	reserved
+		txmessage[len++] = 0; //	total body length
+		txmessage[len++] = 0; //	total body length
+		txmessage[len++] = 0; //	total body length
+		txmessage[len++] = 0; //	total body length
+		udp_template_patch(t, UDP_PATCH_ID, len, 4);
+		txmessage[len++] = 0x21; //	opaque (refreshed for each probe)
+		txmessage[len++] = 0x03; //	opaque
+		txmessage[len++] = 0x14; //	opaque
+		txmessage[len++] = 0x08; //	opaque
+		txmessage[len++] = 0; //	cas
+		txmessage[len++] = 0; //	cas
+		txmessage[len++] = 0; //	cas
+		txmessage[len++] = 0; //	cas
+		txmessage[len++] = 0; //	cas
+		txmessage[len++] = 0; //	cas
+		txmessage[len++] = 0; //	cas
+		txmessage[len++] = 0; //	cas
+	}
+
+	if (PORTUNKNOWN != retval) return(-1);
+	return(len);
+}
+
+//
+// Unspecified message, for any port without a probe of its own
+//
+
+int udp_build_unspecified(struct udp_template_struc *t, const char *hostname)
+{
+	char *txmessage = &t->payload[0];
+	int rc = 0;
+	int len = 0;
+	int retval = PORTUNKNOWN;
+
+	(void)hostname;
+
+	// Unhandled port
+	IPSCAN_LOG( LOGPREFIX "udp_build_unspecified: generating an unspecified message for UDP port %d\n", t->port);
+	// Generate an unspecified message
+	txmessage[len++] = 0x0A;
+	txmessage[len++] = 0x0A;
+	txmessage[len++] = 0x0D;
+	txmessage[len++] = 0x0;
+	rc = snprintf(&txmessage[len], (size_t)(UDP_BUFFER_SIZE-len), "IPscan (c) 2011-2021 Tim Chappell. This message is destined for UDP port %d\n", t->port);
+	if (rc < 0 || rc >= (UDP_BUFFER_SIZE-len))
+	{
+		IPSCAN_LOG( LOGPREFIX "udp_build_unspecified: Bad snprintf() for unhandled port, returned %d\n", rc);
+		retval = PORTINTERROR;
+	}
+	else
+	{
+		len += rc;
+	}
+
+	if (PORTUNKNOWN != retval) return(-1);
+	return(len);
+}
+
+//
+// Find the registered probe for the given port and special case test, or NULL if there is none
+//
+
+const struct udp_probedesc_struc * udp_probe_find(uint16_t port, uint8_t special)
+{
+	unsigned int i;
+
+	for (i = 0; i < numudpprobes; i++)
+	{
+		if (port == udpprobes[i].port && special == udpprobes[i].special) return(&udpprobes[i]);
+	}
+	return(NULL);
+}
+
+//
+// Build the payload for the given port and special case test with its registered builder,
+// recording how long that took. Returns 0 on success or -1 on error.
+//
+
+int udp_template_build(struct udp_template_struc *t, uint16_t port, uint8_t special, const char *hostname)
+{
+	struct timespec start, end;
+	int len;
+
+	// Prefill the payload with 0s
+	memset(t, 0, sizeof(struct udp_template_struc));
+	t->port = port;
+	t->special = special;
+	t->probe = udp_probe_find(port, special);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	len = (NULL != t->probe) ? t->probe->build(t, hostname) : udp_build_unspecified(t, hostname);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	t->buildnsecs = (uint32_t)(((uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL) + (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec);
+	if (0 > len) return(-1);
+	t->len = len;
+	return(0);
+}
+
+//
+// Find the template for the given port and special case test, building it if required
+//
+
+const struct udp_template_struc * udp_template_get(uint16_t port, uint8_t special, const char *hostname)
+{
+	struct udp_template_struc *t;
+	unsigned int i;
+
+	for (i = 0; i < numudptemplates; i++)
+	{
+		if (port == udptemplates[i].port && special == udptemplates[i].special) return(&udptemplates[i]);
+	}
+
+	t = (UDP_MAXTEMPLATES > numudptemplates) ? &udptemplates[numudptemplates] : &udptemplate_scratch;
+	if (0 != udp_template_build(t, port, special, hostname))
+	{
+		IPSCAN_LOG( LOGPREFIX "udp_template_get: failed to build payload for port %d:%d\n", port, special);
+		return(NULL);
+	}
+	if (t != &udptemplate_scratch) numudptemplates++;
+	return(t);
+}
+
+//
+// Build the templates for every UDP port to be scanned - call before forking the UDP children
+// so that they inherit the finished table. Returns the number of payloads which failed to build.
+//
+
+int udp_templates_init(const char *hostname, unsigned int numudpports, struct portlist_struc *udpportlist)
+{
+	unsigned int i;
+	int failures = 0;
+
+	for (i = 0; i < numudpports; i++)
+	{
+		if (NULL == udp_template_get(udpportlist[i].port_num, udpportlist[i].special, hostname)) failures++;
+	}
+	return(failures);
+}
+
+//
+// Order a list of UDP tests for scanning - those whose services may take longest to answer first,
+// so that their wait overlaps the rest, and otherwise the cheapest to build first. A stable
+// insertion sort, since the list is short and already mostly in order.
+//
+
+void udp_probes_order(struct portlist_struc *list, unsigned int num, const char *hostname)
+{
+	struct portlist_struc entry;
+	const struct udp_template_struc *a, *b;
+	uint64_t hinta, hintb;
+	unsigned int i, j;
+
+	for (i = 1; i < num; i++)
+	{
+		memcpy(&entry, &list[i], sizeof(entry));
+		a = udp_template_get(entry.port_num, entry.special, hostname);
+		hinta = (NULL != a && NULL != a->probe) ? a->probe->timeouthint : 0;
+
+		for (j = i; j > 0; j--)
+		{
+			b = udp_template_get(list[j-1].port_num, list[j-1].special, hostname);
+			hintb = (NULL != b && NULL != b->probe) ? b->probe->timeouthint : 0;
+			if (NULL == a || NULL == b || hintb > hinta) break;
+			if (hintb == hinta && b->buildnsecs <= a->buildnsecs) break;
+			memcpy(&list[j], &list[j-1], sizeof(entry));
+		}
+		memcpy(&list[j], &entry, sizeof(entry));
+	}
+}
+
+//
+// A fresh identifier for each probe, started from a per-process value so that concurrent children differ
+//
+
+uint32_t udp_next_probeid(void)
+{
+	if (0 == udp_probeid)
+	{
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		udp_probeid = ((uint32_t)getpid() << 16) ^ (uint32_t)tv.tv_usec;
+	}
+	udp_probeid++;
+	return(udp_probeid);
+}
+
+//
+// Copy a template into the transmit buffer, filling in its per-probe fields, and return its length
+//
+
+int udp_payload_fill(const struct udp_template_struc *t, char *txmessage, uint32_t probeid)
+{
+	unsigned int i, j;
+
+	memcpy(txmessage, &t->payload[0], (size_t)t->len);
+
+	for (i = 0; i < t->numpatches; i++)
+	{
+		char *field = &txmessage[t->patch[i].offset];
+
+		switch (t->patch[i].type)
+		{
+		case UDP_PATCH_ID:
+		{
+			// Big-endian, and kept positive since SNMP request IDs are signed
+			for (j = 0; j < t->patch[i].len; j++)
+			{
+				field[j] = (char)((probeid >> (8 * (t->patch[i].len - 1 - j))) & 0xff);
+			}
+			field[0] = (char)(field[0] & 0x7f);
+			break;
+		}
+
+		case UDP_PATCH_NTPTIME:
+		{
+			// Capture time of day and convert to NTP format
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			const unsigned long long EPOCH = 2208988800ULL;
+			const unsigned long long NTP_SCALE_FRAC = 4294967296ULL;
+			long long unsigned int tv_secs  = (long long unsigned int)(tv.tv_sec) + EPOCH;
+			long long unsigned int tv_usecs = ((NTP_SCALE_FRAC * (long long unsigned int)tv.tv_usec) / 1000000UL);
+
+			field[0] = (char)((tv_secs >> 24) & 0xff);
+			field[1] = (char)((tv_secs >> 16) & 0xff);
+			field[2] = (char)((tv_secs >>  8) & 0xff);
+			field[3] = (char)(tv_secs         & 0xff);
+			field[4] = (char)((tv_usecs >> 24) & 0xff);
+			field[5] = (char)((tv_usecs >> 16) & 0xff);
+			field[6] = (char)((tv_usecs >>  8) & 0xff);
+			field[7] = (char)(tv_usecs         & 0xff);
+			break;
+		}
+
+		case UDP_PATCH_MAC:
+		{
+			// Fill in a default MAC in case the interface's MAC is unknown
+			unsigned char localmacaddr[6] = { 0, 0, 0, 0, 0, 0x01 };
+			iface_lookup(NULL, &localmacaddr[0]);
+			memcpy(field, &localmacaddr[0], sizeof(localmacaddr));
+			break;
+		}
+
+		case UDP_PATCH_LOCALADDR:
+		{
+			// Fill in a default address in case the interface's address is unknown
+			struct in6_addr localaddr = IN6ADDR_LOOPBACK_INIT;
+			iface_lookup(&localaddr, NULL);
+			memcpy(field, &localaddr.s6_addr[0], sizeof(localaddr.s6_addr));
+			break;
+		}
+
+		default:
+			break;
+		}
+	}
+	return(t->len);
+}
+
+//
+// The value of an identifier field of len octets, as udp_payload_fill() writes it for probeid
+//
+
+uint32_t udp_probeid_field(uint32_t probeid, unsigned int len)
+{
+	if (4 > len) probeid &= ((1U << (8 * len)) - 1);
+	return( probeid & ~(0x80U << (8 * (len - 1))) );
+}
+
+//
+// Minimal BER decoding, for SNMP replies. Reads the tag and length at *pos, leaving *pos at the
+// start of the contents. Returns 0, or -1 if the item does not fit within the buffer.
+//
+
+int ber_header(const unsigned char *buf, int buflen, int *pos, unsigned char *tag, int *itemlen)
+{
+	int p = *pos, n;
+
+	if ((p + 2) > buflen) return(-1);
+	*tag = buf[p++];
+	*itemlen = buf[p++];
+	if (0 != (*itemlen & 0x80))
+	{
+		// Long form, of no more than two length octets
+		n = *itemlen & 0x7f;
+		if (1 > n || 2 < n || (p + n) > buflen) return(-1);
+		*itemlen = 0;
+		while (n-- > 0) *itemlen = (*itemlen << 8) + buf[p++];
+	}
+	if ((p + *itemlen) > buflen) return(-1);
+	*pos = p;
+	return(0);
+}
+
+int ber_integer(const unsigned char *buf, int buflen, int *pos, uint32_t *value)
+{
+	unsigned char tag;
+	int itemlen, i;
+
+	if (0 != ber_header(buf, buflen, pos, &tag, &itemlen) || 0x02 != tag || 1 > itemlen || 5 < itemlen) return(-1);
+	*value = 0;
+	for (i = 0; i < itemlen; i++) *value = (*value << 8) + buf[(*pos)++];
+	return(0);
+}
+
+//
+// DNS - the ID is echoed, with the QR bit set to mark a response
+//
+
+int udp_validate_dns(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len)
+{
+	(void)t;
+
+	if (12 > len) return(UDP_MATCH_NO);
+	if (((uint32_t)(rx[0] << 8) + rx[1]) != udp_probeid_field(probeid, 2)) return(UDP_MATCH_NO);
+	return( (0 != (rx[2] & 0x80)) ? UDP_MATCH_YES : UDP_MATCH_NO );
+}
+
+//
+// TFTP - a read request is answered by DATA (3), ERROR (5) or, with options, OACK (6)
+//
+
+int udp_validate_tftp(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len)
+{
+	(void)t;
+	(void)probeid;
+
+	if (4 > len || 0 != rx[0]) return(UDP_MATCH_NO);
+	return( (3 == rx[1] || 5 == rx[1] || 6 == rx[1]) ? UDP_MATCH_YES : UDP_MATCH_NO );
+}
+
+//
+// NTP - mode 4 (server) answers a client query, mode 7 (private) the MONLIST request
+//
+
+int udp_validate_ntp(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len)
+{
+	if (1 == t->special)
+	{
+		// Response bit set, and the request code echoed
+		if (4 > len || 7 != (rx[0] & 0x07) || 0 == (rx[0] & 0x80)) return(UDP_MATCH_NO);
+		return( (0x2a == rx[3]) ? UDP_MATCH_YES : UDP_MATCH_NO );
+	}
+	// The origin timestamp is our transmit timestamp, whose fraction carries the identifier
+	if (48 > len || 4 != (rx[0] & 0x07)) return(UDP_MATCH_NO);
+	if (((uint32_t)rx[28] << 24) + ((uint32_t)rx[29] << 16) + ((uint32_t)rx[30] << 8) + rx[31] != udp_probeid_field(probeid, 4)) return(UDP_MATCH_NO);
+	return(UDP_MATCH_YES);
+}
+
+//
+// SNMP - SEQUENCE { version, ... } where version is 0 for SNMPv1, 1 for SNMPv2c and 3 for SNMPv3
+//
+
+int udp_validate_snmp(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len)
+{
+	uint32_t version, requestid, maxsize;
+	unsigned char tag;
+	int pos = 0, itemlen;
+
+	if (0 != ber_header(rx, len, &pos, &tag, &itemlen) || 0x30 != tag) return(UDP_MATCH_NO);
+	if (0 != ber_integer(rx, len, &pos, &version)) return(UDP_MATCH_NO);
+	if (version != ((2 == t->special) ? 3U : (uint32_t)t->special)) return(UDP_MATCH_NO);
+	if (2 == t->special)
+	{
+		// SNMPv3 continues with msgGlobalData, which starts with the msgID, then the maximum size
+		// and flags - the reportable flag is never set in a Report or Response, unlike our request
+		if (0 != ber_header(rx, len, &pos, &tag, &itemlen) || 0x30 != tag) return(UDP_MATCH_NO);
+		if (0 != ber_integer(rx, len, &pos, &requestid)) return(UDP_MATCH_NO);
+		if (requestid != udp_probeid_field(probeid, 1)) return(UDP_MATCH_NO);
+		if (0 != ber_integer(rx, len, &pos, &maxsize)) return(UDP_MATCH_NO);
+		if (0 != ber_header(rx, len, &pos, &tag, &itemlen) || 0x04 != tag || 1 > itemlen) return(UDP_MATCH_NO);
+		return( (0 == (rx[pos] & 0x04)) ? UDP_MATCH_YES : UDP_MATCH_NO );
+	}
+
+	// SNMPv1/v2c continue with the community, then the PDU - a GetResponse (0xa2), or possibly a
+	// Report (0xa8), but never our GetRequest (0xa0) - which starts with the request ID
+	if (0 != ber_header(rx, len, &pos, &tag, &itemlen) || 0x04 != tag) return(UDP_MATCH_NO);
+	pos += itemlen;
+	if (0 != ber_header(rx, len, &pos, &tag, &itemlen) || (0xa2 != tag && 0xa8 != tag)) return(UDP_MATCH_NO);
+	if (0 != ber_integer(rx, len, &pos, &requestid)) return(UDP_MATCH_NO);
+	return( (requestid == udp_probeid_field(probeid, 4)) ? UDP_MATCH_YES : UDP_MATCH_NO );
+}
+
+//
+// IKE - the initiator's SPI is echoed, whatever the responder makes of the rest of the exchange.
+// The reply must differ from the request though - by the response flag, a responder SPI or, for
+// an IKEv1 notification, the exchange type.
+//
+
+int udp_validate_ike(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len)
+{
+	unsigned int i;
+	int responder = 0;
+
+	if (28 > len) return(UDP_MATCH_NO);
+	if (0 != memcmp(rx, &t->payload[0], 4)) return(UDP_MATCH_NO);
+	if (((uint32_t)rx[4] << 24) + ((uint32_t)rx[5] << 16) + ((uint32_t)rx[6] << 8) + rx[7] != udp_probeid_field(probeid, 4)) return(UDP_MATCH_NO);
+
+	for (i = 8; i < 16; i++) responder |= rx[i];
+	return( (0 != (rx[19] & 0x20) || 0 != responder || (unsigned char)t->payload[18] != rx[18]) ? UDP_MATCH_YES : UDP_MATCH_NO );
+}
+
+//
+// RIPng - a response (2), version 1
+//
+
+int udp_validate_ripng(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len)
+{
+	(void)t;
+	(void)probeid;
+
+	if (4 > len) return(UDP_MATCH_NO);
+	return( (2 == rx[0] && 1 == rx[1]) ? UDP_MATCH_YES : UDP_MATCH_NO );
+}
+
+//
+// DHCPv6 - ADVERTISE (2) or REPLY (7), echoing the transaction-id
+//
+
+int udp_validate_dhcpv6(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len)
+{
+	(void)t;
+
+	if (4 > len || (2 != rx[0] && 7 != rx[0])) return(UDP_MATCH_NO);
+	return( (((uint32_t)rx[1] << 16) + ((uint32_t)rx[2] << 8) + rx[3] == udp_probeid_field(probeid, 3)) ? UDP_MATCH_YES : UDP_MATCH_NO );
+}
+
+//
+// SSDP - M-SEARCH is answered by an HTTP response
+//
+
+int udp_validate_ssdp(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len)
+{
+	(void)t;
+	(void)probeid;
+
+	return( (9 <= len && 0 == strncasecmp((const char *)rx, "HTTP/1.", 7)) ? UDP_MATCH_YES : UDP_MATCH_NO );
+}
+
+//
+// LSP Ping - an echo reply (2), returning the sender's handle
+//
+
+int udp_validate_lspping(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len)
+{
+	(void)t;
+
+	if (12 > len || 2 != rx[4]) return(UDP_MATCH_NO);
+	return( (((uint32_t)rx[8] << 24) + ((uint32_t)rx[9] << 16) + ((uint32_t)rx[10] << 8) + rx[11] == udp_probeid_field(probeid, 4)) ? UDP_MATCH_YES : UDP_MATCH_NO );
+}
+
+//
+// memcache - the frame header's request ID is echoed, and binary replies start with magic 0x81
+//
+
+int udp_validate_memcache(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len)
+{
+	if (8 > len) return(UDP_MATCH_NO);
+	if (((uint32_t)(rx[0] << 8) + rx[1]) != udp_probeid_field(probeid, 2)) return(UDP_MATCH_NO);
+	if (1 == t->special) return( (8 < len && 0x81 == rx[8]) ? UDP_MATCH_YES : UDP_MATCH_NO );
+	if (8 < len && 0x81 == rx[8]) return(UDP_MATCH_NO);
+	// ASCII replies are VERSION, or an error, but never our own command echoed back
+	return( (len == t->len && 0 == memcmp(&rx[8], &t->payload[8], (size_t)(len - 8))) ? UDP_MATCH_NO : UDP_MATCH_YES );
+}
+
+//
+// Decide whether a reply belongs to the probe sent from template t with the given identifier,
+// using its registered validator. Returns UDP_MATCH_YES or UDP_MATCH_NO, or UDP_MATCH_UNKNOWN
+// if the protocol offers no way to tell. Replies which are not a valid response to the request,
+// e.g. a DNS query echoed back, are UDP_MATCH_NO.
+//
+
+int udp_response_match(const struct udp_template_struc *t, uint32_t probeid, const char *reply, int len)
+{
+	if (NULL == t->probe || NULL == t->probe->validate) return(UDP_MATCH_UNKNOWN);
+	return(t->probe->validate(t, probeid, (const unsigned char *)reply, len));
+}
@@ -39,6 +39,7 @@
 // 0.15 - update copyright dates
 // 0.16 - update copyright year
 // 0.17 - add whois, TCP/43
+// 0.18 - UDP ports are now listed in the probe registry, together with their builders and validators
 
 #include "ipscan.h"
 
@@ -120,27 +121,61 @@ struct portlist_struc defportlist[] =
 // Calculate and record the number of default ports to be tested
 #define DEFNUMPORTS ( sizeof(defportlist) / sizeof(struct portlist_struc) )
 
-struct portlist_struc udpportlist[] =
+// Probe builders and validators, from ipscan_payload.c
+int udp_build_dns(struct udp_template_struc *t, const char *hostname);
+int udp_build_tftp(struct udp_template_struc *t, const char *hostname);
+int udp_build_ntp(struct udp_template_struc *t, const char *hostname);
+int udp_build_snmp(struct udp_template_struc *t, const char *hostname);
+int udp_build_ike(struct udp_template_struc *t, const char *hostname);
+int udp_build_ripng(struct udp_template_struc *t, const char *hostname);
+int udp_build_dhcpv6(struct udp_template_struc *t, const char *hostname);
+int udp_build_ssdp(struct udp_template_struc *t, const char *hostname);
+int udp_build_lspping(struct udp_template_struc *t, const char *hostname);
+int udp_build_memcache(struct udp_template_struc *t, const char *hostname);
+int udp_validate_dns(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len);
+int udp_validate_tftp(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len);
+int udp_validate_ntp(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len);
+int udp_validate_snmp(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len);
+int udp_validate_ike(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len);
+int udp_validate_ripng(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len);
+int udp_validate_dhcpv6(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len);
+int udp_validate_ssdp(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len);
+int udp_validate_lspping(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len);
+int udp_validate_memcache(const struct udp_template_struc *t, uint32_t probeid, const unsigned char *rx, int len);
+
+// UDP probe registry - the UDP tests to be run, in the order they are displayed. Each entry
+// includes its port number, special case, text description (up to PORTDESCSIZE-1 characters
+// long), payload builder, reply validator and any additional time its service may take to
+// answer. Adding a UDP test needs only a builder and validator in ipscan_payload.c and an entry here.
+//
+struct udp_probedesc_struc udpprobes[] =
 {
-		{   53, 0, "DNS" },\
-		{   69, 0, "TFTP" },\
-		{  123, 0, "NTP" },\
-		{  123, 1, "NTP MONLIST" },\
-		{  161, 0, "SNMPv1" },\
-		{  161, 1, "SNMPv2c" },\
-		{  161, 2, "SNMPv3" },\
-		{  500, 0, "IKEv2 SA_INIT" },\
-		{  521, 0, "RIPng" },\
-		{  547, 0, "DHCPv6" },\
-		{ 1900, 0, "UPnP SSDP" },\
-		{ 3503, 0, "MPLS LSP Ping" },\
-		{ 4500, 0, "IKEv2 NAT-T SA_INIT" },\
-		{11211, 0, "memcache ASCII" },\
-		{11211, 1, "memcache binary" },\
+		{   53, 0, "DNS", udp_build_dns, udp_validate_dns, 0 },\
+		{   69, 0, "TFTP", udp_build_tftp, udp_validate_tftp, 0 },\
+		{  123, 0, "NTP", udp_build_ntp, udp_validate_ntp, 0 },\
+		{  123, 1, "NTP MONLIST", udp_build_ntp, udp_validate_ntp, 0 },\
+		{  161, 0, "SNMPv1", udp_build_snmp, udp_validate_snmp, 0 },\
+		{  161, 1, "SNMPv2c", udp_build_snmp, udp_validate_snmp, 0 },\
+		{  161, 2, "SNMPv3", udp_build_snmp, udp_validate_snmp, 0 },\
+		{  500, 0, "IKEv2 SA_INIT", udp_build_ike, udp_validate_ike, 0 },\
+		{  521, 0, "RIPng", udp_build_ripng, udp_validate_ripng, 0 },\
+		{  547, 0, "DHCPv6", udp_build_dhcpv6, udp_validate_dhcpv6, 0 },\
+		// SSDP responders may delay their reply by up to MX seconds
+		{ 1900, 0, "UPnP SSDP", udp_build_ssdp, udp_validate_ssdp, ((uint64_t)SSDP_MX_SECS * 1000000) },\
+		{ 3503, 0, "MPLS LSP Ping", udp_build_lspping, udp_validate_lspping, 0 },\
+		{ 4500, 0, "IKEv2 NAT-T SA_INIT", udp_build_ike, udp_validate_ike, 0 },\
+		{11211, 0, "memcache ASCII", udp_build_memcache, udp_validate_memcache, 0 },\
+		{11211, 1, "memcache binary", udp_build_memcache, udp_validate_memcache, 0 },\
 };
 
+#define NUMUDPPROBES ( sizeof(udpprobes) / sizeof(struct udp_probedesc_struc) )
+const unsigned int numudpprobes = NUMUDPPROBES;
+
+// The UDP port list, filled in from the registry
+struct portlist_struc udpportlist[NUMUDPPROBES];
+
 #if (IPSCAN_INCLUDE_UDP == 1)
-#define NUMUDPPORTS ( sizeof(udpportlist) / sizeof(struct portlist_struc) )
+#define NUMUDPPORTS NUMUDPPROBES
 #else
 #define NUMUDPPORTS 0
 #endif
@@ -0,0 +1,509 @@
+//    IPscan - an HTTP-initiated IPv6 port scanner.
+//
+//    Copyright (C) 2011-2021 Tim Chappell.
+//
+//    This file is part of IPscan.
+//
+//    IPscan is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with IPscan.  If not, see <http://www.gnu.org/licenses/>.
+
+// ipscan_syn.c 	version
+// 0.01			initial version - half-open (SYN) TCP scan engine
+// 0.02			derive probe timeouts from the measured round trip time
+// 0.03			pace SYNs through the shared token bucket
+// 0.04			take the pre-resolved target from the scan context
+// 0.05			take the timeout ceiling for the current round from the scan context
+// 0.06			schedule probe deadlines and pacing holdoffs on the timer wheel
+// 0.07			describe the extension of probe deadlines in the engine's header comment
+// 0.08			open the raw sockets once, before root privileges are dropped for good, and keep them between rounds
+
+#include "ipscan.h"
+
+// Raw sockets require root privileges, so only build the engine where setuid is available
+#if (1 == IPSCAN_INCLUDE_SYN)
+
+//
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+// IPv6 address conversion
+#include <arpa/inet.h>
+
+// Logging with syslog requires additional include
+#if (LOGMODE == 1)
+#include <syslog.h>
+#endif
+
+// Others that FreeBSD highlighted
+#include <netinet/in.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+// Other IPv6 related
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <netinet/tcp.h>
+
+//Poll support
+#include <poll.h>
+
+// Offset of the checksum within the TCP header, for IPV6_CHECKSUM
+#define SYN_TCP_CSUM_OFFSET 16
+
+// SYN segment - TCP header plus a single MSS option
+#define SYN_TCP_OPTLEN 4
+#define SYN_TCP_MSS 1440
+#define SYN_TCP_WINDOW 64240
+
+// The probe index is carried in the upper 16 bits of the initial sequence number
+#define SYN_INDEX_SHIFT 16
+
+//
+// Prototype declarations
+//
+int tcp_classify_probe(int conn, int errsv, char * hostname, uint16_t port, uint8_t special);
+int tcp_record_result(struct scan_context_struc *ctx, uint16_t port, uint8_t special, int result);
+uint64_t tcp_now_usecs(void);
+void tcp_rtt_sample(struct rtt_struc *rtt, uint64_t started, int result);
+
+// from ipscan_pacer
+int pacer_admit(uint64_t *holdoff, uint64_t now);
+
+// from ipscan_general
+uint64_t rtt_timeout(struct rtt_struc *rtt, uint64_t floorusecs, uint64_t ceilingusecs);
+
+// from ipscan_timer
+struct timerwheel_struc * timer_wheel(void);
+int timer_pending(const struct timer_struc *timer);
+void timer_add(struct timerwheel_struc *wheel, struct timer_struc *timer, int kind, unsigned int owner, uint64_t expires);
+void timer_cancel(struct timerwheel_struc *wheel, struct timer_struc *timer);
+struct timer_struc * timer_expire(struct timerwheel_struc *wheel, uint64_t now);
+int timer_wait_msecs(struct timerwheel_struc *wheel, uint64_t now);
+
+// Per-probe state held by the SYN engine - the timer holds its deadline, or a free slot's holdoff
+struct syn_probe_struc
+{
+	int inuse;
+	unsigned int index;
+	uint64_t started;
+	uint64_t holdoff;
+	struct timer_struc timer;
+};
+
+//
+// Map an ICMPv6 error onto the errno that the kernel would report to connect()
+//
+
+int syn_icmp6_errno(unsigned int type, unsigned int code)
+{
+	int errsv = EPROTO;
+	switch (type)
+	{
+		case ICMP6_DST_UNREACH:
+			switch (code)
+			{
+				case ICMP6_DST_UNREACH_NOROUTE:
+					errsv = ENETUNREACH;
+					break;
+				case ICMP6_DST_UNREACH_NOPORT:
+					errsv = ECONNREFUSED;
+					break;
+				case ICMP6_DST_UNREACH_BEYONDSCOPE:
+				case ICMP6_DST_UNREACH_ADDR:
+					errsv = EHOSTUNREACH;
+					break;
+				default:
+					// administratively prohibited, source address failed policy or reject route
+					errsv = EACCES;
+					break;
+			}
+			break;
+		case ICMP6_PACKET_TOO_BIG:
+			errsv = EMSGSIZE;
+			break;
+		case ICMP6_TIME_EXCEEDED:
+			errsv = EHOSTUNREACH;
+			break;
+		case ICMP6_PARAM_PROB:
+		default:
+			errsv = EPROTO;
+			break;
+	}
+	return(errsv);
+}
+
+// Raw sockets opened whilst the scanner still held root privileges, or -1
+static int syntcpsock = -1;
+static int synicmpsock = -1;
+
+//
+// Open the raw sockets - must be called before root privileges are dropped, which happens before
+// anything else is done. Each scan round drains whatever they have queued in the meantime.
+//
+
+int syn_open_sockets(void)
+{
+	struct icmp6_filter myfilter;
+	int csumoffset = SYN_TCP_CSUM_OFFSET;
+	int retval = 0;
+	int rc;
+
+	// Quietly leave the engine unavailable if not installed setuid root - it is reported when used
+	if (0 != geteuid()) return(-1);
+
+	syntcpsock = socket(AF_INET6, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (-1 == syntcpsock)
+	{
+		IPSCAN_LOG( LOGPREFIX "syn_open_sockets: TCP raw socket: Error : %s (%d)\n", strerror(errno), errno);
+		retval = -1;
+	}
+	synicmpsock = socket(AF_INET6, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMPV6);
+	if (-1 == synicmpsock)
+	{
+		IPSCAN_LOG( LOGPREFIX "syn_open_sockets: ICMPv6 raw socket: Error : %s (%d)\n", strerror(errno), errno);
+		retval = -1;
+	}
+
+	if (0 == retval)
+	{
+		// Have the kernel complete the TCP checksum, including the pseudo-header
+		rc = setsockopt(syntcpsock, IPPROTO_IPV6, IPV6_CHECKSUM, &csumoffset, sizeof(csumoffset));
+		if (rc < 0)
+		{
+			IPSCAN_LOG( LOGPREFIX "syn_open_sockets: setsockopt: Error setting IPV6_CHECKSUM: %s (%d)\n", strerror(errno), errno);
+			retval = -1;
+		}
+	}
+
+	if (0 == retval)
+	{
+		// Filter out everything except the errors which might relate to our probes
+		ICMP6_FILTER_SETBLOCKALL(&myfilter);
+		ICMP6_FILTER_SETPASS(ICMP6_DST_UNREACH, &myfilter);
+		ICMP6_FILTER_SETPASS(ICMP6_PARAM_PROB, &myfilter);
+		ICMP6_FILTER_SETPASS(ICMP6_TIME_EXCEEDED, &myfilter);
+		ICMP6_FILTER_SETPASS(ICMP6_PACKET_TOO_BIG, &myfilter);
+		rc = setsockopt(synicmpsock, IPPROTO_ICMPV6, ICMP6_FILTER, &myfilter, sizeof(myfilter));
+		if (rc < 0)
+		{
+			IPSCAN_LOG( LOGPREFIX "syn_open_sockets: setsockopt: Error setting ICMPv6 filter: %s (%d)\n", strerror(errno), errno);
+			retval = -1;
+		}
+	}
+
+	if (0 != retval)
+	{
+		if (-1 != syntcpsock) close(syntcpsock);
+		if (-1 != synicmpsock) close(synicmpsock);
+		syntcpsock = -1;
+		synicmpsock = -1;
+	}
+	return(retval);
+}
+
+//
+// Discard anything queued on a raw socket since it was last read
+//
+
+void syn_drain(int sock)
+{
+	unsigned char discard[ICMPV6_PACKET_BUFFER_SIZE];
+	while (0 <= recv(sock, discard, sizeof(discard), MSG_DONTWAIT));
+}
+
+//
+// Reserve a local TCP port, so that no real connection can share it. Because the reserving
+// socket is neither connected nor listening, the kernel answers any SYN-ACK with a RST,
+// which completes the half-open exchange without the target ever seeing a full handshake
+//
+
+int syn_reserve_port(uint16_t *localport)
+{
+	struct sockaddr_in6 local;
+	socklen_t locallen = sizeof(local);
+	int sock = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (-1 == sock)
+	{
+		IPSCAN_LOG( LOGPREFIX "syn_reserve_port: Bad socket call, returned %d (%s)\n", errno, strerror(errno));
+		return(-1);
+	}
+
+	memset(&local, 0, sizeof(local));
+	local.sin6_family = AF_INET6;
+	local.sin6_addr = in6addr_any;
+	if (0 != bind(sock, (struct sockaddr *)&local, sizeof(local)) || 0 != getsockname(sock, (struct sockaddr *)&local, &locallen))
+	{
+		IPSCAN_LOG( LOGPREFIX "syn_reserve_port: bind/getsockname failed, returned %d (%s)\n", errno, strerror(errno));
+		close(sock);
+		return(-1);
+	}
+
+	*localport = ntohs(local.sin6_port);
+	return(sock);
+}
+
+//
+// Transmit a single SYN
+//
+
+int syn_send(int sock, struct sockaddr_in6 *destination, uint16_t localport, uint16_t port, uint32_t seq)
+{
+	unsigned char txpacket[sizeof(struct tcphdr) + SYN_TCP_OPTLEN];
+	struct tcphdr *txtcphdr_ptr = (struct tcphdr *)txpacket;
+	ssize_t rc;
+
+	memset(txpacket, 0, sizeof(txpacket));
+	txtcphdr_ptr->th_sport = htons(localport);
+	txtcphdr_ptr->th_dport = htons(port);
+	txtcphdr_ptr->th_seq = htonl(seq);
+	txtcphdr_ptr->th_ack = 0;
+	txtcphdr_ptr->th_off = (sizeof(txpacket) / 4);
+	txtcphdr_ptr->th_flags = TH_SYN;
+	txtcphdr_ptr->th_win = htons(SYN_TCP_WINDOW);
+	txtcphdr_ptr->th_sum = 0;
+
+	// MSS option
+	txpacket[sizeof(struct tcphdr)] = TCPOPT_MAXSEG;
+	txpacket[sizeof(struct tcphdr) + 1] = TCPOLEN_MAXSEG;
+	txpacket[sizeof(struct tcphdr) + 2] = (unsigned char)((SYN_TCP_MSS >> 8) & 0xFF);
+	txpacket[sizeof(struct tcphdr) + 3] = (unsigned char)(SYN_TCP_MSS & 0xFF);
+
+	destination->sin6_port = 0;
+	rc = sendto(sock, txpacket, sizeof(txpacket), 0, (struct sockaddr *)destination, sizeof(struct sockaddr_in6));
+	if (rc != (ssize_t)sizeof(txpacket))
+	{
+		IPSCAN_LOG( LOGPREFIX "syn_send: sendto returned %d, errno %d (%s)\n", (int)rc, errno, strerror(errno));
+		return(-1);
+	}
+	return(0);
+}
+
+//
+// Half-open (SYN) TCP engine
+//
+// SYNs are built here and sent through a raw socket, with replies classified from raw TCP and ICMPv6
+// receive sockets: SYN-ACK reports PORTOPEN, RST reports PORTREFUSED and ICMPv6 errors map onto the
+// same errno, and therefore resultsstruct entry, as a failed connect() would. A probe which receives
+// nothing within the RTT-derived timeout reports PORTINPROGRESS. Deadlines and pacing holdoffs are
+// timers on the wheel. Each deadline is set from the timeout as it stood when the SYN was sent, and is
+// extended on expiry should replies to other probes have since grown the timeout. The probe index is
+// encoded in the initial sequence number, so responses are matched without any per-connection kernel state.
+//
+
+int check_tcp_ports_syn(struct scan_context_struc *ctx, unsigned int portindex, unsigned int todo, struct portlist_struc *portlist)
+{
+	struct syn_probe_struc probes[MAXTCPINFLIGHT];
+	struct sockaddr_in6 destination;
+	struct pollfd pollfiledesc[2];
+	unsigned char rxbuf[ICMPV6_PACKET_BUFFER_SIZE];
+	struct timerwheel_struc *wheel = timer_wheel();
+	struct timer_struc *timer;
+	uint32_t seqbase = (uint32_t)((ctx->session * 2654435761U) ^ ctx->timestamp) & ((1U << SYN_INDEX_SHIFT) - 1);
+	uint16_t localport = 0;
+	unsigned int next = 0, done = 0, i;
+	int tcpsock, icmpsock, reservesock;
+	int rc = 0;
+
+	if (todo > (1U << (32 - SYN_INDEX_SHIFT)))
+	{
+		IPSCAN_LOG( LOGPREFIX "check_tcp_ports_syn: too many ports (%d) to encode\n", todo);
+		return(IPSCAN_TCP_ENGINE_UNAVAILABLE);
+	}
+
+	memcpy(&destination, &ctx->remoteaddr, sizeof(destination));
+
+	tcpsock = syntcpsock;
+	icmpsock = synicmpsock;
+	if (-1 == tcpsock || -1 == icmpsock)
+	{
+		IPSCAN_LOG( LOGPREFIX "check_tcp_ports_syn: raw sockets unavailable - is setuid permission set?\n");
+		return(IPSCAN_TCP_ENGINE_UNAVAILABLE);
+	}
+
+	reservesock = syn_reserve_port(&localport);
+	if (-1 == reservesock)
+	{
+		return(IPSCAN_TCP_ENGINE_UNAVAILABLE);
+	}
+
+	// Neither the responses to an earlier round, nor anything else received since, belong to this one
+	syn_drain(tcpsock);
+	syn_drain(icmpsock);
+
+	memset(probes, 0, sizeof(probes));
+
+	#ifdef PARLLDEBUG
+	IPSCAN_LOG( LOGPREFIX "check_tcp_ports_syn(): startindex %d, todo %d, local port %d, maximum in flight %d\n", portindex, todo, localport, MAXTCPINFLIGHT);
+	#endif
+
+	while (done < todo)
+	{
+		uint64_t now = tcp_now_usecs();
+		int waitms, nfds;
+
+		// Expire any probes which have exceeded their deadline - any replies were drained on the
+		// previous pass. A pacing holdoff which has ended needs no action.
+		while (NULL != (timer = timer_expire(wheel, now)))
+		{
+			struct syn_probe_struc *probe = &probes[timer->owner];
+
+			if (TIMER_TCP_DEADLINE != timer->kind || 0 == probe->inuse) continue;
+
+			// Allow the longer timeout, should it have grown since the SYN was sent
+			uint64_t deadline = probe->started + rtt_timeout(&ctx->rtt, TCPTIMEOUT_FLOOR_USECS, ctx->tcpceilingusecs);
+			if (deadline > now)
+			{
+				timer_add(wheel, &probe->timer, TIMER_TCP_DEADLINE, timer->owner, deadline);
+				continue;
+			}
+			rc |= tcp_record_result(ctx, portlist[portindex + probe->index].port_num, portlist[portindex + probe->index].special, PORTINPROGRESS);
+			done++;
+			probe->inuse = 0;
+		}
+
+		// Send a SYN for each free slot
+		for (i = 0 ; i < MAXTCPINFLIGHT && next < todo ; i++)
+		{
+			struct syn_probe_struc *probe = &probes[i];
+			if (0 != probe->inuse) continue;
+			// Only one slot at a time waits for a token, so none are reserved needlessly
+			if (0 != timer_pending(&probe->timer)) break;
+			if (0 == pacer_admit(&probe->holdoff, now))
+			{
+				timer_add(wheel, &probe->timer, TIMER_TCP_PACE, i, probe->holdoff);
+				break;
+			}
+
+			probe->index = next;
+			probe->started = now;
+			probe->inuse = 1;
+			next++;
+
+			if (0 != syn_send(tcpsock, &destination, localport, portlist[portindex + probe->index].port_num, (seqbase | (probe->index << SYN_INDEX_SHIFT))))
+			{
+				probe->inuse = 0;
+				rc |= tcp_record_result(ctx, portlist[portindex + probe->index].port_num, portlist[portindex + probe->index].special, PORTINTERROR);
+				done++;
+				continue;
+			}
+			timer_add(wheel, &probe->timer, TIMER_TCP_DEADLINE, i, now + rtt_timeout(&ctx->rtt, TCPTIMEOUT_FLOOR_USECS, ctx->tcpceilingusecs));
+		}
+
+		if (done >= todo) break;
+		// Sleep until the earliest deadline or holdoff, unless a reply arrives first
+		waitms = timer_wait_msecs(wheel, tcp_now_usecs());
+
+		pollfiledesc[0].fd = tcpsock;
+		pollfiledesc[0].events = POLLIN;
+		pollfiledesc[0].revents = 0;
+		pollfiledesc[1].fd = icmpsock;
+		pollfiledesc[1].events = POLLIN;
+		pollfiledesc[1].revents = 0;
+
+		nfds = poll(pollfiledesc, 2, waitms);
+		if (-1 == nfds && EINTR != errno)
+		{
+			IPSCAN_LOG( LOGPREFIX "check_tcp_ports_syn: poll failed, returned %d (%s)\n", errno, strerror(errno));
+		}
+
+		// Drain both receive sockets
+		for (i = 0 ; 0 < nfds && i < 2 ; i++)
+		{
+			while (0 != (pollfiledesc[i].revents & POLLIN))
+			{
+				struct sockaddr_in6 source;
+				socklen_t sourcelen = sizeof(source);
+				struct tcphdr *rxtcphdr_ptr;
+				uint32_t seq;
+				unsigned int index, slot;
+				int conn = -1, errsv = 0;
+				ssize_t len = recvfrom(pollfiledesc[i].fd, rxbuf, sizeof(rxbuf), 0, (struct sockaddr *)&source, &sourcelen);
+
+				if (0 > len) break;
+
+				if (0 == i)
+				{
+					// TCP - only segments from our target, to our reserved port, are of interest
+					if ((size_t)len < sizeof(struct tcphdr)) continue;
+					if (0 != memcmp(&source.sin6_addr, &destination.sin6_addr, sizeof(struct in6_addr))) continue;
+					rxtcphdr_ptr = (struct tcphdr *)rxbuf;
+					if (ntohs(rxtcphdr_ptr->th_dport) != localport) continue;
+					if (0 == (rxtcphdr_ptr->th_flags & TH_ACK)) continue;
+
+					seq = ntohl(rxtcphdr_ptr->th_ack) - 1;
+					if ((rxtcphdr_ptr->th_flags & (TH_SYN | TH_RST)) == TH_SYN)
+					{
+						conn = 0;
+					}
+					else if (0 != (rxtcphdr_ptr->th_flags & TH_RST))
+					{
+						errsv = ECONNREFUSED;
+					}
+					else
+					{
+						continue;
+					}
+				}
+				else
+				{
+					// ICMPv6 error - the invoking packet must be one of our SYNs to our target
+					struct icmp6_hdr *rxicmp6hdr_ptr = (struct icmp6_hdr *)rxbuf;
+					struct ip6_hdr *rxip6hdr_ptr = (struct ip6_hdr *)(rxbuf + sizeof(struct icmp6_hdr));
+
+					if ((size_t)len < (sizeof(struct icmp6_hdr) + sizeof(struct ip6_hdr) + 8)) continue;
+					if (IPPROTO_TCP != rxip6hdr_ptr->ip6_nxt) continue;
+					if (0 != memcmp(&rxip6hdr_ptr->ip6_dst, &destination.sin6_addr, sizeof(struct in6_addr))) continue;
+					rxtcphdr_ptr = (struct tcphdr *)(rxbuf + sizeof(struct icmp6_hdr) + sizeof(struct ip6_hdr));
+					if (ntohs(rxtcphdr_ptr->th_sport) != localport) continue;
+
+					seq = ntohl(rxtcphdr_ptr->th_seq);
+					errsv = syn_icmp6_errno(rxicmp6hdr_ptr->icmp6_type, rxicmp6hdr_ptr->icmp6_code);
+				}
+
+				// Recover and validate the probe index from the sequence number
+				if ((seq & ((1U << SYN_INDEX_SHIFT) - 1)) != seqbase) continue;
+				index = seq >> SYN_INDEX_SHIFT;
+				for (slot = 0 ; slot < MAXTCPINFLIGHT ; slot++)
+				{
+					if (0 != probes[slot].inuse && index == probes[slot].index) break;
+				}
+				if (MAXTCPINFLIGHT == slot) continue;
+				if (portlist[portindex + index].port_num != ntohs((0 == i) ? rxtcphdr_ptr->th_sport : rxtcphdr_ptr->th_dport)) continue;
+
+				int result = tcp_classify_probe(conn, errsv, ctx->hostname, portlist[portindex + index].port_num, portlist[portindex + index].special);
+				tcp_rtt_sample(&ctx->rtt, probes[slot].started, result);
+				rc |= tcp_record_result(ctx, portlist[portindex + index].port_num, portlist[portindex + index].special, result);
+				done++;
+				probes[slot].inuse = 0;
+				timer_cancel(wheel, &probes[slot].timer);
+			}
+		}
+	}
+
+	// The probes' timers must not outlive them on the wheel
+	for (i = 0 ; i < MAXTCPINFLIGHT ; i++) timer_cancel(wheel, &probes[i].timer);
+
+	// The raw sockets are kept for any later round, since they cannot be reopened
+	close(reservesock);
+
+	return(rc);
+}
+
+#endif
@@ -33,6 +33,19 @@
 // 0.13			extern updated
 // 0.14			update copyright date
 // 0.15			update copyright year
+// 0.16			add non-blocking epoll-driven connect engine
+// 0.17			add run-time selection between io_uring, epoll and forked blocking engines
+// 0.18			add half-open (SYN) engine selection
+// 0.19			derive connect timeouts from the measured round trip time
+// 0.20			pace probes through the shared token bucket instead of sleeping per port
+// 0.21			take the pre-resolved target from the scan context
+// 0.22			add probe socket budget manager - abortive close, source port range and per-client budget
+// 0.23			re-probe ambiguous results in a second round
+// 0.24			add full-range scan, recording results in per-state bitmaps
+// 0.25			scan compact port sets, of which the full-range scan is now one
+// 0.26			schedule the non-blocking engine's deadlines, retries and pacing holdoffs on the timer wheel
+// 0.27			fork the blocking engine's children within the scan-wide child limit, and adopt the echo train's round trip time
+// 0.28			keep the budget table in the private state directory
 
 #include "ipscan.h"
 //
@@ -73,186 +86,456 @@
 // Parallel processing related
 #include <sys/wait.h>
 
+// Non-blocking connect engine related
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+// Socket budget related
+#include <sys/mman.h>
+
+// Not yet provided by all C libraries - restricts the ports the kernel chooses from at connect()
+#ifndef IP_LOCAL_PORT_RANGE
+#define IP_LOCAL_PORT_RANGE 51
+#endif
+
+// Budget entries which have not been updated for this long are assumed to have been abandoned
+#define TCP_BUDGET_STALE_SECS 60
+
+// Returned by tcp_start_probe() when the probe has not (yet) completed
+#define TCP_PROBE_STARTED (-1)
+#define TCP_PROBE_DEFERRED (-2)
+
 // Define offset into ICMPv6 packet where user-defined data resides
 #define ICMP6DATAOFFSET sizeof(struct icmp6_hdr)
 
 //
 // Prototype declarations
 //
-int write_db(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, uint32_t port, int32_t result, char *indirecthost );
+int write_db_scan(struct scan_context_struc *ctx, uint32_t port, int32_t result, char *indirecthost);
+int update_db_scan(struct scan_context_struc *ctx, uint32_t port, int32_t result, char *indirecthost);
+int write_db_bitmap(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, uint32_t proto, int32_t result, uint32_t count, const uint8_t *bits);
+int check_tcp_port(struct scan_context_struc *ctx, uint16_t port, uint8_t special, uint64_t timeoutusecs);
+int tcp_record_result(struct scan_context_struc *ctx, uint16_t port, uint8_t special, int result);
+#if (1 == IPSCAN_INCLUDE_URING)
+int check_tcp_ports_uring(struct scan_context_struc *ctx, unsigned int portindex, unsigned int todo, struct portlist_struc *portlist);
+#endif
+#if (1 == IPSCAN_INCLUDE_SYN)
+int check_tcp_ports_syn(struct scan_context_struc *ctx, unsigned int portindex, unsigned int todo, struct portlist_struc *portlist);
+#endif
+
+// from ipscan_pacer
+int pacer_admit(uint64_t *holdoff, uint64_t now);
+void pacer_wait(void);
+void * pacer_state_map(const char *name, size_t size);
+
+// from ipscan_tcp
+uint64_t tcp_now_usecs(void);
+int tcp_budget_acquire(struct scan_context_struc *ctx, int force);
+void tcp_budget_release(struct scan_context_struc *ctx);
+void tcp_budget_sleep(void);
+int tcp_socket_exhausted(int errsv);
+int tcp_probe_socket(int flags);
+void tcp_probe_close(int sock, int result);
+
+// from ipscan_bitmap
+struct portbitmap_struc * bitmap_create(void);
+void bitmap_destroy(struct portbitmap_struc *bitmap);
+void bitmap_set(struct portbitmap_struc *bitmap, uint16_t port, int result);
+void bitmap_clear(struct portbitmap_struc *bitmap, uint16_t port, int result);
+int bitmap_next_range(const uint8_t *bits, unsigned int *port, unsigned int *first, unsigned int *last);
+
+// from ipscan_timer
+struct timerwheel_struc * timer_wheel(void);
+int timer_pending(const struct timer_struc *timer);
+void timer_add(struct timerwheel_struc *wheel, struct timer_struc *timer, int kind, unsigned int owner, uint64_t expires);
+void timer_cancel(struct timerwheel_struc *wheel, struct timer_struc *timer);
+struct timer_struc * timer_expire(struct timerwheel_struc *wheel, uint64_t now);
+int timer_wait_msecs(struct timerwheel_struc *wheel, uint64_t now);
+
+// from ipscan_general
+void rtt_sample(struct rtt_struc *rtt, uint64_t sampleusecs);
+uint64_t rtt_timeout(struct rtt_struc *rtt, uint64_t floorusecs, uint64_t ceilingusecs);
+int rtt_share_adopt(struct scan_context_struc *ctx);
+void scan_child_add(struct scan_context_struc *ctx, pid_t pid, int proto);
+void scan_child_slot(struct scan_context_struc *ctx, int proto, int protomax);
+void scan_children_wait(struct scan_context_struc *ctx, int proto);
 
 //
-// Check an individual TCP port
+// Map a connect() return code and errno onto the matching resultsstruct returnval
 //
 
-int check_tcp_port(char * hostname, uint16_t port, uint8_t special)
+int tcp_connect_result(int conn, int errsv)
 {
-	struct addrinfo *res, *aip;
-	struct addrinfo hints;
-	int sock = -1, timeo = -1, conn = -1, cl = -1;
-	int error;
+	int retval = PORTUNKNOWN;
 	int i;
-	struct timeval timeout;
-	char portnum[8];
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET6;
-	hints.ai_flags = AI_NUMERICSERV;
-	hints.ai_socktype = SOCK_STREAM;
+	// cycle through the expected list of results
+	for (i = 0; PORTEOL != resultsstruct[i].returnval && PORTUNKNOWN == retval ; i++)
+	{
+		// Find a matching connect returncode and also errno, if appropriate
+		if (resultsstruct[i].connrc == conn)
+		{
+			// Set the returnvalue if we find a match
+			if ( conn == 0 || (conn == -1 && resultsstruct[i].connerrno == errsv) )
+			{
+				retval = resultsstruct[i].returnval;
+			}
+		}
+	}
+	return(retval);
+}
 
-	// set return value to a known default
-	int retval = PORTUNKNOWN;
 
-	error = snprintf(portnum, 8,"%d", port);
-	if (error < 0 || error >= 8)
+//
+// TCP probe socket budget manager
+//
+// Each connect() probe holds a place in its client's budget for as long as its socket is open.
+// The budgets live in a table shared by every scan on this host, indexed by a hash of the client
+// address, so that concurrent scans of the same client share IPSCAN_TCP_HOST_BUDGET sockets rather
+// than each exhausting the local ports towards it. Each entry packs the in-flight count with the
+// time (in seconds) of its last update, so that places left behind by a scan which died are
+// recovered once the entry has gone stale.
+//
+
+static uint64_t *tcpbudget = NULL;
+static unsigned int tcpsrcport = 0;
+
+int tcp_budget_init(void)
+{
+	int rc = 0;
+	size_t size = IPSCAN_TCP_BUDGET_ENTRIES * sizeof(uint64_t);
+
+	// The forked blocking engine inherits the mapping, so only the first call maps it
+	if (NULL != tcpbudget) return(0);
+
+	// A zero-filled table is empty
+	tcpbudget = pacer_state_map(IPSCAN_TCP_BUDGET_FILE, size);
+	if (NULL == tcpbudget)
 	{
-		IPSCAN_LOG( LOGPREFIX "check_tcp_port: Failed to write portnum, rc was %d\n", error);
-		retval = PORTINTERROR;
+		IPSCAN_LOG( LOGPREFIX "tcp_budget_init: budget applies to this scan only\n");
+		rc = -1;
 	}
 
-	error = getaddrinfo(hostname, portnum, &hints, &res);
-	if (error != 0)
+	// Fall back to a table private to this scan, still shared with any forked children
+	if (NULL == tcpbudget)
 	{
-		IPSCAN_LOG( LOGPREFIX "check_tcp_port: getaddrinfo: %s for host %s port %d\n", gai_strerror(error), hostname, port);
-		retval = PORTINTERROR;
+		tcpbudget = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == (void *)tcpbudget)
+		{
+			IPSCAN_LOG( LOGPREFIX "tcp_budget_init: mmap of private table failed : %d (%s), budget disabled\n", errno, strerror(errno));
+			tcpbudget = NULL;
+		}
 	}
-	else
+
+	tcpsrcport = (unsigned int)getpid();
+	return(rc);
+}
+
+// Locate the budget entry for this scan's client
+uint64_t * tcp_budget_entry(struct scan_context_struc *ctx)
+{
+	uint64_t hash = (ctx->host_msb ^ (ctx->host_lsb * 0x9E3779B97F4A7C15ULL));
+	return( &tcpbudget[(hash ^ (hash >> 32)) % IPSCAN_TCP_BUDGET_ENTRIES] );
+}
+
+//
+// Take a place in the client's budget, returning 1 if successful or 0 if the budget is exhausted.
+// A forced take always succeeds, so a probe which has waited long enough is never failed by it.
+//
+
+int tcp_budget_acquire(struct scan_context_struc *ctx, int force)
+{
+	uint64_t *entry, word, newword;
+	uint64_t nowsecs = tcp_now_usecs() / 1000000;
+	uint32_t count;
+
+	if (NULL == tcpbudget) return(1);
+	entry = tcp_budget_entry(ctx);
+
+	word = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+	do
+	{
+		uint64_t stamp = (word >> 32);
+		count = (uint32_t)(word & 0xFFFFFFFF);
+		if (stamp > nowsecs || (nowsecs - stamp) > TCP_BUDGET_STALE_SECS) count = 0;
+		if (0 == force && count >= IPSCAN_TCP_HOST_BUDGET) return(0);
+		newword = (nowsecs << 32) | (uint64_t)(count + 1);
+	} while (!__atomic_compare_exchange_n(entry, &word, newword, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	return(1);
+}
+
+void tcp_budget_release(struct scan_context_struc *ctx)
+{
+	uint64_t *entry, word, newword;
+	uint64_t nowsecs = tcp_now_usecs() / 1000000;
+	uint32_t count;
+
+	if (NULL == tcpbudget) return;
+	entry = tcp_budget_entry(ctx);
+
+	word = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+	do
+	{
+		// The entry may have been recovered as stale whilst our place was held
+		count = (uint32_t)(word & 0xFFFFFFFF);
+		if (0 == count) return;
+		newword = (nowsecs << 32) | (uint64_t)(count - 1);
+	} while (!__atomic_compare_exchange_n(entry, &word, newword, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+void tcp_budget_sleep(void)
+{
+	struct timespec ts;
+	ts.tv_sec = (time_t)(IPSCAN_TCP_BUDGET_RETRY_USECS / 1000000);
+	ts.tv_nsec = (long)((IPSCAN_TCP_BUDGET_RETRY_USECS % 1000000) * 1000);
+	while (-1 == nanosleep(&ts, &ts) && EINTR == errno);
+}
+
+//
+// Errors which indicate that this host has run out of local ports or descriptors, rather
+// than anything about the client's port - the probe should be retried shortly
+//
+
+int tcp_socket_exhausted(int errsv)
+{
+	return( (EADDRNOTAVAIL == errsv || EADDRINUSE == errsv || EMFILE == errsv || ENFILE == errsv) ? 1 : 0 );
+}
+
+//
+// Bind a probe socket's source port from the configured range
+//
+
+int tcp_bind_source(int sock)
+{
+	#if (0 != IPSCAN_TCP_SRCPORT_MIN)
+	uint32_t range = ((uint32_t)IPSCAN_TCP_SRCPORT_MAX << 16) | (uint32_t)IPSCAN_TCP_SRCPORT_MIN;
+	unsigned int span = (IPSCAN_TCP_SRCPORT_MAX - IPSCAN_TCP_SRCPORT_MIN) + 1;
+	unsigned int tries;
+	struct sockaddr_in6 localaddr;
+	int one = 1;
+
+	// Preferably let the kernel choose from the range at connect(), when it can take the
+	// whole address and port 4-tuple into account
+	if (0 == setsockopt(sock, IPPROTO_IP, IP_LOCAL_PORT_RANGE, &range, sizeof(range))) return(0);
+
+	// Otherwise walk through the range ourselves - SO_REUSEADDR permits ports in TIME_WAIT
+	if (0 != setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)))
+	{
+		IPSCAN_LOG( LOGPREFIX "tcp_bind_source: Bad setsockopt SO_REUSEADDR set, returned %d (%s)\n", errno, strerror(errno));
+		return(-1);
+	}
+	memset(&localaddr, 0, sizeof(localaddr));
+	localaddr.sin6_family = AF_INET6;
+	localaddr.sin6_addr = in6addr_any;
+	for (tries = 0 ; tries < span ; tries++)
+	{
+		localaddr.sin6_port = htons((uint16_t)(IPSCAN_TCP_SRCPORT_MIN + (tcpsrcport++ % span)));
+		if (0 == bind(sock, (struct sockaddr *)&localaddr, sizeof(localaddr))) return(0);
+		if (EADDRINUSE != errno) break;
+	}
+	return(-1);
+	#else
+	(void)sock;
+	return(0);
+	#endif
+}
+
+//
+// Create a probe socket, bound to the source port range, returning -1 with errno set on failure
+//
+
+int tcp_probe_socket(int flags)
+{
+	int sock = socket(AF_INET6, SOCK_STREAM | flags, 0);
+	if (-1 == sock) return(-1);
+
+	if (0 != tcp_bind_source(sock))
+	{
+		int errsv = errno;
+		close(sock);
+		errno = errsv;
+		return(-1);
+	}
+	return(sock);
+}
+
+//
+// Prepare a probe socket for closing - a connection to an open port is reset, rather than
+// closed gracefully, so that it does not occupy a local port whilst in TIME_WAIT
+//
+
+void tcp_probe_linger(int sock, int result)
+{
+	#if (1 == IPSCAN_TCP_ABORTIVE_CLOSE)
+	if (PORTOPEN == result)
+	{
+		struct linger lingerval;
+		lingerval.l_onoff = 1;
+		lingerval.l_linger = 0;
+		if (0 != setsockopt(sock, SOL_SOCKET, SO_LINGER, &lingerval, sizeof(lingerval)))
+		{
+			IPSCAN_LOG( LOGPREFIX "tcp_probe_linger: Bad setsockopt SO_LINGER set, returned %d (%s)\n", errno, strerror(errno));
+		}
+	}
+	#else
+	(void)sock;
+	(void)result;
+	#endif
+}
+
+void tcp_probe_close(int sock, int result)
+{
+	tcp_probe_linger(sock, result);
+	if (-1 == close(sock))
+	{
+		IPSCAN_LOG( LOGPREFIX "tcp_probe_close: close unexpected failure : %d (%s)\n", errno, strerror(errno));
+	}
+}
+
+//
+// Check an individual TCP port
+//
+
+int check_tcp_port(struct scan_context_struc *ctx, uint16_t port, uint8_t special, uint64_t timeoutusecs)
+{
+	struct sockaddr_in6 remoteaddr;
+	int sock = -1, timeo = -1, conn = -1;
+	int retry;
+	struct timeval timeout;
+	uint64_t waitstart;
+
+	// set return value to a known default
+	int retval = PORTUNKNOWN;
+
+	// The target was resolved once for the whole scan, only the port differs
+	memcpy(&remoteaddr, &ctx->remoteaddr, sizeof(remoteaddr));
+	remoteaddr.sin6_port = htons(port);
+
+	// Wait for a place in the client's socket budget
+	waitstart = tcp_now_usecs();
+	while (0 == tcp_budget_acquire(ctx, ((tcp_now_usecs() - waitstart) >= IPSCAN_TCP_BUDGET_MAXWAIT_USECS)))
+	{
+		tcp_budget_sleep();
+	}
+
+	do
 	{
+		retry = 0;
+		retval = PORTUNKNOWN;
 
-		// cycle around the results ...
-		for (aip = res; (NULL != aip && PORTUNKNOWN == retval) ; aip = aip->ai_next)
+		// Attempt to create a socket
+		sock = tcp_probe_socket(0);
+		if (sock == -1)
 		{
-			// If this is not an IPv6 address then skip, should never happen now AF family specified ...
-			if (aip->ai_family != AF_INET6)
+			int errsv = errno ;
+			if (0 != tcp_socket_exhausted(errsv) && (tcp_now_usecs() - waitstart) < IPSCAN_TCP_BUDGET_MAXWAIT_USECS)
 			{
-				// IPSCAN_LOG( LOGPREFIX "Skipping, because ai_family != AF_INET6 (actually %d)\n",aip->ai_family);
-				continue;
+				retry = 1;
 			}
+			else
+			{
+				IPSCAN_LOG( LOGPREFIX "check_tcp_port: Bad socket call, returned %d (%s)\n", errsv, strerror(errsv));
+			}
+			retval = PORTINTERROR;
+		}
 
-			// Attempt to create a socket
-			sock = socket(aip->ai_family, aip->ai_socktype, aip->ai_protocol);
-			if (sock == -1)
+		// Assuming something bad hasn't already happened then attempt to set the receive timeout
+		if (PORTUNKNOWN == retval)
+		{
+			// Set send timeout
+			memset(&timeout, 0, sizeof(timeout));
+			timeout.tv_sec = (time_t)(timeoutusecs / 1000000);
+			timeout.tv_usec = (suseconds_t)(timeoutusecs % 1000000);
+			timeo = setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+			if (timeo < 0)
 			{
 				int errsv = errno ;
-				IPSCAN_LOG( LOGPREFIX "check_tcp_port: Bad socket call, returned %d (%s)\n", errsv, strerror(errsv));
+				IPSCAN_LOG( LOGPREFIX "check_tcp_port: Bad setsockopt SO_SNDTIMEO set, returned %d (%s)\n", errsv, strerror(errsv));
 				retval = PORTINTERROR;
 			}
+		}
 
-			// Assuming something bad hasn't already happened then attempt to set the receive timeout
-			if (PORTUNKNOWN == retval)
+		// Assuming something bad hasn't already happened then attempt to set the receive timeout
+		if (PORTUNKNOWN == retval)
+		{
+			// Set receive timeout
+			memset(&timeout, 0, sizeof(timeout));
+			timeout.tv_sec = (time_t)(timeoutusecs / 1000000);
+			timeout.tv_usec = (suseconds_t)(timeoutusecs % 1000000);
+			timeo = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			if (timeo < 0)
 			{
-				// Set send timeout
-				memset(&timeout, 0, sizeof(timeout));
-				timeout.tv_sec = TIMEOUTSECS;
-				timeout.tv_usec = TIMEOUTMICROSECS;
-				timeo = setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
-				if (timeo < 0)
-				{
-					int errsv = errno ;
-					IPSCAN_LOG( LOGPREFIX "check_tcp_port: Bad setsockopt SO_SNDTIMEO set, returned %d (%s)\n", errsv, strerror(errsv));
-					retval = PORTINTERROR;
-				}
+				int errsv = errno ;
+				IPSCAN_LOG( LOGPREFIX "check_tcp_port: Bad setsockopt SO_RCVTIMEO set, returned %d (%s)\n", errsv, strerror(errsv));
+				retval = PORTINTERROR;
 			}
+		}
+
+		// Assuming something bad hasn't already happened then attempt to connect
+		if (PORTUNKNOWN == retval)
+		{
+			// attempt to connect
+			conn = connect(sock, (struct sockaddr *)&remoteaddr, sizeof(remoteaddr));
+			int errsv = errno ;
+
+			// map the result through the expected list of results
+			retval = tcp_connect_result(conn, errsv);
 
-			// Assuming something bad hasn't already happened then attempt to set the receive timeout
-			if (PORTUNKNOWN == retval)
+			// Running out of local ports says nothing about the client, so try again shortly
+			if (-1 == conn && 0 != tcp_socket_exhausted(errsv) && (tcp_now_usecs() - waitstart) < IPSCAN_TCP_BUDGET_MAXWAIT_USECS)
 			{
-				// Set receive timeout
-				memset(&timeout, 0, sizeof(timeout));
-				timeout.tv_sec = TIMEOUTSECS;
-				timeout.tv_usec = TIMEOUTMICROSECS;
-				timeo = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-				if (timeo < 0)
-				{
-					int errsv = errno ;
-					IPSCAN_LOG( LOGPREFIX "check_tcp_port: Bad setsockopt SO_RCVTIMEO set, returned %d (%s)\n", errsv, strerror(errsv));
-					retval = PORTINTERROR;
-				}
+				retry = 1;
+				retval = PORTINTERROR;
 			}
 
-			// Assuming something bad hasn't already happened then attempt to connect
-			if (PORTUNKNOWN == retval)
+			#ifdef RESULTSDEBUG
+			if (0 != special)
 			{
-				// attempt to connect
-				conn = connect(sock, aip->ai_addr, aip->ai_addrlen);
-				int errsv = errno ;
-
-				// cycle through the expected list of results
-				for (i = 0; PORTEOL != resultsstruct[i].returnval && PORTUNKNOWN == retval ; i++)
-				{
-
-					// Find a matching connect returncode and also errno, if appropriate
-					if (resultsstruct[i].connrc == conn)
-					{
-						// Set the returnvalue if we find a match
-						if ( conn == 0 || (conn == -1 && resultsstruct[i].connerrno == errsv) )
-						{
-							retval = resultsstruct[i].returnval;
-						}
-					}
-				}
+				IPSCAN_LOG( LOGPREFIX "check_tcp_port: found port %d:%d returned conn = %d, errsv = %d(%s)\n", port, special, conn, errsv, strerror(errsv));
+			}
+			else
+			{
+				IPSCAN_LOG( LOGPREFIX "check_tcp_port: found port %d returned conn = %d, errsv = %d(%s)\n", port, conn, errsv, strerror(errsv));
+			}
+			#endif
 
-				#ifdef RESULTSDEBUG
+			// If we haven't found a matching returncode/errno then log this ....
+			if (PORTUNKNOWN == retval && 0 == retry)
+			{
 				if (0 != special)
 				{
-					IPSCAN_LOG( LOGPREFIX "check_tcp_port: found port %d:%d returned conn = %d, errsv = %d(%s)\n", port, special, conn, errsv, strerror(errsv));
+					IPSCAN_LOG( LOGPREFIX "check_tcp_port: connect unexpected response, errno is : %d (%s) for host %s port %d:%d\n", \
+							errsv, strerror(errsv), ctx->hostname, port, special);
 				}
 				else
 				{
-					IPSCAN_LOG( LOGPREFIX "check_tcp_port: found port %d returned conn = %d, errsv = %d(%s)\n", port, conn, errsv, strerror(errsv));
-				}
-				#endif
-
-				// If we haven't found a matching returncode/errno then log this ....
-				if (PORTUNKNOWN == retval)
-				{
-					if (0 != special)
-					{
-						IPSCAN_LOG( LOGPREFIX "check_tcp_port: connect unexpected response, errno is : %d (%s) for host %s port %d:%d\n", \
-								errsv, strerror(errsv), hostname, port, special);
-					}
-					else
-					{
-						IPSCAN_LOG( LOGPREFIX "check_tcp_port: connect unexpected response, errno is : %d (%s) for host %s port %d\n", \
-								errsv, strerror(errsv), hostname, port);
-					}
-					retval = PORTUNEXPECTED;
-				}
-
-				cl = close(sock);
-				if (cl == -1)
-				{
-					IPSCAN_LOG( LOGPREFIX "check_tcp_port: close unexpected failure : %d (%s)\n", errno, strerror(errno));
-				}
-
-			}
-			else
-			{
-				// Something bad has happened during setsockopts, but ensure we close an open socket anyway
-				if (-1 != sock)
-				{
-					cl = close(sock);
-					if (cl == -1)
-					{
-						IPSCAN_LOG( LOGPREFIX "check_tcp_port: close unexpected failure : %d (%s)\n", errno, strerror(errno));
-					}
+					IPSCAN_LOG( LOGPREFIX "check_tcp_port: connect unexpected response, errno is : %d (%s) for host %s port %d\n", \
+							errsv, strerror(errsv), ctx->hostname, port);
 				}
+				retval = PORTUNEXPECTED;
 			}
+		}
 
-		} // end for loop
-		freeaddrinfo(res);
-	}
+		// Ensure we close an open socket in all cases
+		if (-1 != sock)
+		{
+			tcp_probe_close(sock, retval);
+			sock = -1;
+		}
 
-	// If we received any non-positive feedback then make sure we wait at least IPSCAN_MINTIME_PER_PORT secs
-	if ((PORTOPEN != retval) && (PORTINPROGRESS != retval)) sleep(IPSCAN_MINTIME_PER_PORT);
+		if (0 != retry) tcp_budget_sleep();
+	} while (0 != retry);
+
+	tcp_budget_release(ctx);
 
 	return(retval);
 }
 
 
-int check_tcp_ports_parll(char * hostname, unsigned int portindex, unsigned int todo, uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, struct portlist_struc *portlist)
+int check_tcp_ports_parll(struct scan_context_struc *ctx, unsigned int portindex, unsigned int todo, struct portlist_struc *portlist, uint64_t timeoutusecs)
 {
-	int rc,result;
+	int result;
 	unsigned int i;
 	pid_t childpid = fork();
 	if (childpid > 0)
@@ -268,18 +551,15 @@ int check_tcp_ports_parll(char * hostname, unsigned int portindex, unsigned int
 		IPSCAN_LOG( LOGPREFIX "check_tcp_ports_parll(): startindex %d, todo %d\n",portindex,todo);
 		#endif
 		// child - actually do the work here - and then exit successfully
-		char unusedfield[8] = "unused\0";
 		for (i = 0 ; i < todo ; i++)
 		{
 			uint16_t port = portlist[portindex+i].port_num;
 			uint8_t special = portlist[portindex+i].special;
-			result = check_tcp_port(hostname, port, special);
+			// Wait for a token from the bucket shared with the other children
+			pacer_wait();
+			result = check_tcp_port(ctx, port, special, timeoutusecs);
 			// Put results into database
-			rc = write_db(host_msb, host_lsb, timestamp, session, (uint32_t)(port + ((special & IPSCAN_SPECIAL_MASK) << IPSCAN_SPECIAL_SHIFT) + (IPSCAN_PROTO_TCP << IPSCAN_PROTO_SHIFT)), result, unusedfield );
-			if (rc != 0)
-			{
-				IPSCAN_LOG( LOGPREFIX "check_tcp_ports_parll(): ERROR: check_tcp_port_parll() write_db returned %d\n", rc);
-			}
+			(void)tcp_record_result(ctx, port, special, result);
 		}
 		// Usual practice to have children _exit() whilst the parent calls exit()
 		_exit(EXIT_SUCCESS);
@@ -291,3 +571,642 @@ int check_tcp_ports_parll(char * hostname, unsigned int portindex, unsigned int
 	}
 	return( (int)childpid );
 }
+
+
+//
+// Non-blocking TCP connect engine
+//
+// Every probe socket is opened with SOCK_NONBLOCK so that all of the connect() attempts
+// are issued at once, up to MAXTCPINFLIGHT, and their completions are collected through
+// a single epoll instance. Each probe is allowed the RTT-derived connect timeout current when
+// it was sent, or longer should the timeout since have grown, after which it is reported as
+// PORTINPROGRESS, matching the blocking check_tcp_port(). Responses feed the RTT estimator,
+// so the timeout tightens as the scan progresses. New attempts are paced by the shared token
+// bucket, a slot waiting for its token being held off rather than blocking the engine.
+// Likewise a probe which finds the client's socket budget or the local ports exhausted is
+// deferred and retried, keeping its slot. Each slot's deadline, retry or holdoff is a timer
+// on the wheel, which tells epoll_wait() how long it may sleep.
+//
+
+// Per-probe state held by the non-blocking engine - a deferred probe is in use without a socket
+struct tcp_probe_struc
+{
+	int sock;
+	int inuse;
+	int budget;
+	unsigned int index;
+	uint64_t started;
+	uint64_t holdoff;
+	uint64_t waitstart;
+	struct timer_struc timer;
+};
+
+// Current monotonic time in microseconds
+uint64_t tcp_now_usecs(void)
+{
+	struct timespec ts;
+	if (0 != clock_gettime(CLOCK_MONOTONIC, &ts))
+	{
+		IPSCAN_LOG( LOGPREFIX "tcp_now_usecs: clock_gettime failed, errno %d (%s)\n", errno, strerror(errno));
+		return(0);
+	}
+	return( ((uint64_t)ts.tv_sec * 1000000) + ((uint64_t)ts.tv_nsec / 1000) );
+}
+
+// Feed the round trip time of a completed probe into the estimator
+void tcp_rtt_sample(struct rtt_struc *rtt, uint64_t started, int result)
+{
+	uint64_t now;
+
+	// Only responses measure the path to the client, timeouts and internal errors do not
+	if (PORTINPROGRESS == result || PORTINTERROR == result || PORTUNEXPECTED == result) return;
+
+	now = tcp_now_usecs();
+	if (now > started) rtt_sample(rtt, (now - started));
+}
+
+//
+// Re-probe of ambiguous results
+//
+// The first round notes each port which timed out or responded unexpectedly in a list which is
+// mapped shared, so that the forked blocking engine's children can add to it. Only those ports
+// are probed in the second round, whose result replaces the first round's where the two differ.
+//
+
+struct tcp_reprobe_struc
+{
+	int round;
+	unsigned int count;
+	unsigned int changed;
+	struct portlist_struc ports[IPSCAN_TCP_REPROBE_MAXPORTS];
+	int firstresult[IPSCAN_TCP_REPROBE_MAXPORTS];
+};
+
+// Record a second round result, updating the database only if the port's state has changed
+int tcp_record_reprobe(struct scan_context_struc *ctx, uint16_t port, uint8_t special, int result)
+{
+	struct tcp_reprobe_struc *reprobe = ctx->reprobe;
+	char unusedfield[8] = "unused\0";
+	unsigned int count = (reprobe->count < IPSCAN_TCP_REPROBE_MAXPORTS) ? reprobe->count : IPSCAN_TCP_REPROBE_MAXPORTS;
+	unsigned int i;
+	int rc;
+
+	for (i = 0 ; i < count && (reprobe->ports[i].port_num != port || reprobe->ports[i].special != special) ; i++);
+	if (i >= count)
+	{
+		IPSCAN_LOG( LOGPREFIX "tcp_record_reprobe: ERROR: port %d:%d was not in the first round's list\n", port, special);
+		return(-1);
+	}
+
+	// An internal failure of the second attempt tells us nothing, so the first result stands
+	if (result == reprobe->firstresult[i] || PORTINTERROR == result) return(0);
+
+	__atomic_fetch_add(&reprobe->changed, 1, __ATOMIC_ACQ_REL);
+	#if (1 < IPSCAN_LOGVERBOSITY)
+	IPSCAN_LOG( LOGPREFIX "tcp_record_reprobe: port %d:%d changed from %d to %d when re-probed\n", port, special, reprobe->firstresult[i], result);
+	#endif
+
+	// A full-range scan moves the port between bitmaps instead
+	if (NULL != ctx->bitmap)
+	{
+		bitmap_clear(ctx->bitmap, port, reprobe->firstresult[i]);
+		bitmap_set(ctx->bitmap, port, result);
+		return(0);
+	}
+
+	rc = update_db_scan(ctx, (uint32_t)(port + ((special & IPSCAN_SPECIAL_MASK) << IPSCAN_SPECIAL_SHIFT) + (IPSCAN_PROTO_TCP << IPSCAN_PROTO_SHIFT)), result, unusedfield );
+	if (rc != 0)
+	{
+		IPSCAN_LOG( LOGPREFIX "tcp_record_reprobe: ERROR: update_db_scan returned %d\n", rc);
+	}
+	return(rc);
+}
+
+// Record a single TCP result in the database, or the bitmap of a full-range scan
+int tcp_record_result(struct scan_context_struc *ctx, uint16_t port, uint8_t special, int result)
+{
+	char unusedfield[8] = "unused\0";
+	int rc;
+
+	if (NULL != ctx->reprobe)
+	{
+		if (2 == ctx->reprobe->round) return( tcp_record_reprobe(ctx, port, special, result) );
+
+		// Note any ambiguous first round result for the second round
+		if (PORTINPROGRESS == result || PORTUNEXPECTED == result)
+		{
+			unsigned int i = __atomic_fetch_add(&ctx->reprobe->count, 1, __ATOMIC_ACQ_REL);
+			if (i < IPSCAN_TCP_REPROBE_MAXPORTS)
+			{
+				ctx->reprobe->ports[i].port_num = port;
+				ctx->reprobe->ports[i].special = special;
+				ctx->reprobe->firstresult[i] = result;
+			}
+		}
+	}
+
+	// A full-range scan records one bit per port rather than a database row
+	if (NULL != ctx->bitmap)
+	{
+		bitmap_set(ctx->bitmap, port, result);
+		return(0);
+	}
+
+	rc = write_db_scan(ctx, (uint32_t)(port + ((special & IPSCAN_SPECIAL_MASK) << IPSCAN_SPECIAL_SHIFT) + (IPSCAN_PROTO_TCP << IPSCAN_PROTO_SHIFT)), result, unusedfield );
+	if (rc != 0)
+	{
+		IPSCAN_LOG( LOGPREFIX "tcp_record_result: ERROR: write_db returned %d\n", rc);
+	}
+	return(rc);
+}
+
+// Classify a completed connect attempt, logging any unexpected response
+int tcp_classify_probe(int conn, int errsv, char * hostname, uint16_t port, uint8_t special)
+{
+	int result = tcp_connect_result(conn, errsv);
+
+	#ifdef RESULTSDEBUG
+	IPSCAN_LOG( LOGPREFIX "tcp_classify_probe: found port %d:%d returned conn = %d, errsv = %d(%s)\n", port, special, conn, errsv, strerror(errsv));
+	#endif
+
+	if (PORTUNKNOWN == result)
+	{
+		if (0 != special)
+		{
+			IPSCAN_LOG( LOGPREFIX "tcp_classify_probe: connect unexpected response, errno is : %d (%s) for host %s port %d:%d\n", \
+					errsv, strerror(errsv), hostname, port, special);
+		}
+		else
+		{
+			IPSCAN_LOG( LOGPREFIX "tcp_classify_probe: connect unexpected response, errno is : %d (%s) for host %s port %d\n", \
+					errsv, strerror(errsv), hostname, port);
+		}
+		result = PORTUNEXPECTED;
+	}
+	return(result);
+}
+
+// Complete a probe - close the socket, free the slot and record the result
+int tcp_complete_probe(struct scan_context_struc *ctx, struct tcp_probe_struc *probe, int result, struct portlist_struc *portlist)
+{
+	tcp_rtt_sample(&ctx->rtt, probe->started, result);
+	timer_cancel(timer_wheel(), &probe->timer);
+
+	// Closing the descriptor also removes it from the epoll set
+	if (-1 != probe->sock)
+	{
+		tcp_probe_close(probe->sock, result);
+		probe->sock = -1;
+	}
+	if (0 != probe->budget)
+	{
+		tcp_budget_release(ctx);
+		probe->budget = 0;
+	}
+	probe->inuse = 0;
+
+	return( tcp_record_result(ctx, portlist[probe->index].port_num, portlist[probe->index].special, result) );
+}
+
+//
+// Start (or retry) a probe's connect attempt. Returns TCP_PROBE_STARTED once it is waiting in the
+// epoll set, with its deadline armed, TCP_PROBE_DEFERRED once its retry is armed, otherwise its result.
+//
+
+int tcp_start_probe(struct scan_context_struc *ctx, struct tcp_probe_struc *probe, int epfd, unsigned int slot, struct sockaddr_in6 *remoteaddr, struct portlist_struc *portlist, uint64_t now)
+{
+	int mayretry = ((now - probe->waitstart) < IPSCAN_TCP_BUDGET_MAXWAIT_USECS) ? 1 : 0;
+	int conn = -1, errsv;
+
+	if (0 == probe->budget)
+	{
+		if (0 == tcp_budget_acquire(ctx, (0 == mayretry)))
+		{
+			timer_add(timer_wheel(), &probe->timer, TIMER_TCP_RETRY, slot, now + IPSCAN_TCP_BUDGET_RETRY_USECS);
+			return(TCP_PROBE_DEFERRED);
+		}
+		probe->budget = 1;
+	}
+
+	probe->started = now;
+	probe->sock = tcp_probe_socket(SOCK_NONBLOCK | SOCK_CLOEXEC);
+	errsv = errno;
+	if (-1 != probe->sock)
+	{
+		remoteaddr->sin6_port = htons(portlist[probe->index].port_num);
+		conn = connect(probe->sock, (struct sockaddr *)remoteaddr, sizeof(struct sockaddr_in6));
+		errsv = errno;
+	}
+
+	if (-1 != probe->sock && -1 == conn && EINPROGRESS == errsv)
+	{
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLOUT;
+		ev.data.u32 = slot;
+		if (0 == epoll_ctl(epfd, EPOLL_CTL_ADD, probe->sock, &ev))
+		{
+			timer_add(timer_wheel(), &probe->timer, TIMER_TCP_DEADLINE, slot, now + rtt_timeout(&ctx->rtt, TCPTIMEOUT_FLOOR_USECS, ctx->tcpceilingusecs));
+			return(TCP_PROBE_STARTED);
+		}
+
+		IPSCAN_LOG( LOGPREFIX "tcp_start_probe: epoll_ctl failed, returned %d (%s)\n", errno, strerror(errno));
+		return(PORTINTERROR);
+	}
+
+	// Running out of local ports says nothing about the client, so try again shortly
+	if (-1 == conn && 0 != mayretry && 0 != tcp_socket_exhausted(errsv))
+	{
+		if (-1 != probe->sock)
+		{
+			tcp_probe_close(probe->sock, PORTINTERROR);
+			probe->sock = -1;
+		}
+		timer_add(timer_wheel(), &probe->timer, TIMER_TCP_RETRY, slot, now + IPSCAN_TCP_BUDGET_RETRY_USECS);
+		return(TCP_PROBE_DEFERRED);
+	}
+
+	if (-1 == probe->sock)
+	{
+		IPSCAN_LOG( LOGPREFIX "tcp_start_probe: Bad socket call, returned %d (%s)\n", errsv, strerror(errsv));
+		return(PORTINTERROR);
+	}
+
+	// Immediate completion (or failure), classify it now
+	return( tcp_classify_probe(conn, errsv, ctx->hostname, portlist[probe->index].port_num, portlist[probe->index].special) );
+}
+
+int check_tcp_ports_nonblock(struct scan_context_struc *ctx, unsigned int portindex, unsigned int todo, struct portlist_struc *portlist)
+{
+	struct tcp_probe_struc probes[MAXTCPINFLIGHT];
+	struct epoll_event events[MAXTCPINFLIGHT];
+	struct sockaddr_in6 remoteaddr;
+	struct timerwheel_struc *wheel = timer_wheel();
+	struct timer_struc *timer;
+	unsigned int next = 0, done = 0, i;
+	int epfd, rc = 0, paced;
+
+	memcpy(&remoteaddr, &ctx->remoteaddr, sizeof(remoteaddr));
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (-1 == epfd)
+	{
+		// Nothing has been scanned yet, so let the caller fall back to another engine
+		IPSCAN_LOG( LOGPREFIX "check_tcp_ports_nonblock: epoll_create1 failed, errno %d (%s)\n", errno, strerror(errno));
+		return(IPSCAN_TCP_ENGINE_UNAVAILABLE);
+	}
+
+	memset(probes, 0, sizeof(probes));
+	for (i = 0 ; i < MAXTCPINFLIGHT ; i++) probes[i].sock = -1;
+
+	#ifdef PARLLDEBUG
+	IPSCAN_LOG( LOGPREFIX "check_tcp_ports_nonblock(): startindex %d, todo %d, maximum in flight %d\n", portindex, todo, MAXTCPINFLIGHT);
+	#endif
+
+	while (done < todo)
+	{
+		uint64_t now = tcp_now_usecs();
+		int waitms, nfds, n, result;
+
+		// Act on whichever deadlines, retries and holdoffs have fallen due. Completions were collected
+		// first, on the previous pass, so late-processed replies are not mistaken for timeouts.
+		while (NULL != (timer = timer_expire(wheel, now)))
+		{
+			struct tcp_probe_struc *probe = &probes[timer->owner];
+
+			if (TIMER_TCP_DEADLINE == timer->kind)
+			{
+				// Allow the longer timeout, should it have grown since the probe was sent
+				uint64_t deadline = probe->started + rtt_timeout(&ctx->rtt, TCPTIMEOUT_FLOOR_USECS, ctx->tcpceilingusecs);
+				if (deadline > now)
+				{
+					timer_add(wheel, &probe->timer, TIMER_TCP_DEADLINE, timer->owner, deadline);
+					continue;
+				}
+				// Equivalent to blocking connect() timing out
+				rc |= tcp_complete_probe(ctx, probe, PORTINPROGRESS, portlist);
+				done++;
+			}
+			else if (TIMER_TCP_RETRY == timer->kind)
+			{
+				// A deferred probe already holds its token, so is retried straight away
+				result = tcp_start_probe(ctx, probe, epfd, timer->owner, &remoteaddr, portlist, now);
+				if (TCP_PROBE_STARTED == result || TCP_PROBE_DEFERRED == result) continue;
+
+				rc |= tcp_complete_probe(ctx, probe, result, portlist);
+				done++;
+			}
+			// Once a slot's pacing holdoff ends, it is simply free to be admitted below
+		}
+
+		// Start as many new connect attempts as there are free slots
+		for (i = 0, paced = 0 ; i < MAXTCPINFLIGHT && next < todo && 0 == paced ; i++)
+		{
+			struct tcp_probe_struc *probe = &probes[i];
+
+			if (0 != probe->inuse) continue;
+
+			// Only one slot at a time waits for a token, so none are reserved needlessly
+			if (0 != timer_pending(&probe->timer) || 0 == pacer_admit(&probe->holdoff, now))
+			{
+				if (0 == timer_pending(&probe->timer)) timer_add(wheel, &probe->timer, TIMER_TCP_PACE, i, probe->holdoff);
+				paced = 1;
+				continue;
+			}
+
+			probe->index = portindex + next;
+			probe->inuse = 1;
+			probe->waitstart = now;
+			next++;
+
+			result = tcp_start_probe(ctx, probe, epfd, i, &remoteaddr, portlist, now);
+			if (TCP_PROBE_STARTED == result || TCP_PROBE_DEFERRED == result) continue;
+
+			rc |= tcp_complete_probe(ctx, probe, result, portlist);
+			done++;
+		}
+		if (done >= todo) break;
+
+		// Sleep until the earliest deadline, retry or holdoff, unless a connect completes first
+		waitms = timer_wait_msecs(wheel, tcp_now_usecs());
+
+		nfds = epoll_wait(epfd, events, MAXTCPINFLIGHT, waitms);
+		if (-1 == nfds)
+		{
+			if (EINTR == errno) continue;
+			IPSCAN_LOG( LOGPREFIX "check_tcp_ports_nonblock: epoll_wait failed, returned %d (%s)\n", errno, strerror(errno));
+			nfds = 0;
+		}
+
+		for (n = 0 ; n < nfds ; n++)
+		{
+			struct tcp_probe_struc *probe = &probes[events[n].data.u32];
+			int soerr = 0;
+			socklen_t soerrlen = sizeof(soerr);
+
+			if (0 == probe->inuse || -1 == probe->sock) continue;
+			if (0 != getsockopt(probe->sock, SOL_SOCKET, SO_ERROR, &soerr, &soerrlen))
+			{
+				IPSCAN_LOG( LOGPREFIX "check_tcp_ports_nonblock: getsockopt SO_ERROR failed, returned %d (%s)\n", errno, strerror(errno));
+				result = PORTINTERROR;
+			}
+			else
+			{
+				// SO_ERROR holds the errno that a blocking connect() would have returned
+				result = tcp_classify_probe(((0 == soerr) ? 0 : -1), soerr, ctx->hostname, portlist[probe->index].port_num, portlist[probe->index].special);
+			}
+			rc |= tcp_complete_probe(ctx, probe, result, portlist);
+			done++;
+		}
+	}
+
+	// The probes' timers must not outlive them on the wheel
+	for (i = 0 ; i < MAXTCPINFLIGHT ; i++) timer_cancel(wheel, &probes[i].timer);
+
+	if (-1 == close(epfd))
+	{
+		IPSCAN_LOG( LOGPREFIX "check_tcp_ports_nonblock: close of epoll fd failed : %d (%s)\n", errno, strerror(errno));
+	}
+
+	return(rc);
+}
+
+
+//
+// Forked blocking engine - the original implementation, retained as the final fallback
+//
+
+int check_tcp_ports_blocking(struct scan_context_struc *ctx, unsigned int portindex, unsigned int todo, struct portlist_struc *portlist)
+{
+	// Children cannot feed back their own measurements, so they share the timeout known at the start
+	uint64_t timeoutusecs = rtt_timeout(&ctx->rtt, TCPTIMEOUT_FLOOR_USECS, ctx->tcpceilingusecs);
+	unsigned int porti = 0;
+
+	while (porti < todo)
+	{
+		unsigned int chunk = ((todo - porti) > MAXPORTSPERCHILD) ? MAXPORTSPERCHILD : (todo - porti);
+		// Share the scan's children with the ICMPv6 and UDP phases which may still be running
+		scan_child_slot(ctx, IPSCAN_PROTO_TCP, MAXCHILDREN);
+		#ifdef PARLLDEBUG
+		IPSCAN_LOG( LOGPREFIX "check_tcp_ports_blocking: check_tcp_ports_parll(%s,%d,%d,portlist)\n",ctx->hostname,(portindex+porti),chunk);
+		#endif
+		scan_child_add(ctx, (pid_t)check_tcp_ports_parll(ctx, (portindex + porti), chunk, portlist, timeoutusecs), IPSCAN_PROTO_TCP);
+		porti += chunk;
+	}
+	// Any re-probe round depends on this one's results, so wait for its children only
+	scan_children_wait(ctx, IPSCAN_PROTO_TCP);
+
+	// Children record their own results, and exit() the process should fork() fail
+	return(0);
+}
+
+//
+// Determine which TCP engine to use - may be overridden through the environment, which
+// allows the webserver (e.g. Apache SetEnv) to select an engine without recompilation
+//
+
+int tcp_engine_select(void)
+{
+	int engine = IPSCAN_TCP_ENGINE_DEFAULT;
+	char * enginevar = getenv(IPSCAN_TCP_ENGINE_ENV);
+
+	if (NULL != enginevar && strnlen(enginevar, 16) < 16)
+	{
+		if (0 == strncmp(enginevar, "blocking", 16)) engine = IPSCAN_TCP_ENGINE_BLOCKING;
+		else if (0 == strncmp(enginevar, "epoll", 16)) engine = IPSCAN_TCP_ENGINE_EPOLL;
+		#if (1 == IPSCAN_INCLUDE_URING)
+		else if (0 == strncmp(enginevar, "uring", 16)) engine = IPSCAN_TCP_ENGINE_URING;
+		#endif
+		#if (1 == IPSCAN_INCLUDE_SYN)
+		else if (0 == strncmp(enginevar, "syn", 16)) engine = IPSCAN_TCP_ENGINE_SYN;
+		#endif
+		else IPSCAN_LOG( LOGPREFIX "tcp_engine_select: unrecognised %s value, using default engine\n", IPSCAN_TCP_ENGINE_ENV);
+	}
+	return(engine);
+}
+
+//
+// Scan a list of TCP ports, starting with the given engine and falling back as required
+//
+
+int tcp_run_engine(struct scan_context_struc *ctx, int *engine, unsigned int portindex, unsigned int todo, struct portlist_struc *portlist)
+{
+	int rc = IPSCAN_TCP_ENGINE_UNAVAILABLE;
+
+	#if (1 == IPSCAN_INCLUDE_SYN)
+	if (IPSCAN_TCP_ENGINE_SYN == *engine)
+	{
+		rc = check_tcp_ports_syn(ctx, portindex, todo, portlist);
+		if (IPSCAN_TCP_ENGINE_UNAVAILABLE == rc) *engine = IPSCAN_TCP_ENGINE_DEFAULT;
+	}
+	#endif
+
+	#if (1 == IPSCAN_INCLUDE_URING)
+	if (IPSCAN_TCP_ENGINE_URING == *engine)
+	{
+		rc = check_tcp_ports_uring(ctx, portindex, todo, portlist);
+		if (IPSCAN_TCP_ENGINE_UNAVAILABLE == rc) *engine = IPSCAN_TCP_ENGINE_EPOLL;
+	}
+	#endif
+
+	if (IPSCAN_TCP_ENGINE_EPOLL == *engine)
+	{
+		rc = check_tcp_ports_nonblock(ctx, portindex, todo, portlist);
+		if (IPSCAN_TCP_ENGINE_UNAVAILABLE == rc) *engine = IPSCAN_TCP_ENGINE_BLOCKING;
+	}
+
+	if (IPSCAN_TCP_ENGINE_BLOCKING == *engine)
+	{
+		rc = check_tcp_ports_blocking(ctx, portindex, todo, portlist);
+	}
+
+	return(rc);
+}
+
+//
+// Scan a list of TCP ports, using the preferred engine, then re-probe any ambiguous results
+//
+
+int check_tcp_ports(struct scan_context_struc *ctx, unsigned int portindex, unsigned int todo, struct portlist_struc *portlist)
+{
+	int engine = tcp_engine_select();
+	int rc;
+
+	// Map the socket budget before any children are forked, so that they share it
+	(void)tcp_budget_init();
+
+	// Adopt the echo train's round trip time, should it have arrived since the scan began waiting for it
+	(void)rtt_share_adopt(ctx);
+
+	#if (1 == IPSCAN_TCP_REPROBE)
+	// A list longer than the re-probe list could hold is scanned in a single round instead, since
+	// any ambiguous port left out of the second round would keep the shorter first round's result
+	if (todo > IPSCAN_TCP_REPROBE_MAXPORTS)
+	{
+		IPSCAN_LOG( LOGPREFIX "check_tcp_ports: %u ports exceeds the re-probe list of %d, scanning in a single round\n", todo, IPSCAN_TCP_REPROBE_MAXPORTS);
+		ctx->reprobe = NULL;
+	}
+	else
+	{
+		ctx->reprobe = mmap(NULL, sizeof(struct tcp_reprobe_struc), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == (void *)ctx->reprobe)
+		{
+			IPSCAN_LOG( LOGPREFIX "check_tcp_ports: mmap of re-probe list failed : %d (%s), scanning in a single round\n", errno, strerror(errno));
+			ctx->reprobe = NULL;
+		}
+		else
+		{
+			ctx->reprobe->round = 1;
+		}
+	}
+	#endif
+
+	// A single round must allow the full timeout, whereas the first of two may be shorter
+	ctx->tcpceilingusecs = (NULL != ctx->reprobe) ? TCPTIMEOUT_FIRST_CEILING_USECS : TCPTIMEOUT_CEILING_USECS;
+	rc = tcp_run_engine(ctx, &engine, portindex, todo, portlist);
+
+	#if (1 == IPSCAN_TCP_REPROBE)
+	if (NULL != ctx->reprobe)
+	{
+		unsigned int count = ctx->reprobe->count;
+		if (count > IPSCAN_TCP_REPROBE_MAXPORTS)
+		{
+			IPSCAN_LOG( LOGPREFIX "check_tcp_ports: ERROR: %u ambiguous ports found, only re-probing %d\n", count, IPSCAN_TCP_REPROBE_MAXPORTS);
+			count = IPSCAN_TCP_REPROBE_MAXPORTS;
+		}
+
+		if (0 < count)
+		{
+			// The engine which completed the first round also performs the second
+			ctx->reprobe->round = 2;
+			ctx->tcpceilingusecs = TCPREPROBE_CEILING_USECS;
+			rc |= tcp_run_engine(ctx, &engine, 0, count, &ctx->reprobe->ports[0]);
+			#if (1 <= IPSCAN_LOGVERBOSITY)
+			IPSCAN_LOG( LOGPREFIX "check_tcp_ports: re-probed %u ambiguous ports, %u changed state\n", count, ctx->reprobe->changed);
+			#endif
+		}
+
+		if (0 != munmap(ctx->reprobe, sizeof(struct tcp_reprobe_struc)))
+		{
+			IPSCAN_LOG( LOGPREFIX "check_tcp_ports: munmap of re-probe list failed : %d (%s)\n", errno, strerror(errno));
+		}
+		ctx->reprobe = NULL;
+	}
+	#endif
+	ctx->tcpceilingusecs = TCPTIMEOUT_CEILING_USECS;
+
+	#ifdef PARLLDEBUG
+	IPSCAN_LOG( LOGPREFIX "check_tcp_ports: completed using engine %d, rc = %d\n", engine, rc);
+	#endif
+
+	return(rc);
+}
+
+//
+// Port set scan
+//
+// The ports in the set (a full-range scan being the set of every port) are handed to
+// check_tcp_ports() in blocks of up to IPSCAN_FULLSCAN_BLOCK, so that the concurrent engine
+// (and the re-probe of any ambiguous results) works as for a normal scan. Results are recorded
+// in a bitmap per state, each of which is then written to the database as a single row. The
+// number of ports found in each state is added to portsstats.
+//
+
+int check_tcp_ports_set(struct scan_context_struc *ctx, const struct portset_struc *set, unsigned int *portsstats)
+{
+	struct portlist_struc block[IPSCAN_FULLSCAN_BLOCK];
+	unsigned int next = 0, first = 0, last = 0, port = 1;
+	unsigned int todo;
+	int state, rc = 0, dbrc;
+	int more;
+
+	ctx->bitmap = bitmap_create();
+	if (NULL == ctx->bitmap)
+	{
+		IPSCAN_LOG( LOGPREFIX "check_tcp_ports_set: unable to allocate the results bitmap\n");
+		return(-1);
+	}
+
+	// Walk the set a range at a time, filling each block before it is scanned
+	more = bitmap_next_range(&set->bits[0], &next, &first, &last);
+	if (0 != more) port = first;
+	while (0 != more)
+	{
+		for (todo = 0 ; todo < IPSCAN_FULLSCAN_BLOCK && 0 != more ; todo++)
+		{
+			block[todo].port_num = (uint16_t)port;
+			block[todo].special = 0;
+			block[todo].port_desc[0] = 0;
+			if (port < last)
+			{
+				port++;
+			}
+			else
+			{
+				more = bitmap_next_range(&set->bits[0], &next, &first, &last);
+				port = first;
+			}
+		}
+		rc |= check_tcp_ports(ctx, 0, todo, &block[0]);
+	}
+
+	for (state = 0 ; state < NUMRESULTTYPES ; state++)
+	{
+		if (0 == ctx->bitmap->count[state]) continue;
+
+		portsstats[state] += ctx->bitmap->count[state];
+		#if (1 < IPSCAN_LOGVERBOSITY)
+		IPSCAN_LOG( LOGPREFIX "check_tcp_ports_set: found %u ports in state %d\n", ctx->bitmap->count[state], state);
+		#endif
+		dbrc = write_db_bitmap(ctx->host_msb, ctx->host_lsb, ctx->timestamp, ctx->session, IPSCAN_PROTO_TCP, state, ctx->bitmap->count[state], &ctx->bitmap->bits[state][0]);
+		if (0 != dbrc)
+		{
+			IPSCAN_LOG( LOGPREFIX "check_tcp_ports_set: ERROR: write_db_bitmap returned %d for state %d\n", dbrc, state);
+			rc |= dbrc;
+		}
+	}
+
+	bitmap_destroy(ctx->bitmap);
+	ctx->bitmap = NULL;
+	return(rc);
+}
@@ -0,0 +1,243 @@
+//    IPscan - an HTTP-initiated IPv6 port scanner.
+//
+//    Copyright (C) 2011-2021 Tim Chappell.
+//
+//    This file is part of IPscan.
+//
+//    IPscan is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with IPscan.  If not, see <http://www.gnu.org/licenses/>.
+
+// ipscan_timer.c 	version
+// 0.01			initial version - hierarchical timer wheel for probe deadlines, retransmissions and pacing
+
+#include "ipscan.h"
+//
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <limits.h>
+
+// Logging with syslog requires additional include
+#if (LOGMODE == 1)
+#include <syslog.h>
+#endif
+
+// Others that FreeBSD highlighted
+#include <stdint.h>
+#include <inttypes.h>
+
+//
+// Prototype declarations
+//
+uint64_t pacer_now_usecs(void);
+void timer_wheel_init(struct timerwheel_struc *wheel, uint64_t now);
+struct timerwheel_struc * timer_wheel(void);
+void timer_place(struct timerwheel_struc *wheel, struct timer_struc *timer);
+void timer_cascade(struct timerwheel_struc *wheel, unsigned int level);
+int timer_pending(const struct timer_struc *timer);
+void timer_add(struct timerwheel_struc *wheel, struct timer_struc *timer, int kind, unsigned int owner, uint64_t expires);
+void timer_cancel(struct timerwheel_struc *wheel, struct timer_struc *timer);
+struct timer_struc * timer_expire(struct timerwheel_struc *wheel, uint64_t now);
+uint64_t timer_next(struct timerwheel_struc *wheel);
+int timer_wait_msecs(struct timerwheel_struc *wheel, uint64_t now);
+
+//
+// The wheel has TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots, each slot an unsorted list.
+// A timer due within TIMER_WHEEL_SLOTS ticks sits in the level 0 slot of its tick, one due within
+// TIMER_WHEEL_SLOTS^2 ticks in the level 1 slot covering its tick, and so on. Each time a level
+// wraps, the next level's current slot is cascaded down, so a timer is moved at most once per
+// level. Adding, cancelling and expiring a timer are therefore O(1), however many are pending.
+//
+// Every engine in a process shares the one wheel, so that a loop serving several of them sleeps
+// until whichever deadline is earliest. A forked child starts with an empty wheel of its own.
+//
+static struct timerwheel_struc scanwheel;
+
+void timer_wheel_init(struct timerwheel_struc *wheel, uint64_t now)
+{
+	memset(wheel, 0, sizeof(struct timerwheel_struc));
+	wheel->tick = now / TIMER_TICK_USECS;
+	wheel->pid = (long)getpid();
+}
+
+struct timerwheel_struc * timer_wheel(void)
+{
+	if ((long)getpid() != scanwheel.pid) timer_wheel_init(&scanwheel, pacer_now_usecs());
+	return(&scanwheel);
+}
+
+// Link a timer into the slot for its expiry, relative to the wheel's current tick
+void timer_place(struct timerwheel_struc *wheel, struct timer_struc *timer)
+{
+	uint64_t when = timer->expires / TIMER_TICK_USECS;
+	uint64_t diff;
+	unsigned int level;
+
+	// Overdue timers are run at the current tick, and those beyond the wheel's reach are parked
+	// in the top level, to be placed again as it turns
+	if (when < wheel->tick) when = wheel->tick;
+	diff = when - wheel->tick;
+	if (diff >= ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+	{
+		diff = ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+		when = wheel->tick + diff;
+	}
+	for (level = 0 ; level < (TIMER_WHEEL_LEVELS - 1) && diff >= ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))) ; level++);
+
+	timer->level = (uint8_t)level;
+	timer->slot = (uint8_t)((when >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+	timer->next = wheel->slot[level][timer->slot];
+	if (NULL != timer->next) timer->next->pprev = &timer->next;
+	timer->pprev = &wheel->slot[level][timer->slot];
+	wheel->slot[level][timer->slot] = timer;
+	wheel->occupied[level] |= ((uint64_t)1 << timer->slot);
+}
+
+// Move every timer in a level's current slot down the wheel
+void timer_cascade(struct timerwheel_struc *wheel, unsigned int level)
+{
+	unsigned int slot = (unsigned int)((wheel->tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+	struct timer_struc *timer = wheel->slot[level][slot];
+	struct timer_struc *next;
+
+	wheel->slot[level][slot] = NULL;
+	wheel->occupied[level] &= ~((uint64_t)1 << slot);
+	while (NULL != timer)
+	{
+		next = timer->next;
+		timer_place(wheel, timer);
+		timer = next;
+	}
+}
+
+int timer_pending(const struct timer_struc *timer)
+{
+	return( (NULL != timer->pprev) ? 1 : 0 );
+}
+
+//
+// Arm a timer to expire at the given time (in microseconds, on the pacer's clock), re-arming it
+// if already pending. kind and owner are left for the caller to identify it when it expires.
+//
+
+void timer_add(struct timerwheel_struc *wheel, struct timer_struc *timer, int kind, unsigned int owner, uint64_t expires)
+{
+	timer_cancel(wheel, timer);
+	timer->kind = kind;
+	timer->owner = owner;
+	timer->expires = expires;
+	timer_place(wheel, timer);
+	wheel->count++;
+}
+
+void timer_cancel(struct timerwheel_struc *wheel, struct timer_struc *timer)
+{
+	if (NULL == timer->pprev) return;
+
+	*timer->pprev = timer->next;
+	if (NULL != timer->next) timer->next->pprev = timer->pprev;
+	if (NULL == wheel->slot[timer->level][timer->slot]) wheel->occupied[timer->level] &= ~((uint64_t)1 << timer->slot);
+	timer->next = NULL;
+	timer->pprev = NULL;
+	wheel->count--;
+}
+
+//
+// Remove and return one timer which has expired by time now, or NULL once there are none
+//
+
+struct timer_struc * timer_expire(struct timerwheel_struc *wheel, uint64_t now)
+{
+	uint64_t nowtick = now / TIMER_TICK_USECS;
+	struct timer_struc *timer;
+	unsigned int level;
+
+	while (1)
+	{
+		// Everything in the current tick's slot is due once the tick has passed, but only some may
+		// be within the tick itself
+		for (timer = wheel->slot[0][wheel->tick & TIMER_WHEEL_MASK]; NULL != timer; timer = timer->next)
+		{
+			if (timer->expires <= now)
+			{
+				timer_cancel(wheel, timer);
+				return(timer);
+			}
+		}
+		if (wheel->tick >= nowtick) return(NULL);
+
+		// With nothing pending at level 0, skip straight to the next point at which a level wraps
+		if (0 == wheel->occupied[0])
+		{
+			if ((wheel->tick | TIMER_WHEEL_MASK) >= nowtick)
+			{
+				wheel->tick = nowtick;
+				continue;
+			}
+			wheel->tick |= TIMER_WHEEL_MASK;
+		}
+		wheel->tick++;
+
+		for (level = 1 ; level < TIMER_WHEEL_LEVELS && 0 == ((wheel->tick >> (TIMER_WHEEL_BITS * (level - 1))) & TIMER_WHEEL_MASK) ; level++)
+		{
+			timer_cascade(wheel, level);
+		}
+	}
+}
+
+//
+// Determine when the earliest pending timer expires, or TIMER_NEVER if there are none. At each
+// level the first occupied slot, in the order the wheel will reach them, holds its earliest timers.
+//
+
+uint64_t timer_next(struct timerwheel_struc *wheel)
+{
+	uint64_t next = TIMER_NEVER, occupied;
+	struct timer_struc *timer;
+	unsigned int level, start, slot;
+
+	if (0 == wheel->count) return(TIMER_NEVER);
+
+	for (level = 0 ; level < TIMER_WHEEL_LEVELS ; level++)
+	{
+		if (0 == wheel->occupied[level]) continue;
+
+		// Above level 0 the current slot holds the furthest timers, since its nearer ones have been cascaded
+		start = (unsigned int)((wheel->tick >> (TIMER_WHEEL_BITS * level)) + ((0 == level) ? 0 : 1)) & TIMER_WHEEL_MASK;
+		occupied = (0 == start) ? wheel->occupied[level] : ((wheel->occupied[level] >> start) | (wheel->occupied[level] << (TIMER_WHEEL_SLOTS - start)));
+		slot = (start + (unsigned int)__builtin_ctzll(occupied)) & TIMER_WHEEL_MASK;
+
+		for (timer = wheel->slot[level][slot]; NULL != timer; timer = timer->next)
+		{
+			if (timer->expires < next) next = timer->expires;
+		}
+	}
+	return(next);
+}
+
+//
+// Milliseconds to wait, rounded up, for the earliest pending timer - as poll() and epoll_wait()
+// take it, so -1 (indefinitely) if there are none
+//
+
+int timer_wait_msecs(struct timerwheel_struc *wheel, uint64_t now)
+{
+	uint64_t next = timer_next(wheel);
+
+	if (TIMER_NEVER == next) return(-1);
+	if (next <= now) return(0);
+	if (((next - now) / 1000) >= (uint64_t)INT_MAX) return(INT_MAX);
+	return( (int)(((next - now) + 999) / 1000) );
+}
@@ -48,6 +48,20 @@
 // 0.28			Update copyright dates
 // 0.29			swap comparison terms, where appropriate
 // 0.30			delete old comments, update copyright year
+// 0.31			use the RTT-derived timeout supplied by the caller
+// 0.32			pace probes through the shared token bucket instead of sleeping per port
+// 0.33			take the pre-parsed target address from the scan context
+// 0.34			read the local address and MAC from the cached interface context, not getifaddrs() per probe
+// 0.35			move payload generation to prebuilt templates in ipscan_payload.c
+// 0.36			add the multiplexed engine, with all of a child's probes in flight at once
+// 0.37			send and receive the multiplexed engine's datagrams in batches
+// 0.38			retransmit unanswered probes with exponential backoff, within a fixed budget
+// 0.39			send all of a port's tests from one socket, telling their replies apart by protocol identifiers
+// 0.40			discard replies which do not answer the probe, rather than reporting the port open
+// 0.41			take each probe's additional timeout from the probe registry
+// 0.42			measure replies in full, including any further datagrams, and record the amplification factor
+// 0.43			schedule the multiplexed engine's retransmissions, deadlines and linger on the timer wheel
+// 0.44			take the UDP timeout from the echo train's round trip time, should it arrive after the scan began
 
 #include "ipscan.h"
 //
@@ -76,17 +90,26 @@
 // gettimeofday()
 #include <sys/time.h>
 
-// getifaddrs()
-#include <ifaddrs.h>
-
-// Link layer
-#include <linux/if_packet.h>
-#include <net/ethernet.h>
-
 //
 // Prototype declarations
 //
-int write_db(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, uint32_t port, int32_t result, char *indirecthost );
+int write_db_scan(struct scan_context_struc *ctx, uint32_t port, int32_t result, char *indirecthost);
+void pacer_wait(void);
+const struct udp_template_struc * udp_template_get(uint16_t port, uint8_t special, const char *hostname);
+int udp_payload_fill(const struct udp_template_struc *t, char *txmessage, uint32_t probeid);
+uint32_t udp_next_probeid(void);
+int udp_response_match(const struct udp_template_struc *t, uint32_t probeid, const char *reply, int len);
+uint64_t pacer_now_usecs(void);
+int udp_classify_error(struct scan_context_struc *ctx, uint16_t port, uint8_t special, int errsv);
+void udp_log_response(uint16_t port, uint8_t special, const char *rxmessage, int rxlen);
+uint64_t udp_probe_timeout(const struct udp_template_struc *t, uint64_t timeoutusecs);
+int check_udp_port(struct scan_context_struc *ctx, uint16_t port, uint8_t special, uint64_t timeoutusecs, struct udp_amp_struc *amp);
+void udp_result_note(char *note, size_t size, unsigned int retransmits, const struct udp_amp_struc *amp);
+int check_udp_ports_mux(struct scan_context_struc *ctx, unsigned int portindex, unsigned int todo, struct portlist_struc *udpportlist);
+uint64_t pacer_reserve(void);
+void pacer_sleep(uint64_t wait);
+uint64_t rtt_timeout(struct rtt_struc *rtt, uint64_t floorusecs, uint64_t ceilingusecs);
+int rtt_share_adopt(struct scan_context_struc *ctx);
 
 // Others that FreeBSD highlighted
 #include <netinet/in.h>
@@ -103,137 +126,204 @@ int write_db(uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t
 // Parallel processing related
 #include <sys/wait.h>
 
-int check_udp_port(char * hostname, uint16_t port, uint8_t special)
+// IPV6_RECVERR error queue
+#include <linux/errqueue.h>
+
+// from ipscan_udpbatch.c
+void udp_batch_reset(void);
+int udp_batch_add(int fd, const struct sockaddr_in6 *addr, const char *payload, int len);
+unsigned int udp_batch_pending(void);
+unsigned int udp_batch_send(int *errs);
+int udp_batch_recv(int fd, int flags);
+int udp_batch_rx(unsigned int i, struct sockaddr_in6 **from, char **data, int *len);
+int udp_batch_rx_size(unsigned int i);
+const struct sock_extended_err * udp_batch_rx_error(unsigned int i);
+
+// from ipscan_timer.c
+struct timerwheel_struc * timer_wheel(void);
+int timer_pending(const struct timer_struc *timer);
+void timer_add(struct timerwheel_struc *wheel, struct timer_struc *timer, int kind, unsigned int owner, uint64_t expires);
+void timer_cancel(struct timerwheel_struc *wheel, struct timer_struc *timer);
+struct timer_struc * timer_expire(struct timerwheel_struc *wheel, uint64_t now);
+int timer_wait_msecs(struct timerwheel_struc *wheel, uint64_t now);
+
+//
+// Map a failed read's errno onto a result, as for a connected socket - an ICMPv6 error
+// delivered through the error queue is classified the same way
+//
+
+int udp_classify_error(struct scan_context_struc *ctx, uint16_t port, uint8_t special, int errsv)
 {
-	char txmessage[UDP_BUFFER_SIZE+1],rxmessage[UDP_BUFFER_SIZE+1];
-	struct sockaddr_in6 remoteaddr;
-	struct timeval timeout;
-	char localaddrstr[INET6_ADDRSTRLEN+1];
-	struct sockaddr_in6 localaddr;
+	int retval = PORTUNKNOWN;
+	unsigned int i;
+
+	// cycle through the expected list of results
+	for (i = 0; PORTEOL != resultsstruct[i].returnval && PORTUNKNOWN == retval ; i++)
+	{
+		// Find a matching read returncode and also errno
+		if (-1 == resultsstruct[i].connrc && resultsstruct[i].connerrno == errsv)
+		{
+			retval = resultsstruct[i].returnval;
+		}
+	}
 
-	// Local address update indication
-	int la_update = 0;
+	#ifdef RESULTSDEBUG
+	IPSCAN_LOG( LOGPREFIX "udp_classify_error: found port %d:%d returned errsv = %d(%s)\n", port, special, errsv, strerror(errsv));
+	#endif
 
-	int rc = 0;
-	unsigned int i = 0;
-	const char * rccharptr;
-	int fd = -1;
+	// If we haven't found a matching returncode/errno then log this ....
+	if (PORTUNKNOWN == retval)
+	{
+		if (0 != special)
+		{
+			IPSCAN_LOG( LOGPREFIX "udp_classify_error: read(port %d:%d) unexpected response, errno is : %d (%s) for host %s port %d\n", port, special,\
+					errsv, strerror(errsv), ctx->hostname, port);
+		}
+		else
+		{
+			IPSCAN_LOG( LOGPREFIX "udp_classify_error: read(port %d) unexpected response, errno is : %d (%s) for host %s port %d\n", port, \
+					errsv, strerror(errsv), ctx->hostname, port);
+		}
+		retval = PORTUNEXPECTED;
+	}
+	return(retval);
+}
 
-	// Use different community strings for SNMPv1 (index 0) and SNMPv2c (index 1)
-	char community[2][16] = { "public", "private" };
+//
+// Log the start of a response packet - but only if LOGVERBOSITY is set to 1
+//
 
-	// buffer for logging entries
+void udp_log_response(uint16_t port, uint8_t special, const char *rxmessage, int rxlen)
+{
 	#ifdef UDPDEBUG
 	int udplogbuffersize = LOGENTRYSIZE;
 	char udplogbuffer[ (size_t)(LOGENTRYSIZE + 1) ];
 	char *udplogbufferptr = &udplogbuffer[0];
-	#endif
-
-	// Holds length of transmitted UDP packet, which since they are representative packets,
-	//  depends on the port being tested
-	int len = 0;
-
-	// set return value to a known default
-	int retval = PORTUNKNOWN;
-
-	// Capture time of day and convert to NTP format
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	const unsigned long long EPOCH = 2208988800ULL;
-	const unsigned long long NTP_SCALE_FRAC = 4294967296ULL;
-	long long unsigned int tv_secs  = (long long unsigned int)(tv.tv_sec) + EPOCH;
-	long long unsigned int tv_usecs = ((NTP_SCALE_FRAC * (long long unsigned int)tv.tv_usec) / 1000000UL);
+	int rxlength = ( rxlen < UDPMAXLOGOCTETS ) ? rxlen : UDPMAXLOGOCTETS;
+	int i = 0, rc, position = 0;
 
-	// Prefill transmit message buffer with 0s
-	memset(&txmessage, 0,  UDP_BUFFER_SIZE+1);
-
-	// Local MAC address lookup and storage
-	struct ifaddrs *ifaddr, *ifa;
-	int family;
-	unsigned char localmacaddr[6];
-	memset( &localmacaddr, 0, sizeof(localmacaddr));
-	// Fill in a default MAC in case getifaddrs() is unsuccessful
-	localmacaddr[5] = 0x01;
-	// Local MAC address update indication
-	int lam_update = 0;
-
-	// Clear localaddr
-	memset(&localaddr, 0, sizeof(struct sockaddr_in6));
-	// Fill in a default address in case getifaddrs() is unsuccessful
-	rc = inet_pton(AF_INET6, "::1", &(localaddr.sin6_addr));
-
-	if (rc != 1)
+	if (0 != special)
 	{
-		IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad inet_pton() call for localaddr, returned %d with errno %d (%s)\n", rc, errno, strerror(errno));
+		IPSCAN_LOG( LOGPREFIX "udp_log_response: good read() of UDP port %d:%d, returned %d bytes\n", port, special, rxlen);
 	}
-	localaddr.sin6_port = htons(port);
-	localaddr.sin6_family = AF_INET6;
-	localaddr.sin6_flowinfo = 0;
-	localaddr.sin6_scope_id = 0;
-
-	// Determine local address and its related MAC address
-	// Modify IPSCAN_INTERFACE_NAME in ipscan.h to match the server
-	rc = getifaddrs( &ifaddr );
-	if (rc == -1)
+	else
 	{
-		IPSCAN_LOG( LOGPREFIX "check_udp_port: getifaddrs failed, returned %d (%s)\n", errno, strerror(errno));
+		IPSCAN_LOG( LOGPREFIX "udp_log_response: good read() of UDP port %d, returned %d bytes\n", port, rxlen);
 	}
-	else
+
+	while (i < rxlength)
 	{
-		for (ifa = ifaddr; (NULL != ifa); ifa = ifa->ifa_next)
+		if (position == 0)
 		{
-			if (ifa->ifa_addr == NULL) continue;
-
-			family = ifa->ifa_addr->sa_family;
-
-			if ( family == AF_INET6 && strcasecmp(IPSCAN_INTERFACE_NAME, ifa->ifa_name) == 0 && la_update == 0 )
+			if (0 != special)
 			{
-				rccharptr = inet_ntop(AF_INET6, &((*((struct sockaddr_in6*)ifa->ifa_addr)).sin6_addr), localaddrstr, INET6_ADDRSTRLEN);
-				if (NULL == rccharptr)
-				{
-					IPSCAN_LOG( LOGPREFIX "check_udp_port: inet_ntop() returned an error (%s)\n", strerror(errno));
-				}
-				else
-				{
-					// Copy result to localaddr for later use (MPLS LSP Ping)
-					memcpy(&localaddr.sin6_addr, &((*((struct sockaddr_in6*)ifa->ifa_addr)).sin6_addr), sizeof(struct in6_addr));
-					la_update = 1;
-					#ifdef UDPDEBUG
-					IPSCAN_LOG( LOGPREFIX "check_udp_port: found localaddr = %s\n", localaddrstr);
-					#endif
-				}
+				rc = snprintf(udplogbufferptr, udplogbuffersize, "udp_log_response: Found response packet for port %d:%d: %02x", port, special, (rxmessage[i] & 0xff) );
 			}
-
-			if ( family == AF_PACKET && strcasecmp(IPSCAN_INTERFACE_NAME, ifa->ifa_name) == 0 && lam_update == 0 )
+			else
 			{
-				// Copy result to localmacaddr for later use (DHCPv6)
-				struct sockaddr_ll *sa_ll = (struct sockaddr_ll * )ifa->ifa_addr;
-				for (i = 0; i < 6; i++) localmacaddr[i] = sa_ll->sll_addr[i];
-				lam_update = 1;
-				#ifdef UDPDEBUG
-				IPSCAN_LOG( LOGPREFIX "check_udp_port: found MAC address %02x:%02x:%02x:%02x:%02x:%02x\n", localmacaddr[0], localmacaddr[1], localmacaddr[2], localmacaddr[3], localmacaddr[4], localmacaddr[5]);
-				#endif
+				rc = snprintf(udplogbufferptr, udplogbuffersize, "udp_log_response: Found response packet for port %d: %02x", port, (rxmessage[i] & 0xff) );
 			}
 		}
-		freeifaddrs(ifaddr);
+		else
+		{
+			rc = snprintf(udplogbufferptr, udplogbuffersize, " %02x", (rxmessage[i] & 0xff) );
+		}
+
+		if (rc < 0 || rc >= udplogbuffersize)
+		{
+			IPSCAN_LOG( LOGPREFIX "udp_log_response: logbuffer write truncated, increase LOGENTRYSIZE (currently %d) and recompile.\n", LOGENTRYSIZE);
+			exit(EXIT_FAILURE);
+		}
+
+		udplogbufferptr += rc ;
+		udplogbuffersize -= rc;
+		position ++ ;
+		if ( position >= LOGMAXOCTETS || i == (rxlength-1) )
+		{
+			#if (IPSCAN_LOGVERBOSITY == 1)
+			IPSCAN_LOG( LOGPREFIX "%s\n", udplogbuffer);
+			#endif
+			udplogbufferptr = &udplogbuffer[0];
+			udplogbuffersize = LOGENTRYSIZE;
+			position = 0;
+		}
+		i++ ;
 	}
+	#else
+	(void)port;
+	(void)special;
+	(void)rxmessage;
+	(void)rxlen;
+	#endif
+}
 
-	if (la_update == 0 && lam_update == 0)
+// Allow for any time the service may take to answer, e.g. SSDP responders delay by up to MX seconds
+uint64_t udp_probe_timeout(const struct udp_template_struc *t, uint64_t timeoutusecs)
+{
+	if (NULL != t && NULL != t->probe && 0 < t->probe->timeouthint)
 	{
-		IPSCAN_LOG( LOGPREFIX "check_udp_port: WARNING - Failed to determine the link-local or MAC address for interface %s\n", IPSCAN_INTERFACE_NAME);
-		IPSCAN_LOG( LOGPREFIX "check_udp_port: Check whether IPSCAN_INTERFACE_NAME defined in ipscan.h is correct.\n");
+		timeoutusecs += t->probe->timeouthint;
+		if (timeoutusecs > UDPTIMEOUT_CEILING_USECS) timeoutusecs = UDPTIMEOUT_CEILING_USECS;
 	}
+	return(timeoutusecs);
+}
 
-	rc = inet_pton(AF_INET6, hostname, &(remoteaddr.sin6_addr));
-	if (rc != 1)
+//
+// Describe how a probe fared, for the indirect host field - the number of times it was resent
+// and, if it was answered, the bytes received per byte sent and the number of datagrams
+//
+
+void udp_result_note(char *note, size_t size, unsigned int retransmits, const struct udp_amp_struc *amp)
+{
+	uint64_t tenths;
+
+	if (NULL == amp || 0 == amp->txbytes || 0 == amp->rxbytes)
 	{
-		IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad inet_pton() call, returned %d with errno %d (%s)\n", rc, errno, strerror(errno));
-		retval = PORTINTERROR;
+		snprintf(note, size, "%s%u", UDP_RETRANSMIT_NOTE, retransmits);
+		return;
 	}
+
+	tenths = (((uint64_t)amp->rxbytes * 10) + (amp->txbytes / 2)) / amp->txbytes;
+	snprintf(note, size, "%s%u,%s%"PRIu64".%u,%s%u", UDP_RETRANSMIT_NOTE, retransmits, UDP_AMPLIFICATION_NOTE, (tenths / 10),\
+			(unsigned int)(tenths % 10), UDP_DATAGRAMS_NOTE, amp->rxdatagrams);
+}
+
+//
+// Scan a single port from its own connected socket. amp, if not NULL, accumulates the bytes sent
+// and received, the latter including any further datagrams which arrive shortly after the reply.
+//
+
+int check_udp_port(struct scan_context_struc *ctx, uint16_t port, uint8_t special, uint64_t timeoutusecs, struct udp_amp_struc *amp)
+{
+	char txmessage[UDP_BUFFER_SIZE+1],rxmessage[UDP_BUFFER_SIZE+1];
+	struct sockaddr_in6 remoteaddr;
+	struct timeval timeout;
+
+	int rc = 0, rxlen;
+	int fd = -1;
+	const struct udp_template_struc *template = NULL;
+	uint32_t probeid = 0;
+	uint64_t deadline, now, wait;
+
+	// Holds length of transmitted UDP packet, which since they are representative packets,
+	//  depends on the port being tested
+	int len = 0;
+
+	// set return value to a known default
+	int retval = PORTUNKNOWN;
+
+	// Prefill transmit message buffer with 0s
+	memset(&txmessage, 0,  UDP_BUFFER_SIZE+1);
+
+	// Target address was parsed once when the scan context was set up
+	memcpy(&remoteaddr, &(ctx->remoteaddr), sizeof(remoteaddr));
 	remoteaddr.sin6_port = htons(port);
-	remoteaddr.sin6_family = AF_INET6;
-	remoteaddr.sin6_flowinfo = 0;
-	remoteaddr.sin6_scope_id = 0; // unused in our case
+
+	// The payload for this service was built once, and has its per-probe fields filled in below
+	template = udp_template_get(port, special, ctx->hostname);
+	if (NULL == template) retval = PORTINTERROR;
+
+	timeoutusecs = udp_probe_timeout(template, timeoutusecs);
 
 	// Attempt to create a socket
 	if (PORTUNKNOWN == retval)
@@ -247,8 +337,8 @@ int check_udp_port(char * hostname, uint16_t port, uint8_t special)
 		else
 		{
 			memset(&timeout, 0, sizeof(timeout));
-			timeout.tv_sec = UDPTIMEOUTSECS;
-			timeout.tv_usec = UDPTIMEOUTMICROSECS;
+			timeout.tv_sec = (time_t)(timeoutusecs / 1000000);
+			timeout.tv_usec = (suseconds_t)(timeoutusecs % 1000000);
 
 			rc = setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 			if (rc < 0)
@@ -262,8 +352,8 @@ int check_udp_port(char * hostname, uint16_t port, uint8_t special)
 	if (PORTUNKNOWN == retval) // continue
 	{
 		memset(&timeout, 0, sizeof(timeout));
-		timeout.tv_sec = UDPTIMEOUTSECS;
-		timeout.tv_usec = UDPTIMEOUTMICROSECS;
+		timeout.tv_sec = (time_t)(timeoutusecs / 1000000);
+		timeout.tv_usec = (suseconds_t)(timeoutusecs % 1000000);
 
 		rc = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 		if (rc < 0)
@@ -287,1618 +377,576 @@ int check_udp_port(char * hostname, uint16_t port, uint8_t special)
 
 	if (PORTUNKNOWN == retval)
 	{
-		// Fill the txmessage with the appropriate message (depends on service)
-		switch (port)
-		{
+		// Copy in the payload, filling in its per-probe fields
+		probeid = udp_next_probeid();
+		len = udp_payload_fill(template, &txmessage[0], probeid);
+	}
 
-		// DNS query
-		case 53:
+	if (PORTUNKNOWN == retval)
+	{
+		rc = write(fd,&txmessage,(size_t)len);
+		if (rc < 0)
 		{
-			// Host name to query
-			char dnsquery1[] = "www6";
-			char dnsquery2[] = "chappell-family";
-			char dnsquery3[] = "co";
-			char dnsquery4[] = "uk";
-
-			/*
-				Header - 12 bytes
-				Contains fields that describe the type of message and provide important information about it.
-				Also contains fields that indicate the number of entries in the other sections of the message.
-				Question carries one or more �questions�, that is, queries for information being sent to a DNS name server.
-				Answer carries one or more resource records that answer the question(s) indicated in the Question section above.
-				Authority contains one or more resource records that point to authoritative name servers that can be used to
-				continue the resolution process.
-				Additional conveys one or more resource records that contain additional information related to the query that
-				is not strictly necessary to answer the queries (questions) in the message.
-			 */
-			len = 0;
-			// ID - identifier - 16 bit field
-			txmessage[len++]= 21;
-			txmessage[len++]= 6;
-			// QR - query/response flag - 0=query. 1 bit field
-			// OP - opcode - 0=query,2=status. 4 bit field
-			// AA - Authoritative Answer flag. 1 bit field
-			// TC - truncation flag. 1 bit field
-			// RD - recursion desired - 0=not desired, 1=desired. 1 bit field
-			// RA - recursion available. 1 bit field
-			// Z  - reserved. 3 bit field
-			// Rcode - result code - 0=no error, 4=not implemented
-			txmessage[len++]= 1; // 0=Standard Query, 1=Recursion, 16 for server status query
-			txmessage[len++]= 0;
-			// QDCOUNT - question count - 16 bit field
-			txmessage[len++]= 0;
-			txmessage[len++]= 1;
-			// ANCOUNT - answer record count - 16 bit field
-			txmessage[len++]= 0;
-			txmessage[len++]= 0;
-			// NSCOUNT - authority record count (NS=name server) - 16 bit field
-			txmessage[len++]= 0;
-			txmessage[len++]= 0;
-			// ARCOUNT - 16 bit field
-			txmessage[len++]= 0;
-			txmessage[len++]= 0;
-			// Question section
-
-			txmessage[len++] = (char)strlen(dnsquery1);
-			// Need one extra octet for trailing 0, however this will be overwritten
-			// by the length of the next part of the host name in standard DNS format
-			rc = snprintf(&txmessage[len], (size_t)(UDP_BUFFER_SIZE-len), "%s", dnsquery1);
-			if (rc < 0 || rc >=( UDP_BUFFER_SIZE-len ))
+			if (0 != special)
 			{
-				IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad snprintf() for DNS query, returned %d\n", rc);
-				retval = PORTINTERROR;
+				IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad write(port %d:%d) attempt, returned %d (%s)\n", port, special, errno, strerror(errno));
 			}
 			else
 			{
-				len += rc;
+				IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad write(port %d) attempt, returned %d (%s)\n", port, errno, strerror(errno));
 			}
-
-			// Only add new octets if no internal error has been encountered
-			//
-			if (PORTUNKNOWN == retval)
+			retval = PORTINTERROR;
+		}
+		else
+		{
+			if (NULL != amp) amp->txbytes += (uint32_t)rc;
+			#ifdef UDPDEBUG
+			if (0 != special)
 			{
-				txmessage[len++]= (char)strlen(dnsquery2);
-				rc = snprintf(&txmessage[len], (size_t)(UDP_BUFFER_SIZE-len), "%s", dnsquery2);
-				if (rc < 0 || rc >= ( UDP_BUFFER_SIZE-len ))
-				{
-					IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad snprintf() for DNS query, returned %d\n", rc);
-					retval = PORTINTERROR;
-				}
-				else
-				{
-					len += rc;
-				}
+				IPSCAN_LOG( LOGPREFIX "check_udp_port: write(port %d:%d) returned %d\n", port, special, rc);
 			}
-
-			// Only add new octets if no internal error has been encountered
-			//
-			if (PORTUNKNOWN == retval)
+			else
 			{
-				txmessage[len++]= (char)strlen(dnsquery3);
-				rc = snprintf(&txmessage[len], (size_t)(UDP_BUFFER_SIZE-len), "%s", dnsquery3);
-				if (rc < 0 || rc >= ( UDP_BUFFER_SIZE-len ))
-				{
-					IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad snprintf() for DNS query, returned %d\n", rc);
-					retval = PORTINTERROR;
-				}
-				else
-				{
-					len += rc;
-				}
+				IPSCAN_LOG( LOGPREFIX "check_udp_port: write(port %d) returned %d\n", port, rc);
 			}
+			#endif
+		}
+	}
 
-			// Only add new octets if no internal error has been encountered
-			//
-			if (PORTUNKNOWN == retval)
+	// Read until a valid reply arrives, discarding any which do not answer this probe. Each read
+	// only waits for whatever remains of the timeout, so stray datagrams cannot extend it.
+	// MSG_TRUNC returns the full size of a reply, even though only UDP_BUFFER_SIZE of it is kept.
+	deadline = pacer_now_usecs() + timeoutusecs;
+	while (PORTUNKNOWN == retval)
+	{
+		rc = (int)recv(fd, &rxmessage, UDP_BUFFER_SIZE, MSG_TRUNC);
+		rxlen = (UDP_BUFFER_SIZE < rc) ? UDP_BUFFER_SIZE : rc;
+		if (rc < 0)
+		{
+			int errsv = errno ;
+			#ifdef UDPDEBUG
+			if (0 != special)
 			{
-				txmessage[len++]= (char)strlen(dnsquery4);
-				rc = snprintf(&txmessage[len], (size_t)(UDP_BUFFER_SIZE-len), "%s", dnsquery4);
-				if (rc < 0 || rc >= ( UDP_BUFFER_SIZE-len ))
-				{
-					IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad snprintf() for DNS query, returned %d\n", rc);
-					retval = PORTINTERROR;
-				}
-				else
-				{
-					len += rc;
-				}
+				IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad read(port %d:%d), returned %d (%s)\n", port, special, errno, strerror(errno));
 			}
-
-			// Only add new octets if no internal error has been encountered
-			//
-			if (PORTUNKNOWN == retval)
+			else
 			{
-				// End of name
-				txmessage[len++]= 0;
-
-				// Question type - 1 = host address, 2=NS, 255 is request all
-				txmessage[len++] = 0;
-				txmessage[len++] = 255;
-				// Qclass - 1=INternet
-				txmessage[len++] = 0;
-				txmessage[len++] = 1;
+				IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad read(port %d), returned %d (%s)\n", port, errno, strerror(errno));
 			}
-			break;
+			#endif
+			retval = udp_classify_error(ctx, port, special, errsv);
 		}
-
-		case 69:
+		else if (UDP_MATCH_NO != udp_response_match(template, probeid, &rxmessage[0], rxlen))
 		{
-			/* TFTP
-				TFTP supports five types of packets, all of which have been mentioned
-				   above:
-
-				          opcode  operation
-				            1     Read request (RRQ)
-				            2     Write request (WRQ)
-				            3     Data (DATA)
-				            4     Acknowledgment (ACK)
-				            5     Error (ERROR)
-
-				   The TFTP header of a packet contains the  opcode  associated  with
-				   that packet.
-
-				            2 bytes     string    1 byte     string   1 byte
-				            ------------------------------------------------
-				           | Opcode |  Filename  |   0  |    Mode    |   0  |
-				            ------------------------------------------------
-
-				                       Figure 5-1: RRQ/WRQ packet
-
-				    The mode field contains the string "netascii", "octet", or "mail"
-				    (or any combination of upper and lower case, such as "NETASCII",
-				    NetAscii", etc.) in netascii indicating the three modes defined in
-				    the protocol.                                                   */
-
-			// Create a pseudo-random filename based on the current pid
-			len = snprintf(&txmessage[0], UDP_BUFFER_SIZE, "%c%c%s%d%coctet%c",0,1,"/filename_tjc_",getpid(),0,0);
-			if (len < 0)
+			retval = UDPOPEN;
+			udp_log_response(port, special, &rxmessage[0], rxlen);
+			if (NULL != amp)
 			{
-				IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad snprintf() for tftp, returned %d\n", len);
-				len = 0;
-				retval = PORTINTERROR;
+				amp->rxbytes += (uint32_t)rc;
+				amp->rxdatagrams++;
 			}
-			break;
 		}
-
-
-
-		case 123:
+		else
 		{
-			/* NTP
-			 * from RFC4330
-								1                   2                   3
-				  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9  0  1
-				 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-				 |LI | VN  |Mode |    Stratum    |     Poll      |   Precision    |
-				 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-				 |                          Root  Delay                           |
-				 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-				 |                       Root  Dispersion                         |
-				 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-				 |                     Reference Identifier                       |
-				 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-				 |                                                                |
-				 |                    Reference Timestamp (64)                    |
-				 |                                                                |
-				 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-				 |                                                                |
-				 |                    Originate Timestamp (64)                    |
-				 |                                                                |
-				 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-				 |                                                                |
-				 |                     Receive Timestamp (64)                     |
-				 |                                                                |
-				 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-				 |                                                                |
-				 |                     Transmit Timestamp (64)                    |
-				 |                                                                |
-				 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+  */
-
-			if (1 == special) // NTP monlist case
-			{
-				txmessage[0] = 0x17; 	// NTP version 2, NTP_MODE = 7 (Private use)
-				txmessage[1] = 0; 		// (Auth bit and sequence number)
-				txmessage[2] = 0x03;	// Implementation is XNTPD
-				txmessage[3] = 0X2a;	// MON_GETLIST_1
-				len = 256;
-			}
-			else // Standard NTP client query
+			#ifdef UDPDEBUG
+			IPSCAN_LOG( LOGPREFIX "check_udp_port: discarded %d byte datagram which does not answer port %d:%d\n", rc, port, special);
+			#endif
+			now = pacer_now_usecs();
+			if (now >= deadline)
 			{
-				txmessage[0] = ((NTP_LI << 5) + (NTP_VN << 3) + ( NTP_MODE ));
-				txmessage[1] = NTP_STRATUM;
-				txmessage[2] = NTP_POLL;
-				txmessage[3] = NTP_PRECISION;
-				// Pad out 11 32-bit words (Root Delay through transmit timestamp)
-				len = 48;
+				retval = udp_classify_error(ctx, port, special, EAGAIN);
 			}
-			break;
-		}
-
-
-		case 161:
-		{
-			len = 0;
-
-			if (0 == special || 1 == special)
+			else
 			{
-				// SNMPv1 or SNMPv2c get
-				// Note this code will need amending if you modify the mib string and it includes IDs with values >=128
-				char mib[32] = {1,2,1,1,1,0}; // system.sysDescr.0 - System Description minus 1.3.6 prefix
-				unsigned int miblen = 6;
-
-				// SNMP packet start
-				txmessage[len++] = 0x30;
-				txmessage[len++] = (char)(29 + strlen(community[special]) + miblen);
-				// SNMP version 1
-				txmessage[len++] = 0x02; //int
-				txmessage[len++] = 0x01; //length of 1
-				txmessage[len++] = (special & 0xff); // 0 = SNMPv1, 1 = SNMPv2c
-				// Community name
-				txmessage[len++] = 0x04; //string
-				txmessage[len++] = (char)strlen(community[special]);
-				rc = snprintf(&txmessage[len], (size_t)(UDP_BUFFER_SIZE-len), "%s", community[special]);
-				if (rc < 0 || rc >= (UDP_BUFFER_SIZE-len))
+				memset(&timeout, 0, sizeof(timeout));
+				timeout.tv_sec = (time_t)((deadline - now) / 1000000);
+				timeout.tv_usec = (suseconds_t)((deadline - now) % 1000000);
+				if (0 > setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)))
 				{
-					IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad snprintf() for SNMP, returned %d\n", rc);
-					retval = PORTINTERROR;
-				}
-				else
-				{
-					len += rc;
-				}
-
-				// MIB - check there's enough room before adding
-				if (PORTUNKNOWN == retval && (len < (int)(UDP_BUFFER_SIZE-24-miblen)) )
-				{
-					txmessage[len++] = 0xA0; // SNMP GET request
-					txmessage[len++] = (char)(22 + miblen); //0x1c
-
-					txmessage[len++] = 0x02; // Request ID
-					txmessage[len++] = 0x04; // 4 octets length
-					txmessage[len++] = 0x21; // "Random" value
-					txmessage[len++] = 0x06;
-					txmessage[len++] = 0x01;
-					txmessage[len++] = 0x08;
-
-					// Error status (0=noError)
-					txmessage[len++] = 0x02; //int
-					txmessage[len++] = 0x01; //length of 1
-					txmessage[len++] = 0x00; // SNMP error status
-					// Error index (0)
-					txmessage[len++] = 0x02; //int
-					txmessage[len++] = 0x01; //length of 1
-					txmessage[len++] = 0x00; // SNMP error index
-					// Variable bindings
-					txmessage[len++] = 0x30; //var-bind sequence
-					txmessage[len++] = (char)(8 + miblen);
-
-					txmessage[len++] = 0x30; //var-bind
-					txmessage[len++] = (char)(miblen +6 );
-
-					txmessage[len++] = 0x06; // Object
-					txmessage[len++] = (char)(miblen + 2); // MIB length
-
-					txmessage[len++] = 0x2b;
-					txmessage[len++] = 0x06;
-					// Insert the OID
-					for (i = 0; i <miblen; i++)
-					{
-						txmessage[len++] = mib[i];
-					}
-					txmessage[len++] = 0x05; // Null object
-					txmessage[len++] = 0x00; // length of 0
-				}
-				else if (PORTUNKNOWN == retval && (len >= (int)(UDP_BUFFER_SIZE-24-miblen)))
-				{
-					IPSCAN_LOG( LOGPREFIX "check_udp_port: Insufficient room to add OID, len = %d\n", len);
+					IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad setsockopt SO_RCVTIMEO set, returned %d (%s)\n", errno, strerror(errno));
 					retval = PORTINTERROR;
 				}
 			}
-			else if (2 == special)
-			{
-				// SNMPv3 engine discovery
-				txmessage[len++] = 0x30;
-				txmessage[len++] = 0x38;
+		}
+	}
 
-				// SNMP version 3
-				txmessage[len++] = 0x02; // int
-				txmessage[len++] = 0x01; // length of 1
-				txmessage[len++] = 0x03; // SNMP v3
+	// Count any further datagrams answering the probe, such as the rest of a multi-part reply,
+	// until none has arrived for UDP_AMP_LINGER_USECS, but never beyond the deadline
+	while (UDPOPEN == retval && NULL != amp)
+	{
+		now = pacer_now_usecs();
+		if (now >= deadline) break;
+		wait = ((deadline - now) < UDP_AMP_LINGER_USECS) ? (deadline - now) : UDP_AMP_LINGER_USECS;
 
-				// msgGlobalData
-				txmessage[len++] = 0x30;
-				txmessage[len++] = 0x0e;
+		memset(&timeout, 0, sizeof(timeout));
+		timeout.tv_sec = (time_t)(wait / 1000000);
+		timeout.tv_usec = (suseconds_t)(wait % 1000000);
+		if (0 > setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))) break;
+
+		rc = (int)recv(fd, &rxmessage, UDP_BUFFER_SIZE, MSG_TRUNC);
+		if (rc < 0) break;
+		rxlen = (UDP_BUFFER_SIZE < rc) ? UDP_BUFFER_SIZE : rc;
+		if (UDP_MATCH_NO != udp_response_match(template, probeid, &rxmessage[0], rxlen))
+		{
+			amp->rxbytes += (uint32_t)rc;
+			amp->rxdatagrams++;
+		}
+	}
 
-				txmessage[len++] = 0x02;
-				txmessage[len++] = 0x01;
-				txmessage[len++] = 0x02; // msgID
+	if (-1 != fd)
+	{
+		rc = close(fd);
+		if (rc == -1)
+		{
+			IPSCAN_LOG( LOGPREFIX "check_udp_port: close of fd %d caused unexpected failure : %d (%s)\n", fd, errno, strerror(errno));
+			retval = PORTINTERROR;
+		}
+	}
 
-				txmessage[len++] = 0x02; //
-				txmessage[len++] = 0x03; //
-				txmessage[len++] = 0x00; // Max message size (less than 64K)
-				txmessage[len++] = 0xff; //
-				txmessage[len++] = 0xe3; //
+	return (retval);
+}
 
-				txmessage[len++] = 0x04;
-				txmessage[len++] = 0x01;
-				txmessage[len++] = 0x04; // flags (reportable, not encrypted, not authenticated)
+//
+// Multiplexed engine - send every probe from a few unconnected sockets and then await all of
+// them together. Replies are matched to their probe by source port and ICMPv6 errors by the
+// destination port of the offending datagram, as reported through the IPV6_RECVERR error queue.
+//
 
-				txmessage[len++] = 0x02;
-				txmessage[len++] = 0x01;
-				txmessage[len++] = 0x03; // msgSecurityModel is USM (3)
+struct udp_probe_struc
+{
+	uint16_t port;
+	uint8_t special;
+	int sock;
+	int result;
+	const struct udp_template_struc *template;
+	uint32_t probeid;
+	int len;
+	unsigned int retransmits;
+	struct udp_amp_struc amp;
+	uint64_t interval;
+	uint64_t nextsend;
+	uint64_t deadline;
+	struct timer_struc timer;
+};
+
+// Find the outstanding probe sent to port from the given socket, or return -1
+int udp_find_probe(struct udp_probe_struc *probes, unsigned int numprobes, int sockindex, uint16_t port)
+{
+	unsigned int i;
 
-				// end of GlobalData
+	for (i = 0 ; i < numprobes ; i++)
+	{
+		if (probes[i].sock == sockindex && probes[i].port == port && PORTUNKNOWN == probes[i].result) return((int)i);
+	}
+	return(-1);
+}
 
-				txmessage[len++] = 0x04;
-				txmessage[len++] = 0x10; //
+// Find the probe, with the given result so far, which a reply from port answers - PORTUNKNOWN for
+// one still outstanding, or UDPOPEN for one already answered. Where several tests of the port
+// qualify, the protocol's identifiers decide, otherwise the first is taken. Returns -1 if the
+// reply matches none of them.
+int udp_match_reply(struct udp_probe_struc *probes, unsigned int numprobes, int sockindex, uint16_t port, int result, const char *reply, int len)
+{
+	unsigned int i;
+	int candidate = -1;
 
-				txmessage[len++] = 0x30; //
-				txmessage[len++] = 0x0e; // length to end of this varbind
+	for (i = 0 ; i < numprobes ; i++)
+	{
+		if (probes[i].sock != sockindex || probes[i].port != port || result != probes[i].result) continue;
 
-				txmessage[len++] = 0x04; //
-				txmessage[len++] = 0x00; // EngineID
+		switch (udp_response_match(probes[i].template, probes[i].probeid, reply, len))
+		{
+		case UDP_MATCH_YES:
+			return((int)i);
+		case UDP_MATCH_UNKNOWN:
+			if (0 > candidate) candidate = (int)i;
+			break;
+		default:
+			break;
+		}
+	}
+	return(candidate);
+}
 
-				txmessage[len++] = 0x02;
-				txmessage[len++] = 0x01;
-				txmessage[len++] = 0x00; // EngineBoots
+// Collect any replies queued on a socket, returning the number of probes they completed. Every
+// datagram answering a probe is counted towards its amplification, at its full size, and lastrx
+// records when the latest arrived.
+unsigned int udp_mux_replies(struct scan_context_struc *ctx, struct udp_probe_struc *probes, unsigned int numprobes, int sockindex, int fd, uint64_t *lastrx)
+{
+	struct sockaddr_in6 *from;
+	char *rxmessage;
+	unsigned int completed = 0, i;
+	int rc, len, p;
+	uint16_t port;
 
-				txmessage[len++] = 0x02;
-				txmessage[len++] = 0x01;
-				txmessage[len++] = 0x00; // EngineTime
+	while (1)
+	{
+		rc = udp_batch_recv(fd, MSG_DONTWAIT | MSG_TRUNC);
+		if (rc < 0)
+		{
+			// A pending ICMPv6 error is also reported here, but is collected from the error queue
+			if (EAGAIN == errno || EWOULDBLOCK == errno) break;
+			if (EINTR == errno || ECONNREFUSED == errno || EHOSTUNREACH == errno || ENETUNREACH == errno || EACCES == errno) continue;
+			IPSCAN_LOG( LOGPREFIX "udp_mux_replies: recvmmsg failed, returned %d (%s)\n", errno, strerror(errno));
+			break;
+		}
 
-				txmessage[len++] = 0x04; // UserName
-				txmessage[len++] = 0x00;
+		for (i = 0 ; 0 == udp_batch_rx(i, &from, &rxmessage, &len) ; i++)
+		{
+			// Only the client itself can answer a probe
+			if (AF_INET6 != from->sin6_family || 0 != memcmp(&from->sin6_addr, &ctx->remoteaddr.sin6_addr, sizeof(struct in6_addr))) continue;
 
-				txmessage[len++] = 0x04; // Authentication Parameters
-				txmessage[len++] = 0x00;
+			port = ntohs(from->sin6_port);
+			p = udp_match_reply(probes, numprobes, sockindex, port, PORTUNKNOWN, rxmessage, len);
+			if (0 <= p)
+			{
+				probes[p].result = UDPOPEN;
+				timer_cancel(timer_wheel(), &probes[p].timer);
+				udp_log_response(probes[p].port, probes[p].special, rxmessage, len);
+				completed++;
+			}
+			else
+			{
+				// Perhaps more of a reply already received, or another reply to a retransmission
+				p = udp_match_reply(probes, numprobes, sockindex, port, UDPOPEN, rxmessage, len);
+				if (0 > p) continue;
+			}
 
-				txmessage[len++] = 0x04; // Privacy Parameters
-				txmessage[len++] = 0x00;
+			probes[p].amp.rxbytes += (uint32_t)udp_batch_rx_size(i);
+			probes[p].amp.rxdatagrams++;
+			*lastrx = pacer_now_usecs();
+		}
+		// A short batch means the queue has been drained
+		if (UDP_BATCH_MAXMSGS > rc) break;
+	}
+	return(completed);
+}
 
-				// msgData
-				txmessage[len++] = 0x30; //
-				txmessage[len++] = 0x11; //
+// Collect any ICMPv6 errors queued on a socket, returning the number of probes they completed
+unsigned int udp_mux_errors(struct scan_context_struc *ctx, struct udp_probe_struc *probes, unsigned int numprobes, int sockindex, int fd)
+{
+	const struct sock_extended_err *ee;
+	struct sockaddr_in6 *dest;
+	char *errmessage;
+	unsigned int completed = 0, i;
+	int rc, len, p;
 
-				txmessage[len++] = 0x04; //  Context Engine ID (missing)
-				txmessage[len++] = 0x00; //
+	while (1)
+	{
+		rc = udp_batch_recv(fd, MSG_ERRQUEUE | MSG_DONTWAIT);
+		if (rc < 0)
+		{
+			if (EAGAIN == errno || EWOULDBLOCK == errno) break;
+			if (EINTR == errno) continue;
+			IPSCAN_LOG( LOGPREFIX "udp_mux_errors: recvmmsg failed, returned %d (%s)\n", errno, strerror(errno));
+			break;
+		}
 
-				txmessage[len++] = 0x04; //  Context Name (missing)
-				txmessage[len++] = 0x00; //
+		for (i = 0 ; 0 == udp_batch_rx(i, &dest, &errmessage, &len) ; i++)
+		{
+			// The name is the original destination, so the error is matched by its port
+			if (0 != memcmp(&dest->sin6_addr, &ctx->remoteaddr.sin6_addr, sizeof(struct in6_addr))) continue;
+			p = udp_find_probe(probes, numprobes, sockindex, ntohs(dest->sin6_port));
+			if (0 > p) continue;
 
-				txmessage[len++] = 0xa0; //  Get Request
-				txmessage[len++] = 0x0b; //
+			ee = udp_batch_rx_error(i);
+			if (NULL == ee || (SO_EE_ORIGIN_ICMP6 != ee->ee_origin && SO_EE_ORIGIN_LOCAL != ee->ee_origin)) continue;
 
-				txmessage[len++] = 0x02; // Request ID (is 0x14)
-				txmessage[len++] = 0x01; //
-				txmessage[len++] = 0x14; //
+			#ifdef UDPDEBUG
+			IPSCAN_LOG( LOGPREFIX "udp_mux_errors: port %d:%d ICMPv6 type %d code %d, errno %d (%s)\n", probes[p].port, probes[p].special,\
+					ee->ee_type, ee->ee_code, ee->ee_errno, strerror((int)ee->ee_errno));
+			#endif
+			probes[p].result = udp_classify_error(ctx, probes[p].port, probes[p].special, (int)ee->ee_errno);
+			timer_cancel(timer_wheel(), &probes[p].timer);
+			completed++;
+		}
+		if (UDP_BATCH_MAXMSGS > rc) break;
+	}
+	return(completed);
+}
 
-				// Error status (0=noError)
-				txmessage[len++] = 0x02; //int
-				txmessage[len++] = 0x01; //length of 1
-				txmessage[len++] = 0x00; // SNMP error status
-				// Error index (0)
-				txmessage[len++] = 0x02; //int
-				txmessage[len++] = 0x01; //length of 1
-				txmessage[len++] = 0x00; // SNMP error index
-				// Variable bindings (none)
-				txmessage[len++] = 0x30; //var-bind sequence
-				txmessage[len++] = 0x00;
+// Arm a probe's timer for its next retransmission or, once it has none left, the end of its budget
+void udp_mux_arm(struct udp_probe_struc *probes, unsigned int p)
+{
+	struct udp_probe_struc *probe = &probes[p];
 
-				// End of msgData
-			}
+	if (UDP_MAXRETRANSMITS > probe->retransmits && probe->nextsend < probe->deadline)
+	{
+		timer_add(timer_wheel(), &probe->timer, TIMER_UDP_RETRANSMIT, p, probe->nextsend);
+	}
+	else
+	{
+		timer_add(timer_wheel(), &probe->timer, TIMER_UDP_DEADLINE, p, probe->deadline);
+	}
+}
 
-			break;
-		}
+// Send the queued probes, starting the budget and backoff of each one sent for the first time.
+// Returns the number of probes newly in flight.
+unsigned int udp_mux_flush(struct udp_probe_struc *probes, unsigned int *queued, uint64_t *deadline)
+{
+	int errs[UDP_BATCH_MAXMSGS];
+	unsigned int i, count = udp_batch_pending(), started = 0;
+	uint64_t now;
 
-		// IKEv2
-		case 500:
-		case 4500:
-		{
-			// ISAKMP
-			len = 0;
-			// Initiator cookie (8 bytes)
-			txmessage[len++] = 0xde;
-			txmessage[len++] = 0xad;
-			txmessage[len++] = 0xfa;
-			txmessage[len++] = 0xce;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 1;
-			// Responder cookie (8 bytes)
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			// Next payload 0=None, 2=proposal, 4=key exchange, 33=SA
-			txmessage[len++] = 33;
-			// Version Major/Minor 2.0
-			txmessage[len++] = 32;
-			// Exchange type 4=aggressive, 34=IKE_SA_INIT
-			txmessage[len++] = 34;
-			// Flags 8=initiator
-			txmessage[len++] = 8;
-
-			// Message ID (4 bytes)
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			// Length (4 bytes)
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0x01;
-			txmessage[len++] = 0x2c; // includes key exchange payload
-
-			// SA=33
-			// Next payload 0=None, 2=proposal, 4=key exchange, 33=SA, 34=KeyEx
-			txmessage[len++] = 34;
-			txmessage[len++] = 0; // Not critical
-			txmessage[len++] = 0; // Length 44
-			txmessage[len++] = 44;
-
-			txmessage[len++] = 0x00; // No next payload
-			txmessage[len++] = 0x00; // Not critical
-			txmessage[len++] = 0x00; // Length 40
-			txmessage[len++] = 0x28;
-			txmessage[len++] = 0x01; // Proposal 1
-			txmessage[len++] = 0x01; // IKE
-			txmessage[len++] = 0x00; // SPI size 0
-			txmessage[len++] = 0x04; // Number of transforms
-			txmessage[len++] = 0x03; // Payload type is transform
-			txmessage[len++] = 0x00; // Not critical
-			txmessage[len++] = 0x00; // Length 8
-			txmessage[len++] = 0x08;
-			txmessage[len++] = 0x01; // ENCRYPTION Algorithm
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00; // 3=3DES
-			txmessage[len++] = 0x03;
-			txmessage[len++] = 0x03; // Payload type is transform
-			txmessage[len++] = 0x00; // Not critical
-			txmessage[len++] = 0x00; // Length 8
-			txmessage[len++] = 0x08;
-			txmessage[len++] = 0x03; // INTEGRITY Algorithm
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00; // 2=AUTH_HMAC_SHA1_96
-			txmessage[len++] = 0x02;
-			txmessage[len++] = 0x03; // Payload type is transform
-			txmessage[len++] = 0x00; // Not critical
-			txmessage[len++] = 0x00; // Length 8
-			txmessage[len++] = 0x08;
-			txmessage[len++] = 0x02; // PRF Algorithm
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00; // 2=PRF_HMAC_SHA1
-			txmessage[len++] = 0x02;
-			txmessage[len++] = 0x00; // Next Payload type is NONE
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00; // Length 8
-			txmessage[len++] = 0x08;
-			txmessage[len++] = 0x04; // 4=Diffie-Hellman Group
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00; // 1024-bit MODP group
-			txmessage[len++] = 0x02;
-
-			// Key Exchange payload
-			//      		   	  1                   2                   3
-			//0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-			//+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//! Next Payload  !   RESERVED    !         Payload Length        !
-			//+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//!                                                               !
-			//~                       Key Exchange Data                       ~
-			//!                                                               !
-			//+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//
-
-			txmessage[len++] = 0x28; // Next Payload type is None (40)
-			txmessage[len++] = 0x00; // Not critical
-			txmessage[len++] = 0x00; // Length 136
-			txmessage[len++] = 0x88;
-			txmessage[len++] = 0x00; // DH group 1024-bit MODP (2)
-			txmessage[len++] = 0x02;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x2d; // Key Exchange data (128 octets)
-			txmessage[len++] = 0x54;
-			txmessage[len++] = 0x91;
-			txmessage[len++] = 0xfa;
-			txmessage[len++] = 0x0c;
-			txmessage[len++] = 0xd4;
-			txmessage[len++] = 0xd4;
-			txmessage[len++] = 0xcc;
-			txmessage[len++] = 0x77;
-			txmessage[len++] = 0xf8;
-			txmessage[len++] = 0xce;
-			txmessage[len++] = 0x08;
-			txmessage[len++] = 0x98;
-			txmessage[len++] = 0x45;
-			txmessage[len++] = 0x40;
-			txmessage[len++] = 0xb7;
-			txmessage[len++] = 0xc6;
-			txmessage[len++] = 0x8c;
-			txmessage[len++] = 0x08;
-			txmessage[len++] = 0x93;
-			txmessage[len++] = 0x2c;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0xf7;
-			txmessage[len++] = 0xc1;
-			txmessage[len++] = 0x5b;
-			txmessage[len++] = 0xf1;
-			txmessage[len++] = 0x04;
-			txmessage[len++] = 0xb0;
-			txmessage[len++] = 0x94;
-			txmessage[len++] = 0x02;
-			txmessage[len++] = 0x1a;
-			txmessage[len++] = 0xf9;
-			txmessage[len++] = 0x95;
-			txmessage[len++] = 0x29;
-			txmessage[len++] = 0x6c;
-			txmessage[len++] = 0x4a;
-			txmessage[len++] = 0x26;
-			txmessage[len++] = 0x12;
-			txmessage[len++] = 0x18;
-			txmessage[len++] = 0x75;
-			txmessage[len++] = 0x21;
-			txmessage[len++] = 0x0e;
-			txmessage[len++] = 0x02;
-			txmessage[len++] = 0x06;
-			txmessage[len++] = 0x11;
-			txmessage[len++] = 0x49;
-			txmessage[len++] = 0xc1;
-			txmessage[len++] = 0xa0;
-			txmessage[len++] = 0xc5;
-			txmessage[len++] = 0x82;
-			txmessage[len++] = 0xe1;
-			txmessage[len++] = 0x11;
-			txmessage[len++] = 0x30;
-			txmessage[len++] = 0xab;
-			txmessage[len++] = 0xc4;
-			txmessage[len++] = 0x31;
-			txmessage[len++] = 0xde;
-			txmessage[len++] = 0x49;
-			txmessage[len++] = 0x7d;
-			txmessage[len++] = 0xd3;
-			txmessage[len++] = 0xe6;
-			txmessage[len++] = 0xfb;
-			txmessage[len++] = 0x42;
-			txmessage[len++] = 0x08;
-			txmessage[len++] = 0xfd;
-			txmessage[len++] = 0x72;
-			txmessage[len++] = 0x74;
-			txmessage[len++] = 0xbf;
-			txmessage[len++] = 0x34;
-			txmessage[len++] = 0x60;
-			txmessage[len++] = 0xdc;
-			txmessage[len++] = 0x98;
-			txmessage[len++] = 0x97;
-			txmessage[len++] = 0xd3;
-			txmessage[len++] = 0xb5;
-			txmessage[len++] = 0x5b;
-			txmessage[len++] = 0x82;
-			txmessage[len++] = 0xec;
-			txmessage[len++] = 0x77;
-			txmessage[len++] = 0x0d;
-			txmessage[len++] = 0xae;
-			txmessage[len++] = 0xca;
-			txmessage[len++] = 0x39;
-			txmessage[len++] = 0xfd;
-			txmessage[len++] = 0x9a;
-			txmessage[len++] = 0x08;
-			txmessage[len++] = 0x8f;
-			txmessage[len++] = 0x5a;
-			txmessage[len++] = 0x73;
-			txmessage[len++] = 0xa1;
-			txmessage[len++] = 0xfd;
-			txmessage[len++] = 0x60;
-			txmessage[len++] = 0x98;
-			txmessage[len++] = 0xa8;
-			txmessage[len++] = 0xc8;
-			txmessage[len++] = 0xdf;
-			txmessage[len++] = 0x16;
-			txmessage[len++] = 0x3d;
-			txmessage[len++] = 0x55;
-			txmessage[len++] = 0xff;
-			txmessage[len++] = 0x6d;
-			txmessage[len++] = 0xe0;
-			txmessage[len++] = 0x94;
-			txmessage[len++] = 0xd7;
-			txmessage[len++] = 0x93;
-			txmessage[len++] = 0xa6;
-			txmessage[len++] = 0x82;
-			txmessage[len++] = 0x1f;
-			txmessage[len++] = 0xce;
-			txmessage[len++] = 0x07;
-			txmessage[len++] = 0x0a;
-			txmessage[len++] = 0x17;
-			txmessage[len++] = 0xf4;
-			txmessage[len++] = 0x87;
-			txmessage[len++] = 0x0b;
-			txmessage[len++] = 0xc7;
-			txmessage[len++] = 0x90;
-			txmessage[len++] = 0xa2;
-			txmessage[len++] = 0x47;
-			txmessage[len++] = 0x51;
-			txmessage[len++] = 0xca;
-			txmessage[len++] = 0x2c;
-			txmessage[len++] = 0xe8;
-			txmessage[len++] = 0x33;
-			txmessage[len++] = 0x3a;
-			txmessage[len++] = 0x4d;
-			txmessage[len++] = 0x5f;
-			txmessage[len++] = 0xae;
-
-			// Payload is Nonce
-			txmessage[len++] = 0x29; // Next payload is Notify (41)
-			txmessage[len++] = 0x00; // Not critical
-			txmessage[len++] = 0x00; // Length 36
-			txmessage[len++] = 0x24; // Nonce data
-			txmessage[len++] = 0xfb;
-			txmessage[len++] = 0xe5;
-			txmessage[len++] = 0x90;
-			txmessage[len++] = 0x3f;
-			txmessage[len++] = 0xc9;
-			txmessage[len++] = 0xdf;
-			txmessage[len++] = 0x47;
-			txmessage[len++] = 0x09;
-			txmessage[len++] = 0xe5;
-			txmessage[len++] = 0xd4;
-			txmessage[len++] = 0xab;
-			txmessage[len++] = 0x0a;
-			txmessage[len++] = 0xa6;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0xb3;
-			txmessage[len++] = 0xbe;
-			txmessage[len++] = 0x36;
-			txmessage[len++] = 0xeb;
-			txmessage[len++] = 0x35;
-			txmessage[len++] = 0xa6;
-			txmessage[len++] = 0xf5;
-			txmessage[len++] = 0x54;
-			txmessage[len++] = 0x47;
-			txmessage[len++] = 0xfe;
-			txmessage[len++] = 0xda;
-			txmessage[len++] = 0xb9;
-			txmessage[len++] = 0x0d;
-			txmessage[len++] = 0x67;
-			txmessage[len++] = 0x66;
-			txmessage[len++] = 0x9f;
-			txmessage[len++] = 0xab;
-			txmessage[len++] = 0x96;
-
-			// Payload is Notify
-			txmessage[len++] = 0x29; // Next payload is also notify
-			txmessage[len++] = 0x00; // Not critical
-			txmessage[len++] = 0x00; // Length 28
-			txmessage[len++] = 0x1c;
-			txmessage[len++] = 0x00; // Protocol ID is RESERVED (0)
-			txmessage[len++] = 0x00; // SPI size is 0
-			txmessage[len++] = 0x40; // NAT_DETECTION_SOURCE_IP (16388)
-			txmessage[len++] = 0x04;
-			// data is SHA1(SPIs, source IP address, source port)
-			// however, we're just looking for a response, not a valid
-			// packet
-			txmessage[len++] = 0xc6; // Notification data
-			txmessage[len++] = 0x93;
-			txmessage[len++] = 0x14;
-			txmessage[len++] = 0x61;
-			txmessage[len++] = 0x31;
-			txmessage[len++] = 0xa7;
-			txmessage[len++] = 0x7f;
-			txmessage[len++] = 0xe9;
-			txmessage[len++] = 0x93;
-			txmessage[len++] = 0x47;
-			txmessage[len++] = 0x26;
-			txmessage[len++] = 0xe5;
-			txmessage[len++] = 0x23;
-			txmessage[len++] = 0x17;
-			txmessage[len++] = 0xd4;
-			txmessage[len++] = 0xec;
-			txmessage[len++] = 0x5f;
-			txmessage[len++] = 0x64;
-			txmessage[len++] = 0x45;
-			txmessage[len++] = 0xf1;
-
-			// Payload is Notify
-			txmessage[len++] = 0x00; // Next payload is NONE
-			txmessage[len++] = 0x00; // Not critical
-			txmessage[len++] = 0x00; // :ength 28
-			txmessage[len++] = 0x1c;
-			txmessage[len++] = 0x00; // Protocol ID is RESERVED(0)
-			txmessage[len++] = 0x00; // SPI size = 0
-			txmessage[len++] = 0x40; // NAT_DETECTION_DESTIANTION_IP (16389)
-			txmessage[len++] = 0x05;
-			// data is SHA1(SPIs, source IP address, source port)
-			// however, we're just looking for a response, not a valid
-			// packet
-			txmessage[len++] = 0xf9; // Notification data
-			txmessage[len++] = 0x33;
-			txmessage[len++] = 0xa1;
-			txmessage[len++] = 0x9a;
-			txmessage[len++] = 0x65;
-			txmessage[len++] = 0x1a;
-			txmessage[len++] = 0xc3;
-			txmessage[len++] = 0x73;
-			txmessage[len++] = 0x8b;
-			txmessage[len++] = 0xb7;
-			txmessage[len++] = 0xf6;
-			txmessage[len++] = 0x04;
-			txmessage[len++] = 0x43;
-			txmessage[len++] = 0x6f;
-			txmessage[len++] = 0x80;
-			txmessage[len++] = 0x12;
-			txmessage[len++] = 0x69;
-			txmessage[len++] = 0x3e;
-			txmessage[len++] = 0x6a;
-			txmessage[len++] = 0x2a;
+	if (0 == count) return(0);
+	(void)udp_batch_send(&errs[0]);
+	now = pacer_now_usecs();
 
-			break;
-		}
+	for (i = 0 ; i < count ; i++)
+	{
+		struct udp_probe_struc *probe = &probes[queued[i]];
 
-		// RIPng
-		case 521:
+		if (0 != errs[i])
 		{
-			len = 0;
-			txmessage[len++] = 0x01; // Command is REQUEST
-			txmessage[len++] = 0x01; // Version 1
-			txmessage[len++] = 0x00; // Reserved
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00; // ::
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00; // Route Tag
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00; // Prefix length
-			txmessage[len++] = 0x10; // Metric
-			break;
+			IPSCAN_LOG( LOGPREFIX "udp_mux_flush: Bad sendmmsg(port %d:%d) attempt, returned %d (%s)\n", probe->port, probe->special, errs[i], strerror(errs[i]));
+			// A failed retransmission leaves the earlier ones to be answered
+			if (0 == probe->deadline) probe->result = PORTINTERROR;
+			else udp_mux_arm(probes, queued[i]);
+			continue;
 		}
 
-		case 547:
+		probe->amp.txbytes += (uint32_t)probe->len;
+		if (0 == probe->deadline)
 		{
-			// DHCPv6 defined in https://tools.ietf.org/html/rfc3315
-			//       0                   1                   2                   3
-			//       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      |    msg-type   |               transaction-id                  |
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      |                                                               |
-			//      .                            options                            .
-			//      .                           (variable)                          .
-			//      |                                                               |
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//
-			len = 0;
-			txmessage[len++] = 0x01; // msg-type = 0x01 (Solicit)
-			txmessage[len++] = 0xde; // transaction-id
-			txmessage[len++] = 0xad;
-			txmessage[len++] = 0xfa;
-
-			//       0                   1                   2                   3
-			//       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      |        OPTION_CLIENTID        |          option-len           |
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      .                                                               .
-			//      .                              DUID                             .
-			//      .                        (variable length)                      .
-			//      .                                                               .
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-
-			txmessage[len++] = 0x00; // Option 1 is Client Identifier
-			txmessage[len++] = 0x01;
-
-			txmessage[len++] = 0x00; // Length field
-			txmessage[len++] = 0x0e;
-
-
-			// The following diagram illustrates the format of a DUID-LLT:
-			//
-			//     0                   1                   2                   3
-			//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//    |               1               |    hardware type (16 bits)    |
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//    |                        time (32 bits)                         |
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//    .                                                               .
-			//    .             link-layer address (variable length)              .
-			//    .                                                               .
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//
-
-			txmessage[len++] = 0x00; // DUID-LLT
-			txmessage[len++] = 0x01;
-
-			txmessage[len++] = 0x00; // Hardware type: Ethernet
-			txmessage[len++] = 0x01;
-
-			txmessage[len++] = 0x00; // Time
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x01;
-
-			// Copy in the local MAC address as the Link-layer address
-			for (i = 0; i < 6 ; i++) txmessage[len++] = localmacaddr[i];
-
-			//  0                   1                   2                   3
-			//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//    |     OPTION_RECONF_ACCEPT      |               0               |
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//
-			//      option-code   OPTION_RECONF_ACCEPT (20).
-			//
-			//      option-len    0.
-			//
-
-			txmessage[len++] = 0x00; // Reconfigure Accept option
-			txmessage[len++] = 0x14;
-
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-
-			// The format of the IA_NA option is:
-			//
-			//       0                   1                   2                   3
-			//       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      |          OPTION_IA_NA         |          option-len           |
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      |                        IAID (4 octets)                        |
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      |                              T1                               |
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      |                              T2                               |
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      |                                                               |
-			//      .                         IA_NA-options                         .
-			//      .                                                               .
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//
-			//      option-code          OPTION_IA_NA (3).
-			//
-			//      option-len           12 + length of IA_NA-options field.
-			//
-			//      IAID                 The unique identifier for this IA_NA; the
-			//                           IAID must be unique among the identifiers for
-			//                           all of this client's IA_NAs.  The number
-			//                           space for IA_NA IAIDs is separate from the
-			//                           number space for IA_TA IAIDs.
-			//
-			//      T1                   The time at which the client contacts the
-			//                           server from which the addresses in the IA_NA
-			//                           were obtained to extend the lifetimes of the
-			//                           addresses assigned to the IA_NA; T1 is a
-			//                           time duration relative to the current time
-			//                           expressed in units of seconds.
-			//
-			//      T2                   The time at which the client contacts any
-			//                           available server to extend the lifetimes of
-			//                           the addresses assigned to the IA_NA; T2 is a
-			//                           time duration relative to the current time
-			//                           expressed in units of seconds.
-			//
-			//      IA_NA-options        Options associated with this IA_NA.
-
-			txmessage[len++] = 0x00; // Identity Association for Non-temporary Address (IA_NA) option
-			txmessage[len++] = 0x03;
-
-			txmessage[len++] = 0x00; // Length (options length = 0)
-			txmessage[len++] = 0x0c;
-
-			txmessage[len++] = 0x00; // IAID
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-
-			txmessage[len++] = 0x00; // T1
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-
-			txmessage[len++] = 0x00; // T2
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-
-			//       0                   1                   2                   3
-			//       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      |      OPTION_ELAPSED_TIME      |           option-len          |
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      |          elapsed-time         |
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//
-			//      option-code   OPTION_ELAPSED_TIME (8).
-			//
-			//      option-len    2.
-			//
-			//      elapsed-time  The amount of time since the client began its
-			//                    current DHCP transaction.  This time is expressed in
-			//                    hundredths of a second (10^-2 seconds).
-
-
-			txmessage[len++] = 0x00; // Elapsed Time Option
-			txmessage[len++] = 0x08;
-
-			txmessage[len++] = 0x00; // Length
-			txmessage[len++] = 0x02;
-
-			txmessage[len++] = 0x00; // We just started ..
-			txmessage[len++] = 0x00;
-
-			//   The Option Request option is used to identify a list of options in a
-			//   message between a client and a server.  The format of the Option
-			//   Request option is:
-			//
-			//       0                   1                   2                   3
-			//       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      |           OPTION_ORO          |           option-len          |
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      |    requested-option-code-1    |    requested-option-code-2    |
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      |                              ...                              |
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//
-			//      option-code   OPTION_ORO (6).
-			//
-			//      option-len    2 * number of requested options.
-			//
-			//      requested-option-code-n The option code for an option requested by
-			//      the client.
-
-			txmessage[len++] = 0x00; // Option Request Option Option
-			txmessage[len++] = 0x06;
-
-			txmessage[len++] = 0x00; // Option length
-			txmessage[len++] = 0x04;
-
-			txmessage[len++] = 0x00; // Recursive DNS server
-			txmessage[len++] = 0x17;
-
-			txmessage[len++] = 0x00; // Domain Search List
-			txmessage[len++] = 0x18;
-
-			// From RFC 3633
-			// The IA_PD option is used to carry a prefix delegation identity
-			//   association, the parameters associated with the IA_PD and the
-			//   prefixes associated with it.
-			//
-			//   The format of the IA_PD option is:
-			//
-			//     0                   1                   2                   3
-			//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//    |         OPTION_IA_PD          |         option-length         |
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//    |                         IAID (4 octets)                       |
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//    |                              T1                               |
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//    |                              T2                               |
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//    .                                                               .
-			//    .                          IA_PD-options                        .
-			//    .                                                               .
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//
-			//   option-code:      OPTION_IA_PD (25)
-			//
-			//   option-length:    12 + length of IA_PD-options field.
-			//
-			//   IAID:             The unique identifier for this IA_PD; the IAID must
-			//                     be unique among the identifiers for all of this
-			//                     requesting router's IA_PDs.
-			//
-			//   T1:               The time at which the requesting router should
-			//                     contact the delegating router from which the
-			//                     prefixes in the IA_PD were obtained to extend the
-			//                     lifetimes of the prefixes delegated to the IA_PD;
-			//                     T1 is a time duration relative to the current time
-			//                     expressed in units of seconds.
-			//
-			//   T2:               The time at which the requesting router should
-			//                     contact any available delegating router to extend
-			//                     the lifetimes of the prefixes assigned to the
-			//                     IA_PD; T2 is a time duration relative to the
-			//                     current time expressed in units of seconds.
-			//
-			//   IA_PD-options:    Options associated with this IA_PD.
-
-			txmessage[len++] = 0x00; // IA_PD Option
-			txmessage[len++] = 0x19;
-
-			txmessage[len++] = 0x00; // Length
-			txmessage[len++] = 0x29;
-
-			txmessage[len++] = 0x00; // IAID
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-
-			txmessage[len++] = 0x00; // T1
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-
-			txmessage[len++] = 0x00; // T2
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-
-			//   The IA_PD Prefix option is used to specify IPv6 address prefixes
-			//   associated with an IA_PD.  The IA_PD Prefix option must be
-			//   encapsulated in the IA_PD-options field of an IA_PD option.
-			//
-			//   The format of the IA_PD Prefix option is:
-			//
-			//     0                   1                   2                   3
-			//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//    |        OPTION_IAPREFIX        |         option-length         |
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//    |                      preferred-lifetime                       |
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//    |                        valid-lifetime                         |
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//    | prefix-length |                                               |
-			//    +-+-+-+-+-+-+-+-+          IPv6 prefix                          |
-			//    |                           (16 octets)                         |
-			//    |                                                               |
-			//    |                                                               |
-			//    |                                                               |
-			//    |               +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//    |               |                                               .
-			//    +-+-+-+-+-+-+-+-+                                               .
-			//    .                       IAprefix-options                        .
-			//    .                                                               .
-			//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//
-			//   option-code:      OPTION_IAPREFIX (26)
-			//
-			//   option-length:    25 + length of IAprefix-options field
-			//
-			//   preferred-lifetime: The recommended preferred lifetime for the IPv6
-			//                     prefix in the option, expressed in units of
-			//                     seconds.  A value of 0xFFFFFFFF represents
-			//                     infinity.
-			//
-			//   valid-lifetime:   The valid lifetime for the IPv6 prefix in the
-			//                     option, expressed in units of seconds.  A value of
-			//                     0xFFFFFFFF represents infinity.
-			//
-			//   prefix-length:    Length for this prefix in bits
-			//
-			//   IPv6-prefix:      An IPv6 prefix
-			//
-			//   IAprefix-options: Options associated with this prefix
-
-			txmessage[len++] = 0x00; // IA Prefix option
-			txmessage[len++] = 0x1a;
-
-			txmessage[len++] = 0x00; // Length (no additional options)
-			txmessage[len++] = 0x19;
-
-			txmessage[len++] = 0x00; // Preferred lifetime - 21600 seconds (6 hours)
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x54;
-			txmessage[len++] = 0x60;
-
-			txmessage[len++] = 0x00; // Valid lifetime - 86400 seconds (24 hours)
-			txmessage[len++] = 0x01;
-			txmessage[len++] = 0x51;
-			txmessage[len++] = 0x80;
-
-			txmessage[len++] = 0x40; // 64-bit prefix length
-
-			txmessage[len++] = 0x00; // Prefix ::
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			txmessage[len++] = 0x00;
-			break;
+			// However often it is resent, the probe must be answered within the budget
+			probe->deadline = now + udp_probe_timeout(probe->template, UDPRETRANSMIT_BUDGET_USECS);
+			if (probe->deadline > *deadline) *deadline = probe->deadline;
+			started++;
 		}
+		probe->nextsend = now + probe->interval;
+		udp_mux_arm(probes, queued[i]);
+	}
+	return(started);
+}
 
+// Queue a probe's datagram, first sending any already queued if the pacer asks us to wait.
+// Returns the number of probes newly in flight as a result.
+unsigned int udp_mux_queue(struct udp_probe_struc *probes, unsigned int p, struct pollfd *fds, struct sockaddr_in6 *remoteaddr, unsigned int *queued, uint64_t *deadline)
+{
+	char txmessage[UDP_BUFFER_SIZE+1];
+	unsigned int started = 0;
+	uint64_t wait;
+	int len, entry;
+
+	// Every transmission carries the same identifiers, so that a reply to any of them will do
+	memset(&txmessage, 0, UDP_BUFFER_SIZE+1);
+	len = udp_payload_fill(probes[p].template, &txmessage[0], probes[p].probeid);
+	probes[p].len = len;
+
+	wait = pacer_reserve();
+	if (0 < wait)
+	{
+		started += udp_mux_flush(probes, queued, deadline);
+		pacer_sleep(wait);
+	}
 
-		case 1900:
-		{
-			// UPnP
-			// taken from http://upnp.org/specs/arch/UPnP-arch-DeviceArchitecture-v1.1.pdf
-			//
-			len = snprintf(&txmessage[0], UDP_BUFFER_SIZE, \
-					"M-SEARCH * HTTP/1.1\r\nHost:[%s]:1900\r\nMan: \"ssdp:discover\"\r\nMX:1\r\nST: \"ssdp:all\"\r\nUSER-AGENT: linux/2.6 UPnP/1.1 TimsTester/1.0\r\n\r\n", hostname);
-			if (len < 0 || len >= UDP_BUFFER_SIZE)
-			{
-				IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad snprintf() for UPnP, returned %d\n", len);
-				len = 0;
-				retval = PORTINTERROR;
-			}
+	remoteaddr->sin6_port = htons(probes[p].port);
+	entry = udp_batch_add(fds[probes[p].sock].fd, remoteaddr, &txmessage[0], len);
+	if (0 > entry)
+	{
+		started += udp_mux_flush(probes, queued, deadline);
+		entry = udp_batch_add(fds[probes[p].sock].fd, remoteaddr, &txmessage[0], len);
+	}
+	queued[entry] = p;
+	return(started);
+}
 
-			break;
+int check_udp_ports_mux(struct scan_context_struc *ctx, unsigned int portindex, unsigned int todo, struct portlist_struc *udpportlist)
+{
+	struct udp_probe_struc probes[UDP_MUX_MAXPROBES];
+	unsigned int queued[UDP_BATCH_MAXMSGS];
+	struct pollfd fds[UDP_MUX_MAXSOCKETS];
+	char resultnote[INET6_ADDRSTRLEN];
+	struct sockaddr_in6 remoteaddr;
+	struct timerwheel_struc *wheel = timer_wheel();
+	struct timer_struc *timer, linger;
+	unsigned int numsocks = 0, outstanding = 0, i, j;
+	uint64_t deadline = 0, now, interval, lastrx = 0, lingerfrom = 0;
+	int s, rc = 0, one = 1;
+
+	if (todo > UDP_MUX_MAXPROBES) todo = UDP_MUX_MAXPROBES;
+	memcpy(&remoteaddr, &ctx->remoteaddr, sizeof(remoteaddr));
+
+	// The first retransmission follows one RTT-derived timeout, and each thereafter doubles it
+	interval = rtt_timeout(&ctx->rtt, UDPRETRANSMIT_FLOOR_USECS, UDPRETRANSMIT_CEILING_USECS);
+
+	// Tests of the same port share a socket if their replies can be told apart, otherwise they are
+	// spread across sockets so that a reply identifies one probe. Any beyond UDP_MUX_MAXSOCKETS
+	// (sock of -1) are scanned individually afterwards.
+	for (i = 0 ; i < todo ; i++)
+	{
+		memset(&probes[i], 0, sizeof(struct udp_probe_struc));
+		probes[i].port = udpportlist[portindex+i].port_num;
+		probes[i].special = udpportlist[portindex+i].special;
+		probes[i].result = PORTUNKNOWN;
+		probes[i].interval = interval;
+		probes[i].sock = 0;
+
+		probes[i].template = udp_template_get(probes[i].port, probes[i].special, ctx->hostname);
+		if (NULL == probes[i].template)
+		{
+			probes[i].result = PORTINTERROR;
+			continue;
 		}
 
-		// LSP Ping
-		case 3503:
+		for (j = 0 ; j < i ; j++)
 		{
-			// Taken from RFC4379
-			//
-			//             0                   1                   2                   3
-			//		       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-			//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//		      |         Version Number        |         Global Flags          |
-			//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//		      |  Message Type |   Reply mode  |  Return Code  | Return Subcode|
-			//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//		      |                        Sender's Handle                        |
-			//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//		      |                        Sequence Number                        |
-			//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//		      |                    TimeStamp Sent (seconds)                   |
-			//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//		      |                  TimeStamp Sent (microseconds)                |
-			//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//		      |                  TimeStamp Received (seconds)                 |
-			//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//		      |                TimeStamp Received (microseconds)              |
-			//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//		      |                            TLVs ...                           |
-			//		      .                                                               .
-			//		      .                                                               .
-			//		      .                                                               .
-			//		      |                                                               |
-			//		      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			// Version
-			txmessage[len++] = 0;
-			txmessage[len++] = 1; // Version 1
-			// Global flags
-			txmessage[len++] = 0;
-			txmessage[len++] = 1; // Global Flags 1=Validate FEC Stack
-			// Message type
-			txmessage[len++] = 1; // Message type 1=echo request
-			// Reply mode
-			txmessage[len++] = 2; // Reply Mode (1=don't;2=ip udp;3=ip udp + router alert; 4 = app level control channel)
-			// Return code
-			txmessage[len++] = 0; // Filled in by responder
-			// Return subcode
-			txmessage[len++] = 0; // Filled in by responder
-			// Sender's Handle
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			// Sequence Number
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 1;
-			// Timestamp sent (seconds)
-			txmessage[len++] = (tv_secs >> 24) & 0xff;
-			txmessage[len++] = (tv_secs >> 16) & 0xff;
-			txmessage[len++] = (tv_secs >>  8) & 0xff;
-			txmessage[len++] = tv_secs         & 0xff;
-			// Timestamp sent (microseconds)
-			txmessage[len++] = (tv_usecs >> 24) & 0xff;
-			txmessage[len++] = (tv_usecs >> 16) & 0xff;
-			txmessage[len++] = (tv_usecs >>  8) & 0xff;
-			txmessage[len++] = tv_usecs         & 0xff;
-			// Timestamp received (seconds)
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			// Timestamp received (microseconds)
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-			//
-			// TLVs
-			//
-			//			TLVs (Type-Length-Value tuples) have the following format:
-			//
-			//			       0                   1                   2                   3
-			//			       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-			//			      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//			      |             Type              |            Length             |
-			//			      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//			      |                             Value                             |
-			//			      .                                                               .
-			//			      .                                                               .
-			//			      .                                                               .
-			//			      |                                                               |
-			//			      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//
-			//			   Types are defined below; Length is the length of the Value field in
-			//			   octets.  The Value field depends on the Type; it is zero padded to
-			//			   align to a 4-octet boundary.  TLVs may be nested within other TLVs,
-			//			   in which case the nested TLVs are called sub-TLVs.  Sub-TLVs have
-			//			   independent types and MUST also be 4-octet aligned.
-			//
-			//			   A description of the Types and Values of the top-level TLVs for LSP
-			//			   ping are given below:
-			//
-			//			          Type #                  Value Field
-			//			          ------                  -----------
-			//			               1                  Target FEC Stack
-			//			               2                  Downstream Mapping
-			//			               3                  Pad
-			//			               4                  Not Assigned
-			//			               5                  Vendor Enterprise Number
-			//			               6                  Not Assigned
-			//			               7                  Interface and Label Stack
-			//			               8                  Not Assigned
-			//			               9                  Errored TLVs
-			//			              10                  Reply TOS Byte
-			//
-			// Always include a FEC TLV
-			txmessage[len++] = 0;
-			txmessage[len++] = 1; // Target FEC Stack (from types listed above)
-			txmessage[len++] = 0;
-			txmessage[len++] = 24; // length of LDP IPv6 prefix that follows
-			//
-			// A Target FEC Stack is a list of sub-TLVs.  The number of elements is
-			//   determined by looking at the sub-TLV length fields.
-			//
-			//    Sub-Type       Length            Value Field
-			//    --------       ------            -----------
-			//           1            5            LDP IPv4 prefix
-			//           2           17            LDP IPv6 prefix
-			//           3           20            RSVP IPv4 LSP
-			//           4           56            RSVP IPv6 LSP
-			//           5                         Not Assigned
-			//           6           13            VPN IPv4 prefix
-			//           7           25            VPN IPv6 prefix
-			//           8           14            L2 VPN endpoint
-			//           9           10            "FEC 128" Pseudowire (deprecated)
-			//          10           14            "FEC 128" Pseudowire
-			//          11          16+            "FEC 129" Pseudowire
-			//          12            5            BGP labeled IPv4 prefix
-			//
-			txmessage[len++] = 0;
-			txmessage[len++] = 2; // Sub-type LDP IPv6 prefix
-			txmessage[len++] = 0;
-			txmessage[len++] = 17; // LDP IPv6 prefix TLV length as listed above
-			//
-			//			The Label Distribution Protocol (LDP) IPv6 FEC
-			//			sub-TLV has the following format:
-			//
-			//       0                   1                   2                   3
-			//       0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      |                          IPv6 prefix                          |
-			//      |                          (16 octets)                          |
-			//      |                                                               |
-			//      |                                                               |
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//      | Prefix Length |         Must Be Zero                          |
-			//      +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-			//
-			//
-			// copy the server's local address into the FEC entry
-			for (i = 0; i < 16; i++)
-			{
-				txmessage[len++] = localaddr.sin6_addr.s6_addr[i] & 0xff;
-			}
-			txmessage[len++] = 128; // single host is /128
-			txmessage[len++] = 0;   // 0-padding
-			txmessage[len++] = 0;
-			txmessage[len++] = 0;
-
-			break;
+			if (PORTUNKNOWN != probes[j].result || probes[j].port != probes[i].port || probes[j].sock != probes[i].sock) continue;
+			if (0 != (probes[j].template->flags & probes[i].template->flags & UDP_TEMPLATE_DISTINCT)) continue;
+			probes[i].sock++;
 		}
+		if (UDP_MUX_MAXSOCKETS <= probes[i].sock) probes[i].sock = -1;
+		else if ((unsigned int)probes[i].sock >= numsocks) numsocks = (unsigned int)probes[i].sock + 1;
+	}
 
-		case 11211: // memcache
+	for (s = 0 ; s < (int)numsocks ; s++)
+	{
+		fds[s].events = POLLIN;
+		fds[s].revents = 0;
+		fds[s].fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (-1 == fds[s].fd)
 		{
-			if (0 == special)
-			{
-				// ASCII mode
-				// The frame header is 8 bytes long, as follows (all values are 16-bit integers
-				// in network byte order, high byte first):
-				//
-				// 0-1 Request ID
-				// 2-3 Sequence number
-				// 4-5 Total number of datagrams in this message
-				// 6-7 Reserved for future use; must be 0
-				// <cmd>\r\n
-
-				txmessage[len++] = 0x00; // Request ID
-				txmessage[len++] = 0x01;
-				txmessage[len++] = 0x00; // Sequence ID
-				txmessage[len++] = 0x00;
-				txmessage[len++] = 0x00; // Number of datagrams
-				txmessage[len++] = 0x01;
-				txmessage[len++] = 0x00; // Reserved for future use
-				txmessage[len++] = 0x00;
-
-				char mccmd[] = "version";
-
-				rc = snprintf(&txmessage[len], (size_t)(UDP_BUFFER_SIZE-len), "%s\r\n", mccmd);
-				if (rc < 0 || rc >= ( UDP_BUFFER_SIZE-len ))
-				{
-					IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad snprintf() for memcache command, returned %d\n", rc);
-					retval = PORTINTERROR;
-				}
-				else
-				{
-					len += rc;
-				}
-			}
-			else
-			{
-				txmessage[len++] = 0x00; // Request ID
-				txmessage[len++] = 0x01;
-				txmessage[len++] = 0x00; // Sequence ID
-				txmessage[len++] = 0x00;
-				txmessage[len++] = 0x00; // Number of datagrams
-				txmessage[len++] = 0x01;
-				txmessage[len++] = 0x00; // Reserved for future use
-				txmessage[len++] = 0x00;
-				// Binary mode
-				// https://github.com/couchbase/memcached/blob/master/docs/BinaryProtocol.md#0x0b-version
-				//
-				//  Byte/     0       |       1       |       2       |       3       |
-				//     /              |               |               |               |
-				//    |0 1 2 3 4 5 6 7|0 1 2 3 4 5 6 7|0 1 2 3 4 5 6 7|0 1 2 3 4 5 6 7|
-				//    +---------------+---------------+---------------+---------------+
-				//   0| 0x80          | 0x0b          | 0x00          | 0x00          |
-				//    +---------------+---------------+---------------+---------------+
-				//   4| 0x00          | 0x00          | 0x00          | 0x00          |
-				//    +---------------+---------------+---------------+---------------+
-				//   8| 0x00          | 0x00          | 0x00          | 0x00          |
-				//    +---------------+---------------+---------------+---------------+
-				//  12| 0x00          | 0x00          | 0x00          | 0x00          |
-				//    +---------------+---------------+---------------+---------------+
-				//  16| 0x00          | 0x00          | 0x00          | 0x00          |
-				//    +---------------+---------------+---------------+---------------+
-				//  20| 0x00          | 0x00          | 0x00          | 0x00          |
-				//    +---------------+---------------+---------------+---------------+
-				//
-				txmessage[len++] = 0x80; //	request
-				txmessage[len++] = 0x0b; //	opcode - Version
-				txmessage[len++] = 0; //	keylength
-				txmessage[len++] = 0; //	keylength
-				txmessage[len++] = 0; //	extras length -must be 0, else "multipart not supported"
-				txmessage[len++] = 1; //	data type    - must be 1, else "multipart not supported"
-				txmessage[len++] = 0; //	reserved
-				txmessage[len++] = 0; //	reserved
-				txmessage[len++] = 0; //	total body length
-				txmessage[len++] = 0; //	total body length
-				txmessage[len++] = 0; //	total body length
-				txmessage[len++] = 0; //	total body length
-				txmessage[len++] = 0x21; //	opaque
-				txmessage[len++] = 0x03; //	opaque
-				txmessage[len++] = 0x14; //	opaque
-				txmessage[len++] = 0x08; //	opaque
-				txmessage[len++] = 0; //	cas
-				txmessage[len++] = 0; //	cas
-				txmessage[len++] = 0; //	cas
-				txmessage[len++] = 0; //	cas
-				txmessage[len++] = 0; //	cas
-				txmessage[len++] = 0; //	cas
-				txmessage[len++] = 0; //	cas
-				txmessage[len++] = 0; //	cas
-			}
+			IPSCAN_LOG( LOGPREFIX "check_udp_ports_mux: Bad socket call, returned %d (%s)\n", errno, strerror(errno));
 			break;
 		}
-
-		default:
+		// Unconnected sockets only see ICMPv6 errors if they are queued for us
+		if (0 != setsockopt(fds[s].fd, IPPROTO_IPV6, IPV6_RECVERR, &one, sizeof(one)))
 		{
-			// Unhandled port
-			IPSCAN_LOG( LOGPREFIX "check_udp_port: generating an unspecified message for UDP port %d\n", port);
-			len = 0;
-			// Generate an unspecified message
-			txmessage[len++] = 0x0A;
-			txmessage[len++] = 0x0A;
-			txmessage[len++] = 0x0D;
-			txmessage[len++] = 0x0;
-			rc = snprintf(&txmessage[len], (size_t)(UDP_BUFFER_SIZE-len), "IPscan (c) 2011-2021 Tim Chappell. This message is destined for UDP port %d\n", port);
-			if (rc < 0 || rc >= (UDP_BUFFER_SIZE-len))
-			{
-				IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad snprintf() for unhandled port, returned %d\n", rc);
-				retval = PORTINTERROR;
-			}
-			else
-			{
-				len += rc;
-			}
+			IPSCAN_LOG( LOGPREFIX "check_udp_ports_mux: Bad setsockopt IPV6_RECVERR set, returned %d (%s)\n", errno, strerror(errno));
+			close(fds[s].fd);
 			break;
 		}
-		}
 	}
 
-	if (PORTUNKNOWN == retval)
+	// Nothing has been sent yet, so let the caller fall back to a socket per probe
+	if (s < (int)numsocks)
 	{
-		rc = write(fd,&txmessage,(size_t)len);
-		if (rc < 0)
+		while (s > 0) close(fds[--s].fd);
+		return(IPSCAN_UDP_MUX_UNAVAILABLE);
+	}
+
+	#ifdef UDPPARLLDEBUG
+	IPSCAN_LOG( LOGPREFIX "check_udp_ports_mux(): startindex %d, todo %d, using %d sockets\n", portindex, todo, numsocks);
+	#endif
+
+	// Queue every probe, sending the batch whenever the bucket shared with the other children
+	// runs dry, so that the burst allowance goes out in a single call
+	udp_batch_reset();
+	for (i = 0 ; i < todo ; i++)
+	{
+		if (-1 == probes[i].sock || PORTUNKNOWN != probes[i].result) continue;
+
+		probes[i].probeid = udp_next_probeid();
+		outstanding += udp_mux_queue(probes, i, fds, &remoteaddr, &queued[0], &deadline);
+	}
+	outstanding += udp_mux_flush(probes, &queued[0], &deadline);
+
+	// Collect replies and errors, resending unanswered probes as their backoff expires, until
+	// every probe has been answered or run out of budget. Then carry on collecting whilst further
+	// datagrams answering the probes are still arriving, within the round's deadline.
+	memset(&linger, 0, sizeof(linger));
+	while (0 < outstanding || 0 != timer_pending(&linger))
+	{
+		now = pacer_now_usecs();
+		while (NULL != (timer = timer_expire(wheel, now)))
 		{
-			if (0 != special)
+			struct udp_probe_struc *probe = &probes[timer->owner];
+
+			if (TIMER_UDP_RETRANSMIT == timer->kind)
 			{
-				IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad write(port %d:%d) attempt, returned %d (%s)\n", port, special, errno, strerror(errno));
+				probe->retransmits++;
+				probe->interval *= 2;
+				outstanding += udp_mux_queue(probes, timer->owner, fds, &remoteaddr, &queued[0], &deadline);
+				#ifdef UDPDEBUG
+				IPSCAN_LOG( LOGPREFIX "check_udp_ports_mux: retransmission %u of port %d:%d\n", probe->retransmits, probe->port, probe->special);
+				#endif
 			}
-			else
+			else if (TIMER_UDP_DEADLINE == timer->kind && 0 < outstanding)
 			{
-				IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad write(port %d) attempt, returned %d (%s)\n", port, errno, strerror(errno));
+				// Out of retransmissions and budget, so as though a blocking read() had timed out
+				probe->result = udp_classify_error(ctx, probe->port, probe->special, EAGAIN);
+				outstanding--;
 			}
-			retval = PORTINTERROR;
 		}
-		else
+		if (0 < udp_batch_pending())
 		{
-			#ifdef UDPDEBUG
-			if (0 != special)
-			{
-				IPSCAN_LOG( LOGPREFIX "check_udp_port: write(port %d:%d) returned %d\n", port, special, rc);
-			}
-			else
-			{
-				IPSCAN_LOG( LOGPREFIX "check_udp_port: write(port %d) returned %d\n", port, rc);
-			}
-			#endif
+			outstanding += udp_mux_flush(probes, &queued[0], &deadline);
+			// The resent probes' next backoff may now be the earliest event
+			continue;
 		}
-	}
+		if (0 == outstanding && 0 == timer_pending(&linger)) break;
 
-	if (PORTUNKNOWN == retval)
-	{
-		rc=read(fd,&rxmessage,UDP_BUFFER_SIZE);
+		rc = poll(fds, numsocks, timer_wait_msecs(wheel, pacer_now_usecs()));
 		if (rc < 0)
 		{
-			int errsv = errno ;
-			#ifdef UDPDEBUG
-			if (0 != special)
-			{
-				IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad read(port %d:%d), returned %d (%s)\n", port, special, errno, strerror(errno));
-			}
-			else
-			{
-				IPSCAN_LOG( LOGPREFIX "check_udp_port: Bad read(port %d), returned %d (%s)\n", port, errno, strerror(errno));
-			}
-			#endif
-			// cycle through the expected list of results
-			for (i = 0; PORTEOL != resultsstruct[i].returnval && PORTUNKNOWN == retval ; i++)
-			{
-
-				// Find a matching connect returncode and also errno, if appropriate
-				if (resultsstruct[i].connrc == rc)
-				{
-					// Set the returnvalue if we find a match
-					if ( rc == -1 && resultsstruct[i].connerrno == errsv )
-					{
-						retval = resultsstruct[i].returnval;
-					}
-				}
-			}
-
-			#ifdef RESULTSDEBUG
-			if (0 != special)
-			{
-				IPSCAN_LOG( LOGPREFIX "check_udp_port: found port %d:%d returned read = %d, errsv = %d(%s)\n",port, special, rc, errsv, strerror(errsv));
-			}
-			else
-			{
-				IPSCAN_LOG( LOGPREFIX "check_udp_port: found port %d returned read = %d, errsv = %d(%s)\n",port, rc, errsv, strerror(errsv));
-			}
-			#endif
-
-			// If we haven't found a matching returncode/errno then log this ....
-			if (PORTUNKNOWN == retval)
-			{
-				if (0 != special)
-				{
-					IPSCAN_LOG( LOGPREFIX "check_udp_port: read(port %d:%d) unexpected response, errno is : %d (%s) for host %s port %d\n", port, special,\
-							errsv, strerror(errsv), hostname, port);
-				}
-				else
-				{
-					IPSCAN_LOG( LOGPREFIX "check_udp_port: read(port %d) unexpected response, errno is : %d (%s) for host %s port %d\n", port, \
-							errsv, strerror(errsv), hostname, port);
-				}
-				retval = PORTUNEXPECTED;
-			}
+			if (EINTR == errno) continue;
+			IPSCAN_LOG( LOGPREFIX "check_udp_ports_mux: poll failed, returned %d (%s)\n", errno, strerror(errno));
+			break;
 		}
-		else
-		{
-			retval = UDPOPEN;
 
-			#ifdef UDPDEBUG
-			if (0 != special)
-			{
-				IPSCAN_LOG( LOGPREFIX "check_udp_port: good read() of UDP port %d:%d, returned %d bytes\n", port, special, rc);
-			}
-			else
-			{
-				IPSCAN_LOG( LOGPREFIX "check_udp_port: good read() of UDP port %d, returned %d bytes\n", port, rc);
-			}
+		for (s = 0 ; s < (int)numsocks ; s++)
+		{
+			unsigned int completed = 0;
+			if (0 != (fds[s].revents & POLLERR)) completed += udp_mux_errors(ctx, probes, todo, s, fds[s].fd);
+			if (0 != (fds[s].revents & POLLIN)) completed += udp_mux_replies(ctx, probes, todo, s, fds[s].fd, &lastrx);
+			outstanding = (completed < outstanding) ? (outstanding - completed) : 0;
+		}
 
-			// Log the summary of results internally - but only if LOGVERBOSITY is set to 1
-			unsigned int rxlength = ( rc < UDPMAXLOGOCTETS ) ? rc : UDPMAXLOGOCTETS;
-			i = 0;
-			int position = 0;
-			while (i < rxlength)
-			{
-				if (position == 0)
-				{
-					if (0 != special)
-					{
-						rc = snprintf(udplogbufferptr, udplogbuffersize, "check_udp_port: Found response packet for port %d:%d: %02x", port, special, (rxmessage[i] & 0xff) );
-					}
-					else
-					{
-						rc = snprintf(udplogbufferptr, udplogbuffersize, "check_udp_port: Found response packet for port %d: %02x", port, (rxmessage[i] & 0xff) );
-					}
-				}
-				else
-				{
-					rc = snprintf(udplogbufferptr, udplogbuffersize, " %02x", (rxmessage[i] & 0xff) );
-				}
+		// Each datagram answering a probe extends the linger, up to the round's deadline
+		if (lastrx != lingerfrom)
+		{
+			lingerfrom = lastrx;
+			timer_add(wheel, &linger, TIMER_UDP_LINGER, 0, (lastrx + UDP_AMP_LINGER_USECS < deadline) ? (lastrx + UDP_AMP_LINGER_USECS) : deadline);
+		}
+	}
 
-				if (rc < 0 || rc >= udplogbuffersize)
-				{
-					IPSCAN_LOG( LOGPREFIX "check_udp_port: logbuffer write truncated, increase LOGENTRYSIZE (currently %d) and recompile.\n", LOGENTRYSIZE);
-					exit(EXIT_FAILURE);
-				}
+	// The timers must not outlive the probes on the wheel
+	timer_cancel(wheel, &linger);
+	for (i = 0 ; i < todo ; i++) timer_cancel(wheel, &probes[i].timer);
 
-				udplogbufferptr += rc ;
-				udplogbuffersize -= rc;
-				position ++ ;
-				if ( position >= LOGMAXOCTETS || i == (rxlength-1) )
-				{
-					#if (IPSCAN_LOGVERBOSITY == 1)
-					IPSCAN_LOG( LOGPREFIX "%s\n", udplogbuffer);
-					#endif
-					udplogbufferptr = &udplogbuffer[0];
-					udplogbuffersize = LOGENTRYSIZE;
-					position = 0;
-				}
-				i++ ;
-			}
-			#endif
+	for (s = 0 ; s < (int)numsocks ; s++)
+	{
+		if (-1 == close(fds[s].fd))
+		{
+			IPSCAN_LOG( LOGPREFIX "check_udp_ports_mux: close of fd %d caused unexpected failure : %d (%s)\n", fds[s].fd, errno, strerror(errno));
 		}
 	}
 
-	if (-1 != fd)
+	// Record every result, with the number of times its probe was resent and its amplification -
+	// unanswered probes as though a blocking read() had timed out
+	rc = 0;
+	for (i = 0 ; i < todo ; i++)
 	{
-		rc = close(fd);
-		if (rc == -1)
+		int result = probes[i].result;
+
+		if (-1 == probes[i].sock)
 		{
-			IPSCAN_LOG( LOGPREFIX "check_udp_port: close of fd %d caused unexpected failure : %d (%s)\n", fd, errno, strerror(errno));
-			retval = PORTINTERROR;
+			pacer_wait();
+			result = check_udp_port(ctx, probes[i].port, probes[i].special, ctx->udptimeoutusecs, &probes[i].amp);
+		}
+		else if (PORTUNKNOWN == result)
+		{
+			result = udp_classify_error(ctx, probes[i].port, probes[i].special, EAGAIN);
 		}
-	}
 
-	// If we received any non-positive feedback then make sure we wait at least IPSCAN_MINTIME_PER_PORT secs
-	if ((UDPOPEN != retval) && (UDPSTEALTH != retval)) sleep(IPSCAN_MINTIME_PER_PORT);
+		#if (IPSCAN_LOGVERBOSITY == 1)
+		if (0 < probes[i].retransmits)
+		{
+			IPSCAN_LOG( LOGPREFIX "check_udp_ports_mux: port %d:%d returned %s after %u retransmissions\n", probes[i].port, probes[i].special, resultsstruct[result].label, probes[i].retransmits);
+		}
+		#endif
 
-	return (retval);
+		udp_result_note(&resultnote[0], sizeof(resultnote), probes[i].retransmits, &probes[i].amp);
+		if (0 != write_db_scan(ctx, (uint32_t)(probes[i].port + ((probes[i].special & IPSCAN_SPECIAL_MASK) << IPSCAN_SPECIAL_SHIFT) + (IPSCAN_PROTO_UDP << IPSCAN_PROTO_SHIFT)), result, resultnote ))
+		{
+			IPSCAN_LOG( LOGPREFIX "check_udp_ports_mux: ERROR: write_db_scan failed\n");
+			rc = -1;
+		}
+	}
+	return(rc);
 }
 
-int check_udp_ports_parll(char * hostname, unsigned int portindex, unsigned int todo, uint64_t host_msb, uint64_t host_lsb, uint64_t timestamp, uint64_t session, struct portlist_struc *udpportlist)
+int check_udp_ports_parll(struct scan_context_struc *ctx, unsigned int portindex, unsigned int todo, struct portlist_struc *udpportlist)
 {
 	int rc,result;
 	unsigned int i;
@@ -1916,17 +964,36 @@ int check_udp_ports_parll(char * hostname, unsigned int portindex, unsigned int
 		IPSCAN_LOG( LOGPREFIX "check_udp_ports_parll(): startindex %d and todo %d\n",portindex,todo);
 		#endif
 		// child - actually do the work here - and then exit successfully
-		char unusedfield[8] = "unused\0";
+		char resultnote[INET6_ADDRSTRLEN];
+		struct udp_amp_struc amp;
+		// Adopt the echo train's round trip time, should it have arrived since the scan began waiting for it
+		if (0 != rtt_share_adopt(ctx)) ctx->udptimeoutusecs = rtt_timeout(&ctx->rtt, UDPTIMEOUT_FLOOR_USECS, UDPTIMEOUT_CEILING_USECS);
+		#if (1 == IPSCAN_UDP_MUX)
+		// Put all of this child's probes in flight at once, in as many rounds as needed
+		for (i = 0 ; i < todo ; i += UDP_MUX_MAXPROBES)
+		{
+			unsigned int round = ((todo - i) > UDP_MUX_MAXPROBES) ? UDP_MUX_MAXPROBES : (todo - i);
+			// Should the sockets not be available, scan the remaining ports one at a time
+			if (IPSCAN_UDP_MUX_UNAVAILABLE == check_udp_ports_mux(ctx, portindex + i, round, udpportlist)) break;
+		}
+		portindex += i;
+		todo = (i < todo) ? (todo - i) : 0;
+		#endif
 		for (i = 0 ; i <todo ; i++)
 		{
 			uint16_t port = udpportlist[(unsigned int)(portindex+i)].port_num;
 			uint8_t special = udpportlist[(unsigned int)(portindex+i)].special;
-			result = check_udp_port(hostname, port, special);
+			// Wait for a token from the bucket shared with the other children
+			pacer_wait();
+			if (0 != rtt_share_adopt(ctx)) ctx->udptimeoutusecs = rtt_timeout(&ctx->rtt, UDPTIMEOUT_FLOOR_USECS, UDPTIMEOUT_CEILING_USECS);
+			memset(&amp, 0, sizeof(amp));
+			result = check_udp_port(ctx, port, special, ctx->udptimeoutusecs, &amp);
 			// Put results into database
-			rc = write_db(host_msb, host_lsb, timestamp, session, (uint32_t)(port + ((special & IPSCAN_SPECIAL_MASK) << IPSCAN_SPECIAL_SHIFT) + (IPSCAN_PROTO_UDP << IPSCAN_PROTO_SHIFT)), result, unusedfield );
+			udp_result_note(&resultnote[0], sizeof(resultnote), 0, &amp);
+			rc = write_db_scan(ctx, (uint32_t)(port + ((special & IPSCAN_SPECIAL_MASK) << IPSCAN_SPECIAL_SHIFT) + (IPSCAN_PROTO_UDP << IPSCAN_PROTO_SHIFT)), result, resultnote );
 			if (rc != 0)
 			{
-				IPSCAN_LOG( LOGPREFIX "check_udp_port_parll(): ERROR: write_db returned %d\n", rc);
+				IPSCAN_LOG( LOGPREFIX "check_udp_port_parll(): ERROR: write_db_scan returned %d\n", rc);
 			}
 		}
 		// Usual practice to have children _exit() whilst the parent calls exit()
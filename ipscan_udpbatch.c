@@ -0,0 +1,257 @@
+//    IPscan - an HTTP-initiated IPv6 port scanner.
+//
+//    Copyright (C) 2011-2021 Tim Chappell.
+//
+//    This file is part of IPscan.
+//
+//    IPscan is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with IPscan.  If not, see <http://www.gnu.org/licenses/>.
+
+// ipscan_udpbatch.c 	version
+// 0.01			initial version - batched UDP transmission and reception using sendmmsg() and recvmmsg()
+// 0.02			report the full size of datagrams received with MSG_TRUNC, as well as the part kept
+
+// sendmmsg() and recvmmsg() are GNU extensions
+#define _GNU_SOURCE
+
+#include "ipscan.h"
+//
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <unistd.h>
+
+// Logging with syslog requires additional include
+#if (LOGMODE == 1)
+#include <syslog.h>
+#endif
+
+// IPV6_RECVERR error queue
+#include <linux/errqueue.h>
+
+// Others that FreeBSD highlighted
+#include <netinet/in.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+//
+// Prototype declarations
+//
+void udp_batch_reset(void);
+int udp_batch_add(int fd, const struct sockaddr_in6 *addr, const char *payload, int len);
+unsigned int udp_batch_pending(void);
+unsigned int udp_batch_send(int *errs);
+int udp_batch_recv(int fd, int flags);
+int udp_batch_rx(unsigned int i, struct sockaddr_in6 **from, char **data, int *len);
+int udp_batch_rx_size(unsigned int i);
+const struct sock_extended_err * udp_batch_rx_error(unsigned int i);
+
+//
+// Datagrams queued for transmission, in the order they were added, and those last received.
+// Each process (scan child) has its own batches, and only one of each is ever needed.
+//
+struct udp_batch_struc
+{
+	unsigned int count;
+	int fd[UDP_BATCH_MAXMSGS];
+	int len[UDP_BATCH_MAXMSGS];
+	struct mmsghdr msgs[UDP_BATCH_MAXMSGS];
+	struct iovec iov[UDP_BATCH_MAXMSGS];
+	struct sockaddr_in6 addr[UDP_BATCH_MAXMSGS];
+	char control[UDP_BATCH_MAXMSGS][UDP_BATCH_CONTROLLEN];
+	char buffer[UDP_BATCH_MAXMSGS][UDP_BUFFER_SIZE+1];
+};
+
+static struct udp_batch_struc txbatch;
+static struct udp_batch_struc rxbatch;
+
+void udp_batch_reset(void)
+{
+	txbatch.count = 0;
+	rxbatch.count = 0;
+}
+
+//
+// Queue a datagram for the next udp_batch_send(), returning its position in the batch,
+// or -1 if the batch is full and must be sent first
+//
+
+int udp_batch_add(int fd, const struct sockaddr_in6 *addr, const char *payload, int len)
+{
+	unsigned int i = txbatch.count;
+
+	if (UDP_BATCH_MAXMSGS <= i) return(-1);
+	if (0 > len || UDP_BUFFER_SIZE < len) len = 0;
+
+	txbatch.fd[i] = fd;
+	memcpy(&txbatch.addr[i], addr, sizeof(struct sockaddr_in6));
+	memcpy(&txbatch.buffer[i][0], payload, (size_t)len);
+	txbatch.len[i] = len;
+	txbatch.count++;
+	return((int)i);
+}
+
+unsigned int udp_batch_pending(void)
+{
+	return(txbatch.count);
+}
+
+//
+// Send every queued datagram, with one sendmmsg() per socket. errs[] receives 0 for each datagram
+// sent, or the errno of its failure, by position in the batch. Returns the number sent.
+//
+
+unsigned int udp_batch_send(int *errs)
+{
+	struct mmsghdr msgs[UDP_BATCH_MAXMSGS];
+	unsigned int order[UDP_BATCH_MAXMSGS];
+	unsigned int done[UDP_BATCH_MAXMSGS];
+	unsigned int i, j, n, off, sent = 0;
+	int rc, retried;
+
+	memset(done, 0, sizeof(done));
+
+	for (i = 0 ; i < txbatch.count ; i++)
+	{
+		if (0 != done[i]) continue;
+
+		// Gather this socket's datagrams, keeping them in the order they were queued
+		for (j = i, n = 0 ; j < txbatch.count ; j++)
+		{
+			if (0 != done[j] || txbatch.fd[j] != txbatch.fd[i]) continue;
+
+			txbatch.iov[j].iov_base = &txbatch.buffer[j][0];
+			txbatch.iov[j].iov_len = (size_t)txbatch.len[j];
+			memset(&msgs[n], 0, sizeof(struct mmsghdr));
+			msgs[n].msg_hdr.msg_name = &txbatch.addr[j];
+			msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+			msgs[n].msg_hdr.msg_iov = &txbatch.iov[j];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			order[n] = j;
+			done[j] = 1;
+			n++;
+		}
+
+		off = 0;
+		retried = 0;
+		while (off < n)
+		{
+			rc = sendmmsg(txbatch.fd[i], &msgs[off], n - off, 0);
+			if (0 < rc)
+			{
+				for (j = off ; j < (off + (unsigned int)rc) ; j++) errs[order[j]] = 0;
+				sent += (unsigned int)rc;
+				off += (unsigned int)rc;
+				retried = 0;
+				continue;
+			}
+
+			// An ICMPv6 error for an earlier datagram is reported once, by whichever call
+			// comes next. It remains in the error queue, so simply send again.
+			if (0 == retried && (ECONNREFUSED == errno || EHOSTUNREACH == errno || ENETUNREACH == errno || EACCES == errno || EINTR == errno))
+			{
+				retried = 1;
+				continue;
+			}
+
+			// Otherwise the first datagram has failed - record it and carry on with the rest
+			errs[order[off]] = (0 > rc) ? errno : EIO;
+			off++;
+			retried = 0;
+		}
+	}
+
+	txbatch.count = 0;
+	return(sent);
+}
+
+//
+// Receive as many datagrams as are waiting on a socket, up to UDP_BATCH_MAXMSGS, with one
+// recvmmsg(). flags would normally include MSG_DONTWAIT, and may include MSG_ERRQUEUE to
+// collect queued errors instead, or MSG_TRUNC to learn the full size of any datagram too large
+// for its buffer. Returns the number received, or -1 with errno set.
+//
+
+int udp_batch_recv(int fd, int flags)
+{
+	unsigned int i;
+	int rc;
+
+	rxbatch.count = 0;
+	for (i = 0 ; i < UDP_BATCH_MAXMSGS ; i++)
+	{
+		rxbatch.iov[i].iov_base = &rxbatch.buffer[i][0];
+		rxbatch.iov[i].iov_len = UDP_BUFFER_SIZE;
+		memset(&rxbatch.msgs[i], 0, sizeof(struct mmsghdr));
+		rxbatch.msgs[i].msg_hdr.msg_name = &rxbatch.addr[i];
+		rxbatch.msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+		rxbatch.msgs[i].msg_hdr.msg_iov = &rxbatch.iov[i];
+		rxbatch.msgs[i].msg_hdr.msg_iovlen = 1;
+		rxbatch.msgs[i].msg_hdr.msg_control = &rxbatch.control[i][0];
+		rxbatch.msgs[i].msg_hdr.msg_controllen = UDP_BATCH_CONTROLLEN;
+	}
+
+	rc = recvmmsg(fd, &rxbatch.msgs[0], UDP_BATCH_MAXMSGS, flags, NULL);
+	if (0 < rc) rxbatch.count = (unsigned int)rc;
+	return(rc);
+}
+
+//
+// Fetch the sender (or, for an error, the original destination), payload and length of a
+// datagram from the last udp_batch_recv(). The length is only of the part that was kept, so
+// never more than UDP_BUFFER_SIZE. Returns 0, or -1 if there is no such datagram.
+//
+
+int udp_batch_rx(unsigned int i, struct sockaddr_in6 **from, char **data, int *len)
+{
+	if (i >= rxbatch.count) return(-1);
+
+	*from = &rxbatch.addr[i];
+	*data = &rxbatch.buffer[i][0];
+	*len = (UDP_BUFFER_SIZE < rxbatch.msgs[i].msg_len) ? UDP_BUFFER_SIZE : (int)rxbatch.msgs[i].msg_len;
+	return(0);
+}
+
+//
+// Fetch the size of a datagram from the last udp_batch_recv() as it was sent, which with
+// MSG_TRUNC may exceed the part kept. Returns -1 if there is no such datagram.
+//
+
+int udp_batch_rx_size(unsigned int i)
+{
+	if (i >= rxbatch.count) return(-1);
+	return((int)rxbatch.msgs[i].msg_len);
+}
+
+//
+// Fetch the extended error accompanying a datagram from the error queue, or NULL if none
+//
+
+const struct sock_extended_err * udp_batch_rx_error(unsigned int i)
+{
+	struct cmsghdr *cmsg;
+
+	if (i >= rxbatch.count) return(NULL);
+
+	for (cmsg = CMSG_FIRSTHDR(&rxbatch.msgs[i].msg_hdr); NULL != cmsg; cmsg = CMSG_NXTHDR(&rxbatch.msgs[i].msg_hdr, cmsg))
+	{
+		if (IPPROTO_IPV6 == cmsg->cmsg_level && IPV6_RECVERR == cmsg->cmsg_type)
+		{
+			return((const struct sock_extended_err *)CMSG_DATA(cmsg));
+		}
+	}
+	return(NULL);
+}
@@ -0,0 +1,575 @@
+//    IPscan - an HTTP-initiated IPv6 port scanner.
+//
+//    Copyright (C) 2011-2021 Tim Chappell.
+//
+//    This file is part of IPscan.
+//
+//    IPscan is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with IPscan.  If not, see <http://www.gnu.org/licenses/>.
+
+// ipscan_uring.c 	version
+// 0.01			initial version - io_uring TCP connect engine
+// 0.02			derive the linked timeout from the measured round trip time
+// 0.03			pace connect submissions through the shared token bucket
+// 0.04			take the pre-resolved target from the scan context
+// 0.05			draw probe sockets from the TCP socket budget
+// 0.06			take the timeout ceiling for the current round from the scan context
+
+#include "ipscan.h"
+
+// Only build the engine if it has been enabled in the Makefile
+#if (1 == IPSCAN_INCLUDE_URING)
+
+//
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+// IPv6 address conversion
+#include <arpa/inet.h>
+
+// Logging with syslog requires additional include
+#if (LOGMODE == 1)
+#include <syslog.h>
+#endif
+
+// Others that FreeBSD highlighted
+#include <netinet/in.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+// io_uring related - the raw kernel interface is used so that liburing is not required
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Operation types, carried in the low byte of each submission's user_data
+#define URING_OP_CONNECT 1
+#define URING_OP_TIMEOUT 2
+#define URING_OP_CLOSE 3
+#define URING_OP_WAKEUP 4
+#define URING_OP_SHIFT 8
+
+// Ring size - each probe needs a connect, its linked timeout and a close, plus one pacing wakeup
+#define URING_ENTRIES (4 * MAXTCPINFLIGHT)
+
+//
+// Prototype declarations
+//
+int tcp_classify_probe(int conn, int errsv, char * hostname, uint16_t port, uint8_t special);
+int tcp_record_result(struct scan_context_struc *ctx, uint16_t port, uint8_t special, int result);
+uint64_t tcp_now_usecs(void);
+void tcp_rtt_sample(struct rtt_struc *rtt, uint64_t started, int result);
+int tcp_budget_acquire(struct scan_context_struc *ctx, int force);
+void tcp_budget_release(struct scan_context_struc *ctx);
+int tcp_socket_exhausted(int errsv);
+int tcp_probe_socket(int flags);
+void tcp_probe_linger(int sock, int result);
+
+// from ipscan_pacer
+int pacer_admit(uint64_t *holdoff, uint64_t now);
+
+// from ipscan_general
+uint64_t rtt_timeout(struct rtt_struc *rtt, uint64_t floorusecs, uint64_t ceilingusecs);
+
+// Mapped io_uring submission and completion queues
+struct uring_struc
+{
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+	unsigned int tosubmit;
+};
+
+// Per-probe state - the address and timeout must remain valid whilst the kernel owns them.
+// A deferred probe keeps its port index until it can be retried at retryat.
+struct uring_probe_struc
+{
+	int sock;
+	int inuse;
+	int pending;
+	int deferred;
+	int budget;
+	unsigned int index;
+	uint64_t started;
+	uint64_t holdoff;
+	uint64_t waitstart;
+	uint64_t retryat;
+	struct sockaddr_in6 addr;
+	struct __kernel_timespec ts;
+};
+
+//
+// Release the rings and close the io_uring descriptor, cancelling anything outstanding
+//
+
+void uring_teardown(struct uring_struc *ring)
+{
+	if (NULL != ring->sqes && MAP_FAILED != (void *)ring->sqes) munmap(ring->sqes, ring->sqes_size);
+	if (NULL != ring->cq_ptr && MAP_FAILED != ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+	if (NULL != ring->sq_ptr && MAP_FAILED != ring->sq_ptr) munmap(ring->sq_ptr, ring->sq_size);
+	if (-1 != ring->fd && -1 == close(ring->fd))
+	{
+		IPSCAN_LOG( LOGPREFIX "uring_teardown: close unexpected failure : %d (%s)\n", errno, strerror(errno));
+	}
+	memset(ring, 0, sizeof(struct uring_struc));
+	ring->fd = -1;
+}
+
+//
+// Check the running kernel supports each of the operations the engine requires
+//
+
+int uring_check_ops(struct uring_struc *ring)
+{
+	size_t probesize = sizeof(struct io_uring_probe) + (256 * sizeof(struct io_uring_probe_op));
+	struct io_uring_probe *probe = calloc(1, probesize);
+	int retval = -1;
+
+	if (NULL == probe)
+	{
+		IPSCAN_LOG( LOGPREFIX "uring_check_ops: calloc failed\n");
+		return(retval);
+	}
+
+	if (0 > syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256))
+	{
+		IPSCAN_LOG( LOGPREFIX "uring_check_ops: IORING_REGISTER_PROBE failed : %d (%s)\n", errno, strerror(errno));
+	}
+	else if (probe->last_op >= IORING_OP_CLOSE \
+			&& 0 != (probe->ops[IORING_OP_TIMEOUT].flags & IO_URING_OP_SUPPORTED) \
+			&& 0 != (probe->ops[IORING_OP_CONNECT].flags & IO_URING_OP_SUPPORTED) \
+			&& 0 != (probe->ops[IORING_OP_LINK_TIMEOUT].flags & IO_URING_OP_SUPPORTED) \
+			&& 0 != (probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED) )
+	{
+		retval = 0;
+	}
+	else
+	{
+		IPSCAN_LOG( LOGPREFIX "uring_check_ops: kernel does not support the required io_uring operations\n");
+	}
+
+	free(probe);
+	return(retval);
+}
+
+//
+// Create and map an io_uring instance
+//
+
+int uring_setup(struct uring_struc *ring, unsigned int entries)
+{
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof(struct uring_struc));
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (0 > ring->fd)
+	{
+		IPSCAN_LOG( LOGPREFIX "uring_setup: io_uring_setup failed : %d (%s)\n", errno, strerror(errno));
+		ring->fd = -1;
+		return(-1);
+	}
+
+	ring->sq_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned int));
+	ring->cq_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+	if (0 != (params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ring->sq_ptr)
+	{
+		IPSCAN_LOG( LOGPREFIX "uring_setup: mmap of submission ring failed : %d (%s)\n", errno, strerror(errno));
+		uring_teardown(ring);
+		return(-1);
+	}
+
+	if (0 != (params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		ring->cq_ptr = ring->sq_ptr;
+	}
+	else
+	{
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (MAP_FAILED == ring->cq_ptr)
+		{
+			IPSCAN_LOG( LOGPREFIX "uring_setup: mmap of completion ring failed : %d (%s)\n", errno, strerror(errno));
+			uring_teardown(ring);
+			return(-1);
+		}
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (MAP_FAILED == (void *)ring->sqes)
+	{
+		IPSCAN_LOG( LOGPREFIX "uring_setup: mmap of submission entries failed : %d (%s)\n", errno, strerror(errno));
+		uring_teardown(ring);
+		return(-1);
+	}
+
+	ring->sq_head = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.array);
+	ring->cq_head = (unsigned int *)((char *)ring->cq_ptr + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_ptr + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((char *)ring->cq_ptr + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + params.cq_off.cqes);
+
+	return( uring_check_ops(ring) );
+}
+
+//
+// Obtain the next free submission entry - the ring is sized so that it cannot overflow
+//
+
+struct io_uring_sqe * uring_get_sqe(struct uring_struc *ring)
+{
+	unsigned int tail = *ring->sq_tail + ring->tosubmit;
+	unsigned int index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sq_array[index] = index;
+	ring->tosubmit++;
+	return(sqe);
+}
+
+//
+// Submit everything prepared so far, optionally waiting for at least one completion
+//
+
+int uring_submit(struct uring_struc *ring, unsigned int waitnr)
+{
+	int rc;
+
+	// Publish the new tail only once the entries themselves are visible
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->tosubmit, __ATOMIC_RELEASE);
+	rc = (int)syscall(__NR_io_uring_enter, ring->fd, ring->tosubmit, waitnr, ((0 < waitnr) ? IORING_ENTER_GETEVENTS : 0), NULL, 0);
+	if (0 <= rc)
+	{
+		ring->tosubmit -= (unsigned int)rc;
+	}
+	else if (EINTR == errno || EAGAIN == errno || EBUSY == errno)
+	{
+		// Entries remain queued, nothing is lost
+		rc = 0;
+	}
+	else
+	{
+		IPSCAN_LOG( LOGPREFIX "uring_submit: io_uring_enter failed : %d (%s)\n", errno, strerror(errno));
+	}
+	// Anything not consumed will be resubmitted next time, so withdraw it from the tail
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail - ring->tosubmit, __ATOMIC_RELEASE);
+	return(rc);
+}
+
+//
+// io_uring TCP connect engine
+//
+// Connect attempts are submitted as IORING_OP_CONNECT, each linked to an IORING_OP_LINK_TIMEOUT
+// of the current RTT-derived timeout, and the probe sockets are released through IORING_OP_CLOSE.
+// Everything prepared in a pass is handed to the kernel with a single io_uring_enter(), which
+// also waits for the next completion. A connect cancelled by its timeout is reported as
+// PORTINPROGRESS, otherwise the result maps through resultsstruct as for check_tcp_port().
+//
+
+int check_tcp_ports_uring(struct scan_context_struc *ctx, unsigned int portindex, unsigned int todo, struct portlist_struc *portlist)
+{
+	struct uring_struc ring;
+	struct uring_probe_struc probes[MAXTCPINFLIGHT];
+	struct __kernel_timespec wakeupts;
+	unsigned int next = 0, done = 0, inflight = 0, i;
+	int rc = 0, failed = 0, wakeuppending = 0, paced, mayretry;
+
+	if (0 != uring_setup(&ring, URING_ENTRIES))
+	{
+		// Nothing has been scanned yet, so let the caller fall back to another engine
+		uring_teardown(&ring);
+		return(IPSCAN_TCP_ENGINE_UNAVAILABLE);
+	}
+
+	memset(probes, 0, sizeof(probes));
+	for (i = 0 ; i < MAXTCPINFLIGHT ; i++) probes[i].sock = -1;
+
+	#ifdef PARLLDEBUG
+	IPSCAN_LOG( LOGPREFIX "check_tcp_ports_uring(): startindex %d, todo %d, maximum in flight %d\n", portindex, todo, MAXTCPINFLIGHT);
+	#endif
+
+	while (0 == failed && (done < todo || (unsigned int)wakeuppending < inflight))
+	{
+		uint64_t now = tcp_now_usecs();
+		uint64_t wakeup = 0;
+		uint64_t timeoutusecs = rtt_timeout(&ctx->rtt, TCPTIMEOUT_FLOOR_USECS, ctx->tcpceilingusecs);
+		unsigned int head, tail;
+
+		// Prepare a connect and linked timeout for each free slot, and retry any deferred probes
+		for (i = 0, paced = 0 ; i < MAXTCPINFLIGHT ; i++)
+		{
+			struct uring_probe_struc *probe = &probes[i];
+			struct io_uring_sqe *sqe;
+
+			if (0 != probe->inuse || 0 != probe->pending) continue;
+			if (0 != probe->deferred)
+			{
+				// A deferred probe already holds its token, so needs only wait for its retry time
+				if (probe->retryat > now)
+				{
+					if (0 == wakeup || probe->retryat < wakeup) wakeup = probe->retryat;
+					continue;
+				}
+			}
+			else
+			{
+				if (next >= todo || 0 != paced) continue;
+				if (0 == pacer_admit(&probe->holdoff, now))
+				{
+					// Only one slot at a time waits for a token, so none are reserved needlessly
+					if (0 == wakeup || probe->holdoff < wakeup) wakeup = probe->holdoff;
+					paced = 1;
+					continue;
+				}
+
+				probe->index = portindex + next;
+				probe->waitstart = now;
+				next++;
+			}
+			probe->deferred = 0;
+
+			mayretry = ((now - probe->waitstart) < IPSCAN_TCP_BUDGET_MAXWAIT_USECS) ? 1 : 0;
+			if (0 == probe->budget)
+			{
+				if (0 == tcp_budget_acquire(ctx, (0 == mayretry)))
+				{
+					probe->deferred = 1;
+					probe->retryat = now + IPSCAN_TCP_BUDGET_RETRY_USECS;
+					if (0 == wakeup || probe->retryat < wakeup) wakeup = probe->retryat;
+					continue;
+				}
+				probe->budget = 1;
+			}
+
+			probe->sock = tcp_probe_socket(SOCK_CLOEXEC);
+			if (-1 == probe->sock)
+			{
+				int errsv = errno;
+				if (0 != mayretry && 0 != tcp_socket_exhausted(errsv))
+				{
+					probe->deferred = 1;
+					probe->retryat = now + IPSCAN_TCP_BUDGET_RETRY_USECS;
+					if (0 == wakeup || probe->retryat < wakeup) wakeup = probe->retryat;
+					continue;
+				}
+				IPSCAN_LOG( LOGPREFIX "check_tcp_ports_uring: Bad socket call, returned %d (%s)\n", errsv, strerror(errsv));
+				tcp_budget_release(ctx);
+				probe->budget = 0;
+				rc |= tcp_record_result(ctx, portlist[probe->index].port_num, portlist[probe->index].special, PORTINTERROR);
+				done++;
+				continue;
+			}
+
+			memset(&probe->addr, 0, sizeof(probe->addr));
+			probe->addr.sin6_family = AF_INET6;
+			probe->addr.sin6_port = htons(portlist[probe->index].port_num);
+			probe->addr.sin6_addr = ctx->remoteaddr.sin6_addr;
+			probe->ts.tv_sec = (long long)(timeoutusecs / 1000000);
+			probe->ts.tv_nsec = (long long)((timeoutusecs % 1000000) * 1000);
+			probe->started = now;
+
+			sqe = uring_get_sqe(&ring);
+			sqe->opcode = IORING_OP_CONNECT;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->fd = probe->sock;
+			sqe->addr = (uint64_t)(uintptr_t)&probe->addr;
+			sqe->off = sizeof(probe->addr);
+			sqe->user_data = ((uint64_t)i << URING_OP_SHIFT) | URING_OP_CONNECT;
+
+			sqe = uring_get_sqe(&ring);
+			sqe->opcode = IORING_OP_LINK_TIMEOUT;
+			sqe->fd = -1;
+			sqe->addr = (uint64_t)(uintptr_t)&probe->ts;
+			sqe->len = 1;
+			sqe->user_data = ((uint64_t)i << URING_OP_SHIFT) | URING_OP_TIMEOUT;
+
+			probe->inuse = 1;
+			probe->pending = 2;
+			inflight += 2;
+		}
+
+		// Slots waiting for a token or a retry must not be left until the next connect completes,
+		// so have io_uring_enter() return when the earliest of them may proceed
+		if (0 != wakeup && 0 < inflight && 0 == wakeuppending)
+		{
+			struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+			wakeupts.tv_sec = (long long)((wakeup - now) / 1000000);
+			wakeupts.tv_nsec = (long long)(((wakeup - now) % 1000000) * 1000);
+			sqe->opcode = IORING_OP_TIMEOUT;
+			sqe->fd = -1;
+			sqe->addr = (uint64_t)(uintptr_t)&wakeupts;
+			sqe->len = 1;
+			sqe->user_data = URING_OP_WAKEUP;
+			wakeuppending = 1;
+			inflight++;
+		}
+
+		if (0 == inflight)
+		{
+			// Only slots in holdoff remain, so wait for the earliest to expire
+			if (0 != wakeup && wakeup > now)
+			{
+				struct timespec holdoffts;
+				holdoffts.tv_sec = (time_t)((wakeup - now) / 1000000);
+				holdoffts.tv_nsec = (long)(((wakeup - now) % 1000000) * 1000);
+				nanosleep(&holdoffts, NULL);
+			}
+			continue;
+		}
+
+		if (0 > uring_submit(&ring, 1))
+		{
+			failed = 1;
+			break;
+		}
+
+		// Reap the completions
+		head = *ring.cq_head;
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail)
+		{
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			unsigned int op = (unsigned int)(cqe->user_data & ((1 << URING_OP_SHIFT) - 1));
+			struct uring_probe_struc *probe = &probes[cqe->user_data >> URING_OP_SHIFT];
+			int res = cqe->res;
+
+			head++;
+			inflight--;
+
+			if (URING_OP_CONNECT == op)
+			{
+				int result;
+				struct io_uring_sqe *sqe;
+
+				if (0 == res)
+				{
+					result = PORTOPEN;
+				}
+				else if (-ECANCELED == res)
+				{
+					// Linked timeout expired - equivalent to blocking connect() timing out
+					result = PORTINPROGRESS;
+				}
+				else if (0 != tcp_socket_exhausted(-res) && (tcp_now_usecs() - probe->waitstart) < IPSCAN_TCP_BUDGET_MAXWAIT_USECS)
+				{
+					// Running out of local ports says nothing about the client, so try again shortly
+					result = PORTUNKNOWN;
+					probe->deferred = 1;
+					probe->retryat = tcp_now_usecs() + IPSCAN_TCP_BUDGET_RETRY_USECS;
+				}
+				else
+				{
+					result = tcp_classify_probe(-1, -res, ctx->hostname, portlist[probe->index].port_num, portlist[probe->index].special);
+				}
+				if (0 == probe->deferred)
+				{
+					tcp_rtt_sample(&ctx->rtt, probe->started, result);
+					rc |= tcp_record_result(ctx, portlist[probe->index].port_num, portlist[probe->index].special, result);
+					done++;
+					tcp_budget_release(ctx);
+					probe->budget = 0;
+				}
+
+				// Queue the close for the next submission, resetting an open port's connection
+				tcp_probe_linger(probe->sock, result);
+				sqe = uring_get_sqe(&ring);
+				sqe->opcode = IORING_OP_CLOSE;
+				sqe->fd = probe->sock;
+				sqe->user_data = ((cqe->user_data >> URING_OP_SHIFT) << URING_OP_SHIFT) | URING_OP_CLOSE;
+				inflight++;
+
+				probe->sock = -1;
+				probe->inuse = 0;
+				probe->pending--;
+			}
+			else if (URING_OP_TIMEOUT == op)
+			{
+				// -ETIME if it fired, -ECANCELED if the connect completed first
+				probe->pending--;
+			}
+			else if (URING_OP_WAKEUP == op)
+			{
+				wakeuppending = 0;
+			}
+			else if (URING_OP_CLOSE == op && 0 > res)
+			{
+				IPSCAN_LOG( LOGPREFIX "check_tcp_ports_uring: close unexpected failure : %d (%s)\n", -res, strerror(-res));
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	if (0 != failed)
+	{
+		// Tearing down the ring cancels anything outstanding - report unfinished ports as internal errors
+		for (i = 0 ; i < MAXTCPINFLIGHT ; i++)
+		{
+			if (0 != probes[i].budget) tcp_budget_release(ctx);
+			if (0 != probes[i].inuse || 0 != probes[i].deferred)
+			{
+				rc |= tcp_record_result(ctx, portlist[probes[i].index].port_num, portlist[probes[i].index].special, PORTINTERROR);
+				done++;
+			}
+		}
+		while (next < todo)
+		{
+			rc |= tcp_record_result(ctx, portlist[portindex+next].port_num, portlist[portindex+next].special, PORTINTERROR);
+			next++;
+		}
+	}
+
+	uring_teardown(&ring);
+
+	// Close any probe sockets that the kernel did not close for us
+	for (i = 0 ; i < MAXTCPINFLIGHT ; i++)
+	{
+		if (-1 != probes[i].sock && -1 == close(probes[i].sock))
+		{
+			IPSCAN_LOG( LOGPREFIX "check_tcp_ports_uring: close unexpected failure : %d (%s)\n", errno, strerror(errno));
+		}
+	}
+
+	return(rc);
+}
+
+#endif
@@ -65,6 +65,10 @@
 // 0.45 - make Javascript style more consistent
 // 0.46 - add cache-control private
 // 0.47 - add LGTM pragmas to ignore cross-site scripting false positives
+// 0.48 - add full-range scan results table
+// 0.49 - add port set entry to the text-mode forms
+// 0.50 - show the amplification factor of answered UDP ports in the javascript results
+// 0.51 - show the round trip time, jitter and loss of an ICMPv6 ECHO-REPLY in the javascript results
 
 #include "ipscan.h"
 
@@ -84,6 +88,9 @@
 #include <syslog.h>
 #endif
 
+// Functions from ipscan_bitmap.c
+unsigned int bitmap_print_ranges(const uint8_t *bits);
+
 void create_html_common_header(void)
 {
 	printf("%s%c%c\n","content-type:text/html;charset=iso-8859-1",13,10);
@@ -404,6 +411,10 @@ void create_html_header(uint16_t numports, uint16_t numudpports, char * reconque
 	printf(" case %d:", IPSCAN_PROTO_ICMPV6); // ICMPv6
 	printf(" if (result >= %d)", IPSCAN_INDIRECT_RESPONSE);
 	printf(" { textupdate = \"INDIRECT-\" + labels[j] + \" (from \" + host + \")\"; } else { textupdate = labels[j]; }");
+	// An ECHO-REPLY's note carries the echo train's round trip times (ms), jitter and loss
+	printf(" rttmatch = /%s([0-9.]+)\\/([0-9.]+)\\/([0-9.]+),%s([0-9.]+),%s([0-9]+)\\/([0-9]+)/.exec(host);", ICMPV6_RTT_NOTE, ICMPV6_JITTER_NOTE, ICMPV6_LOSS_NOTE);
+	printf(" if (result < %d && null != rttmatch) { textupdate += \" (round trip time min/avg/max \" + rttmatch[1] + \"/\" + rttmatch[2] + \"/\" + rttmatch[3]", IPSCAN_INDIRECT_RESPONSE);
+	printf(" + \" ms, jitter \" + rttmatch[4] + \" ms, \" + rttmatch[5] + \" of \" + rttmatch[6] + \" lost)\"; }");
 	printf(" break;");
 
 	printf(" case %d:", IPSCAN_PROTO_UDP); // UDP
@@ -412,6 +423,9 @@ void create_html_header(uint16_t numports, uint16_t numudpports, char * reconque
 	printf(" else { textupdate = \"Port \" + port + \" = INDIRECT-\" + labels[j] + \" (from \" + host + \")\"; }");
 	printf(" } else {");
 	printf(" if (0 != special) { textupdate = \"Port \" + port + \"[\" + special + \"]\" + \" = \" + labels[j]; } else { textupdate = \"Port \" + port + \" = \" + labels[j]; }");
+	// An answered port's note carries its amplification factor
+	printf(" ampmatch = /%s([0-9.]+)/.exec(host);", UDP_AMPLIFICATION_NOTE);
+	printf(" if (null != ampmatch) { textupdate += \" (amplification x\" + ampmatch[1] + \")\"; }");
 	printf(" }");
 	printf(" break;");
 
@@ -564,6 +578,32 @@ void create_results_key_table(char * hostname, time_t timestamp)
 	#endif
 }
 
+// Report a port set or full-range TCP scan in compact form - a row for each state found, listing its ports as ranges
+void create_portset_results_table(struct portbitmap_struc *bitmap)
+{
+	int i;
+
+	printf("<table border=\"1\">\n");
+	printf("<tr style=\"text-align:left\">\n");
+	printf("<td width=\"25%%\" style=\"background-color:white\">REPORTED STATE</td><td width=\"10%%\" style=\"background-color:white\">PORTS</td>");
+	printf("<td width=\"65%%\" style=\"background-color:white\">PORT NUMBERS</td>\n");
+	printf("</tr>\n");
+
+	for (i=0; PORTEOL != resultsstruct[i].returnval; i++)
+	{
+		if (0 == bitmap->count[resultsstruct[i].returnval]) continue;
+
+		printf("<tr style=\"text-align:left\">\n");
+		printf("<td width=\"25%%\" style=\"background-color:%s\">%s</td><td width=\"10%%\" style=\"background-color:white\">%u</td>",\
+				resultsstruct[i].colour, resultsstruct[i].label, bitmap->count[resultsstruct[i].returnval]);
+		printf("<td width=\"65%%\" style=\"background-color:white\">");
+		(void)bitmap_print_ranges(&bitmap->bits[resultsstruct[i].returnval][0]);
+		printf("</td>\n");
+		printf("</tr>\n");
+	}
+	printf("</table>\n");
+}
+
 void create_html_body(char * hostname, time_t timestamp, uint16_t numports, uint16_t numudpports, struct portlist_struc *portlist, struct portlist_struc *udpportlist)
 {
 	uint16_t portindex;
@@ -779,6 +819,11 @@ void create_html_form(uint16_t numports, uint16_t numudpports, struct portlist_s
 		if (position >= MAXCOLS || last == 1) { printf("</tr>\n"); position=0; };
 	}
 	printf("</table>\n");
+	// Port sets are only reported by the text-only version
+	#if (1 == TEXTMODE) && (0 < IPSCAN_PORTSET_MAXPORTS)
+	printf("<p>Optionally, enter a list of further TCP ports or port ranges, e.g. 8000-8100, 8443 (up to %d ports in total):</p>\n", IPSCAN_PORTSET_MAXPORTS);
+	printf("<input type=\"text\" value=\"\" size=\"40\" maxlength=\"%d\" alt=\"TCP port set\" name=\"portset\">\n", IPSCAN_PORTSET_MAXLEN);
+	#endif
 	#if (INCLUDETERMSOFUSE != 0)
 	printf("<p style=\"font-weight:bold\">3. and finally, confirming that you accept the <a href=\"%s\" target=\"_blank\"> terms of usage</a>, please click on the Begin scan button:</p>\n", TERMSOFUSEURL);
 	#else
@@ -886,6 +931,11 @@ void create_html5_form(uint16_t numports, uint16_t numudpports, struct portlist_
 		if (position >= MAXCOLS || last == 1) { printf("</tr>\n"); position=0; };
 	}
 	printf("</table>\n");
+	// Port sets are only reported by the text-only version
+	#if (1 == TEXTMODE) && (0 < IPSCAN_PORTSET_MAXPORTS)
+	printf("<p>Optionally, enter a list of further TCP ports or port ranges, e.g. 8000-8100, 8443 (up to %d ports in total):</p>\n", IPSCAN_PORTSET_MAXPORTS);
+	printf("<input type=\"text\" value=\"\" size=\"40\" maxlength=\"%d\" alt=\"TCP port set\" name=\"portset\" pattern=\"[0-9, -]*\">\n", IPSCAN_PORTSET_MAXLEN);
+	#endif
 
 	#if (INCLUDETERMSOFUSE != 0)
 	printf("<p style=\"font-weight:bold\">3. Accept the <a href=\"%s\">Terms and Conditions</a> by ticking this box <input type=\"checkbox\" required name=\"termsaccepted\" value=\"1\">.</p>\n",TERMSOFUSEURL);
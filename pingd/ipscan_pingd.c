@@ -0,0 +1,569 @@
+//    IPscan - an HTTP-initiated IPv6 port scanner.
+//
+//    Copyright (C) 2011-2021 Tim Chappell.
+//
+//    This file is part of IPscan.
+//
+//    IPscan is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with IPscan.  If not, see <http://www.gnu.org/licenses/>.
+
+// ipscan_pingd.c 	version
+// 0.01			initial version - persistent ICMPv6 echo helper shared by all scans
+// 0.02			have the kernel filter out all but responses bearing our identifier
+// 0.03			send a train of ECHO-REQUESTs for each request, reporting each with its kernel-timestamped round trip time
+//
+// Owns a single raw ICMPv6 socket on behalf of every scan on the host. Built with "make pingd",
+// started as root (e.g. at boot) and run as:
+//
+//	pingd/ipscan-pingd [-s socketpath] [-u user]
+//
+// Once the raw socket is open and the Unix socket bound, it runs as the given user (by default
+// IPSCAN_PINGD_USER). Each scan connects to the Unix socket and sends a request naming its target,
+// and the helper sends the request's train of ECHO-REQUESTs on its behalf. The identifier of every
+// ECHO-REQUEST is the helper's own, and its sequence number selects the outstanding ECHO-REQUEST, so
+// each ECHO-REPLY or ICMPv6 error is matched directly to it. The outcome of each ECHO-REQUEST is
+// reported on the scan's connection as soon as it is known, or once the request's timeout has passed
+// without a response.
+
+// accept4() is a GNU extension
+#define _GNU_SOURCE
+
+#include "ipscan.h"
+//
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pwd.h>
+#include <grp.h>
+
+// Logging with syslog requires additional include
+#if (LOGMODE == 1)
+#include <syslog.h>
+#endif
+
+// Others that FreeBSD highlighted
+#include <netinet/in.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+// Other IPv6 related
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <arpa/inet.h>
+
+//Poll support
+#include <poll.h>
+
+// Unix domain socket to the scans
+#include <sys/un.h>
+
+//
+// Prototype declarations
+//
+uint64_t pacer_now_usecs(void);
+
+// from ipscan_timer.c
+struct timerwheel_struc * timer_wheel(void);
+void timer_add(struct timerwheel_struc *wheel, struct timer_struc *timer, int kind, unsigned int owner, uint64_t expires);
+void timer_cancel(struct timerwheel_struc *wheel, struct timer_struc *timer);
+struct timer_struc * timer_expire(struct timerwheel_struc *wheel, uint64_t now);
+int timer_wait_msecs(struct timerwheel_struc *wheel, uint64_t now);
+
+// from ipscan_icmpv6msg.c
+int icmpv6_echo_fill(char *packet, unsigned int id, unsigned int seq, uint64_t timestamp, uint64_t session);
+int icmpv6_echo_ids(const char *packet, int len, unsigned int *id, unsigned int *seq);
+int icmpv6_echo_classify(const char *packet, int len, const struct sockaddr_in6 *source, const struct in6_addr *target,\
+	unsigned int txid, unsigned int txseqno, uint64_t timestamp, uint64_t session, char *router);
+int icmpv6_filter_attach(int sock, unsigned int id, int seq, unsigned int numseq, const char *txpacket, const struct in6_addr *target);
+int icmpv6_timestamps_enable(int sock);
+uint64_t icmpv6_realtime_usecs(void);
+uint64_t icmpv6_rx_usecs(struct msghdr *msg);
+
+int pingd_open_raw(void);
+int pingd_open_listener(const char *path, uid_t uid, gid_t gid);
+int pingd_drop_privileges(const struct passwd *pw);
+void pingd_accept(int listenfd);
+void pingd_close_client(unsigned int client);
+void pingd_request(unsigned int client);
+void pingd_transmit(int rawsock, unsigned int slot);
+void pingd_complete(unsigned int slot, int result, const char *router, uint64_t rttusecs);
+void pingd_receive(int rawsock);
+int main(int argc, char **argv);
+
+//
+// An outstanding ECHO-REQUEST, indexed by its sequence number modulo IPSCAN_PINGD_MAXPENDING. The
+// sequence number's upper bits change each time a slot is reused, so that a late response to an
+// earlier request in the same slot is not mistaken for one to the current request. Each ECHO-REQUEST
+// of a train has its own slot, whose timer first runs until it is due to be sent (TIMER_ICMPV6_TRAIN)
+// and then until the train's timeout passes (TIMER_ICMPV6_DEADLINE). txusecs is on the real time
+// clock of the kernel's receive timestamps, trainusecs (when the train began) on the wheel's.
+//
+struct pingd_pending_struc
+{
+	int client;
+	unsigned int seq;
+	unsigned int probe;
+	uint64_t txusecs;
+	uint64_t trainusecs;
+	struct pingd_request_struc request;
+	struct timer_struc timer;
+};
+
+static struct pingd_pending_struc pending[IPSCAN_PINGD_MAXPENDING];
+static int clientfd[IPSCAN_PINGD_MAXCLIENTS];
+static unsigned int numclients = 0;
+static unsigned int nextseq = 0;
+static unsigned int echoid = 0;
+
+//
+// Open the raw ICMPv6 socket, passing only the response types of interest, as the scans do, and
+// only those bearing our identifier, each timestamped by the kernel on receipt
+//
+
+int pingd_open_raw(void)
+{
+	struct icmp6_filter myfilter;
+	int sock, rc, errsv;
+
+	sock = socket(AF_INET6, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMPV6);
+	errsv = errno;
+	if (0 > sock)
+	{
+		IPSCAN_LOG( LOGPREFIX "pingd_open_raw: socket: Error : %s (%d) - is the helper running as root?\n", strerror(errsv), errsv);
+		return(-1);
+	}
+
+	ICMP6_FILTER_SETBLOCKALL(&myfilter);
+	ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &myfilter);
+	ICMP6_FILTER_SETPASS(ICMP6_DST_UNREACH, &myfilter);
+	ICMP6_FILTER_SETPASS(ICMP6_PARAM_PROB, &myfilter);
+	ICMP6_FILTER_SETPASS(ICMP6_TIME_EXCEEDED, &myfilter);
+	ICMP6_FILTER_SETPASS(ICMP6_PACKET_TOO_BIG, &myfilter);
+	rc = setsockopt(sock, IPPROTO_ICMPV6, ICMP6_FILTER, &myfilter, sizeof(myfilter));
+	errsv = errno;
+	if (0 > rc)
+	{
+		IPSCAN_LOG( LOGPREFIX "pingd_open_raw: setsockopt: Error setting ICMPv6 filter: %s (%d)\n", strerror(errsv), errsv);
+		close(sock);
+		return(-1);
+	}
+
+	// Each outstanding request has its own target and data, so the kernel can only check the identifier
+	if (0 != icmpv6_filter_attach(sock, echoid, -1, 0, NULL, NULL))
+	{
+		IPSCAN_LOG( LOGPREFIX "pingd_open_raw: continuing without an ICMPv6 receive filter\n");
+	}
+	(void)icmpv6_timestamps_enable(sock);
+	return(sock);
+}
+
+//
+// Bind the Unix socket on which the scans connect, replacing any left behind by an earlier helper,
+// and make it accessible to the scans' user only
+//
+
+int pingd_open_listener(const char *path, uid_t uid, gid_t gid)
+{
+	struct sockaddr_un listenaddr;
+	int sock, rc, errsv;
+
+	if (strlen(path) >= sizeof(listenaddr.sun_path))
+	{
+		IPSCAN_LOG( LOGPREFIX "pingd_open_listener: socket path %s is too long\n", path);
+		return(-1);
+	}
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	errsv = errno;
+	if (0 > sock)
+	{
+		IPSCAN_LOG( LOGPREFIX "pingd_open_listener: socket: Error : %s (%d)\n", strerror(errsv), errsv);
+		return(-1);
+	}
+
+	memset(&listenaddr, 0, sizeof(listenaddr));
+	listenaddr.sun_family = AF_UNIX;
+	strncpy(listenaddr.sun_path, path, sizeof(listenaddr.sun_path) - 1);
+
+	unlink(path);
+	rc = bind(sock, (struct sockaddr *)&listenaddr, sizeof(listenaddr));
+	errsv = errno;
+	if (0 > rc)
+	{
+		IPSCAN_LOG( LOGPREFIX "pingd_open_listener: bind to %s: Error : %s (%d)\n", path, strerror(errsv), errsv);
+		close(sock);
+		return(-1);
+	}
+
+	// Only meaningful, and only permitted, whilst still running as root
+	if (0 == geteuid() && 0 != chown(path, uid, gid))
+	{
+		errsv = errno;
+		IPSCAN_LOG( LOGPREFIX "pingd_open_listener: chown of %s: Error : %s (%d)\n", path, strerror(errsv), errsv);
+		close(sock);
+		return(-1);
+	}
+	if (0 != chmod(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP))
+	{
+		errsv = errno;
+		IPSCAN_LOG( LOGPREFIX "pingd_open_listener: chmod of %s: Error : %s (%d)\n", path, strerror(errsv), errsv);
+		close(sock);
+		return(-1);
+	}
+
+	rc = listen(sock, IPSCAN_PINGD_MAXCLIENTS);
+	errsv = errno;
+	if (0 > rc)
+	{
+		IPSCAN_LOG( LOGPREFIX "pingd_open_listener: listen: Error : %s (%d)\n", strerror(errsv), errsv);
+		close(sock);
+		return(-1);
+	}
+	return(sock);
+}
+
+//
+// Permanently give up root privileges, once the sockets which need them are open
+//
+
+int pingd_drop_privileges(const struct passwd *pw)
+{
+	if (0 != geteuid())
+	{
+		IPSCAN_LOG( LOGPREFIX "pingd_drop_privileges: not running as root, so continuing as user-id %d\n", (int)geteuid());
+		return(0);
+	}
+
+	if (0 != setgroups(0, NULL) || 0 != setgid(pw->pw_gid) || 0 != setuid(pw->pw_uid))
+	{
+		IPSCAN_LOG( LOGPREFIX "pingd_drop_privileges: failed to become user %s: %s (%d)\n", pw->pw_name, strerror(errno), errno);
+		return(-1);
+	}
+
+	// Check that root privileges cannot be regained
+	if (0 == setuid(0))
+	{
+		IPSCAN_LOG( LOGPREFIX "pingd_drop_privileges: root privileges were not revoked\n");
+		return(-1);
+	}
+	return(0);
+}
+
+void pingd_accept(int listenfd)
+{
+	int fd;
+
+	while (0 <= (fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)))
+	{
+		// A scan turned away here falls back to a raw socket of its own
+		if (IPSCAN_PINGD_MAXCLIENTS <= numclients)
+		{
+			IPSCAN_LOG( LOGPREFIX "pingd_accept: already serving %d scans, so turning another away\n", IPSCAN_PINGD_MAXCLIENTS);
+			close(fd);
+			continue;
+		}
+		clientfd[numclients] = fd;
+		numclients++;
+	}
+	if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+	{
+		IPSCAN_LOG( LOGPREFIX "pingd_accept: accept: Error : %s (%d)\n", strerror(errno), errno);
+	}
+}
+
+//
+// Close a scan's connection and abandon its outstanding ECHO-REQUESTs. The last connection
+// takes its place, so any of its outstanding requests are renumbered to match.
+//
+
+void pingd_close_client(unsigned int client)
+{
+	struct timerwheel_struc *wheel = timer_wheel();
+	unsigned int slot, last = numclients - 1;
+
+	for (slot = 0 ; slot < IPSCAN_PINGD_MAXPENDING ; slot++)
+	{
+		if ((int)client == pending[slot].client)
+		{
+			timer_cancel(wheel, &pending[slot].timer);
+			pending[slot].client = -1;
+		}
+		else if ((int)last == pending[slot].client)
+		{
+			pending[slot].client = (int)client;
+		}
+	}
+
+	close(clientfd[client]);
+	clientfd[client] = clientfd[last];
+	numclients--;
+}
+
+//
+// Read a scan's request, and schedule its train of ECHO-REQUESTs, the first to be sent at once
+//
+
+void pingd_request(unsigned int client)
+{
+	struct pingd_request_struc request;
+	unsigned int seqs[ICMPV6_TRAIN_COUNT];
+	unsigned int slot, tries, probe = 0;
+	uint64_t now;
+	int rc;
+
+	rc = (int)recv(clientfd[client], &request, sizeof(request), 0);
+	if (rc != (int)sizeof(request) || IPSCAN_PINGD_MAGIC != request.magic || 0 == request.count || ICMPV6_TRAIN_COUNT < request.count\
+		|| ((uint64_t)(request.count - 1) * request.spacingusecs) >= request.timeoutusecs)
+	{
+		if (0 != rc) IPSCAN_LOG( LOGPREFIX "pingd_request: discarding malformed request of %d bytes\n", rc);
+		pingd_close_client(client);
+		return;
+	}
+
+	// Find a free slot for each ECHO-REQUEST, starting from the next sequence number
+	for (tries = 0 ; tries < IPSCAN_PINGD_MAXPENDING && probe < request.count ; tries++)
+	{
+		slot = (nextseq + tries) & (IPSCAN_PINGD_MAXPENDING - 1);
+		if (0 > pending[slot].client) seqs[probe++] = (nextseq + tries) & 0xFFFF;
+	}
+	if (probe < request.count)
+	{
+		IPSCAN_LOG( LOGPREFIX "pingd_request: already %d ECHO-REQUESTs outstanding, so turning another away\n", IPSCAN_PINGD_MAXPENDING);
+		pingd_close_client(client);
+		return;
+	}
+
+	now = pacer_now_usecs();
+	for (probe = 0 ; probe < request.count ; probe++)
+	{
+		slot = seqs[probe] & (IPSCAN_PINGD_MAXPENDING - 1);
+		memcpy(&pending[slot].request, &request, sizeof(request));
+		pending[slot].client = (int)client;
+		pending[slot].probe = probe;
+		pending[slot].trainusecs = now;
+		pending[slot].txusecs = 0;
+		pending[slot].seq = seqs[probe];
+		timer_add(timer_wheel(), &pending[slot].timer, TIMER_ICMPV6_TRAIN, slot, now + ((uint64_t)probe * request.spacingusecs));
+	}
+	nextseq = (nextseq + tries) & 0xFFFF;
+}
+
+//
+// Send an ECHO-REQUEST which has fallen due, and wait for its response until the train's timeout
+//
+
+void pingd_transmit(int rawsock, unsigned int slot)
+{
+	struct sockaddr_in6 destination;
+	char txpackdata[ICMPV6_PACKET_BUFFER_SIZE];
+	int rc = 0, len;
+
+	len = icmpv6_echo_fill(&txpackdata[0], echoid, pending[slot].seq, pending[slot].request.timestamp, pending[slot].request.session);
+
+	memset(&destination, 0, sizeof(destination));
+	destination.sin6_family = AF_INET6;
+	memcpy(&destination.sin6_addr, &pending[slot].request.target, sizeof(destination.sin6_addr));
+
+	pending[slot].txusecs = icmpv6_realtime_usecs();
+	if (0 < len) rc = (int)sendto(rawsock, &txpackdata[0], (size_t)len, 0, (struct sockaddr *)&destination, sizeof(destination));
+	if (0 >= len || rc != len)
+	{
+		IPSCAN_LOG( LOGPREFIX "pingd_transmit: sendto returned %d, errno %d (%s)\n", rc, errno, strerror(errno));
+		pingd_complete(slot, PORTINTERROR, "unset", 0);
+		return;
+	}
+
+	timer_add(timer_wheel(), &pending[slot].timer, TIMER_ICMPV6_DEADLINE, slot, pending[slot].trainusecs + pending[slot].request.timeoutusecs);
+}
+
+//
+// Report the outcome of an outstanding ECHO-REQUEST to its scan, freeing its slot
+//
+
+void pingd_complete(unsigned int slot, int result, const char *router, uint64_t rttusecs)
+{
+	struct pingd_reply_struc reply;
+	unsigned int client = (unsigned int)pending[slot].client;
+	int rc;
+
+	timer_cancel(timer_wheel(), &pending[slot].timer);
+	pending[slot].client = -1;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.magic = IPSCAN_PINGD_MAGIC;
+	reply.tag = pending[slot].request.tag;
+	reply.result = result;
+	reply.probe = pending[slot].probe;
+	reply.rttusecs = rttusecs;
+	strncpy(reply.router, router, INET6_ADDRSTRLEN - 1);
+
+	// The scan may have given up waiting already, which is no concern of ours
+	rc = (int)send(clientfd[client], &reply, sizeof(reply), MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (rc != (int)sizeof(reply))
+	{
+		#ifdef PINGDEBUG
+		IPSCAN_LOG( LOGPREFIX "pingd_complete: send returned %d, errno %d (%s)\n", rc, errno, strerror(errno));
+		#endif
+	}
+}
+
+//
+// Match every ICMPv6 packet waiting on the raw socket to its outstanding ECHO-REQUEST
+//
+
+void pingd_receive(int rawsock)
+{
+	struct sockaddr_in6 source;
+	struct msghdr rmsghdr;
+	struct iovec rxiov[1];
+	char rxpackdata[ICMPV6_PACKET_BUFFER_SIZE];
+	char rxcontrol[CMSG_SPACE(sizeof(struct timespec))];
+	char router[INET6_ADDRSTRLEN];
+	unsigned int id, seq, slot;
+	uint64_t rxusecs;
+	int rc, result;
+
+	while (1)
+	{
+		memset(&rmsghdr, 0, sizeof(rmsghdr));
+		rmsghdr.msg_name = &source;
+		rmsghdr.msg_namelen = sizeof(source);
+		rxiov[0].iov_base = &rxpackdata[0];
+		rxiov[0].iov_len = sizeof(rxpackdata);
+		rmsghdr.msg_iov = rxiov;
+		rmsghdr.msg_iovlen = 1;
+		rmsghdr.msg_control = &rxcontrol[0];
+		rmsghdr.msg_controllen = sizeof(rxcontrol);
+		rc = (int)recvmsg(rawsock, &rmsghdr, 0);
+		if (0 > rc)
+		{
+			if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+			{
+				IPSCAN_LOG( LOGPREFIX "pingd_receive: recvmsg: Error : %s (%d)\n", strerror(errno), errno);
+			}
+			return;
+		}
+		if (sizeof(struct sockaddr_in6) != rmsghdr.msg_namelen || AF_INET6 != source.sin6_family) continue;
+
+		// Anything not concerning one of our outstanding (and already sent) ECHO-REQUESTs is of no interest
+		if (0 != icmpv6_echo_ids(&rxpackdata[0], rc, &id, &seq) || id != echoid) continue;
+		slot = seq & (IPSCAN_PINGD_MAXPENDING - 1);
+		if (0 > pending[slot].client || seq != pending[slot].seq || 0 == pending[slot].txusecs) continue;
+
+		result = icmpv6_echo_classify(&rxpackdata[0], rc, &source, &pending[slot].request.target, echoid, seq,\
+			pending[slot].request.timestamp, pending[slot].request.session, router);
+		if (0 > result) continue;
+
+		rxusecs = icmpv6_rx_usecs(&rmsghdr);
+		pingd_complete(slot, result, router, (ECHOREPLY == result) ? ((rxusecs > pending[slot].txusecs) ? (rxusecs - pending[slot].txusecs) : 1) : 0);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd pollfiledesc[2 + IPSCAN_PINGD_MAXCLIENTS];
+	const char *path = IPSCAN_PINGD_SOCKET;
+	const char *user = IPSCAN_PINGD_USER;
+	struct passwd *pw;
+	struct timerwheel_struc *wheel;
+	struct timer_struc *timer;
+	unsigned int slot, client, polled;
+	int rawsock, listenfd, opt, rc;
+
+	while (-1 != (opt = getopt(argc, argv, "s:u:")))
+	{
+		switch (opt)
+		{
+		case 's':
+			path = optarg;
+			break;
+		case 'u':
+			user = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s socketpath] [-u user]\n", argv[0]);
+			return(EXIT_FAILURE);
+		}
+	}
+
+	pw = getpwnam(user);
+	if (NULL == pw)
+	{
+		IPSCAN_LOG( LOGPREFIX "ipscan-pingd: unknown user %s\n", user);
+		return(EXIT_FAILURE);
+	}
+
+	for (slot = 0 ; slot < IPSCAN_PINGD_MAXPENDING ; slot++) pending[slot].client = -1;
+	echoid = (unsigned int)getpid() & 0xFFFF;
+	wheel = timer_wheel();
+
+	rawsock = pingd_open_raw();
+	if (0 > rawsock) return(EXIT_FAILURE);
+	listenfd = pingd_open_listener(path, pw->pw_uid, pw->pw_gid);
+	if (0 > listenfd) return(EXIT_FAILURE);
+	if (0 != pingd_drop_privileges(pw)) return(EXIT_FAILURE);
+
+	IPSCAN_LOG( LOGPREFIX "ipscan-pingd: serving ECHO-REQUESTs on %s as user %s\n", path, user);
+
+	while (1)
+	{
+		// Send each ECHO-REQUEST which has fallen due, and report each whose timeout has passed without a response
+		while (NULL != (timer = timer_expire(wheel, pacer_now_usecs())))
+		{
+			if (TIMER_ICMPV6_TRAIN == timer->kind) pingd_transmit(rawsock, timer->owner);
+			else pingd_complete(timer->owner, ECHONOREPLY, "unset", 0);
+		}
+
+		pollfiledesc[0].fd = rawsock;
+		pollfiledesc[0].events = POLLIN;
+		pollfiledesc[1].fd = listenfd;
+		pollfiledesc[1].events = POLLIN;
+		for (client = 0 ; client < numclients ; client++)
+		{
+			pollfiledesc[2 + client].fd = clientfd[client];
+			pollfiledesc[2 + client].events = POLLIN;
+		}
+		polled = numclients;
+
+		rc = poll(pollfiledesc, 2 + polled, timer_wait_msecs(wheel, pacer_now_usecs()));
+		if (0 > rc)
+		{
+			if (EINTR != errno) IPSCAN_LOG( LOGPREFIX "ipscan-pingd: poll: Error : %s (%d)\n", strerror(errno), errno);
+			continue;
+		}
+
+		if (0 != (pollfiledesc[0].revents & POLLIN)) pingd_receive(rawsock);
+
+		// Work backwards, since closing a connection moves the last one into its place
+		for (client = polled ; client > 0 ; client--)
+		{
+			if (0 != (pollfiledesc[1 + client].revents & POLLIN))
+			{
+				pingd_request(client - 1);
+			}
+			else if (0 != (pollfiledesc[1 + client].revents & (POLLHUP | POLLERR | POLLNVAL)))
+			{
+				pingd_close_client(client - 1);
+			}
+		}
+
+		if (0 != (pollfiledesc[1].revents & POLLIN)) pingd_accept(listenfd);
+	}
+	return(EXIT_SUCCESS);
+}